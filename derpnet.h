@@ -23,35 +23,451 @@ typedef struct {
 DERPNET_API void DerpNet_CreateNewKey(DerpKey* UserSecret);
 DERPNET_API void DerpNet_GetPublicKey(const DerpKey* UserSecret, DerpKey* UserPublic);
 
+// calculates shared keys with many peers at once, ~10% faster per key than one at a time
+// these can be used with DerpNet_SendEx
+DERPNET_API void DerpNet_GetSharedKeys(const DerpKey* UserSecret, const DerpKey* PublicKeys, size_t Count, DerpKey* SharedKeys);
+
+// how many peer shared keys to remember per connection, must be power of 2
+#ifndef DERPNET_KEY_CACHE_SIZE
+#	define DERPNET_KEY_CACHE_SIZE 256
+#endif
+
+// most bytes of encrypted data DerpNet_TrySend keeps queued when socket is not writable
+#ifndef DERPNET_SEND_QUEUE_SIZE
+#	define DERPNET_SEND_QUEUE_SIZE (1 << 16)
+#endif
+
+// largest buffers for received & outgoing data, fit largest frame with its TLS records
+// they are this big during TLS handshake, after it they grow from DERPNET_BUFFER_START_SIZE only as needed
+#ifndef DERPNET_RECV_BUFFER_SIZE
+#	define DERPNET_RECV_BUFFER_SIZE ((1 << 16) + (1 << 15))
+#endif
+#ifndef DERPNET_SEND_BUFFER_SIZE
+#	define DERPNET_SEND_BUFFER_SIZE ((1 << 16) + 4096)
+#endif
+#ifndef DERPNET_BUFFER_START_SIZE
+#	define DERPNET_BUFFER_START_SIZE 4096
+#endif
+
+// usec without traffic after which DerpNet_HubRun frees empty buffers of connection with DerpNet_Shrink
+#ifndef DERPNET_HUB_IDLE_TIME
+#	define DERPNET_HUB_IDLE_TIME 1000000
+#endif
+
+// messages DerpNet_ThreadSend can queue for I/O thread, must be power of 2
+#ifndef DERPNET_THREAD_QUEUE_SIZE
+#	define DERPNET_THREAD_QUEUE_SIZE 4096
+#endif
+
+// bytes of received messages I/O thread can hold for DerpNet_ThreadRecv, must be power of 2
+#ifndef DERPNET_THREAD_RECV_SIZE
+#	define DERPNET_THREAD_RECV_SIZE (1 << 20)
+#endif
+
+typedef struct {
+	DerpKey PublicKey;
+	uint8_t SharedKey[32];
+	uint8_t Used;
+	uint8_t Referenced;
+} DerpNetPeer;
+
+// nonce generator state, one per connection
+typedef struct {
+	uint8_t Key[32];
+	uint8_t Buffer[1024];
+	size_t Used;
+	uint32_t Generation;
+} DerpNetRandom;
+
+typedef struct DerpNet DerpNet;
+typedef struct DerpNetHub DerpNetHub;
+
+// memory for connection buffers & other state, Free gets same Size as Alloc was called with
+// Alloc returns NULL when there is no memory, then operation that needed it fails
+// set both Alloc & Free, or neither for malloc & free - opening connection fails with only one of them
+typedef struct {
+	void* (*Alloc)(void* User, size_t Size);
+	void (*Free)(void* User, void* Memory, size_t Size);
+	void* User;
+} DerpNetAllocator;
+
+typedef struct {
+	const void* Data;
+	size_t Size;
+} DerpNetIoVec;
+
+typedef enum {
+	DERPNET_TLS_AES_128_GCM,
+	DERPNET_TLS_AES_256_GCM,
+	DERPNET_TLS_CHACHA20_POLY1305,
+} DerpNetTlsCipher;
+
+// traffic keys of one direction of established TLS session, for handing records over to kernel TLS
+typedef struct {
+	uint16_t Version;        // 0x0303 for TLS 1.2, 0x0304 for TLS 1.3
+	DerpNetTlsCipher Cipher;
+	uint8_t Key[32];         // 16 bytes used for AES-128
+	uint8_t Iv[12];          // for TLS 1.2 AES-GCM only first 4 bytes (salt) are used
+	uint64_t Sequence;       // sequence number of next record
+} DerpNetTlsKeys;
+
+// TLS implementation used by connection, socket is still blocking while Handshake runs
+// any data received after handshake must be left at start of Net->Buffer, with its size in Net->BufferReceived
+typedef struct {
+	// returns false if handshake failed, Close is called also in this case
+	bool (*Handshake)(DerpNet* Net, const char* Hostname);
+	// sizes of record header, largest record payload, and largest record trailer
+	void (*GetSizes)(DerpNet* Net, size_t* HeaderSize, size_t* MessageSize, size_t* TrailerSize);
+	// encrypts in place DataSize bytes placed after HeaderSize bytes of Record, with TrailerSize bytes available after data
+	// returns size of record to send, or 0 on error
+	size_t (*Encrypt)(DerpNet* Net, uint8_t* Record, size_t HeaderSize, size_t DataSize, size_t TrailerSize);
+	// decrypts in place first record of Data, returns 1 and where decrypted data is, and size of whole record
+	// returns 0 if Data does not contain full record yet, or -1 on error
+	int (*Decrypt)(DerpNet* Net, uint8_t* Data, size_t Size, size_t* DataOffset, size_t* DataSize, size_t* RecordSize);
+	void (*Close)(DerpNet* Net);
+	// optional, exports keys for sending or receiving direction, returns false if that is not possible
+	// after successful export, Encrypt or Decrypt is not called anymore for that direction
+	bool (*ExportKeys)(DerpNet* Net, bool Send, DerpNetTlsKeys* Keys);
+	// optional, same as Handshake but socket is non-blocking, used by DerpNet_OpenAsync - returns 1 when
+	// handshake is done, 0 when it needs more data from server and must be called again, or -1 if it failed
+	// without it, DerpNet_Step blocks while Handshake runs
+	int (*HandshakeStep)(DerpNet* Net, const char* Hostname);
+} DerpNetTls;
+
+// checks server certificate for built-in TLS, Certificates are DER encoded with server certificate first
+// must check that chain is trusted for Hostname, and that Signature of Signed data with Scheme (TLS 1.3
+// SignatureScheme value) is made by key of server certificate, returns false to fail handshake
+typedef bool DerpNetVerify(void* User, const char* Hostname, const DerpNetIoVec* Certificates, size_t CertificateCount, uint16_t Scheme, const DerpNetIoVec* Signature, const DerpNetIoVec* Signed);
+
+// what is learned about server on first connection, so reconnecting to it is faster - resolved
+// address is reused, ClientInfo is sent together with HTTP upgrade request when server key is
+// known, and built-in TLS resumes session with ticket instead of full handshake
+// same structure can be used for many connections to same server, zero it before first use
+typedef struct {
+	char Server[256];         // hostname & port, everything else is valid only for them
+	uint16_t Port;
+	uint32_t AddressSize;
+	uint8_t Address[32];      // sockaddr that connected successfully
+	bool HasServerKey;
+	uint8_t ServerKey[32];    // DERP server public key
+	uint32_t TicketSize;      // built-in TLS session ticket, 0 if there is none
+	uint32_t TicketAgeAdd;
+	uint32_t TicketLifetime;  // in seconds
+	int64_t TicketTime;       // when ticket was received, in seconds since epoch
+	uint8_t TicketSecret[32];
+	uint8_t Ticket[1024];
+} DerpNetSession;
+
+// built-in TLS 1.3 state, ChaCha20-Poly1305 keys for each direction
+typedef struct {
+	uint8_t Secret[32];
+	uint8_t Key[32];
+	uint8_t Iv[12];
+	uint64_t Sequence;
+} DerpNetTls13Keys;
+
+typedef struct {
+	DerpNetTls13Keys Send;
+	DerpNetTls13Keys Recv;
+	uint8_t ResumptionSecret[32]; // for tickets received after handshake
+	void* Handshake;              // state of handshake while it runs
+} DerpNetTls13;
+
+#if defined(__linux__)
+// io_uring state, used only when connection is opened with DerpNetConfig.IoUring set
+typedef struct {
+	int Fd;
+	uint32_t SubmitCount;
+	uint32_t* SqHead;
+	uint32_t* SqTail;
+	uint32_t* SqMask;
+	uint32_t* SqArray;
+	uint32_t* CqHead;
+	uint32_t* CqTail;
+	uint32_t* CqMask;
+	void* Cqes;
+	void* Sqes;
+	void* SqRing;
+	void* CqRing;
+	size_t SqRingSize;
+	size_t CqRingSize;
+	size_t SqesSize;
+	int RecvResult;
+	int SendResult;
+	bool RecvPending;
+	bool RecvDone;
+	bool SendPending;
+} DerpNetRing;
+#endif
+
+// microseconds since start of DerpNet_OpenEx when each step of opening connection finished
 typedef struct {
+	uint32_t Resolve;   // 0 when cached address was used
+	uint32_t Connect;
+	uint32_t Handshake; // TLS handshake, same as Connect for plain HTTP
+	uint32_t Ready;     // ServerInfo received, first message can be sent
+	uint32_t ConnectAttempts;
+} DerpNetOpenTimes;
+
+struct DerpNet {
 	uintptr_t Socket;
-	void* SocketEvent;
-	void* CredHandle[2];
-	void* CtxHandle[2];
+#if defined(_WIN32)
+	void* SocketEvent; // signaled when socket has data to read
+#else
+	int SocketPoll; // epoll instance for Socket on Linux
+#endif
+#if defined(__linux__)
+	DerpNetRing Ring; // when Ring.Fd >= 0, io_uring is used instead of epoll
+#endif
+	const DerpNetTls* Tls; // NULL for plain HTTP
+	void* TlsState[4];
+	DerpNetTls13 Tls13;    // used by built-in TLS
+	DerpNetVerify* Verify;
+	void* VerifyUser;
+	DerpNetSession* Session;
+	bool KernelTlsSend;      // outgoing TLS records are encrypted by kernel
+	bool KernelTlsRecv;      // incoming TLS records are decrypted by kernel
+	bool KernelTlsRecvLater; // waits until ciphertext already in Buffer is decrypted
 	uint8_t UserPrivateKey[32];
-	uint8_t LastPublicKey[32];
-	uint8_t LastSharedKey[32];
-	size_t BufferSize;
+	uint64_t KeyCacheSeed[2];
+	size_t KeyCacheHits;
+	size_t KeyCacheMisses;
+	DerpNetPeer KeyCache[DERPNET_KEY_CACHE_SIZE];
+	DerpNetRandom Random;
+	size_t BufferStart;
+	size_t BufferPlain;
+	size_t BufferCipher;
 	size_t BufferReceived;
-	size_t LastFrameSize;
+	size_t LastFrameSize; // plaintext held by messages returned from last Recv or RecvBatch
 	size_t TotalReceived;
 	size_t TotalSent;
-	uint8_t Buffer[1 << 16];
-} DerpNet;
+	size_t TotalMoved; // bytes moved around in Buffer
+	size_t TotalSyscalls; // socket send, receive & wait calls
+	size_t TotalRecords;  // TLS records sent, or socket writes with plain HTTP
+	DerpNetOpenTimes OpenTimes; // how long last open took
+	size_t RecordHeader;  // layout of outgoing TLS records, queried once when connection is open
+	size_t RecordMessage;
+	size_t RecordTrailer;
+	size_t SendPending;   // bytes of frames in SendBuffer not sent yet
+	uint64_t SendPendingTime; // usec, when first of them was added
+	uint32_t SendBatchSize;
+	uint32_t SendBatchTime;
+	size_t SendQueueStart; // encrypted data in SendQueue that socket did not take yet, only with DerpNet_TrySend
+	size_t SendQueued;
+	size_t SendQueuedPeak; // most bytes that were in SendQueue at once
+	size_t SendQueueLimit;
+	void* Opening; // state of DerpNet_OpenAsync while it runs, NULL when connection is open
+	DerpNetHub* Hub; // hub that runs connection, NULL when it is not in one
+	size_t HubIndex;
+
+	DerpNetAllocator Allocator; // all Alloc & Free are NULL for malloc & free
+	size_t MemoryUsed;    // bytes of Buffer, SendBuffer & SendQueue allocated now
+	size_t MemoryPeak;
+	uint8_t* Buffer;      // received data, largest frame + full TLS record after it
+	size_t BufferSize;
+	size_t BufferLimit;
+	uint8_t* SendBuffer;  // outgoing frames with space for TLS record headers & trailers
+	size_t SendBufferSize;
+	size_t SendBufferLimit;
+	uint8_t* SendQueue;   // up to SendQueueLimit + batch & frame sent when queue is just under it
+	size_t SendQueueSize;
+};
+
+typedef struct {
+	const DerpNetTls* Tls; // NULL uses built-in TLS - SChannel on Windows
+	bool PlainHttp;        // connect without TLS, for example to local test server
+	uint16_t Port;         // 0 uses 443 with TLS, 80 for plain HTTP
+	bool IoUring;          // Linux only, use io_uring instead of epoll when kernel supports it
+	bool KernelTls;        // Linux only, hand TLS records to kernel after handshake, if TLS provider can export keys
+	DerpNetVerify* Verify; // server certificate check, needed by built-in TLS
+	void* VerifyUser;      // passed to Verify
+	DerpNetSession* Session; // optional, for faster reconnect - pass same one when opening connection again
+	uint32_t SendBatchSize;  // 0 sends every message right away, otherwise messages are packed into full TLS records
+	                         // and sent together when this many bytes are waiting, or on DerpNet_Flush
+	uint32_t SendBatchTime;  // usec, with SendBatchSize waiting messages are also sent by Send & Recv calls after this time
+	uint32_t SendQueueLimit; // DerpNet_TrySend returns 0 when this many bytes are queued, 0 uses DERPNET_SEND_QUEUE_SIZE (also the maximum)
+	uint32_t RecvBufferSize; // most bytes received data can use, 0 uses DERPNET_RECV_BUFFER_SIZE (also the maximum)
+	                         // larger frames than fit in it disconnect, with TLS it is at least 32KB
+	uint32_t SendBufferSize; // most bytes outgoing data can use, 0 uses DERPNET_SEND_BUFFER_SIZE (also the maximum)
+	                         // larger messages than fit in it cannot be sent, Send fails for them
+	const DerpNetAllocator* Allocator; // NULL uses malloc & free, it is copied into connection
+} DerpNetConfig;
+
+// one received message, Data points into connection buffer
+typedef struct {
+	const DerpKey* PublicKey; // sender
+	uint8_t* Data;
+	uint32_t Size;
+} DerpNetMessage;
+
+// one node of DERP map
+typedef struct {
+	char HostName[256];
+	char IPv4[16];       // addresses from DERP map, hostname is resolved when both are empty
+	char IPv6[46];
+	uint16_t Port;       // 0 uses port from DerpNetConfig
+	uint32_t RegionId;
+	char RegionCode[16];
+	uint32_t Rtt;        // usec, from probe request to first byte of response, UINT32_MAX when not reachable
+} DerpNetServer;
+
+// what external event loop should wait for before calling DerpNet_Step, from DerpNet_GetPoll
+typedef struct {
+	uintptr_t Socket; // invalid socket (-1) while hostname is being resolved
+	bool WantRead;
+	bool WantWrite;
+	uint32_t Timeout; // msec, call DerpNet_Step after this time even if socket is not ready, UINT32_MAX for no limit
+} DerpNetPoll;
+
+// built-in TLS 1.3 client with X25519 key exchange and ChaCha20-Poly1305 records, for DerpNetConfig.Tls
+// handshake fails if DerpNetConfig.Verify is not set
+DERPNET_API const DerpNetTls* DerpNet_GetBuiltinTls(void);
 
 // use DERP server hostname from https://login.tailscale.com/derpmap/default
 DERPNET_API bool DerpNet_Open(DerpNet* Net, const char* DerpServer, const DerpKey* UserSecret);
+
+// same as DerpNet_Open, with Config=NULL it uses defaults
+DERPNET_API bool DerpNet_OpenEx(DerpNet* Net, const char* DerpServer, const DerpKey* UserSecret, const DerpNetConfig* Config);
+
+// same as DerpNet_OpenEx, but returns without waiting - returns false only if opening fails right away
+// then call DerpNet_Step each time socket from DerpNet_GetPoll is ready, until it returns 1 or -1
+// name is resolved on separate thread, Config->IoUring is ignored - io_uring would be hidden from event loop
+// TLS provider without HandshakeStep blocks inside DerpNet_Step until TLS handshake is done
+DERPNET_API bool DerpNet_OpenAsync(DerpNet* Net, const char* DerpServer, const DerpKey* UserSecret, const DerpNetConfig* Config);
+
+// makes progress without waiting - continues opening connection, sends queued data and expired batch
+// returns 1 when connection is open, 0 while it is still opening, -1 on failure
+// after -1 from opening there is nothing to close, after -1 on open connection call DerpNet_Close
+// once open, use DerpNet_Recv with Wait=false when socket is readable
+DERPNET_API int DerpNet_Step(DerpNet* Net);
+
+// socket, interest flags and timeout for next DerpNet_Step, changes after every call to DerpNet
+DERPNET_API void DerpNet_GetPoll(DerpNet* Net, DerpNetPoll* Poll);
+
+// also stops connection that DerpNet_OpenAsync is still opening
 DERPNET_API void DerpNet_Close(DerpNet* Net);
 
+// parses DERP map JSON in format of https://login.tailscale.com/derpmap/default, returns count of servers
+// STUN-only nodes and regions marked to avoid are skipped
+DERPNET_API size_t DerpNet_ParseDerpMap(const char* Json, size_t JsonSize, DerpNetServer* Servers, size_t MaxCount);
+
+// same as DerpNet_ParseDerpMap, for JSON in file
+DERPNET_API size_t DerpNet_LoadDerpMap(const char* FileName, DerpNetServer* Servers, size_t MaxCount);
+
+// probes all servers in parallel, sets their Rtt and sorts them from fastest to slowest
+// Timeout is in msec, for each server - it uses TLS or plain HTTP & port from Config like DerpNet_OpenEx
+DERPNET_API void DerpNet_ProbeServers(DerpNetServer* Servers, size_t Count, const DerpNetConfig* Config, uint32_t Timeout);
+
+// probes servers, then opens connection to fastest one that works, returns its index in sorted Servers or -1
+DERPNET_API int DerpNet_OpenFastest(DerpNet* Net, DerpNetServer* Servers, size_t Count, const DerpKey* UserSecret, const DerpNetConfig* Config, uint32_t Timeout);
+
 // returns 1 when received data from other user, pointer is valid till next call
 // returns -1 if disconnected from server
 // returns 0 if no new info is available to read
 // if Wait=true, then never returns 0 - always waits for one incoming message
 DERPNET_API int DerpNet_Recv(DerpNet* Net, DerpKey* ReceivedUserPublicKey, uint8_t** ReceivedData, uint32_t* ReceivedSize, bool Wait);
 
+// returns count of messages put into Messages, up to MaxCount - all complete ones already received
+// are decrypted in one call, after reading everything socket has without waiting
+// returns -1 if disconnected, 0 when nothing was received - with Wait=true never returns 0
+// messages stay valid until DerpNet_RecvRelease, or next Recv/RecvBatch call
+DERPNET_API int DerpNet_RecvBatch(DerpNet* Net, DerpNetMessage* Messages, size_t MaxCount, bool Wait);
+
+// gives buffer space of last received message or batch back, their pointers are not valid after this
+DERPNET_API void DerpNet_RecvRelease(DerpNet* Net);
+
 // returns false if disconnected
 DERPNET_API bool DerpNet_Send(DerpNet* Net, const DerpKey* TargetUserPublicKey, const void* Data, size_t DataSize);
 
+// same as DerpNet_Send, but sends one message from many pieces without copying them together first
+DERPNET_API bool DerpNet_SendV(DerpNet* Net, const DerpKey* TargetUserPublicKey, const DerpNetIoVec* Vec, size_t VecCount);
+
+// sends messages waiting in batch, when DerpNetConfig.SendBatchSize is used
+// they are also sent before Recv waits for incoming data, and when connection is closed
+// returns false if disconnected
+DERPNET_API bool DerpNet_Flush(DerpNet* Net);
+
+// same as DerpNet_Send, but never waits for socket - what socket does not take is queued
+// returns 1 when message is sent or queued, 0 when queue is over limit and message was not taken, -1 if disconnected
+// returns -2 when message is too large to ever be sent, connection stays usable
+// while SendQueued member of DerpNet is not 0, wait for socket to be writable and call DerpNet_Pump
+// Send, Flush, Close and Recv with Wait=true first send everything queued, waiting if needed
+DERPNET_API int DerpNet_TrySend(DerpNet* Net, const DerpKey* TargetUserPublicKey, const void* Data, size_t DataSize);
+
+// sends as much of queued data as socket takes without waiting, returns false if disconnected
+DERPNET_API bool DerpNet_Pump(DerpNet* Net);
+
+// frees buffers that hold no data right now, they are allocated again when connection needs them
+// call it for connection that went idle, connections in hub are shrunk by it after DERPNET_HUB_IDLE_TIME
+DERPNET_API void DerpNet_Shrink(DerpNet* Net);
+
+// I/O thread owns connection socket, DerpNet functions must not be used on connection while it runs
+typedef struct DerpNetThread DerpNetThread;
+
+// starts I/O thread for open connection, returns NULL on failure or when connection uses io_uring
+DERPNET_API DerpNetThread* DerpNet_ThreadStart(DerpNet* Net);
+
+// can be called from any number of threads at the same time, message is encrypted on calling thread
+// returns 1 when message is queued, 0 when queue is full and message was not taken, -1 if disconnected
+// returns -2 when message is too large to ever be sent, connection stays usable
+DERPNET_API int DerpNet_ThreadSend(DerpNetThread* Thread, const DerpKey* TargetUserPublicKey, const void* Data, size_t DataSize);
+
+// only one thread at a time can receive, returned Data is valid until next DerpNet_ThreadRecv call
+// returns 1 when message is received, 0 if there is none and Wait=false, -1 if disconnected
+DERPNET_API int DerpNet_ThreadRecv(DerpNetThread* Thread, DerpKey* OtherUserPublicKey, uint8_t** Data, uint32_t* DataSize, bool Wait);
+
+// sends everything queued and stops I/O thread, messages not yet received are dropped
+// call it when no thread is in ThreadSend or ThreadRecv, after it connection can be used or closed as usual
+DERPNET_API void DerpNet_ThreadStop(DerpNetThread* Thread);
+
+// what happened to connection in hub, reported to DerpNetHubNotify
+typedef enum {
+	DERPNET_HUB_OPEN,     // connection is open, messages can be sent with DerpNet_TrySend
+	DERPNET_HUB_WRITABLE, // send queue has space again after it was over limit
+	DERPNET_HUB_CLOSED,   // opening failed or connection disconnected, it is already closed & removed from hub
+} DerpNetHubEvent;
+
+// messages received by one connection in hub, they are valid only during call
+typedef void DerpNetHubRecv(void* User, DerpNet* Net, const DerpNetMessage* Messages, size_t Count);
+typedef void DerpNetHubNotify(void* User, DerpNet* Net, DerpNetHubEvent Event);
+
+// hub runs many connections on one thread with one epoll (poll on other platforms) for all sockets
+// it is not thread-safe, for more cores run one hub per thread
+DERPNET_API DerpNetHub* DerpNet_HubCreate(void);
+
+// closes all connections still in hub, without waiting for their unsent data
+DERPNET_API void DerpNet_HubDestroy(DerpNetHub* Hub);
+
+// starts opening connection like DerpNet_OpenAsync, Recv & Notify (optional) are called with User for it
+// returns false only if opening fails right away, otherwise result is reported to Notify
+DERPNET_API bool DerpNet_HubAdd(DerpNetHub* Hub, DerpNet* Net, const char* DerpServer, const DerpKey* UserSecret, const DerpNetConfig* Config, DerpNetHubRecv* Recv, DerpNetHubNotify* Notify, void* User);
+
+// removes connection from hub and closes it, can be called from callbacks
+// data that socket does not take right away is dropped, so peer that stopped reading cannot block hub
+DERPNET_API void DerpNet_HubRemove(DerpNetHub* Hub, DerpNet* Net);
+
+// waits up to Timeout msec (UINT32_MAX for no limit) for sockets, then calls callbacks for everything that is ready
+// messages sent with DerpNet_TrySend, from callbacks or between runs, are sent together at end of run or before waiting
+// returns count of messages received, -1 if waiting failed
+DERPNET_API int DerpNet_HubRun(DerpNetHub* Hub, uint32_t Timeout);
+
+// precalculates shared keys for peers in connection key cache, for example
+// to warm up cache with known peers before traffic starts
+DERPNET_API void DerpNet_AddPeers(DerpNet* Net, const DerpKey* PublicKeys, size_t Count);
+
+// crypto code paths, by default the best one supported by CPU is used
+typedef enum {
+	DERPNET_CPU_LEVEL_SCALAR,
+	DERPNET_CPU_LEVEL_SSE2,
+	DERPNET_CPU_LEVEL_AVX2,
+} DerpNetCpuLevel;
+
+// limits crypto code to Level or lower, for testing & comparing performance
+// same can be done with DERPNET_CPU_LEVEL environment variable set to "scalar", "sse2" or "avx2"
+// returns level actually used - it is lower when CPU does not support Level or its self-test fails
+DERPNET_API DerpNetCpuLevel DerpNet_SetCpuLevel(DerpNetCpuLevel Level);
+DERPNET_API DerpNetCpuLevel DerpNet_GetCpuLevel(void);
+
 // use this if you're an expert!
 DERPNET_API bool DerpNet_SendEx(DerpNet* Net, const DerpKey* TargetUserPublicKey, const uint8_t SharedKey[32], const uint8_t Nonce[24], const void* Data, size_t DataSize);
 
@@ -62,19 +478,83 @@ DERPNET_API bool DerpNet_SendEx(DerpNet* Net, const DerpKey* TargetUserPublicKey
 #if defined(DERPNET_STATIC) || defined(DERPNET_IMPLEMENTATION)
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(_WIN32)
+#	define SECURITY_WIN32
+#	define _WINSOCK_DEPRECATED_NO_WARNINGS
+#	include <winsock2.h>
+#	include <windows.h>
+#	include <ws2tcpip.h>
+#	include <security.h>
+#	include <schannel.h>
+#	include <bcrypt.h>
+#	pragma comment (lib, "bcrypt")
+#	pragma comment (lib, "ws2_32")
+#	pragma comment (lib, "secur32")
+#else
+// set DERPNET_USE_IO_URING to 0 to build without io_uring support on Linux
+#	if !defined(DERPNET_USE_IO_URING) && defined(__linux__) && defined(__has_include)
+#		if __has_include(<linux/io_uring.h>)
+#			define DERPNET_USE_IO_URING 1
+#		endif
+#	endif
+// set DERPNET_USE_KERNEL_TLS to 0 to build without kernel TLS support on Linux
+#	if !defined(DERPNET_USE_KERNEL_TLS) && defined(__linux__) && defined(__has_include)
+#		if __has_include(<linux/tls.h>)
+#			define DERPNET_USE_KERNEL_TLS 1
+#		endif
+#	endif
+#	include <errno.h>
+#	include <fcntl.h>
+#	include <unistd.h>
+#	include <netdb.h>
+#	include <pthread.h>
+#	include <sys/socket.h>
+#	include <netinet/in.h>
+#	include <netinet/tcp.h>
+#	include <arpa/inet.h>
+#	include <poll.h>
+#	if defined(__linux__)
+#		include <sys/epoll.h>
+#		include <sys/random.h>
+#	endif
+#	if DERPNET_USE_IO_URING
+#		include <sys/mman.h>
+#		include <sys/syscall.h>
+#		include <sys/uio.h>
+#		include <linux/io_uring.h>
+#	endif
+#	if DERPNET_USE_KERNEL_TLS
+#		include <linux/tls.h>
+#		if !defined(TCP_ULP)
+#			define TCP_ULP 31
+#		endif
+#		if !defined(SOL_TLS)
+#			define SOL_TLS 282
+#		endif
+#	endif
+#endif
+
+#if !defined(DERPNET_USE_IO_URING)
+#	define DERPNET_USE_IO_URING 0
+#endif
 
-#define SECURITY_WIN32
-#define _WINSOCK_DEPRECATED_NO_WARNINGS
-#include <winsock2.h>
-#include <windows.h>
-#include <ws2tcpip.h>
-#include <security.h>
-#include <schannel.h>
-#include <bcrypt.h>
-#pragma comment (lib, "bcrypt")
-#pragma comment (lib, "ws2_32")
-#pragma comment (lib, "secur32")
+#if !defined(DERPNET_USE_KERNEL_TLS)
+#	define DERPNET_USE_KERNEL_TLS 0
+#endif
+
+// set DERPNET_USE_PLAIN_HTTP to 1 to connect without TLS by default
+// outside of Windows it is the default, because built-in TLS needs certificate check from user
+#if !defined(DERPNET_USE_PLAIN_HTTP)
+#	if defined(_WIN32)
+#		define DERPNET_USE_PLAIN_HTTP 0
+#	else
+#		define DERPNET_USE_PLAIN_HTTP 1
+#	endif
+#endif
 
 //
 // helpers
@@ -115,17 +595,55 @@ DERPNET_API bool DerpNet_SendEx(DerpNet* Net, const DerpKey* TargetUserPublicKey
 #	define rol32(x, n) ( ((x) << (n)) | ((x) >> (32-(n))) )
 #endif
 
+#if defined(__clang__)
+#	define rol64(x, n) __builtin_rotateleft64(x, n)
+#elif defined(_MSC_VER)
+#	define rol64(x, n) _rotl64(x, n)
+#else
+#	define rol64(x, n) ( ((x) << (n)) | ((x) >> (64-(n))) )
+#endif
+
+// set DERPNET_USE_SIMD to 0 to build only portable scalar code
+#if !defined(DERPNET_USE_SIMD)
+#	if defined(_M_X64) || defined(_M_AMD64) || defined(__x86_64__)
+#		define DERPNET_USE_SIMD 1
+#	else
+#		define DERPNET_USE_SIMD 0
+#	endif
+#endif
+
+#if DERPNET_USE_SIMD
+#	include <immintrin.h>
+#	if defined(__clang__) || defined(__GNUC__)
+#		define DERPNET_TARGET(x) __attribute__((target(x)))
+#	else
+#		define DERPNET_TARGET(x)
+#	endif
+#endif
+
+#if defined(_MSC_VER)
+#	define DERPNET_DEBUG_BREAK() __debugbreak()
+#else
+#	define DERPNET_DEBUG_BREAK() __builtin_trap()
+#endif
+
+#if defined(_WIN32)
+#	define DERPNET_DEBUG_OUTPUT(str) OutputDebugStringA(str)
+#else
+#	define DERPNET_DEBUG_OUTPUT(str) fputs(str, stderr)
+#endif
+
 #if !defined(NDEBUG)
-#	define DERPNET_ASSERT(cond) do { if (!(cond)) __debugbreak(); } while (0)
+#	define DERPNET_ASSERT(cond) do { if (!(cond)) DERPNET_DEBUG_BREAK(); } while (0)
 #	define DERPNET_LOG(...) do {                                  \
-	char LogBuffer[256];                                          \
+	char LogBuffer[512];                                          \
 	snprintf(LogBuffer, sizeof(LogBuffer), "DERP: " __VA_ARGS__); \
-	OutputDebugStringA(LogBuffer);                                \
-	OutputDebugStringA("\n");                                     \
+	DERPNET_DEBUG_OUTPUT(LogBuffer);                              \
+	DERPNET_DEBUG_OUTPUT("\n");                                   \
 } while (0)
 #else
 #	define DERPNET_ASSERT(cond) do { (void)(cond); } while (0)
-#	define DERPNET_LOG(...) do { (void)sizeof(__VA_ARGS__); } while (0)
+#	define DERPNET_LOG(...) do { if (0) printf(__VA_ARGS__); } while (0)
 #endif
 
 static inline uint32_t Get32LE(const uint8_t* Buffer)
@@ -166,6 +684,12 @@ static inline void Set32BE(uint8_t* Buffer, uint32_t Value)
 	Buffer[0] = Value >> 24;
 }
 
+static inline void Set64BE(uint8_t* Buffer, uint64_t Value)
+{
+	Set32BE(Buffer + 0, (uint32_t)(Value >> 32));
+	Set32BE(Buffer + 4, (uint32_t)(Value));
+}
+
 static inline void Set64LE(uint8_t* Buffer, uint64_t Value)
 {
 	Buffer[0] = (uint8_t)(Value);
@@ -178,12 +702,272 @@ static inline void Set64LE(uint8_t* Buffer, uint64_t Value)
 	Buffer[7] = (uint8_t)(Value >> 56);
 }
 
+static inline size_t DerpNet__Min(size_t A, size_t B)
+{
+	return A < B ? A : B;
+}
+
+static inline size_t DerpNet__Max(size_t A, size_t B)
+{
+	return A > B ? A : B;
+}
+
+// both functions, or neither of them
+static bool DerpNet__AllocatorValid(const DerpNetAllocator* Allocator)
+{
+	if (Allocator && (Allocator->Alloc == NULL) != (Allocator->Free == NULL))
+	{
+		DERPNET_LOG("DerpNetAllocator needs both Alloc and Free, or neither of them");
+		return false;
+	}
+	return true;
+}
+
+static void* DerpNet__Alloc(const DerpNetAllocator* Allocator, size_t Size)
+{
+	return Allocator->Alloc ? Allocator->Alloc(Allocator->User, Size) : malloc(Size);
+}
+
+// large zeroed state - calloc leaves untouched pages to OS, user allocator gets them cleared
+static void* DerpNet__AllocZero(const DerpNetAllocator* Allocator, size_t Size)
+{
+	if (!Allocator->Alloc)
+	{
+		return calloc(1, Size);
+	}
+	void* Memory = Allocator->Alloc(Allocator->User, Size);
+	if (Memory)
+	{
+		memset(Memory, 0, Size);
+	}
+	return Memory;
+}
+
+static void DerpNet__Free(const DerpNetAllocator* Allocator, void* Memory, size_t Size)
+{
+	if (Allocator->Alloc)
+	{
+		Allocator->Free(Allocator->User, Memory, Size);
+	}
+	else
+	{
+		free(Memory);
+	}
+}
+
+//
+// buffers - full size during TLS handshake, as TLS providers expect that, otherwise they start from
+// DERPNET_BUFFER_START_SIZE when first needed, double up to their limit when data does not fit
+// and are freed by DerpNet_Shrink when they are empty
+//
+
+// replaces buffer with one of NewSize bytes, 0 frees it, and keeps first Keep bytes of its data
+static bool DerpNet__BufferResize(DerpNet* Net, uint8_t** Buffer, size_t* Size, size_t NewSize, size_t Keep)
+{
+	uint8_t* NewBuffer = NULL;
+	if (NewSize != 0)
+	{
+		NewBuffer = (uint8_t*)DerpNet__Alloc(&Net->Allocator, NewSize);
+		if (!NewBuffer)
+		{
+			DERPNET_LOG("not enough memory for %zu bytes of connection buffer", NewSize);
+			return false;
+		}
+		if (Keep != 0)
+		{
+			memcpy(NewBuffer, *Buffer, Keep);
+		}
+	}
+	if (*Buffer)
+	{
+		DerpNet__Free(&Net->Allocator, *Buffer, *Size);
+	}
+
+	Net->MemoryUsed = Net->MemoryUsed - *Size + NewSize;
+	Net->MemoryPeak = DerpNet__Max(Net->MemoryPeak, Net->MemoryUsed);
+	*Buffer = NewBuffer;
+	*Size = NewSize;
+	return true;
+}
+
+// size for buffer to hold Needed bytes, or 0 if that is over Limit
+static size_t DerpNet__BufferGrowSize(size_t Size, size_t Needed, size_t Limit)
+{
+	if (Needed > Limit)
+	{
+		return 0;
+	}
+	size_t NewSize = Size ? Size : DERPNET_BUFFER_START_SIZE;
+	while (NewSize < Needed)
+	{
+		NewSize *= 2;
+	}
+	return DerpNet__Min(NewSize, Limit);
+}
+
+static void DerpNet__BufferFreeAll(DerpNet* Net)
+{
+	DerpNet__BufferResize(Net, &Net->Buffer, &Net->BufferSize, 0, 0);
+	DerpNet__BufferResize(Net, &Net->SendBuffer, &Net->SendBufferSize, 0, 0);
+	DerpNet__BufferResize(Net, &Net->SendQueue, &Net->SendQueueSize, 0, 0);
+}
+
+// keys & nonces must not be made from anything else, so this is fatal even in release builds
+static void DerpNet__RandomFailed(const char* Reason)
+{
+	fprintf(stderr, "derpnet: cannot get random bytes, %s\n", Reason);
+	abort();
+}
+
 static inline void DerpNet__GetRandom(void* Buffer, size_t BufferSize)
 {
-	int Status = BCryptGenRandom(NULL, (PUCHAR)Buffer, (ULONG)BufferSize, BCRYPT_USE_SYSTEM_PREFERRED_RNG);
-	DERPNET_ASSERT(Status == 0);
+#if defined(_WIN32)
+	NTSTATUS Status = BCryptGenRandom(NULL, (PUCHAR)Buffer, (ULONG)BufferSize, BCRYPT_USE_SYSTEM_PREFERRED_RNG);
+	if (Status != 0)
+	{
+		DerpNet__RandomFailed("BCryptGenRandom failed");
+	}
+#elif defined(__linux__)
+	uint8_t* Bytes = (uint8_t*)Buffer;
+	while (BufferSize != 0)
+	{
+		ssize_t Size = getrandom(Bytes, BufferSize, 0);
+		if (Size < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			// ENOSYS on kernels before 3.17, EPERM when seccomp filter blocks it
+			break;
+		}
+		Bytes += Size;
+		BufferSize -= Size;
+	}
+
+	if (BufferSize != 0)
+	{
+		int File = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+		if (File < 0)
+		{
+			DerpNet__RandomFailed("getrandom failed and /dev/urandom cannot be opened");
+		}
+		while (BufferSize != 0)
+		{
+			ssize_t Size = read(File, Bytes, BufferSize);
+			if (Size < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			if (Size <= 0)
+			{
+				DerpNet__RandomFailed("cannot read /dev/urandom");
+			}
+			Bytes += Size;
+			BufferSize -= Size;
+		}
+		close(File);
+	}
+#else
+	arc4random_buf(Buffer, BufferSize);
+#endif
+}
+
+#if DERPNET_USE_SIMD
+
+enum
+{
+	DERPNET_CPU_SSE2 = 1 << 0,
+	DERPNET_CPU_SSSE3 = 1 << 1,
+	DERPNET_CPU_AVX2 = 1 << 2,
+	DERPNET_CPU_AVX512 = 1 << 3, // F + BW + VL
+	DERPNET_CPU_BMI2 = 1 << 4,
+	DERPNET_CPU_ADX = 1 << 5,
+	DERPNET_CPU_DETECTED = 1 << 30,
+};
+
+static void DerpNet__CpuId(uint32_t Regs[4], uint32_t Leaf, uint32_t SubLeaf)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+	__cpuidex((int*)Regs, Leaf, SubLeaf);
+#else
+	__asm__ __volatile__("cpuid" : "=a"(Regs[0]), "=b"(Regs[1]), "=c"(Regs[2]), "=d"(Regs[3]) : "a"(Leaf), "c"(SubLeaf));
+#endif
+}
+
+static uint64_t DerpNet__GetXcr0(void)
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+	return _xgetbv(0);
+#else
+	uint32_t Lo, Hi;
+	__asm__ __volatile__("xgetbv" : "=a"(Lo), "=d"(Hi) : "c"(0));
+	return ((uint64_t)Hi << 32) | Lo;
+#endif
+}
+
+static uint32_t DerpNet__CpuFeatures(void)
+{
+	// detected once, racing threads will store the same value
+	static uint32_t Features;
+	if (Features)
+	{
+		return Features;
+	}
+
+	// SSE2 is always present on x64
+	uint32_t Result = DERPNET_CPU_DETECTED | DERPNET_CPU_SSE2;
+
+	uint32_t Regs[4];
+	DerpNet__CpuId(Regs, 0, 0);
+	uint32_t MaxLeaf = Regs[0];
+
+	DerpNet__CpuId(Regs, 1, 0);
+	bool HasOsXSave = (Regs[2] & (1 << 27)) != 0;
+	bool HasAvx = (Regs[2] & (1 << 28)) != 0;
+
+	if (Regs[2] & (1 << 9))
+	{
+		Result |= DERPNET_CPU_SSSE3;
+	}
+
+	if (MaxLeaf >= 7)
+	{
+		DerpNet__CpuId(Regs, 7, 0);
+		uint64_t Xcr0 = HasOsXSave ? DerpNet__GetXcr0() : 0;
+
+		if (Regs[1] & (1 << 8))
+		{
+			Result |= DERPNET_CPU_BMI2;
+		}
+		if (Regs[1] & (1 << 19))
+		{
+			Result |= DERPNET_CPU_ADX;
+		}
+
+		// OS must save & restore ymm registers
+		if (HasAvx && (Xcr0 & 6) == 6 && (Regs[1] & (1 << 5)))
+		{
+			Result |= DERPNET_CPU_AVX2;
+
+			// and also opmask & zmm registers
+			const uint32_t Avx512 = (1 << 16) | (1 << 30) | (1u << 31);
+			if ((Xcr0 & 0xe6) == 0xe6 && (Regs[1] & Avx512) == Avx512)
+			{
+				Result |= DERPNET_CPU_AVX512;
+			}
+		}
+	}
+
+	Features = Result;
+	return Result;
 }
 
+#endif // DERPNET_USE_SIMD
+
+// CPU level of crypto kernels, best one is picked on first use, see DerpNet_SetCpuLevel
+static DerpNetCpuLevel DerpNet__KernelsLevel(void);
+
 //
 // curve25519, based on public domain code from https://github.com/floodyberry/curve25519-donna
 //
@@ -492,12 +1276,16 @@ static void curve25519_recip(bignum25519 out, const bignum25519 z)
 	/* 2^255 - 21 */     curve25519_mul(out, b, a);
 }
 
-static void curve25519_scalarmult(uint8_t* mypublic, const uint8_t* n, const uint8_t* basepoint)
+// montgomery ladder, result is in projective coordinates nqx/nqz
+static void curve25519_ladder(bignum25519 nqx, bignum25519 nqz, const uint8_t* n, const uint8_t* basepoint)
 {
 	// curve25519-donna-64bit.h
 	// curve25519-donna-common.h
-	bignum25519 nqpqx = { 1 }, nqpqz = { 0 }, nqz = { 1 }, nqx;
-	bignum25519 q, qx, qpqx, qqx, zzz, zmone;
+	bignum25519 nqpqx = { 1 }, nqpqz = { 0 };
+	bignum25519 q, qx, qpqx, qqx, zzz;
+
+	nqz[0] = 1;
+	nqz[1] = nqz[2] = nqz[3] = nqz[4] = 0;
 
 	curve25519_expand(q, basepoint);
 	curve25519_copy(nqx, q);
@@ -547,51 +1335,681 @@ static void curve25519_scalarmult(uint8_t* mypublic, const uint8_t* n, const uin
 		curve25519_add(zzz, zzz, qx);
 		curve25519_mul(nqz, nqz, zzz);
 	}
+}
+
+static void curve25519_scalarmult(uint8_t* mypublic, const uint8_t* n, const uint8_t* basepoint)
+{
+	bignum25519 nqx, nqz, zmone;
+	curve25519_ladder(nqx, nqz, n, basepoint);
 
 	curve25519_recip(zmone, nqz);
 	curve25519_mul(nqz, nqx, zmone);
 	curve25519_contract(mypublic, nqz);
 }
 
-//
-// poly1305, based on public domain code from https://github.com/floodyberry/poly1305-donna
-//
-
-#define poly1305_block_size 16
-
-typedef struct {
-	uint64_t r[3];
-	uint64_t h[3];
-	uint64_t pad[2];
-	size_t leftover;
-	unsigned char buffer[poly1305_block_size];
-	unsigned char final;
-} poly1305_state_internal_t;
+#define curve25519_max_batch 32
 
-static void poly1305_init(poly1305_state_internal_t* st, const uint8_t key[32])
+// same as curve25519_scalarmult for many basepoints, with only one field inversion for all of them
+static void curve25519_scalarmult_batch(uint8_t (*mypublic)[32], const uint8_t* n, const uint8_t (*basepoint)[32], size_t count)
 {
-	/* r &= 0xffffffc0ffffffc0ffffffc0fffffff */
-	uint64_t t0 = Get64LE(&key[0]);
-	uint64_t t1 = Get64LE(&key[8]);
-	st->r[0] = ( t0                    ) & 0xffc0fffffff;
-	st->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffff;
-	st->r[2] = ((t1 >> 24)             ) & 0x00ffffffc0f;
+	bignum25519 x[curve25519_max_batch], z[curve25519_max_batch], acc[curve25519_max_batch];
+	bool zero[curve25519_max_batch];
 
-	/* h = 0 */
-	st->h[0] = 0;
-	st->h[1] = 0;
-	st->h[2] = 0;
+	DERPNET_ASSERT(count != 0 && count <= curve25519_max_batch);
 
-	/* save pad for later */
-	st->pad[0] = Get64LE(&key[16]);
-	st->pad[1] = Get64LE(&key[24]);
+	for (size_t i = 0; i < count; i++)
+	{
+		curve25519_ladder(x[i], z[i], n, basepoint[i]);
 
-	st->leftover = 0;
-	st->final = 0;
-}
+		// low order points give z=0, single inversion would return 0 for them
+		// but it cannot be part of the product, so replace it with 1 and output 0 later
+		uint8_t bytes[32], any = 0;
+		curve25519_contract(bytes, z[i]);
+		for (size_t k = 0; k < sizeof(bytes); k++)
+		{
+			any |= bytes[k];
+		}
+		zero[i] = any == 0;
+		if (zero[i])
+		{
+			static const bignum25519 one = { 1 };
+			curve25519_copy(z[i], one);
+		}
+	}
+
+	// Montgomery's trick: invert z[0]*z[1]*...*z[count-1] once, then peel individual inverses
+	curve25519_copy(acc[0], z[0]);
+	for (size_t i = 1; i < count; i++)
+	{
+		curve25519_mul(acc[i], acc[i - 1], z[i]);
+	}
+
+	bignum25519 inv, zinv;
+	curve25519_recip(inv, acc[count - 1]);
+
+	for (size_t i = count - 1; i != 0; i--)
+	{
+		curve25519_mul(zinv, inv, acc[i - 1]);
+		curve25519_mul(inv, inv, z[i]);
+		curve25519_mul(x[i], x[i], zinv);
+	}
+	curve25519_mul(x[0], x[0], inv);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (zero[i])
+		{
+			memset(mypublic[i], 0, 32);
+		}
+		else
+		{
+			curve25519_contract(mypublic[i], x[i]);
+		}
+	}
+}
+
+//
+// fixed-base scalar multiplication for public keys, done on birationally equivalent
+// edwards25519 curve where precomputed multiples of base point can be used
+//
+
+typedef struct {
+	bignum25519 x, y, z, t;
+} ge25519;
+
+typedef struct {
+	bignum25519 ysubx, xaddy, t2d;
+} ge25519_niels;
+
+static void curve25519_reduce(bignum25519 out)
+{
+	uint64_t c;
+	             c = out[0] >> 51; out[0] &= reduce_mask_51;
+	out[1] += c; c = out[1] >> 51; out[1] &= reduce_mask_51;
+	out[2] += c; c = out[2] >> 51; out[2] &= reduce_mask_51;
+	out[3] += c; c = out[3] >> 51; out[3] &= reduce_mask_51;
+	out[4] += c; c = out[4] >> 51; out[4] &= reduce_mask_51;
+	out[0] += c * 19;
+}
+
+static void curve25519_add_reduce(bignum25519 out, const bignum25519 a, const bignum25519 b)
+{
+	curve25519_add(out, a, b);
+	curve25519_reduce(out);
+}
+
+static void curve25519_sub_reduce(bignum25519 out, const bignum25519 a, const bignum25519 b)
+{
+	curve25519_sub(out, a, b);
+	curve25519_reduce(out);
+}
+
+/* r = 2p, output is in completed form: x=E, y=H, z=G, t=F */
+static void ge25519_double_p1p1(ge25519* r, const ge25519* p)
+{
+	bignum25519 a, b, c;
+
+	curve25519_square(a, p->x);
+	curve25519_square(b, p->y);
+	curve25519_square(c, p->z);
+	curve25519_add_reduce(c, c, c);
+	curve25519_add(r->x, p->x, p->y);
+	curve25519_square(r->x, r->x);
+	curve25519_add_reduce(r->y, b, a);
+	curve25519_sub_reduce(r->z, b, a);
+	curve25519_sub_reduce(r->x, r->x, r->y);
+	curve25519_sub_reduce(r->t, c, r->z);
+}
+
+/* r = p + q, output is in completed form: x=E, y=H, z=G, t=F */
+static void ge25519_madd_p1p1(ge25519* r, const ge25519* p, const ge25519_niels* q)
+{
+	bignum25519 a, b, c, d;
+
+	curve25519_sub_reduce(a, p->y, p->x);
+	curve25519_add_reduce(b, p->y, p->x);
+	curve25519_mul(a, a, q->ysubx);
+	curve25519_mul(b, b, q->xaddy);
+	curve25519_mul(c, p->t, q->t2d);
+	curve25519_add_reduce(d, p->z, p->z);
+	curve25519_sub_reduce(r->x, b, a);
+	curve25519_add_reduce(r->y, b, a);
+	curve25519_add_reduce(r->z, d, c);
+	curve25519_sub_reduce(r->t, d, c);
+}
+
+static void ge25519_p1p1_to_full(ge25519* r, const ge25519* p)
+{
+	curve25519_mul(r->x, p->x, p->t);
+	curve25519_mul(r->y, p->y, p->z);
+	curve25519_mul(r->z, p->z, p->t);
+	curve25519_mul(r->t, p->x, p->y);
+}
+
+static void curve25519_move_conditional(bignum25519 out, const bignum25519 in, uint64_t flag)
+{
+	const uint64_t mask = (uint64_t)(-(int64_t)flag);
+	out[0] ^= mask & (out[0] ^ in[0]);
+	out[1] ^= mask & (out[1] ^ in[1]);
+	out[2] ^= mask & (out[2] ^ in[2]);
+	out[3] ^= mask & (out[3] ^ in[3]);
+	out[4] ^= mask & (out[4] ^ in[4]);
+}
+
+/* multiples k * 16^(4*i) * B for k=1..8, in affine niels form (y-x, y+x, 2*d*x*y) as 51-bit limbs,
+   generated offline with exact integer arithmetic on edwards25519 */
+static const ge25519_niels ge25519_base_multiples[16][8] =
+{
+	{
+		{{0x03905d740913e,0x0ba2817d673a2,0x23e2827f4e67c,0x133d2e0c21a34,0x44fd2f9298f81},{0x493c6f58c3b85,0x0df7181c325f7,0x0f50b0b3e4cb7,0x5329385a44c32,0x07cf9d3a33d4b},{0x11205877aaa68,0x479955893d579,0x50d66309b67a0,0x2d42d0dbee5ee,0x6f117b689f0c6}},
+		{{0x1a56042b4d5a8,0x189cc159ed153,0x5b8deaa3cae04,0x2aaf04f11b5d8,0x6bb595a669c92},{0x4e7fc933c71d7,0x2cf41feb6b244,0x7581c0a7d1a76,0x7172d534d32f0,0x590c063fa87d2},{0x2a8b3a59b7a5f,0x3abb359ef087f,0x4f5a8c4db05af,0x5b9a807d04205,0x701af5b13ea50}},
+		{{0x11fe8a4fcd265,0x7bcb8374faacc,0x52f5af4ef4d4f,0x5314098f98d10,0x2ab91587555bd},{0x5b0a84cee9730,0x61d10c97155e4,0x4059cc8096a10,0x47a608da8014f,0x7a164e1b9a80f},{0x6933f0dd0d889,0x44386bb4c4295,0x3cb6d3162508c,0x26368b872a2c6,0x5a2826af12b9b}},
+		{{0x6050a056818bf,0x62acc1f5532bf,0x28141ccc9fa25,0x24d61f471e683,0x27933f4c7445a},{0x351b98efc099f,0x68fbfa4a7050e,0x42a49959d971b,0x393e51a469efd,0x680e910321e58},{0x3fbe9c476ff09,0x0af6b982e4b42,0x0ad1251ba78e5,0x715aeedee7c88,0x7f9d0cbf63553}},
+		{{0x182c3a447d6ba,0x22964e536eff2,0x192821f540053,0x2f9f19e788e5c,0x154a7e73eb1b5},{0x2bc4408a5bb33,0x078ebdda05442,0x2ffb112354123,0x375ee8df5862d,0x2945ccf146e20},{0x3dbf1812a8285,0x0fa17ba3f9797,0x6f69cb49c3820,0x34d5a0db3858d,0x43aabe696b3bb}},
+		{{0x006b67b7d8ca4,0x084fa44e72933,0x1154ee55d6f8a,0x4425d842e7390,0x38b64c41ae417},{0x4eeeb77157131,0x1201915f10741,0x1669cda6c9c56,0x45ec032db346d,0x51e57bb6a2cc3},{0x4326702ea4b71,0x06834376030b5,0x0ef0512f9c380,0x0f1a9f2512584,0x10b8e91a9f0d6}},
+		{{0x72c9aaa3221b1,0x267774474f74d,0x064b0e9b28085,0x3f04ef53b27c9,0x1d6edd5d2e531},{0x25cd0944ea3bf,0x75673b81a4d63,0x150b925d1c0d4,0x13f38d9294114,0x461bea69283c9},{0x36dc801b8b3a2,0x0e0a7d4935e30,0x1deb7cecc0d7d,0x053a94e20dd2c,0x7a9fbb1c6a0f9}},
+		{{0x75dedf39234d9,0x01c36ab1f3c54,0x0f08fee58f5da,0x0e19613a0d637,0x3a9024a1320e0},{0x7596604dd3e8f,0x6fc510e058b36,0x3670c8db2cc0d,0x297d899ce332f,0x0915e76061bce},{0x1f5d9c9a2911a,0x7117994fafcf8,0x2d8a8cae28dc5,0x74ab1b2090c87,0x26907c5c2ecc4}}
+	},
+	{
+		{{0x07d44744346be,0x282b6a564a81d,0x4ed80f875236b,0x6fbbe1d450c50,0x4eb728c12fcdb},{0x34c597c6691ae,0x7a150b6990fc4,0x52beb9d922274,0x70eed7164861a,0x0a871e070c6a9},{0x1b5994bbc8989,0x74b7ba84c0660,0x75678f1cdaeb8,0x23206b0d6f10c,0x3ee7300f2685d}},
+		{{0x255e49e7dd6b7,0x38c2163d59eba,0x3861f2a005845,0x2e11e4ccbaec9,0x1381576297912},{0x27947841e7518,0x32c7388dae87f,0x414add3971be9,0x01850832f0ef1,0x7d47c6a2cfb89},{0x2d0148ef0d6e0,0x3522a8de787fb,0x2ee055e74f9d2,0x64038f6310813,0x148cf58d34c9e}},
+		{{0x492f67934f027,0x7ded0815528d4,0x58461511a6612,0x5ea2e50de1544,0x3ff2fa1ebd5db},{0x72f7d9ae4756d,0x7711e690ffc4a,0x582a2355b0d16,0x0dccfe885b6b4,0x278febad4eaea},{0x2681f8c933966,0x3840521931635,0x674f14a308652,0x3bd9c88a94890,0x4104dd02fe9c6}},
+		{{0x2bf5e1124422a,0x673146756ae56,0x14ad99a87e830,0x1eaca65b080fd,0x2c863b00afaf5},{0x14e06db096ab8,0x1219c89e6b024,0x278abd486a2db,0x240b292609520,0x0165b5a48efca},{0x0a474a0846a76,0x099a5ef981e32,0x2a8ae3c4bbfe6,0x45c34af14832c,0x591b67d9bffec}},
+		{{0x70d1c80b49bfa,0x3d57e7d914625,0x3c0722165e545,0x5e5b93819e04f,0x3de02ec7ca8f7},{0x1b3719f18b55d,0x754318c83d337,0x27c17b7919797,0x145b084089b61,0x489b4f8670301},{0x2102d3aeb92ef,0x68c22d50c3a46,0x42ea89385894e,0x75f9ebf55f38c,0x49f5fbba496cb}},
+		{{0x49a108a5bcfd4,0x6178c8e7d6612,0x1f03473710375,0x73a49614a6098,0x5604a86dcbfa6},{0x5628c1e9c572e,0x598b108e822ab,0x55d8fae29361a,0x0adc8d1a97b28,0x06a1a6c288675},{0x0d1d47c1764b6,0x01c08316a2e51,0x2b3db45c95045,0x1634f818d300c,0x20989e89fe274}},
+		{{0x777fd3a2dcc7f,0x594a9fb124932,0x01f8e80ca15f0,0x714d13cec3269,0x0403ed1d0ca67},{0x4278b85eaec2e,0x0ef59657be2ce,0x72fd169588770,0x2e9b205260b30,0x730b9950f7059},{0x32d35874ec552,0x1f3048df1b929,0x300d73b179b23,0x6e67be5a37d0b,0x5bd7454308303}},
+		{{0x2d19528b24cc2,0x4ac66b8302ff3,0x701c8d9fdad51,0x6c1b35c5b3727,0x133a78007380a},{0x4932115e7792a,0x457b9bbb930b8,0x68f5d8b193226,0x4164e8f1ed456,0x5bb7db123067f},{0x1f467c6ca62be,0x2c4232a5dc12c,0x7551dc013b087,0x0690c11b03bcd,0x740dca6d58f0e}}
+	},
+	{
+		{{0x68756a60dac5f,0x55d757b8aec26,0x3383df45f80bd,0x6783f8c9f96a6,0x20234a7789ecd},{0x5b69f7b85c5e8,0x17a2d175650ec,0x4cc3e6dbfc19e,0x73e1d3873be0e,0x3a5f6d51b0af8},{0x20db67178b252,0x73aa3da2c0eda,0x79045c01c70d3,0x1b37b15251059,0x7cd682353cffe}},
+		{{0x1a45bd887fab6,0x65748076dc17c,0x5b98000aa11a8,0x4a1ecc9080974,0x2838c8863bdc0},{0x5cd6068acf4f3,0x3079afc7a74cc,0x58097650b64b4,0x47fabac9c4e99,0x3ef0253b2b2cd},{0x3b0cf4a465030,0x022b8aef57a2d,0x2ad0677e925ad,0x4094167d7457a,0x21dcb8a606a82}},
+		{{0x004468c9d9fc8,0x5da8554796b8c,0x3b8be70950025,0x6d5892da6a609,0x0bc3d08194a31},{0x500fabe7731ba,0x7cc53c3113351,0x7cf65fe080d81,0x3c5d966011ba1,0x5d840dbf6c6f6},{0x6380d309fe18b,0x4d73c2cb8ee0d,0x6b882adbac0b6,0x36eabdddd4cbe,0x3a4276232ac19}},
+		{{0x2432c8a7084fa,0x47bf73ca8a968,0x1639176262867,0x5e8df4f8010ce,0x1ff177cea16de},{0x0c172db447ecb,0x3f8c505b7a77f,0x6a857f97f3f10,0x4fcc0567fe03a,0x0770c9e824e1a},{0x1d99a45b5b5fd,0x523674f2499ec,0x0f8fa26182613,0x58f7398048c98,0x39f264fd41500}},
+		{{0x53417dbe7e29c,0x54573827394f5,0x565eea6f650dd,0x42050748dc749,0x1712d73468889},{0x34aabfe097be1,0x43bfc03253a33,0x29bc7fe91b7f3,0x0a761e4844a16,0x65c621272c35f},{0x389f8ce3193dd,0x2d424b8177ce5,0x073fa0d3440cd,0x139020cd49e97,0x22f9800ab19ce}},
+		{{0x2368a3e9ef8cb,0x454aa08e2ac0b,0x490923f8fa700,0x372aa9ea4582f,0x13f416cd64762},{0x29fdd9a6efdac,0x7c694a9282840,0x6f7cdeee44b3a,0x55a3207b25cc3,0x4171a4d38598c},{0x758aa99c94c8c,0x5f6001700ff44,0x7694e488c01bd,0x0d5fde948eed6,0x508214fa574bd}},
+		{{0x269153ed6fe4b,0x72a23aef89840,0x052be5299699c,0x3a5e5ef132316,0x22f960ec6faba},{0x215bb53d003d6,0x1179e792ca8c3,0x1a0e96ac840a2,0x22393e2bb3ab6,0x3a7758a4c86cb},{0x111f693ae5076,0x3e3bfaa94ca90,0x445799476b887,0x24a0912464879,0x5d9fd15f8de7f}},
+		{{0x408d36d63727f,0x5faf8f6a66062,0x2bb892da8de6b,0x769d4f0c7e2e6,0x332f35914f8fb},{0x44d2aeed7521e,0x50865d2c2a7e4,0x2705b5238ea40,0x46c70b25d3b97,0x3bc187fa47eb9},{0x70115ea86c20c,0x16d88da24ada8,0x1980622662adf,0x501ebbc195a9d,0x450d81ce906fb}}
+	},
+	{
+		{{0x6f74bc53c1431,0x1c40e5dbbd9c2,0x6c8fb9cae5c97,0x4845c5ce1b7da,0x7e2e0e450b5cc},{0x62b434f460efb,0x294c6c0fad3fc,0x68368937b4c0f,0x5c9f82910875b,0x237e7dbe00545},{0x575ed6701b430,0x4d3e17fa20026,0x791fc888c4253,0x2f1ba99078ac1,0x71afa699b1115}},
+		{{0x66f9b3953b61d,0x555f4283cccb9,0x7dd67fb1960e7,0x14707a1affed4,0x021142e9c2b1c},{0x23c1c473b50d6,0x3e7671de21d48,0x326fa5547a1e8,0x50e4dc25fafd9,0x00731fbc78f89},{0x0c71848f81880,0x44bd9d8233c86,0x6e8578efe5830,0x4045b6d7041b5,0x4c4d6f3347e15}},
+		{{0x7eccfc17d1fc9,0x4ca280782831e,0x7b8337db1d7d6,0x5116def3895fb,0x193fddaaa7e47},{0x4ddfc988f1970,0x4f6173ea365e1,0x645daf9ae4588,0x7d43763db623b,0x38bf9500a88f9},{0x2c93c37e8876f,0x3431a28c583fa,0x49049da8bd879,0x4b4a8407ac11c,0x6a6fb99ebf0d4}},
+		{{0x6c1bb560855eb,0x71f127e13ad48,0x5c6b304905aec,0x3756b8e889bc7,0x75f76914a3189},{0x122b5b6e423c6,0x21e50dff1ddd6,0x73d76324e75c0,0x588485495418e,0x136fda9f42c5e},{0x4dfb1a305bdd1,0x3b3ff05811f29,0x6ed62283cd92e,0x65d1543ec52e1,0x022183510be8d}},
+		{{0x766385ead2d14,0x0194f8b06095e,0x08478f6823b62,0x6018689d37308,0x6a071ce17b806},{0x2710143307a7f,0x3d88fb48bf3ab,0x249eb4ec18f7a,0x136115dff295f,0x1387c441fd404},{0x3c3d187978af8,0x7afe1c88276ba,0x51df281c8ad68,0x64906bda4245d,0x3171b26aaf1ed}},
+		{{0x7319097564ca8,0x1844ebc233525,0x21d4543fdeee1,0x1ad27aaff1bd2,0x221fd4873cf08},{0x5b7d8b28a47d1,0x2c2ee149e34c1,0x776f5629afc53,0x1f4ea50fc49a9,0x6c514a6334424},{0x2204f3a156341,0x537414065a464,0x43c0c3bedcf83,0x5557e706ea620,0x48daa596fb924}},
+		{{0x28e665ca59cc7,0x165c715940dd9,0x0785f3aa11c95,0x57b98d7e38469,0x676dd6fccad84},{0x61d5dc84c9793,0x47de83040c29e,0x189deb26507e7,0x4d4e6fadc479a,0x58c837fa0e8a7},{0x1688596fc9058,0x66f6ad403619f,0x4d759a87772ef,0x7856e6173bea4,0x1c4f73f2c6a57}},
+		{{0x24fbd305fa0bb,0x40a98cc75a1cf,0x78ce1220a7533,0x6217a10e1c197,0x795ac80d1bf64},{0x6706efc7c3484,0x6987839ec366d,0x0731f95cf7f26,0x3ae758ebce4bc,0x70459adb7daf6},{0x1db4991b42bb3,0x469605b994372,0x631e3715c9a58,0x7e9cfefcf728f,0x5fe162848ce21}}
+	},
+	{
+		{{0x38ec78df6b0fe,0x13caebea36a22,0x5ebc6e54e5f6a,0x32804903d0eb8,0x2102fdba2b20d},{0x265e777d1f515,0x0f1f54c1e39a5,0x2f01b95522646,0x4fdd8db9dde6d,0x654878cba97cc},{0x6e405055ce6a1,0x5024a35a532d3,0x1f69054daf29d,0x15d1d0d7a8bd5,0x0ad725db29ecb}},
+		{{0x267b1834e2457,0x6ae19c378bb88,0x7457b5ed9d512,0x3280d783d05fb,0x4aefcffb71a03},{0x7bc0c9b056f85,0x51cfebffaffd8,0x44abbe94df549,0x7ecbbd7e33121,0x4f675f5302399},{0x536360415171e,0x2313309077865,0x251444334afbc,0x2b0c3853756e8,0x0bccbb72a2a86}},
+		{{0x6962feab1a9c8,0x6aca28fb9a30b,0x56db7ca1b9f98,0x39f58497018dd,0x4024f0ab59d6b},{0x55e4c50fe1296,0x05fdd13efc30d,0x1c0c6c380e5ee,0x3e11de3fb62a8,0x6678fd69108f3},{0x6fa31636863c2,0x10ae5a67e42b0,0x27abbf01fda31,0x380a7b9e64fbc,0x2d42e2108ead4}},
+		{{0x5131594dfd29b,0x3a627e98d52fe,0x1154041855661,0x19175d09f8384,0x676b2608b8d2d},{0x17b0d0f537593,0x16263c0c9842e,0x4ab827e4539a4,0x6370ddb43d73a,0x420bf3a79b423},{0x0ba651c5b2b47,0x5862363701027,0x0c4d6c219c6db,0x0f03dff8658de,0x745d2ffa9c0cf}},
+		{{0x25a1e2bc9c8bd,0x104c8f3b037ea,0x405576fa96c98,0x2e86a88e3876f,0x1ae23ceb960cf},{0x6df5721d34e6a,0x4f32f767a0c06,0x1d5abeac76e20,0x41ce9e104e1e4,0x06e15be54c1dc},{0x25d871932994a,0x6b9d63b560b6e,0x2df2814c8d472,0x0fbbee20aa4ed,0x58ded861278ec}},
+		{{0x73793f266c55c,0x0b988a9c93b02,0x09b0ea32325db,0x37cae71c17c5e,0x2ff39de85485f},{0x35ba8b6c2c9a8,0x1dea58b3185bf,0x4b455cd23bbbe,0x5ec19c04883f8,0x08ba696b531d5},{0x53eeec3efc57a,0x2fa9fe9022efd,0x699c72c138154,0x72a751ebd1ff8,0x120633b4947cf}},
+		{{0x4987891610042,0x79d9d7f5d0172,0x3c293013b9ec4,0x0c2b85f39caca,0x35d30a99b4d59},{0x531474912100a,0x5afcdf7c0d057,0x7a9e71b788ded,0x5ef708f3b0c88,0x07433be3cb393},{0x144c05ce997f4,0x4960b8a347fef,0x1da11f15d74f7,0x54fac19c0fead,0x2d873ede7af6d}},
+		{{0x2316443373409,0x5de95503b22af,0x699201beae2df,0x3db5849ff737a,0x2e773654707fa},{0x202e14e5df981,0x2ea02bc3eb54c,0x38875b2883564,0x1298c513ae9dd,0x0543618a01600},{0x2bdf4974c23c1,0x4b3b9c8d261bd,0x26ae8b2a9bc28,0x3068210165c51,0x4b1443362d079}}
+	},
+	{
+		{{0x5058a382b33f3,0x175a91816913e,0x4f6cdb96b8ae8,0x17347c9da81d2,0x5aa3ed9d95a23},{0x0aaf9b4b75601,0x26b91b5ae44f3,0x6de808d7ab1c8,0x6a769675530b0,0x1bbfb284e98f7},{0x777e9c7d96561,0x28e58f006ccac,0x541bbbb2cac49,0x3e63282994cec,0x4a07e14e5e895}},
+		{{0x412cb980df999,0x5e78dd8ee29dc,0x171dff68c575d,0x2015dd2f6ef49,0x3f0bac391d313},{0x358cdc477a49b,0x3cc88fe02e481,0x721aab7f4e36b,0x0408cc9469953,0x50af7aed84afa},{0x7de0115f65be5,0x4242c21364dc9,0x6b75b64a66098,0x0033c0102c085,0x1921a316baebd}},
+		{{0x22f7edfb870fc,0x569eed677b128,0x30937dcb0a5af,0x758039c78ea1b,0x6458df41e273a},{0x2ad9ad9f3c18b,0x5ec1638339aeb,0x5703b6559a83b,0x3fa9f4d05d612,0x7b049deca062c},{0x3e37a35444483,0x661fdb7d27b99,0x317761dd621e4,0x7323c30026189,0x6093dccbc2950}},
+		{{0x39a8585e0706d,0x3167ce72663fe,0x63d14ecdb4297,0x4be21dcf970b8,0x57d1ea084827a},{0x6eebe6084034b,0x6cf01f70a8d7b,0x0b41a54c6670a,0x6c84b99bb55db,0x6e3180c98b647},{0x2b6e7a128b071,0x5b27511755dcf,0x08584c2930565,0x68c7bda6f4159,0x363e999ddd97b}},
+		{{0x043c135ee1fc4,0x2a11c9919f2d5,0x6334cc25dbacd,0x295da17b400da,0x48ee9b78693a0},{0x048dce24baec6,0x2b75795ec05e3,0x3bfa4c5da6dc9,0x1aac8659e371e,0x231f979bc6f9b},{0x1de4bcc2af3c6,0x61fc411a3eb86,0x53ed19ac12ec0,0x209dbc6b804e0,0x079bfa9b08792}},
+		{{0x03a51da300df4,0x467b52b561c72,0x4d5920210e590,0x0ca769e789685,0x038c77f684817},{0x1ed80a2d54245,0x70efec72a5e79,0x42151d42a822d,0x1b5ebb6d631e8,0x1ef4fb1594706},{0x65ee65b167bec,0x052da19b850a9,0x0408665656429,0x7ab39596f9a4c,0x575ee92a4a0bf}},
+		{{0x080908a182fcf,0x0532913b7ba98,0x3dccf78c385c3,0x68002dd5eaba9,0x43d4e7112cd3f},{0x6bc450aa4d801,0x4f4a6773b0ba8,0x6241b0b0ebc48,0x40d9c4f1d9315,0x200a1e7e382f5},{0x5b967eaf93ac5,0x360acca580a31,0x1c65fd5c6f262,0x71c7f15c2ecab,0x050eca52651e4}},
+		{{0x31ade453f0c9c,0x3dfee07737868,0x611ecf7a7d411,0x2637e6cbd64f6,0x4b0ee6c21c58f},{0x4397660e668ea,0x7c2a75692f2f5,0x3b29e7e6c66ef,0x72ba658bcda9a,0x6151c09fa131a},{0x55c0dfdf05d96,0x405569dcf475e,0x05c5c277498bb,0x18588d95dc389,0x1fef24fa800f0}}
+	},
+	{
+		{{0x7a9c59c2ec4de,0x7e9f09e79652d,0x6a3e422f22d86,0x2ae8e3b836c8b,0x63b795fc7ad32},{0x0639c12ddb0a4,0x6180490cd7ab3,0x3f3918297467c,0x74568be1781ac,0x07a195152e095},{0x68f02389e5fc8,0x059f1bc877506,0x504990e410cec,0x09bd7d0feaee2,0x3e8fe83d032f0}},
+		{{0x315b90570a294,0x60ce108a925f1,0x6eff61253c909,0x003ef0e2d70b0,0x75ba3b797fac4},{0x04c8de8efd13c,0x1c67c06e6210e,0x183378f7f146a,0x64352ceaed289,0x22d60899a6258},{0x1dbc070cdd196,0x16d8fb1534c47,0x500498183fa2a,0x72f59c423de75,0x0904d07b87779}},
+		{{0x61fd4ddba919c,0x7d8e991b55699,0x61b31473cc76c,0x7039631e631d6,0x43e2143fbc1dd},{0x22d6648f940b9,0x197a5a1873e86,0x207e4c41a54bc,0x5360b3b4bd6d0,0x6240aacebaf72},{0x4749c5ba295a0,0x37946fa4b5f06,0x724c5ab5a51f1,0x65633789dd3f3,0x56bdaf238db40}},
+		{{0x2b9e3f53533eb,0x2add727a806c5,0x56955c8ce15a3,0x18c4f070a290e,0x1d24a86d83741},{0x0d36cc19d3bb2,0x6ec4470d72262,0x6853d7018a9ae,0x3aa3e4dc2c8eb,0x03aa31507e1e5},{0x47648ffd4ce1f,0x60a9591839e9d,0x424d5f38117ab,0x42cc46912c10e,0x43b261dc9aeb4}},
+		{{0x31e1988bb79bb,0x7b82f46b3bcab,0x0f7a8ce827b41,0x5e15816177130,0x326055cf5b276},{0x13d8b6c951364,0x4c0017e8f632a,0x53e559e53f9c4,0x4b20146886eea,0x02b4d5e242940},{0x155cb28d18df2,0x0c30d9ca11694,0x2090e27ab3119,0x208624e7a49b6,0x27a6c809ae5d3}},
+		{{0x6ebcd1f0db188,0x74ceb4b7d1174,0x7d56168df4f5c,0x0bf79176fd18a,0x2cb67174ff60a},{0x4270ac43d6954,0x2ed4cd95659a5,0x75c0db37528f9,0x2ccbcfd2c9234,0x221503603d8c2},{0x6cdf9390be1d0,0x08e519c7e2b3d,0x253c3d2a50881,0x21b41448e333d,0x7b1df4b73890f}},
+		{{0x2f2e0b3b2a224,0x0c56aa22c1c92,0x5fdec39f1b278,0x4c90af5c7f106,0x61fcef2658fc5},{0x6221807f8f58c,0x3fa92813a8be5,0x6da98c38d5572,0x01ed95554468f,0x68698245d352e},{0x15d852a18187a,0x270dbb59afb76,0x7db120bcf92ab,0x0e7a25d714087,0x46cf4c473daf0}},
+		{{0x525ed9ec4e5f9,0x022d20660684c,0x7972b70397b68,0x7a03958d3f965,0x29387bcd14eb5},{0x46ea7f1498140,0x70725690a8427,0x0a73ae9f079fb,0x2dd924461c62b,0x1065aae50d8cc},{0x44525df200d57,0x2d7f94ce94385,0x60d00c170ecb7,0x38b0503f3d8f0,0x69a198e64f1ce}}
+	},
+	{
+		{{0x42b256768d593,0x2e88459427b4f,0x02b3876630701,0x34878d405eae5,0x29cdd1adc088a},{0x7d1ef5fddc09c,0x7beeaebb9dad9,0x058d30ba0acfb,0x5cd92eab5ae90,0x3041c6bb04ed2},{0x2f2f9d956e148,0x6b3e6ad65c1fe,0x5b00972b79e5d,0x53d8d234c5daf,0x104bbd6814049}},
+		{{0x0fd3168f1ed67,0x1bb0de7784a3e,0x34bcb78b20477,0x0a4a26e2e2182,0x5be8cc57092a7},{0x59a5fd67ff163,0x3a998ead0352b,0x083c95fa4af9a,0x6fadbfc01266f,0x204f2a20fb072},{0x43b3d30ebb079,0x357aca5c61902,0x5b570c5d62455,0x30fb29e1e18c7,0x2570fb17c2791}},
+		{{0x2367f2cb61575,0x6c39ac04d87df,0x6d4958bd7e5bd,0x566f4638a1532,0x3dcb65ea53030},{0x6a9550bb8245a,0x511f20a1a2325,0x29324d7239bee,0x3343cc37516c4,0x241c5f91de018},{0x0172940de6caa,0x6045b2e67451b,0x56c07463efcb3,0x0728b6bfe6e91,0x08420edd5fcdf}},
+		{{0x720ab8362fa4a,0x29c4347cdd9bf,0x0e798ad5f8463,0x4fef18bcb0bfe,0x0d9a53efbc176},{0x0c34e04f410ce,0x344edc0d0a06b,0x6e45486d84d6d,0x44e2ecb3863f5,0x04d654f321db8},{0x5c116ddbdb5d5,0x6d1b4bba5abcf,0x4d28a48a5537a,0x56b8e5b040b99,0x4a7a4f2618991}},
+		{{0x718025fb15f95,0x68d6b8371fe94,0x3804448f7d97c,0x42466fe784280,0x11b50c4cddd31},{0x3b291af372a4b,0x60e3028fe4498,0x2267bca4f6a09,0x719eec242b243,0x4a96314223e0e},{0x0274408a4ffd6,0x7d382aedb34dd,0x40acfc9ce385d,0x628bb99a45b1e,0x4f4bce4dce6bc}},
+		{{0x7ce5ae2242584,0x2d25eb153d4e3,0x3a8f3d09ba9c9,0x0f3690d04eb8e,0x73fcdd14b71c0},{0x2616ec49d0b6f,0x1f95d8462e61c,0x1ad3e9b9159c6,0x79ba475a04df9,0x3042cee561595},{0x67079449bac41,0x5b79c4621484f,0x61069f2156b8d,0x0eb26573b10af,0x389e740c9a9ce}},
+		{{0x4b3ae34dcb9ce,0x47c691a15ac9f,0x318e06e5d400c,0x3c422d9f83eb1,0x61545379465a6},{0x578f6570eac28,0x644f2339c3937,0x66e47b7956c2c,0x34832fe1f55d0,0x25c425e5d6263},{0x606a6f1d7de6e,0x4f1c0c46107e7,0x229b1dcfbe5d8,0x3acc60a7b1327,0x6539a08915484}},
+		{{0x21f74c3d2f773,0x024b88d08bd3a,0x6e678cf054151,0x43631272e747c,0x11c5e4aac5cd1},{0x4dbd414bb4a19,0x7930849f1dbb8,0x329c5a466caf0,0x6c824544feb9b,0x0f65320ef019b},{0x6d1b1cafde0c6,0x462c76a303a90,0x3ca4e693cff9b,0x3952cd45786fd,0x4cabc7bdec330}}
+	},
+	{
+		{{0x27562eb3dbe47,0x291d7b4170be7,0x5d1ca67dfa8e1,0x2a88061f298a2,0x1304e9e71627d},{0x304bfacad8ea2,0x502917d108b07,0x043176ca6dd0f,0x5d5158f2c1d84,0x2b5449e58eb3b},{0x014d26adc9cfe,0x7f1691ba16f13,0x5e71828f06eac,0x349ed07f0fffc,0x4468de2d7c2dd}},
+		{{0x3355e9419469e,0x1847bb8ea8a37,0x1fe6588cf9b71,0x6b1c9d2db6b22,0x6cce7c6ffb44b},{0x2d8c6f86307ce,0x6286ba1850973,0x5e9dcb08444d4,0x1a96a543362b2,0x5da6427e63247},{0x4c688deac22ca,0x6f775c3ff0352,0x565603ee419bb,0x6544456c61c46,0x58f29abfe79f2}},
+		{{0x6cfab8de73e68,0x3e6efced4bd21,0x0056609500dbe,0x71b7824ad85df,0x577629c4a7f41},{0x264bf710ecdf6,0x708c58527896b,0x42ceae6c53394,0x4381b21e82b6a,0x6af93724185b4},{0x0024509c6a888,0x2696ab12e6644,0x0cca27f4b80d8,0x0c7c1f11b119e,0x701f25bb0caec}},
+		{{0x0b0f8e4616ced,0x1d3c4b50fb875,0x2f29673dc0198,0x5f4b0f1830ffa,0x2e0c92bfbdc40},{0x0f6d97cbec113,0x4ce97fb7c93a3,0x139835a11281b,0x728907ada9156,0x720a5bc050955},{0x709439b805a35,0x6ec48557f8187,0x08a4d1ba13a2c,0x076348a0bf9ae,0x0e9b9cbb144ef}},
+		{{0x2d48ffb5720ad,0x57b7f21a1df77,0x5550effba0645,0x5ec6a4098a931,0x221104eb3f337},{0x69bd55db1beee,0x6e14e47f731bd,0x1a35e47270eac,0x66f225478df8e,0x366d44191cfd3},{0x41743f2bc8c14,0x796b0ad8773c7,0x29fee5cbb689b,0x122665c178734,0x4167a4e6bc593}},
+		{{0x39d2876f62700,0x001cecd1d6c87,0x7f01a11747675,0x2350da5a18190,0x7938bb7e22552},{0x62665f8ce8fee,0x29d101ac59857,0x4d93bbba59ffc,0x17b7897373f17,0x34b33370cb7ed},{0x591ee8681d6cc,0x39db0b4ea79b8,0x202220f380842,0x2f276ba42e0ac,0x1176fc6e2dfe6}},
+		{{0x76cd05b9c619b,0x69654b0901695,0x7a53710b77f27,0x79a1ea7d28175,0x08fc3a4c677d5},{0x0e28949770eb8,0x5559e88147b72,0x35e1e6e63ef30,0x35b109aa7ff6f,0x1f6a3e54f2690},{0x4c199d30734ea,0x6c622cb9acc14,0x5660a55030216,0x068f1199f11fb,0x4f2fad0116b90}},
+		{{0x6b24194ae4e54,0x2230afded8897,0x23412617d5071,0x3d5d30f35969b,0x445484a4972ef},{0x4d91db73bb638,0x55f82538112c5,0x6d85a279815de,0x740b7b0cd9cf9,0x3451995f2944e},{0x2fcd09fea7d7c,0x296126b9ed22a,0x4a171012a05b2,0x1db92c74d5523,0x10b89ca604289}}
+	},
+	{
+		{{0x20cc9782a0dde,0x65d4e3070aab3,0x7bc8e31547736,0x09ebfb1432d98,0x504aa77679736},{0x0fcfa36048d13,0x66e7133bbb383,0x64b42a8a45676,0x4ea6e4f9a85cf,0x26f57eee878a1},{0x32cd55687efb1,0x4448f5e2f6195,0x568919d460345,0x034c2e0ad1a27,0x4041943d9dba3}},
+		{{0x0eeba43ebcc96,0x384dd5395f878,0x1df331a35d272,0x207ecfd4af70e,0x1420a1d976843},{0x17743a26caadd,0x48c9156f9c964,0x7ef278d1e9ad0,0x00ce58ea7bd01,0x12d931429800d},{0x67799d337594f,0x01647548f6018,0x57fce5578f145,0x009220c142a71,0x1b4f92314359a}},
+		{{0x4109d89150951,0x225bd2d2d47cb,0x57cc080e73bea,0x6d71075721fcb,0x239b572a7f132},{0x73030a49866b1,0x2442be90b2679,0x77bd3d8947dcf,0x1fb55c1552028,0x5ff191d56f9a2},{0x6d433ac2d9068,0x72bf930a47033,0x64facf4a20ead,0x365f7a2b9402a,0x020c526a758f3}},
+		{{0x034f89ed8dbbc,0x73b8f948d8ef3,0x786c1d323caab,0x43bd4a9266e51,0x02aacc4615313},{0x1ef59f042cc89,0x3b1c24976dd26,0x31d665cb16272,0x28656e470c557,0x452cfe0a5602c},{0x0f7a0647877df,0x4e1cc0f93f0d4,0x7ec4726ef1190,0x3bdd58bf512f8,0x4cfb7d7b304b8}},
+		{{0x43d6cb89b75fe,0x3338d5b900e56,0x38d327d531a53,0x1b25c61d51b9f,0x14b4622b39075},{0x699c29789ef12,0x63beae321bc50,0x325c340adbb35,0x562e1a1e42bf6,0x5b1d4cbc434d3},{0x32615cc0a9f26,0x57711b99cb6df,0x5a69c14e93c38,0x6e88980a4c599,0x2f98f71258592}},
+		{{0x4a74cb50f9e56,0x531d1c2640192,0x0c03d9d6c7fd2,0x57ccd156610c1,0x3a6ae249d806a},{0x2ae444f54a701,0x615397afbc5c2,0x60d7783f3f8fb,0x2aa675fc486ba,0x1d8062e9e7614},{0x2da85a9907c5a,0x6b23721ec4caf,0x4d2d3a4683aa2,0x7f9c6870efdef,0x298b8ce8aef25}},
+		{{0x27953eff70cb2,0x54f22ae0ec552,0x29f3da92e2724,0x242ca0c22bd18,0x34b8a8404d5ce},{0x272ea0a2165de,0x68179ef3ed06f,0x4e2b9c0feac1e,0x3ee290b1b63bb,0x6ba6271803a7d},{0x6ecb583693335,0x3ec76bfdfb84d,0x2c895cf56a04f,0x6355149d54d52,0x71d62bdd465e1}},
+		{{0x3cc28d378df80,0x72141f4968ca6,0x407696bdb6d0d,0x5d271b22ffcfb,0x74d5f317f3172},{0x5b5dab1f75ef5,0x1e2d60cbeb9a5,0x527c2175dfe57,0x59e8a2b8ff51f,0x1c333621262b2},{0x7e55467d9ca81,0x6a5653186f50d,0x6b188ece62df1,0x4c66d36844971,0x4aebcc4547e9d}}
+	},
+	{
+		{{0x7974e8c58aedc,0x7757e083488c6,0x601c62ae7bc8b,0x45370c2ecab74,0x2f1b78fab143a},{0x6bffb305b2f51,0x5b112b2d712dd,0x35774974fe4e2,0x04af87a96e3a3,0x57968290bb3a0},{0x2b8430a20e101,0x1a49e1d88fee3,0x38bbb47ce4d96,0x1f0e7ba84d437,0x7dc43e35dc2aa}},
+		{{0x66665887dd9c3,0x629760a6ab0b2,0x481e6c7243e6c,0x097e37046fc77,0x7ef72016758cc},{0x02a5c273e9718,0x32bc9dfb28b4f,0x48df4f8d5db1a,0x54c87976c028f,0x044fb81d82d50},{0x718c5a907e3d9,0x3b9c98c6b383b,0x006ed255eccdc,0x6976538229a59,0x7f79823f9c30d}},
+		{{0x4d239a3b513e8,0x29723f51b1066,0x642f4cf04d9c3,0x4da095aa09b7a,0x0a4e0373d784d},{0x41ff068f587ba,0x1c00a191bcd53,0x7b56f9c209e25,0x3781e5fccaabe,0x64a9b0431c06d},{0x3d6a15b7d2919,0x41aa75046a5d6,0x691751ec2d3da,0x23638ab6721c4,0x071a7d0ace183}},
+		{{0x72daac887ba0b,0x0b7f4ac5dda60,0x3bdda2c0498a4,0x74e67aa180160,0x2c3bcc7146ea7},{0x4355220e14431,0x0e1362a283981,0x2757cd8359654,0x2e9cd7ab10d90,0x7c69bcf761775},{0x0d7eb04e8295f,0x4a5ea1e6fa0fe,0x45e635c436c60,0x28ef4a8d4d18b,0x6f5a9a7322aca}},
+		{{0x1000c2f41c6c5,0x0219fdf737174,0x314727f127de7,0x7e5277d23b81e,0x494e21a2e147a},{0x1d4eba3d944be,0x0100f15f3dce5,0x61a700e367825,0x5922292ab3d23,0x02ab9680ee8d3},{0x48a85dde50d9a,0x1c1f734493df4,0x47bdb64866889,0x59a7d048f8eec,0x6b5d76cbea46b}},
+		{{0x7556cec0cd994,0x5eb9a03b7510a,0x50ad1dd91cb71,0x1aa5780b48a47,0x0ae333f685277},{0x141171e782522,0x6806d26da7c1f,0x3f31d1bc79ab9,0x09f20459f5168,0x16fb869c03dd3},{0x6199733b60962,0x69b157c266511,0x64740f893f1ca,0x03aa408fbf684,0x3f81e38b8f70d}},
+		{{0x10fcc7ed9affe,0x4248cb0e96ff2,0x4311c115172e2,0x4c9d41cbf6925,0x50510fc104f50},{0x37f355f17c824,0x07ae85334815b,0x7e3abddd2e48f,0x61eeabe1f45e5,0x0ad3e2d34cded},{0x40fc5336e249d,0x3386639fb2de1,0x7bbf871d17b78,0x75f796b7e8004,0x127c158bf0fa1}},
+		{{0x17c422e9879a2,0x28a5946c8fec3,0x53ab32e912b77,0x7b44da09fe0a5,0x354ef87d07ef4},{0x28fc4ae51b974,0x26e89bfd2dbd4,0x4e122a07665cf,0x7cab1203405c3,0x4ed82479d167d},{0x3b52260c5d975,0x79d6836171fdc,0x7d994f140d4bb,0x1b6c404561854,0x302d92d205392}}
+	},
+	{
+		{{0x0b9ab7f5745c6,0x5caf0f8d21d63,0x7debea408ea2b,0x09edb93896d16,0x36597d25ea5c0},{0x4dae0b5511c9a,0x5257fffe0d456,0x54108d1eb2180,0x096cc0f9baefa,0x3f6bd725da4ea},{0x58d7b106058ac,0x3cdf8d20bee69,0x00a4cb765015e,0x36832337c7cc9,0x7b7ecc19da60d}},
+		{{0x2373c695c690d,0x4c0c8520dcf18,0x384af4b7494b9,0x4ab4a8ea22225,0x4235ad7601743},{0x64a51a77cfa9b,0x29cf470ca0db5,0x4b60b6e0898d9,0x55d04ddffe6c7,0x03bedc661bf5c},{0x0cb0d078975f5,0x292313e530c4b,0x38dbb9124a509,0x350d0655a11f1,0x0e7ce2b0cdf06}},
+		{{0x4643ac48c85a3,0x6878c2735b892,0x3a53523f4d877,0x3a504ed8bee9d,0x666e0a5d8fb46},{0x6fedfd94b70f9,0x2383f9745bfd4,0x4beae27c4c301,0x75aa4416a3f3f,0x615256138aece},{0x3f64e4870cb0d,0x61548b16d6557,0x7a261773596f3,0x7724d5f275d3a,0x7f0bc810d514d}},
+		{{0x06ba426f4136f,0x3cafc0606b720,0x518f0a2359cda,0x5fae5e46feca7,0x0d1f8dbcf8eed},{0x49dad737213a0,0x745dee5d31075,0x7b1a55e7fdbe2,0x5ba988f176ea1,0x1d3a907ddec5a},{0x693313ed081dc,0x5b0a366901742,0x40c872ca4ca7e,0x6f18094009e01,0x00011b44a31bf}},
+		{{0x7a06c3fc66c0c,0x1c9bac1ba47fb,0x23935c575038e,0x3f0bd71c59c13,0x3ac48d916e835},{0x61f696a0aa75c,0x38b0a57ad42ca,0x1e59ab706fdc9,0x01308d46ebfcd,0x63d988a2d2851},{0x20753afbd232e,0x71fbb1ed06002,0x39cae47a4af3a,0x0337c0b34d9c2,0x33fad52b2368a}},
+		{{0x649c6c5e41e16,0x60667eee6aa80,0x4179d182be190,0x653d9567e6979,0x16c0f429a256d},{0x4c8d0c422cfe8,0x760b4275971a5,0x3da95bc1cad3d,0x0f151ff5b7376,0x3cc355ccb90a7},{0x69443903e9131,0x16f4ac6f9dd36,0x2ea4912e29253,0x2b4643e68d25d,0x631eaf426bae7}},
+		{{0x10410da66fe9f,0x24d82dcb4d67d,0x3e6fe0e17752d,0x4dade1ecbb08f,0x5599648b1ea91},{0x175b9a3700de8,0x77c5f00aa48fb,0x3917785ca0317,0x05aa9b2c79399,0x431f2c7f665f8},{0x26344858f7b19,0x5f43d4a295ac0,0x242a75c52acd4,0x5934480220d10,0x7b04715f91253}},
+		{{0x5bd28acf6ae43,0x16fab8f56907d,0x7acb11218d5f2,0x41fe02023b4db,0x59b37bf5c2f65},{0x6c280c4e6bac6,0x3ada3b361766e,0x42fe5125c3b4f,0x111d84d4aac22,0x48d0acfa57cde},{0x726e47dabe671,0x2ec45e746f6c1,0x6580e53c74686,0x5eda104673f74,0x16234191336d3}}
+	},
+	{
+		{{0x02014385675a6,0x6155fb53d1def,0x37ea32e89927c,0x059a668f5a82e,0x46115aba1d4dc},{0x5cc9dc80c1ac0,0x683671486d4cd,0x76f5f1a5e8173,0x6d5d3f5f9df4a,0x7da0b8f68d7e7},{0x71953c3b5da76,0x6642233d37a81,0x2c9658076b1bd,0x5a581e63010ff,0x5a5f887e83674}},
+		{{0x301cf70a13d11,0x2a6a1ba1891ec,0x2f291fb3f3ae0,0x21a7b814bea52,0x3669b656e44d1},{0x628d3a0a643b9,0x01cd8640c93d2,0x0b7b0cad70f2c,0x3864da98144be,0x43e37ae2d5d1c},{0x63f06eda6e133,0x233342758070f,0x098e0459cc075,0x4df5ead6c7c1b,0x6a21e6cd4fd5e}},
+		{{0x6170a3046e65f,0x5401a46a49e38,0x20add5561c4a8,0x7abb4edde9e46,0x586bf9f1a195f},{0x129126699b2e3,0x0ee11a2603de8,0x60ac2f5c74c21,0x59b192a196808,0x45371b07001e8},{0x3088d5ef8790b,0x38c2126fcb4db,0x685bae149e3c3,0x0bcd601a4e930,0x0eafb03790e52}},
+		{{0x555c13748042f,0x4d041754232c0,0x521b430866907,0x3308e40fb9c39,0x309acc675a02c},{0x0805e0f75ae1d,0x464cc59860a28,0x248e5b7b00bef,0x5d99675ef8f75,0x44ae3344c5435},{0x289b9bba543ee,0x3ab592e28539e,0x64d82abcdd83a,0x3c78ec172e327,0x62d5221b7f946}},
+		{{0x4299c18d0936d,0x5914183418a49,0x52a18c721aed5,0x2b151ba82976d,0x5c0efde4bc754},{0x5d4263af77a3c,0x23fdd2289aeb0,0x7dc64f77eb9ec,0x01bd28338402c,0x14f29a5383922},{0x17edc25b2d7f5,0x37336a6081bee,0x7b5318887e5c3,0x49f6d491a5be1,0x5e72365c7bee0}},
+		{{0x3fc074571217f,0x3a0d29b2b6aeb,0x06478ccdde59d,0x55e4d051bddfa,0x77f1104c47b4e},{0x339062f08b33e,0x4bbf3e657cfb2,0x67af7f56e5967,0x4dbd67f9ed68f,0x70b20555cb734},{0x113c555112c4c,0x7535103f9b7ca,0x140ed1d9a2108,0x02522333bc2af,0x0e34398f4a064}},
+		{{0x522d93ecebde8,0x024f045e0f6cf,0x16db63426cfa1,0x1b93a1fd30fd8,0x5e5405368a362},{0x30b093e4b1928,0x1ce7e7ec80312,0x4e575bdf78f84,0x61f7a190bed39,0x6f8aded6ca379},{0x0123dfdb7b29a,0x4344356523c68,0x79a527921ee5f,0x74bfccb3e817e,0x780de72ec8d3d}},
+		{{0x28545089ae7bc,0x1e38fe9a0c15c,0x12046e0e2377b,0x6721c560aa885,0x0eb28bf671928},{0x7eaf300f42772,0x5455188354ce3,0x4dcca4a3dcbac,0x3d314d0bfebcb,0x1defc6ad32b58},{0x3be1aef5195a7,0x6f22f62bdb5eb,0x39768b8523049,0x43394c8fbfdbd,0x467d201bf8dd2}}
+	},
+	{
+		{{0x40ff9ce5ec54b,0x57185e261b35b,0x3e254540e70a9,0x1b5814003e3f8,0x78968314ac04b},{0x257a22796bb14,0x6f360fb443e75,0x680e47220eaea,0x2fcf2a5f10c18,0x5ee7fb38d8320},{0x5fdcb41446a8e,0x5286926ff2a71,0x0f231e296b3f6,0x684a357c84693,0x61d0633c9bca0}},
+		{{0x44935ffdb2566,0x12f016d176c6e,0x4fbb00f16f5ae,0x3fab78d99402a,0x6e965fd847aed},{0x328bcf8fc73df,0x3b4de06ff95b4,0x30aa427ba11a5,0x5ee31bfda6d9c,0x5b23ac2df8067},{0x2b953ee80527b,0x55f5bcdb1b35a,0x43a0b3fa23c66,0x76e07388b820a,0x79b9bbb9dd95d}},
+		{{0x355406a3126c2,0x50d1918727d76,0x6e5ea0b498e0e,0x0a3b6063214f2,0x5065f158c9fd2},{0x17dae8e9f7374,0x719f76102da33,0x5117c2a80ca8b,0x41a66b65d0936,0x1ba811460accb},{0x169fb0c429954,0x59aedd9ecee10,0x39916eb851802,0x57917555cc538,0x3981f39e58a4f}},
+		{{0x38a7559230a93,0x52c1cde8ba31f,0x2a4f2d4745a3d,0x07e9d42d4a28a,0x38dc083705acd},{0x5dfa56de66fde,0x0058809075908,0x6d3d8cb854a94,0x5b2f4e970b1e3,0x30f4452edcbc1},{0x52782c5759740,0x53f3397d990ad,0x3a939c7e84d15,0x234c4227e39e0,0x632d9a1a593f2}},
+		{{0x36b15b807cba6,0x3f78a9e1afed7,0x0a59c2c608f1f,0x52bdd8ecb81b7,0x0b24f48847ed4},{0x1fd11ed0c84a7,0x021b3ed2757e1,0x73e1de58fc1c6,0x5d110c84616ab,0x3a5a7df28af64},{0x2d4be511beac7,0x6bda4d99e5b9b,0x17e6996914e01,0x7b1f0ce7fcf80,0x34fcf74475481}},
+		{{0x7e04c789767ca,0x1671b28cfb832,0x7e57ea2e1c537,0x1fbaaef444141,0x3d3bdc164dfa6},{0x31dab78cfaa98,0x4e3216e5e54b7,0x249823973b689,0x2584984e48885,0x0119a3042fb37},{0x2d89ce8c2177d,0x6cd12ba182cf4,0x20a8ac19a7697,0x539fab2cc72d9,0x56c088f1ede20}},
+		{{0x53d1110a86e17,0x6416eb65f466d,0x41ca6235fce20,0x5c3fc8a99bb12,0x09674c6b99108},{0x35fac24f38f02,0x7d75c6197ab03,0x33e4bc2a42fa7,0x1c7cd10b48145,0x038b7ea483590},{0x6f82199316ff8,0x05d54f1a9f3e9,0x3bcc5d0bd274a,0x5b284b8d2d5ad,0x6e5e31025969e}},
+		{{0x462f587e593fb,0x3d94ba7ce362d,0x330f9b52667b7,0x5d45a48e0f00a,0x08f5114789a8d},{0x4fb0e63066222,0x130f59747e660,0x041868fecd41a,0x3105e8c923bc6,0x3058ad43d1838},{0x40ffde57663d0,0x71445d4c20647,0x2653e68170f7c,0x64cdee3c55ed6,0x26549fa4efe3d}}
+	},
+	{
+		{{0x58845832fcedb,0x135cd7f0c6e73,0x53ffbdfe8e35b,0x22f195e06e55b,0x73937e8814bce},{0x600c9193b877f,0x21c1b8a0d7765,0x379927fb38ea2,0x70d7679dbe01b,0x5f46040898de9},{0x37116297bf48d,0x45a9e0d069720,0x25af71aa744ec,0x41af0cb8aaba3,0x2cf8a4e891d5e}},
+		{{0x3fd8707110f67,0x26f8716a92db2,0x1cdaa1b753027,0x504be58b52661,0x2049bd6e58252},{0x5487e17d06ba2,0x3872a032d6596,0x65e28c09348e0,0x27b6bb2ce40c2,0x7a6f7f2891d6a},{0x1fd8d6a9aef49,0x7cb67b7216fa1,0x67aff53c3b982,0x20ea610da9628,0x6011aadfc5459}},
+		{{0x7926dcf95f83c,0x42e25120e2bec,0x63de96df1fa15,0x4f06b50f3f9cc,0x6fc5cc1b0b62f},{0x6d0c802cbf890,0x141bfed554c7b,0x6dbb667ef4263,0x58f3126857edc,0x69ce18b779340},{0x75528b29879cb,0x79a8fd2125a3d,0x27c8d4b746ab8,0x0f8893f02210c,0x15596b3ae5710}},
+		{{0x739d23f9179a2,0x632fadbb9e8c4,0x7c8522bfe0c48,0x6ed0983ef5aa9,0x0d2237687b5f4},{0x731167e5124ca,0x17b38e8bbe13f,0x3d55b942f9056,0x09c1495be913f,0x3aa4e241afb6d},{0x138bf2a3305f5,0x1f45d24d86598,0x5274bad2160fe,0x1b6041d58d12a,0x32fcaa6e4687a}},
+		{{0x56e8dc57d9af5,0x5b3be17be4f78,0x3bf928cf82f4b,0x52e55600a6f11,0x4627e9cefebd6},{0x7a4732787ccdf,0x11e427c7f0640,0x03659385f8c64,0x5f4ead9766bfb,0x746f6336c2600},{0x2f345ab6c971c,0x653286e63e7e9,0x51061b78a23ad,0x14999acb54501,0x7b4917007ed66}},
+		{{0x5fb5cab84b064,0x2513e778285b0,0x457383125e043,0x6bda3b56e223d,0x122ba376f844f},{0x41b28dd53a2dd,0x37be85f87ea86,0x74be3d2a85e41,0x1be87fac96ca6,0x1d03620fe08cd},{0x232cda2b4e554,0x0422ba30ff840,0x751e7667b43f5,0x6261755da5f3e,0x02c70bf52b68e}},
+		{{0x7ec4b5d0b2fbb,0x200e910595450,0x742057105715e,0x2f07022530f60,0x26334f0a409ef},{0x532bf458d72e1,0x40f96e796b59c,0x22ef79d6f9da3,0x501ab67beca77,0x6b0697e3feb43},{0x0f04adf62a3c0,0x5e0edb48bb6d9,0x7c34aa4fbc003,0x7d74e4e5cac24,0x1cc37f43441b2}},
+		{{0x7565a5cc7324f,0x01ca0d5244a11,0x116b067418713,0x0a57d8c55edae,0x6c6809c103803},{0x656f1c9ceaeb9,0x7031cacad5aec,0x1308cd0716c57,0x41c1373941942,0x3a346f772f196},{0x55112e2da6ac8,0x6363d0a3dba5a,0x319c98ba6f40c,0x2e84b03a36ec7,0x05911b9f6ef7c}}
+	},
+	{
+		{{0x048478f387475,0x69397d9678a3e,0x67c8156c976f3,0x2eb4d5589226c,0x2c709e6c1c10a},{0x7f29362730383,0x7fd7951459c36,0x7504c512d49e7,0x087ed7e3bc55f,0x7deb10149c726},{0x2af6a8766ee7a,0x08aaa79a1d96c,0x42f92d59b2fb0,0x1752c40009c07,0x08e68e9ff62ce}},
+		{{0x5500a4bc130ad,0x127a17a938695,0x02a26fa34e36d,0x584d12e1ecc28,0x2f1f3f87eeba3},{0x509d50ab8f2f9,0x1b8ab247be5e5,0x5d9b2e6b2e486,0x4faa5479a1339,0x4cb13bd738f71},{0x48c75e515b64a,0x75b6952071ef0,0x5d46d42965406,0x7746106989f9f,0x19a1e353c0ae2}},
+		{{0x47560bafa05c3,0x418dcabcc2fa3,0x35991cecf8682,0x24371a94b8c60,0x41546b11c20c3},{0x172cdd596bdbd,0x0731ddf881684,0x10426d64f8115,0x71a4fd8a9a3da,0x736bd3990266a},{0x32d509334b3b4,0x16c102cae70aa,0x1720dd51bf445,0x5ae662faf9821,0x412295a2b87fa}},
+		{{0x19b88f57ed6e9,0x4cdbf1904a339,0x42b49cd4e4f2c,0x71a2e771909d9,0x14e153ebb52d2},{0x55261e293eac6,0x06426759b65cc,0x40265ae116a48,0x6c02304bae5bc,0x0760bb8d195ad},{0x61a17cde6818a,0x53dad34108827,0x32b32c55c55b6,0x2f9165f9347a3,0x6b34be9bc33ac}},
+		{{0x72f643a78c0b2,0x3de45c04f9e7b,0x706d68d30fa5c,0x696f63e8e2f24,0x2012c18f0922d},{0x469656571f2d3,0x0aa61ce6f423f,0x3f940d71b27a1,0x185f19d73d16a,0x01b9c7b62e6dd},{0x355e55ac89d29,0x3e8b414ec7101,0x39db07c520c90,0x6f41e9b77efe1,0x08af5b784e4ba}},
+		{{0x499dc881f2533,0x34ef26476c506,0x4d107d2741497,0x346c4bd6efdb3,0x32b79d71163a1},{0x314d289cc2c4b,0x23450e2f1bc4e,0x0cd93392f92f4,0x1370c6a946b7d,0x6423c1d5afd98},{0x5f8d9edfcb36a,0x1e6e8dcbf3990,0x7974f348af30a,0x6e6724ef19c7c,0x480a5efbc13e2}},
+		{{0x1e70b01622071,0x1f163b5f8a16a,0x56aaf341ad417,0x7989635d830f7,0x47aa27600cb7b},{0x14ce442ce221f,0x18980a72516cc,0x072f80db86677,0x703331fda526e,0x24b31d47691c8},{0x41eedc015f8c3,0x7cf8d27ef854a,0x289e3584693f9,0x04a7857b309a7,0x545b585d14dda}},
+		{{0x7275ea0d43a0f,0x681137dd7ccf7,0x1e79cbab79a38,0x22a214489a66a,0x0f62f9c332ba5},{0x4e4d0e3b321e1,0x7451fe3d2ac40,0x666f678eea98d,0x038858667fead,0x4d22dc3e64c8d},{0x46589d63b5f39,0x7eaf979ec3f96,0x4ebe81572b9a8,0x21b7f5d61694a,0x1c0fa01a36371}}
+	}
+};
+
+/* t = digit * 16^(4*i) * B in constant time, digit is in [-8..8] */
+static void ge25519_select_base(ge25519_niels* t, size_t i, int8_t digit)
+{
+	static const bignum25519 zero = { 0 };
+	int8_t mask = digit >> 7;
+	uint64_t sign = (uint8_t)digit >> 7;
+	uint64_t babs = (uint8_t)((digit ^ mask) - mask);
+
+	/* identity */
+	memset(t, 0, sizeof(*t));
+	t->ysubx[0] = 1;
+	t->xaddy[0] = 1;
+
+	for (uint64_t k = 0; k < 8; k++)
+	{
+		uint64_t flag = ((babs ^ (k + 1)) - 1) >> 63;
+		curve25519_move_conditional(t->ysubx, ge25519_base_multiples[i][k].ysubx, flag);
+		curve25519_move_conditional(t->xaddy, ge25519_base_multiples[i][k].xaddy, flag);
+		curve25519_move_conditional(t->t2d,   ge25519_base_multiples[i][k].t2d,   flag);
+	}
+
+	/* -(x,y) = (-x,y), so swap y-x with y+x and negate 2*d*x*y */
+	bignum25519 neg;
+	curve25519_swap_conditional(t->ysubx, t->xaddy, sign);
+	curve25519_sub_reduce(neg, zero, t->t2d);
+	curve25519_move_conditional(t->t2d, neg, sign);
+}
+
+// same result as curve25519_scalarmult(mypublic, n, {9}), but several times faster
+static void curve25519_scalarmult_base(uint8_t* mypublic, const uint8_t* n)
+{
+	/* ladder ignores bits 0..1 and 255, forces bit 254, and for bit 2 set it ends
+	   on (n/8 + 1) multiple of base point - so do the same for any input */
+	uint8_t e[32];
+	uint32_t c = ((n[0] >> 2) & 1) << 3;
+	memcpy(e, n, sizeof(e));
+	e[ 0] &= 0xf8;
+	e[31] &= 0x7f;
+	e[31] |= 0x40;
+	for (size_t i = 0; i < 32; i++)
+	{
+		c += e[i];
+		e[i] = (uint8_t)c;
+		c >>= 8;
+	}
+
+	/* signed radix 16 digits in [-8..8] */
+	int8_t digits[64];
+	for (size_t i = 0; i < 32; i++)
+	{
+		digits[2 * i + 0] = (e[i] >> 0) & 15;
+		digits[2 * i + 1] = (e[i] >> 4) & 15;
+	}
+
+	int8_t carry = 0;
+	for (size_t i = 0; i < 63; i++)
+	{
+		digits[i] += carry;
+		carry = (digits[i] + 8) >> 4;
+		digits[i] -= carry << 4;
+	}
+	digits[63] += carry;
+
+	/* sum of digits[4*i+j] * 16^(4*i+j) * B, with table lookups for 16^(4*i) * B and 4 doublings between j's */
+	ge25519 r, p1p1;
+	ge25519_niels t;
+	memset(&r, 0, sizeof(r));
+	r.y[0] = 1;
+	r.z[0] = 1;
+
+	for (size_t j = 4; j-- != 0; )
+	{
+		if (j != 3)
+		{
+			for (size_t k = 0; k < 4; k++)
+			{
+				ge25519_double_p1p1(&p1p1, &r);
+				ge25519_p1p1_to_full(&r, &p1p1);
+			}
+		}
+
+		for (size_t i = 0; i < 16; i++)
+		{
+			ge25519_select_base(&t, i, digits[4 * i + j]);
+			ge25519_madd_p1p1(&p1p1, &r, &t);
+			ge25519_p1p1_to_full(&r, &p1p1);
+		}
+	}
+
+	/* montgomery u = (1 + y) / (1 - y) = (z + y) / (z - y) */
+	bignum25519 num, den;
+	curve25519_add_reduce(num, r.z, r.y);
+	curve25519_sub_reduce(den, r.z, r.y);
+	curve25519_recip(den, den);
+	curve25519_mul(num, num, den);
+	curve25519_contract(mypublic, num);
+}
+
+//
+// poly1305, based on public domain code from https://github.com/floodyberry/poly1305-donna
+//
+
+#define poly1305_block_size 16
+
+typedef struct {
+	uint64_t r[3];
+	uint64_t h[3];
+	uint64_t pad[2];
+	size_t leftover;
+	unsigned char buffer[poly1305_block_size];
+	unsigned char final;
+#if DERPNET_USE_SIMD
+	unsigned char level; /* DerpNetCpuLevel of kernels used for this mac */
+	unsigned char powers;
+	uint32_t rpow[4][5]; /* r^4, r^3, r^2, r^1 in radix 2^26 */
+#endif
+} poly1305_state_internal_t;
+
+static void poly1305_init_level(poly1305_state_internal_t* st, const uint8_t key[32], DerpNetCpuLevel level)
+{
+	/* r &= 0xffffffc0ffffffc0ffffffc0fffffff */
+	uint64_t t0 = Get64LE(&key[0]);
+	uint64_t t1 = Get64LE(&key[8]);
+	st->r[0] = ( t0                    ) & 0xffc0fffffff;
+	st->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffff;
+	st->r[2] = ((t1 >> 24)             ) & 0x00ffffffc0f;
+
+	/* h = 0 */
+	st->h[0] = 0;
+	st->h[1] = 0;
+	st->h[2] = 0;
+
+	/* save pad for later */
+	st->pad[0] = Get64LE(&key[16]);
+	st->pad[1] = Get64LE(&key[24]);
+
+	st->leftover = 0;
+	st->final = 0;
+#if DERPNET_USE_SIMD
+	st->level = (unsigned char)level;
+	st->powers = 0;
+#else
+	(void)level;
+#endif
+}
+
+static void poly1305_init(poly1305_state_internal_t* st, const uint8_t key[32])
+{
+	poly1305_init_level(st, key, DerpNet__KernelsLevel());
+}
+
+#if DERPNET_USE_SIMD
+
+//
+// four-way poly1305, lane i accumulates every 4th block and is multiplied by r^4 per step
+// at the end lanes are multiplied by r^4, r^3, r^2, r^1 and summed together
+//
+// vector code uses radix 2^26 so products fit into 64-bit lanes of vpmuludq
+// state is converted from/to radix 2^44 of scalar code around each call
+//
+
+#define poly1305_avx2_min_bytes 256
+
+static void poly1305_mul26(uint32_t out[5], const uint32_t a[5], const uint32_t b[5])
+{
+	const uint64_t mask = 0x3ffffff;
+	uint64_t s1 = b[1] * 5, s2 = b[2] * 5, s3 = b[3] * 5, s4 = b[4] * 5;
+	uint64_t d0,d1,d2,d3,d4,c;
+
+	d0 = (uint64_t)a[0] * b[0] + (uint64_t)a[1] * s4   + (uint64_t)a[2] * s3   + (uint64_t)a[3] * s2   + (uint64_t)a[4] * s1;
+	d1 = (uint64_t)a[0] * b[1] + (uint64_t)a[1] * b[0] + (uint64_t)a[2] * s4   + (uint64_t)a[3] * s3   + (uint64_t)a[4] * s2;
+	d2 = (uint64_t)a[0] * b[2] + (uint64_t)a[1] * b[1] + (uint64_t)a[2] * b[0] + (uint64_t)a[3] * s4   + (uint64_t)a[4] * s3;
+	d3 = (uint64_t)a[0] * b[3] + (uint64_t)a[1] * b[2] + (uint64_t)a[2] * b[1] + (uint64_t)a[3] * b[0] + (uint64_t)a[4] * s4;
+	d4 = (uint64_t)a[0] * b[4] + (uint64_t)a[1] * b[3] + (uint64_t)a[2] * b[2] + (uint64_t)a[3] * b[1] + (uint64_t)a[4] * b[0];
+
+	          c = d0 >> 26; d0 &= mask;
+	d1 += c;  c = d1 >> 26; d1 &= mask;
+	d2 += c;  c = d2 >> 26; d2 &= mask;
+	d3 += c;  c = d3 >> 26; d3 &= mask;
+	d4 += c;  c = d4 >> 26; d4 &= mask;
+	d0 += c * 5; c = d0 >> 26; d0 &= mask;
+	d1 += c;
+
+	out[0] = (uint32_t)d0;
+	out[1] = (uint32_t)d1;
+	out[2] = (uint32_t)d2;
+	out[3] = (uint32_t)d3;
+	out[4] = (uint32_t)d4;
+}
+
+static void poly1305_to26(uint32_t out[5], const uint64_t in[3])
+{
+	const uint64_t mask = 0x3ffffff;
+	uint64_t h0 = in[0], h1 = in[1], h2 = in[2];
+
+	h2 += h1 >> 44; h1 &= 0xfffffffffff;
+
+	uint64_t t0 = h0 | (h1 << 44);
+	uint64_t t1 = (h1 >> 20) | (h2 << 24);
+	uint64_t t2 = h2 >> 40;
+
+	out[0] = (uint32_t)(( t0                    ) & mask);
+	out[1] = (uint32_t)(((t0 >> 26)             ) & mask);
+	out[2] = (uint32_t)(((t0 >> 52) | (t1 << 12)) & mask);
+	out[3] = (uint32_t)(((t1 >> 14)             ) & mask);
+	out[4] = (uint32_t)(((t1 >> 40) | (t2 << 24))       );
+}
+
+static void poly1305_compute_powers(poly1305_state_internal_t* st)
+{
+	uint32_t r1[5], r2[5], r3[5], r4[5];
+	poly1305_to26(r1, st->r);
+	poly1305_mul26(r2, r1, r1);
+	poly1305_mul26(r3, r2, r1);
+	poly1305_mul26(r4, r2, r2);
+
+	memcpy(st->rpow[0], r4, sizeof(r4));
+	memcpy(st->rpow[1], r3, sizeof(r3));
+	memcpy(st->rpow[2], r2, sizeof(r2));
+	memcpy(st->rpow[3], r1, sizeof(r1));
+	st->powers = 1;
+}
+
+DERPNET_TARGET("avx2")
+static inline void poly1305_mul_avx2(__m256i d[5], const __m256i h[5], const __m256i r[5], const __m256i s[5])
+{
+#define M(a,b) _mm256_mul_epu32(a, b)
+#define A(a,b) _mm256_add_epi64(a, b)
+	d[0] = A(A(A(A(M(h[0], r[0]), M(h[1], s[4])), M(h[2], s[3])), M(h[3], s[2])), M(h[4], s[1]));
+	d[1] = A(A(A(A(M(h[0], r[1]), M(h[1], r[0])), M(h[2], s[4])), M(h[3], s[3])), M(h[4], s[2]));
+	d[2] = A(A(A(A(M(h[0], r[2]), M(h[1], r[1])), M(h[2], r[0])), M(h[3], s[4])), M(h[4], s[3]));
+	d[3] = A(A(A(A(M(h[0], r[3]), M(h[1], r[2])), M(h[2], r[1])), M(h[3], r[0])), M(h[4], s[4]));
+	d[4] = A(A(A(A(M(h[0], r[4]), M(h[1], r[3])), M(h[2], r[2])), M(h[3], r[1])), M(h[4], r[0]));
+#undef A
+#undef M
+}
+
+// processes 4 blocks per iteration, returns how many bytes were processed
+DERPNET_TARGET("avx2")
+static size_t poly1305_blocks_avx2(poly1305_state_internal_t* st, const uint8_t* m, size_t bytes)
+{
+	if (!st->powers)
+	{
+		poly1305_compute_powers(st);
+	}
+
+	const __m256i mask = _mm256_set1_epi64x(0x3ffffff);
+	const __m256i hibit = _mm256_set1_epi64x(1 << 24); /* 1 << 128 */
+
+	uint32_t h26[5];
+	poly1305_to26(h26, st->h);
+
+	// previous state goes into first lane
+	__m256i h[5], r[5], s[5], d[5];
+	for (int i = 0; i < 5; i++)
+	{
+		h[i] = _mm256_set_epi64x(0, 0, 0, h26[i]);
+		r[i] = _mm256_set1_epi64x(st->rpow[0][i]);
+		s[i] = _mm256_set1_epi64x(st->rpow[0][i] * 5);
+	}
+
+	size_t processed = 0;
+	for (;;)
+	{
+		/* h += m[i..i+3] */
+		__m256i m0 = _mm256_loadu_si256((const __m256i*)(m + processed +  0));
+		__m256i m1 = _mm256_loadu_si256((const __m256i*)(m + processed + 32));
+
+		// 64-bit low & high halves of each block, in block order
+		__m256i lo = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(m0, m1), _MM_SHUFFLE(3,1,2,0));
+		__m256i hi = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(m0, m1), _MM_SHUFFLE(3,1,2,0));
+
+		h[0] = _mm256_add_epi64(h[0], _mm256_and_si256(lo, mask));
+		h[1] = _mm256_add_epi64(h[1], _mm256_and_si256(_mm256_srli_epi64(lo, 26), mask));
+		h[2] = _mm256_add_epi64(h[2], _mm256_and_si256(_mm256_or_si256(_mm256_srli_epi64(lo, 52), _mm256_slli_epi64(hi, 12)), mask));
+		h[3] = _mm256_add_epi64(h[3], _mm256_and_si256(_mm256_srli_epi64(hi, 14), mask));
+		h[4] = _mm256_add_epi64(h[4], _mm256_or_si256(_mm256_srli_epi64(hi, 40), hibit));
+
+		processed += 4 * poly1305_block_size;
+		if (bytes - processed < 4 * poly1305_block_size)
+		{
+			break;
+		}
+
+		/* h *= r^4 */
+		poly1305_mul_avx2(d, h, r, s);
+
+		/* (partial) h %= p */
+		__m256i c;
+		                          c = _mm256_srli_epi64(d[0], 26); h[0] = _mm256_and_si256(d[0], mask);
+		d[1] = _mm256_add_epi64(d[1], c); c = _mm256_srli_epi64(d[1], 26); h[1] = _mm256_and_si256(d[1], mask);
+		d[2] = _mm256_add_epi64(d[2], c); c = _mm256_srli_epi64(d[2], 26); h[2] = _mm256_and_si256(d[2], mask);
+		d[3] = _mm256_add_epi64(d[3], c); c = _mm256_srli_epi64(d[3], 26); h[3] = _mm256_and_si256(d[3], mask);
+		d[4] = _mm256_add_epi64(d[4], c); c = _mm256_srli_epi64(d[4], 26); h[4] = _mm256_and_si256(d[4], mask);
+		h[0] = _mm256_add_epi64(h[0], _mm256_add_epi64(c, _mm256_slli_epi64(c, 2)));
+		c = _mm256_srli_epi64(h[0], 26); h[0] = _mm256_and_si256(h[0], mask);
+		h[1] = _mm256_add_epi64(h[1], c);
+	}
+
+	/* h = h[0]*r^4 + h[1]*r^3 + h[2]*r^2 + h[3]*r */
+	for (int i = 0; i < 5; i++)
+	{
+		r[i] = _mm256_set_epi64x(st->rpow[3][i], st->rpow[2][i], st->rpow[1][i], st->rpow[0][i]);
+		s[i] = _mm256_set_epi64x(st->rpow[3][i] * 5, st->rpow[2][i] * 5, st->rpow[1][i] * 5, st->rpow[0][i] * 5);
+	}
+	poly1305_mul_avx2(d, h, r, s);
+
+	uint64_t t[5];
+	for (int i = 0; i < 5; i++)
+	{
+		__m128i sum = _mm_add_epi64(_mm256_castsi256_si128(d[i]), _mm256_extracti128_si256(d[i], 1));
+		sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+		t[i] = (uint64_t)_mm_cvtsi128_si64(sum);
+	}
+
+	/* (partial) h %= p, then carry limbs so they fit for conversion */
+	uint64_t c;
+	              c = t[0] >> 26; t[0] &= 0x3ffffff;
+	t[1] += c;    c = t[1] >> 26; t[1] &= 0x3ffffff;
+	t[2] += c;    c = t[2] >> 26; t[2] &= 0x3ffffff;
+	t[3] += c;    c = t[3] >> 26; t[3] &= 0x3ffffff;
+	t[4] += c;    c = t[4] >> 26; t[4] &= 0x3ffffff;
+	t[0] += c * 5; c = t[0] >> 26; t[0] &= 0x3ffffff;
+	t[1] += c;    c = t[1] >> 26; t[1] &= 0x3ffffff;
+	t[2] += c;    c = t[2] >> 26; t[2] &= 0x3ffffff;
+	t[3] += c;    c = t[3] >> 26; t[3] &= 0x3ffffff;
+	t[4] += c;
+
+	st->h[0] = ((t[0]      ) | (t[1] << 26)              ) & 0xfffffffffff;
+	st->h[1] = ((t[1] >> 18) | (t[2] <<  8) | (t[3] << 34)) & 0xfffffffffff;
+	st->h[2] = ((t[3] >> 10) | (t[4] << 16)              );
+
+	return processed;
+}
+
+#endif // DERPNET_USE_SIMD
 
 static void poly1305_blocks(poly1305_state_internal_t* st, const uint8_t* m, size_t bytes)
 {
+#if DERPNET_USE_SIMD
+	if (bytes >= poly1305_avx2_min_bytes && !st->final && st->level >= DERPNET_CPU_LEVEL_AVX2)
+	{
+		size_t processed = poly1305_blocks_avx2(st, m, bytes);
+		m += processed;
+		bytes -= processed;
+	}
+#endif
+
 	const uint64_t hibit = (st->final) ? 0 : (1ULL << 40); /* 1 << 128 */
 	uint64_t r0,r1,r2;
 	uint64_t s1,s2;
@@ -641,7 +2059,7 @@ static void poly1305_blocks(poly1305_state_internal_t* st, const uint8_t* m, siz
 	st->h[2] = h2;
 }
 
-void poly1305_finish(poly1305_state_internal_t* st, uint8_t mac[16])
+static void poly1305_finish(poly1305_state_internal_t* st, uint8_t mac[16])
 {
 	uint64_t h0,h1,h2,c;
 	uint64_t g0,g1,g2;
@@ -737,10 +2155,10 @@ static void poly1305_update(poly1305_state_internal_t* st, const uint8_t* m, siz
 	}
 }
 
-static void poly1305_auth(uint8_t mac[16], const uint8_t* m, size_t bytes, const uint8_t key[32])
+static void poly1305_auth(uint8_t mac[16], const uint8_t* m, size_t bytes, const uint8_t key[32], DerpNetCpuLevel level)
 {
 	poly1305_state_internal_t st;
-	poly1305_init(&st, key);
+	poly1305_init_level(&st, key, level);
 	poly1305_update(&st, m, bytes);
 	poly1305_finish(&st, mac);
 }
@@ -851,922 +2269,7658 @@ static void salsa20(uint8_t Output[64], const uint8_t Input[16], const uint8_t K
 	}
 }
 
-static void salsa20_xor(uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t Key[32], const uint8_t Nonce[8], uint64_t Counter)
-{
-	uint8_t TempInput[16];
-	uint8_t Block[64];
+#if DERPNET_USE_SIMD
 
-	memcpy(TempInput, Nonce, 8);
+//
+// multi-block salsa20 keystream, each vector lane holds same state word from different block
+// rows of 4x4 words are transposed back to block order before xor'ing with input
+//
 
-	while (InputSize >= 64)
+// processes 4 blocks per iteration, returns how many bytes were processed
+DERPNET_TARGET("sse2")
+static size_t salsa20_xor_sse2(uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t Key[32], const uint8_t Nonce[8], uint64_t Counter)
+{
+	__m128i s[16];
+	s[ 0] = _mm_set1_epi32(Get32LE((uint8_t*)&salsa20_constant[0]));
+	s[ 1] = _mm_set1_epi32(Get32LE(&Key[ 0]));
+	s[ 2] = _mm_set1_epi32(Get32LE(&Key[ 4]));
+	s[ 3] = _mm_set1_epi32(Get32LE(&Key[ 8]));
+	s[ 4] = _mm_set1_epi32(Get32LE(&Key[12]));
+	s[ 5] = _mm_set1_epi32(Get32LE((uint8_t*)&salsa20_constant[4]));
+	s[ 6] = _mm_set1_epi32(Get32LE(&Nonce[0]));
+	s[ 7] = _mm_set1_epi32(Get32LE(&Nonce[4]));
+	s[10] = _mm_set1_epi32(Get32LE((uint8_t*)&salsa20_constant[8]));
+	s[11] = _mm_set1_epi32(Get32LE(&Key[16]));
+	s[12] = _mm_set1_epi32(Get32LE(&Key[20]));
+	s[13] = _mm_set1_epi32(Get32LE(&Key[24]));
+	s[14] = _mm_set1_epi32(Get32LE(&Key[28]));
+	s[15] = _mm_set1_epi32(Get32LE((uint8_t*)&salsa20_constant[12]));
+
+	size_t Processed = 0;
+	while (InputSize - Processed >= 4 * 64)
 	{
-		memcpy(TempInput + 8, &Counter, sizeof(Counter));
-		salsa20(Block, TempInput, Key);
+		// 64-bit block counter goes into words 8 & 9
+		uint32_t CounterLo[4], CounterHi[4];
+		for (int i = 0; i < 4; i++)
+		{
+			CounterLo[i] = (uint32_t)(Counter + i);
+			CounterHi[i] = (uint32_t)((Counter + i) >> 32);
+		}
+		s[8] = _mm_loadu_si128((const __m128i*)CounterLo);
+		s[9] = _mm_loadu_si128((const __m128i*)CounterHi);
 
-		for (size_t i = 0; i < 64; ++i)
+		__m128i x[16];
+		for (int i = 0; i < 16; i++)
 		{
-			Output[i] = Input[i] ^ Block[i];
+			x[i] = s[i];
 		}
 
-		Counter += 1;
+		for (int i = 0; i < 20; i += 2)
+		{
+			__m128i t;
 
-		Output += 64;
-		Input += 64;
-		InputSize -= 64;
-	}
+#define R(v,n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32-(n)))
+#define Q(a,b,c,d) \
+			t = _mm_add_epi32(x[a], x[d]); x[b] = _mm_xor_si128(x[b], R(t,  7)); \
+			t = _mm_add_epi32(x[b], x[a]); x[c] = _mm_xor_si128(x[c], R(t,  9)); \
+			t = _mm_add_epi32(x[c], x[b]); x[d] = _mm_xor_si128(x[d], R(t, 13)); \
+			t = _mm_add_epi32(x[d], x[c]); x[a] = _mm_xor_si128(x[a], R(t, 18))
 
-	if (InputSize)
-	{
-		memcpy(TempInput + 8, &Counter, sizeof(Counter));
-		salsa20(Block, TempInput, Key);
+			Q( 0,  4,  8, 12);
+			Q( 5,  9, 13,  1);
+			Q(10, 14,  2,  6);
+			Q(15,  3,  7, 11);
 
-		for (size_t i = 0; i < InputSize; ++i)
-		{
-			Output[i] = Input[i] ^ Block[i];
+			Q( 0,  1,  2,  3);
+			Q( 5,  6,  7,  4);
+			Q(10, 11,  8,  9);
+			Q(15, 12, 13, 14);
+
+#undef Q
+#undef R
 		}
-	}
-}
 
-//
-// nacl box seal/unseal
-//
+		for (int i = 0; i < 16; i += 4)
+		{
+			__m128i a0 = _mm_add_epi32(x[i + 0], s[i + 0]);
+			__m128i a1 = _mm_add_epi32(x[i + 1], s[i + 1]);
+			__m128i a2 = _mm_add_epi32(x[i + 2], s[i + 2]);
+			__m128i a3 = _mm_add_epi32(x[i + 3], s[i + 3]);
+
+			__m128i t0 = _mm_unpacklo_epi32(a0, a1);
+			__m128i t1 = _mm_unpacklo_epi32(a2, a3);
+			__m128i t2 = _mm_unpackhi_epi32(a0, a1);
+			__m128i t3 = _mm_unpackhi_epi32(a2, a3);
+
+			__m128i Block[4];
+			Block[0] = _mm_unpacklo_epi64(t0, t1);
+			Block[1] = _mm_unpackhi_epi64(t0, t1);
+			Block[2] = _mm_unpacklo_epi64(t2, t3);
+			Block[3] = _mm_unpackhi_epi64(t2, t3);
+
+			for (int j = 0; j < 4; j++)
+			{
+				size_t Offset = Processed + j * 64 + i * 4;
+				__m128i Data = _mm_loadu_si128((const __m128i*)(Input + Offset));
+				_mm_storeu_si128((__m128i*)(Output + Offset), _mm_xor_si128(Data, Block[j]));
+			}
+		}
 
-static void DerpNet__GetSharedKey(uint8_t SharedKey[32], const uint8_t PrivateKey[32], const uint8_t PublicKey[32])
-{
-	uint8_t SharedSecret[32];
-	curve25519_scalarmult(SharedSecret, PrivateKey, PublicKey);
+		Counter += 4;
+		Processed += 4 * 64;
+	}
 
-	uint8_t ZeroInput[16] = { 0 };
-	hsalsa20(SharedKey, ZeroInput, SharedSecret);
+	return Processed;
 }
 
-static void DerpNet__BoxSealEx(uint8_t Nonce[24], uint8_t Auth[16], uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t SharedKey[32])
+// processes 8 blocks per iteration, returns how many bytes were processed
+DERPNET_TARGET("avx2")
+static size_t salsa20_xor_avx2(uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t Key[32], const uint8_t Nonce[8], uint64_t Counter)
 {
-	// xsalsa20 key construction
-	uint8_t SubKey[32];
-	hsalsa20(SubKey, Nonce, SharedKey);
+	__m256i s[16];
+	s[ 0] = _mm256_set1_epi32(Get32LE((uint8_t*)&salsa20_constant[0]));
+	s[ 1] = _mm256_set1_epi32(Get32LE(&Key[ 0]));
+	s[ 2] = _mm256_set1_epi32(Get32LE(&Key[ 4]));
+	s[ 3] = _mm256_set1_epi32(Get32LE(&Key[ 8]));
+	s[ 4] = _mm256_set1_epi32(Get32LE(&Key[12]));
+	s[ 5] = _mm256_set1_epi32(Get32LE((uint8_t*)&salsa20_constant[4]));
+	s[ 6] = _mm256_set1_epi32(Get32LE(&Nonce[0]));
+	s[ 7] = _mm256_set1_epi32(Get32LE(&Nonce[4]));
+	s[10] = _mm256_set1_epi32(Get32LE((uint8_t*)&salsa20_constant[8]));
+	s[11] = _mm256_set1_epi32(Get32LE(&Key[16]));
+	s[12] = _mm256_set1_epi32(Get32LE(&Key[20]));
+	s[13] = _mm256_set1_epi32(Get32LE(&Key[24]));
+	s[14] = _mm256_set1_epi32(Get32LE(&Key[28]));
+	s[15] = _mm256_set1_epi32(Get32LE((uint8_t*)&salsa20_constant[12]));
+
+	size_t Processed = 0;
+	while (InputSize - Processed >= 8 * 64)
+	{
+		uint32_t CounterLo[8], CounterHi[8];
+		for (int i = 0; i < 8; i++)
+		{
+			CounterLo[i] = (uint32_t)(Counter + i);
+			CounterHi[i] = (uint32_t)((Counter + i) >> 32);
+		}
+		s[8] = _mm256_loadu_si256((const __m256i*)CounterLo);
+		s[9] = _mm256_loadu_si256((const __m256i*)CounterHi);
 
-	uint8_t FirstBlock[64] = { 0 };
-	salsa20_xor(FirstBlock, FirstBlock, sizeof(FirstBlock), SubKey, Nonce + 16, 0);
+		__m256i x[16];
+		for (int i = 0; i < 16; i++)
+		{
+			x[i] = s[i];
+		}
 
-	size_t FirstSize = InputSize > 32 ? 32 : InputSize;
-	for (size_t i = 0; i < FirstSize; i++)
-	{
-		Output[i] = Input[i] ^ FirstBlock[32 + i];
-	}
+		for (int i = 0; i < 20; i += 2)
+		{
+			__m256i t;
 
-	salsa20_xor(Output + FirstSize, Input + FirstSize, InputSize - FirstSize, SubKey, Nonce + 16, 1);
+#define R(v,n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32-(n)))
+#define Q(a,b,c,d) \
+			t = _mm256_add_epi32(x[a], x[d]); x[b] = _mm256_xor_si256(x[b], R(t,  7)); \
+			t = _mm256_add_epi32(x[b], x[a]); x[c] = _mm256_xor_si256(x[c], R(t,  9)); \
+			t = _mm256_add_epi32(x[c], x[b]); x[d] = _mm256_xor_si256(x[d], R(t, 13)); \
+			t = _mm256_add_epi32(x[d], x[c]); x[a] = _mm256_xor_si256(x[a], R(t, 18))
 
-	poly1305_auth(Auth, Output, InputSize, FirstBlock);
-}
+			Q( 0,  4,  8, 12);
+			Q( 5,  9, 13,  1);
+			Q(10, 14,  2,  6);
+			Q(15,  3,  7, 11);
 
-static void DerpNet__BoxSeal(uint8_t Nonce[24], uint8_t Auth[16], uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t PrivateKey[32], const uint8_t PublicKey[32])
+			Q( 0,  1,  2,  3);
+			Q( 5,  6,  7,  4);
+			Q(10, 11,  8,  9);
+			Q(15, 12, 13, 14);
+
+#undef Q
+#undef R
+		}
+
+		// unpack instructions work on 128-bit halves, so after 4x4 transpose
+		// lower half has block j and upper half has block j+4
+		__m256i Rows[16];
+		for (int i = 0; i < 16; i += 4)
+		{
+			__m256i a0 = _mm256_add_epi32(x[i + 0], s[i + 0]);
+			__m256i a1 = _mm256_add_epi32(x[i + 1], s[i + 1]);
+			__m256i a2 = _mm256_add_epi32(x[i + 2], s[i + 2]);
+			__m256i a3 = _mm256_add_epi32(x[i + 3], s[i + 3]);
+
+			__m256i t0 = _mm256_unpacklo_epi32(a0, a1);
+			__m256i t1 = _mm256_unpacklo_epi32(a2, a3);
+			__m256i t2 = _mm256_unpackhi_epi32(a0, a1);
+			__m256i t3 = _mm256_unpackhi_epi32(a2, a3);
+
+			Rows[i + 0] = _mm256_unpacklo_epi64(t0, t1);
+			Rows[i + 1] = _mm256_unpackhi_epi64(t0, t1);
+			Rows[i + 2] = _mm256_unpacklo_epi64(t2, t3);
+			Rows[i + 3] = _mm256_unpackhi_epi64(t2, t3);
+		}
+
+		// join 16-byte rows from neighbour word groups into 32-byte halves of block
+		for (int i = 0; i < 16; i += 8)
+		{
+			for (int j = 0; j < 4; j++)
+			{
+				__m256i Lo = _mm256_permute2x128_si256(Rows[i + j], Rows[i + 4 + j], 0x20);
+				__m256i Hi = _mm256_permute2x128_si256(Rows[i + j], Rows[i + 4 + j], 0x31);
+
+				size_t OffsetLo = Processed + j * 64 + i * 4;
+				size_t OffsetHi = OffsetLo + 4 * 64;
+
+				__m256i DataLo = _mm256_loadu_si256((const __m256i*)(Input + OffsetLo));
+				__m256i DataHi = _mm256_loadu_si256((const __m256i*)(Input + OffsetHi));
+				_mm256_storeu_si256((__m256i*)(Output + OffsetLo), _mm256_xor_si256(DataLo, Lo));
+				_mm256_storeu_si256((__m256i*)(Output + OffsetHi), _mm256_xor_si256(DataHi, Hi));
+			}
+		}
+
+		Counter += 8;
+		Processed += 8 * 64;
+	}
+
+	return Processed;
+}
+
+#endif // DERPNET_USE_SIMD
+
+static void salsa20_xor_level(uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t Key[32], const uint8_t Nonce[8], uint64_t Counter, DerpNetCpuLevel Level)
+{
+	uint8_t TempInput[16];
+	uint8_t Block[64];
+
+#if DERPNET_USE_SIMD
+	// wide kernels do all full groups of blocks, leftover goes to scalar code below
+	if (InputSize >= 8 * 64 && Level >= DERPNET_CPU_LEVEL_AVX2)
+	{
+		size_t Processed = salsa20_xor_avx2(Output, Input, InputSize, Key, Nonce, Counter);
+		Counter += Processed / 64;
+		Output += Processed;
+		Input += Processed;
+		InputSize -= Processed;
+	}
+	if (InputSize >= 4 * 64 && Level >= DERPNET_CPU_LEVEL_SSE2)
+	{
+		size_t Processed = salsa20_xor_sse2(Output, Input, InputSize, Key, Nonce, Counter);
+		Counter += Processed / 64;
+		Output += Processed;
+		Input += Processed;
+		InputSize -= Processed;
+	}
+#else
+	(void)Level;
+#endif
+
+	memcpy(TempInput, Nonce, 8);
+
+	while (InputSize >= 64)
+	{
+		memcpy(TempInput + 8, &Counter, sizeof(Counter));
+		salsa20(Block, TempInput, Key);
+
+		for (size_t i = 0; i < 64; ++i)
+		{
+			Output[i] = Input[i] ^ Block[i];
+		}
+
+		Counter += 1;
+
+		Output += 64;
+		Input += 64;
+		InputSize -= 64;
+	}
+
+	if (InputSize)
+	{
+		memcpy(TempInput + 8, &Counter, sizeof(Counter));
+		salsa20(Block, TempInput, Key);
+
+		for (size_t i = 0; i < InputSize; ++i)
+		{
+			Output[i] = Input[i] ^ Block[i];
+		}
+	}
+}
+
+static void salsa20_xor(uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t Key[32], const uint8_t Nonce[8], uint64_t Counter)
+{
+	salsa20_xor_level(Output, Input, InputSize, Key, Nonce, Counter, DerpNet__KernelsLevel());
+}
+
+//
+// chacha20 & chacha20-poly1305 AEAD, used only by built-in TLS, see RFC 8439
+//
+
+static void chacha20_block(uint8_t Output[64], const uint8_t Key[32], uint32_t Counter, const uint8_t Nonce[12])
+{
+	uint32_t x[16];
+	x[ 0] = Get32LE((uint8_t*)&salsa20_constant[0]);
+	x[ 1] = Get32LE((uint8_t*)&salsa20_constant[4]);
+	x[ 2] = Get32LE((uint8_t*)&salsa20_constant[8]);
+	x[ 3] = Get32LE((uint8_t*)&salsa20_constant[12]);
+	x[ 4] = Get32LE(&Key[ 0]);
+	x[ 5] = Get32LE(&Key[ 4]);
+	x[ 6] = Get32LE(&Key[ 8]);
+	x[ 7] = Get32LE(&Key[12]);
+	x[ 8] = Get32LE(&Key[16]);
+	x[ 9] = Get32LE(&Key[20]);
+	x[10] = Get32LE(&Key[24]);
+	x[11] = Get32LE(&Key[28]);
+	x[12] = Counter;
+	x[13] = Get32LE(&Nonce[0]);
+	x[14] = Get32LE(&Nonce[4]);
+	x[15] = Get32LE(&Nonce[8]);
+
+	uint32_t j[16];
+	memcpy(j, x, sizeof(j));
+
+	for (int i = 0; i < 20; i += 2)
+	{
+
+#define Q(a,b,c,d) \
+		x[a] += x[b]; x[d] ^= x[a]; x[d] = rol32(x[d], 16); \
+		x[c] += x[d]; x[b] ^= x[c]; x[b] = rol32(x[b], 12); \
+		x[a] += x[b]; x[d] ^= x[a]; x[d] = rol32(x[d],  8); \
+		x[c] += x[d]; x[b] ^= x[c]; x[b] = rol32(x[b],  7)
+
+		Q(0, 4,  8, 12);
+		Q(1, 5,  9, 13);
+		Q(2, 6, 10, 14);
+		Q(3, 7, 11, 15);
+
+		Q(0, 5, 10, 15);
+		Q(1, 6, 11, 12);
+		Q(2, 7,  8, 13);
+		Q(3, 4,  9, 14);
+
+#undef Q
+
+	}
+
+	for (int i = 0; i < 16; i++)
+	{
+		Set32LE(&Output[i * 4], x[i] + j[i]);
+	}
+}
+
+static void chacha20_xor(uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t Key[32], uint32_t Counter, const uint8_t Nonce[12])
+{
+	uint8_t Block[64];
+
+	while (InputSize != 0)
+	{
+		chacha20_block(Block, Key, Counter++, Nonce);
+
+		size_t Size = DerpNet__Min(InputSize, sizeof(Block));
+		for (size_t i = 0; i < Size; i++)
+		{
+			Output[i] = Input[i] ^ Block[i];
+		}
+
+		Output += Size;
+		Input += Size;
+		InputSize -= Size;
+	}
+}
+
+static void chacha20poly1305_auth(uint8_t Tag[16], const uint8_t* Aad, size_t AadSize, const uint8_t* Data, size_t DataSize, const uint8_t Key[32], const uint8_t Nonce[12])
+{
+	uint8_t Block[64];
+	chacha20_block(Block, Key, 0, Nonce);
+
+	static const uint8_t Zero[16] = { 0 };
+
+	poly1305_state_internal_t State;
+	poly1305_init(&State, Block);
+	poly1305_update(&State, Aad, AadSize);
+	poly1305_update(&State, Zero, (16 - AadSize % 16) % 16);
+	poly1305_update(&State, Data, DataSize);
+	poly1305_update(&State, Zero, (16 - DataSize % 16) % 16);
+
+	uint8_t Sizes[16];
+	Set64LE(Sizes + 0, AadSize);
+	Set64LE(Sizes + 8, DataSize);
+	poly1305_update(&State, Sizes, sizeof(Sizes));
+	poly1305_finish(&State, Tag);
+
+	memset(Block, 0, sizeof(Block));
+}
+
+// encrypts Data in place
+static void chacha20poly1305_seal(uint8_t Tag[16], uint8_t* Data, size_t DataSize, const uint8_t* Aad, size_t AadSize, const uint8_t Key[32], const uint8_t Nonce[12])
+{
+	chacha20_xor(Data, Data, DataSize, Key, 1, Nonce);
+	chacha20poly1305_auth(Tag, Aad, AadSize, Data, DataSize, Key, Nonce);
+}
+
+// decrypts Data in place, returns false and leaves Data unchanged if authentication fails
+static bool chacha20poly1305_open(uint8_t* Data, size_t DataSize, const uint8_t Tag[16], const uint8_t* Aad, size_t AadSize, const uint8_t Key[32], const uint8_t Nonce[12])
+{
+	uint8_t Expected[16];
+	chacha20poly1305_auth(Expected, Aad, AadSize, Data, DataSize, Key, Nonce);
+	if (!poly1305_verify(Expected, Tag))
+	{
+		return false;
+	}
+
+	chacha20_xor(Data, Data, DataSize, Key, 1, Nonce);
+	return true;
+}
+
+//
+// sha256, hmac & hkdf, used only by built-in TLS, see FIPS 180-4 and RFC 5869
+//
+
+typedef struct {
+	uint32_t h[8];
+	uint64_t size;
+	uint8_t buffer[64];
+} sha256_state;
+
+static const uint32_t sha256_k[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ror32(x, n) rol32(x, 32 - (n))
+
+static void sha256_block(sha256_state* st, const uint8_t Block[64])
+{
+	uint32_t w[64];
+	for (int i = 0; i < 16; i++)
+	{
+		w[i] = Get32BE(&Block[i * 4]);
+	}
+	for (int i = 16; i < 64; i++)
+	{
+		uint32_t s0 = ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	uint32_t a = st->h[0], b = st->h[1], c = st->h[2], d = st->h[3];
+	uint32_t e = st->h[4], f = st->h[5], g = st->h[6], h = st->h[7];
+
+	for (int i = 0; i < 64; i++)
+	{
+		uint32_t s1 = ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25);
+		uint32_t ch = (e & f) ^ (~e & g);
+		uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+		uint32_t s0 = ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22);
+		uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+		uint32_t t2 = s0 + maj;
+
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	st->h[0] += a; st->h[1] += b; st->h[2] += c; st->h[3] += d;
+	st->h[4] += e; st->h[5] += f; st->h[6] += g; st->h[7] += h;
+}
+
+#undef ror32
+
+static void sha256_init(sha256_state* st)
+{
+	static const uint32_t Initial[8] =
+	{
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	memcpy(st->h, Initial, sizeof(st->h));
+	st->size = 0;
+}
+
+static void sha256_update(sha256_state* st, const void* Data, size_t Size)
+{
+	const uint8_t* Bytes = (const uint8_t*)Data;
+
+	size_t Used = st->size % 64;
+	st->size += Size;
+
+	if (Used)
+	{
+		size_t Want = DerpNet__Min(64 - Used, Size);
+		memcpy(st->buffer + Used, Bytes, Want);
+		Bytes += Want;
+		Size -= Want;
+		if (Used + Want < 64)
+		{
+			return;
+		}
+		sha256_block(st, st->buffer);
+	}
+
+	while (Size >= 64)
+	{
+		sha256_block(st, Bytes);
+		Bytes += 64;
+		Size -= 64;
+	}
+
+	memcpy(st->buffer, Bytes, Size);
+}
+
+// state can be copied before finishing, to get hash of data so far and continue after
+static void sha256_finish(sha256_state* st, uint8_t Hash[32])
+{
+	uint64_t Bits = st->size * 8;
+
+	static const uint8_t Padding[64] = { 0x80 };
+	sha256_update(st, Padding, 1 + (119 - st->size % 64) % 64);
+
+	uint8_t Size[8];
+	Set64BE(Size, Bits);
+	sha256_update(st, Size, sizeof(Size));
+
+	for (int i = 0; i < 8; i++)
+	{
+		Set32BE(&Hash[i * 4], st->h[i]);
+	}
+}
+
+static void sha256(uint8_t Hash[32], const void* Data, size_t Size)
+{
+	sha256_state st;
+	sha256_init(&st);
+	sha256_update(&st, Data, Size);
+	sha256_finish(&st, Hash);
+}
+
+typedef struct {
+	sha256_state inner;
+	sha256_state outer;
+} hmac_sha256_state;
+
+static void hmac_sha256_init(hmac_sha256_state* st, const uint8_t* Key, size_t KeySize)
+{
+	uint8_t Pad[64] = { 0 };
+	if (KeySize > sizeof(Pad))
+	{
+		sha256(Pad, Key, KeySize);
+	}
+	else
+	{
+		memcpy(Pad, Key, KeySize);
+	}
+
+	for (size_t i = 0; i < sizeof(Pad); i++)
+	{
+		Pad[i] ^= 0x36;
+	}
+	sha256_init(&st->inner);
+	sha256_update(&st->inner, Pad, sizeof(Pad));
+
+	for (size_t i = 0; i < sizeof(Pad); i++)
+	{
+		Pad[i] ^= 0x36 ^ 0x5c;
+	}
+	sha256_init(&st->outer);
+	sha256_update(&st->outer, Pad, sizeof(Pad));
+
+	memset(Pad, 0, sizeof(Pad));
+}
+
+static void hmac_sha256_finish(hmac_sha256_state* st, uint8_t Mac[32])
+{
+	uint8_t Hash[32];
+	sha256_finish(&st->inner, Hash);
+	sha256_update(&st->outer, Hash, sizeof(Hash));
+	sha256_finish(&st->outer, Mac);
+}
+
+static void hmac_sha256(uint8_t Mac[32], const uint8_t* Key, size_t KeySize, const void* Data, size_t Size)
+{
+	hmac_sha256_state st;
+	hmac_sha256_init(&st, Key, KeySize);
+	sha256_update(&st.inner, Data, Size);
+	hmac_sha256_finish(&st, Mac);
+}
+
+static void hkdf_sha256_extract(uint8_t Secret[32], const uint8_t Salt[32], const uint8_t* Input, size_t InputSize)
+{
+	hmac_sha256(Secret, Salt, 32, Input, InputSize);
+}
+
+// TLS 1.3 HKDF-Expand-Label, only up to 32 bytes of output are needed
+static void hkdf_sha256_expand_label(uint8_t* Output, size_t OutputSize, const uint8_t Secret[32], const char* Label, const uint8_t* Context, size_t ContextSize)
+{
+	DERPNET_ASSERT(OutputSize <= 32);
+
+	size_t LabelSize = strlen(Label);
+	DERPNET_ASSERT(LabelSize <= 32 && ContextSize <= 32);
+
+	uint8_t Info[2 + 1 + 6 + 32 + 1 + 32 + 1];
+	uint8_t* Ptr = Info;
+	*Ptr++ = (uint8_t)(OutputSize >> 8);
+	*Ptr++ = (uint8_t)(OutputSize);
+	*Ptr++ = (uint8_t)(6 + LabelSize);
+	memcpy(Ptr, "tls13 ", 6);
+	Ptr += 6;
+	memcpy(Ptr, Label, LabelSize);
+	Ptr += LabelSize;
+	*Ptr++ = (uint8_t)ContextSize;
+	memcpy(Ptr, Context, ContextSize);
+	Ptr += ContextSize;
+	*Ptr++ = 1;
+
+	uint8_t Block[32];
+	hmac_sha256(Block, Secret, 32, Info, Ptr - Info);
+	memcpy(Output, Block, OutputSize);
+	memset(Block, 0, sizeof(Block));
+}
+
+//
+// runtime dispatch of crypto kernels
+//
+// only salsa20 and poly1305 have vector kernels - hsalsa20 is one block per message, and
+// curve25519 is plain 64-bit multiplies, so these always run portable code
+//
+
+// -1 until first use, level is published with one atomic store, so threads sealing
+// messages meanwhile always see level that has passed self-test
+#if defined(_WIN32)
+static volatile LONG DerpNet__KernelLevel = -1;
+#else
+static volatile int32_t DerpNet__KernelLevel = -1;
+#endif
+
+static int32_t DerpNet__KernelLevelLoad(void)
+{
+#if defined(_WIN32)
+	return DerpNet__KernelLevel;
+#else
+	return __atomic_load_n(&DerpNet__KernelLevel, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static void DerpNet__KernelLevelStore(int32_t Level)
+{
+#if defined(_WIN32)
+	InterlockedExchange(&DerpNet__KernelLevel, Level);
+#else
+	__atomic_store_n(&DerpNet__KernelLevel, Level, __ATOMIC_RELEASE);
+#endif
+}
+
+// stores Level only if nothing was stored yet
+static void DerpNet__KernelLevelStoreFirst(int32_t Level)
+{
+#if defined(_WIN32)
+	InterlockedCompareExchange(&DerpNet__KernelLevel, Level, -1);
+#else
+	int32_t Expected = -1;
+	__atomic_compare_exchange_n(&DerpNet__KernelLevel, &Expected, Level, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static DerpNetCpuLevel DerpNet__CpuMaxLevel(void)
+{
+#if DERPNET_USE_SIMD
+	return (DerpNet__CpuFeatures() & DERPNET_CPU_AVX2) ? DERPNET_CPU_LEVEL_AVX2 : DERPNET_CPU_LEVEL_SSE2;
+#else
+	return DERPNET_CPU_LEVEL_SCALAR;
+#endif
+}
+
+// compares kernels of Level against portable code, sizes & counter are chosen so
+// every kernel runs and salsa20 block counter carries into upper 32 bits
+// level is passed to kernels directly, so test does not change what other threads use
+static bool DerpNet__KernelsSelfTest(DerpNetCpuLevel Level)
+{
+	uint8_t Key[32];
+	uint8_t Nonce[8];
+	uint8_t Input[1000];
+	for (size_t i = 0; i < sizeof(Key); i++)
+	{
+		Key[i] = (uint8_t)(i * 29 + 3);
+	}
+	for (size_t i = 0; i < sizeof(Nonce); i++)
+	{
+		Nonce[i] = (uint8_t)(i * 17 + 5);
+	}
+	for (size_t i = 0; i < sizeof(Input); i++)
+	{
+		Input[i] = (uint8_t)(i * 31 + 7);
+	}
+	const uint64_t Counter = 0xfffffffc;
+
+	uint8_t Expected[sizeof(Input)];
+	uint8_t ExpectedMac[16];
+	salsa20_xor_level(Expected, Input, sizeof(Input), Key, Nonce, Counter, DERPNET_CPU_LEVEL_SCALAR);
+	poly1305_auth(ExpectedMac, Input, sizeof(Input), Key, DERPNET_CPU_LEVEL_SCALAR);
+
+	uint8_t Actual[sizeof(Input)];
+	uint8_t ActualMac[16];
+	salsa20_xor_level(Actual, Input, sizeof(Input), Key, Nonce, Counter, Level);
+	poly1305_auth(ActualMac, Input, sizeof(Input), Key, Level);
+
+	return memcmp(Expected, Actual, sizeof(Actual)) == 0 && poly1305_verify(ExpectedMac, ActualMac);
+}
+
+// highest level up to Level that passes self-test
+static DerpNetCpuLevel DerpNet__KernelsSelect(DerpNetCpuLevel Level)
+{
+	DerpNetCpuLevel MaxLevel = DerpNet__CpuMaxLevel();
+	if (Level > MaxLevel)
+	{
+		Level = MaxLevel;
+	}
+
+	while (Level != DERPNET_CPU_LEVEL_SCALAR && !DerpNet__KernelsSelfTest(Level))
+	{
+		DERPNET_LOG("Crypto self-test failed for CPU level %d", (int)Level);
+		Level = (DerpNetCpuLevel)(Level - 1);
+	}
+	return Level;
+}
+
+// runs once, DerpNet_SetCpuLevel called before first use wins over it
+#if defined(_WIN32)
+static BOOL CALLBACK DerpNet__KernelsInit(PINIT_ONCE Once, PVOID Parameter, PVOID* Context)
+#else
+static void DerpNet__KernelsInit(void)
+#endif
+{
+	DerpNetCpuLevel Level = DerpNet__CpuMaxLevel();
+
+#if defined(_WIN32)
+	char Env[16];
+	DWORD EnvLength = GetEnvironmentVariableA("DERPNET_CPU_LEVEL", Env, sizeof(Env));
+	if (EnvLength != 0 && EnvLength < sizeof(Env))
+#else
+	const char* Env = getenv("DERPNET_CPU_LEVEL");
+	if (Env)
+#endif
+	{
+		if (strcmp(Env, "scalar") == 0)
+		{
+			Level = DERPNET_CPU_LEVEL_SCALAR;
+		}
+		else if (strcmp(Env, "sse2") == 0)
+		{
+			Level = DERPNET_CPU_LEVEL_SSE2;
+		}
+		else if (strcmp(Env, "avx2") == 0)
+		{
+			Level = DERPNET_CPU_LEVEL_AVX2;
+		}
+		else
+		{
+			DERPNET_LOG("Unknown DERPNET_CPU_LEVEL value '%s'", Env);
+		}
+	}
+
+	DerpNet__KernelLevelStoreFirst(DerpNet__KernelsSelect(Level));
+#if defined(_WIN32)
+	(void)Once;
+	(void)Parameter;
+	(void)Context;
+	return TRUE;
+#endif
+}
+
+static DerpNetCpuLevel DerpNet__KernelsLevel(void)
+{
+	int32_t Level = DerpNet__KernelLevelLoad();
+	if (Level < 0)
+	{
+#if defined(_WIN32)
+		static INIT_ONCE KernelsOnce = INIT_ONCE_STATIC_INIT;
+		InitOnceExecuteOnce(&KernelsOnce, &DerpNet__KernelsInit, NULL, NULL);
+#else
+		static pthread_once_t KernelsOnce = PTHREAD_ONCE_INIT;
+		pthread_once(&KernelsOnce, &DerpNet__KernelsInit);
+#endif
+		Level = DerpNet__KernelLevelLoad();
+	}
+	return (DerpNetCpuLevel)Level;
+}
+
+//
+// nacl box seal/unseal
+//
+
+static void DerpNet__GetSharedKey(uint8_t SharedKey[32], const uint8_t PrivateKey[32], const uint8_t PublicKey[32])
+{
+	uint8_t SharedSecret[32];
+	curve25519_scalarmult(SharedSecret, PrivateKey, PublicKey);
+
+	uint8_t ZeroInput[16] = { 0 };
+	hsalsa20(SharedKey, ZeroInput, SharedSecret);
+}
+
+// up to curve25519_max_batch keys at once
+static void DerpNet__GetSharedKeyBatch(uint8_t (*SharedKeys)[32], const uint8_t PrivateKey[32], const uint8_t (*PublicKeys)[32], size_t Count)
+{
+	uint8_t SharedSecrets[curve25519_max_batch][32];
+	curve25519_scalarmult_batch(SharedSecrets, PrivateKey, PublicKeys, Count);
+
+	uint8_t ZeroInput[16] = { 0 };
+	for (size_t i = 0; i < Count; i++)
+	{
+		hsalsa20(SharedKeys[i], ZeroInput, SharedSecrets[i]);
+	}
+}
+
+// payload is processed in chunks small enough to stay in L1 cache between
+// encryption and authentication, so message is traversed only once
+#define DERPNET_BOX_CHUNK_SIZE 4096
+
+typedef struct {
+	uint8_t SubKey[32];
+	uint8_t Nonce[8];
+	uint64_t Counter;
+	uint8_t Block[64];
+	size_t BlockUsed;
+	poly1305_state_internal_t Mac;
+} DerpNet__Box;
+
+static void DerpNet__BoxInit(DerpNet__Box* Box, const uint8_t Nonce[24], const uint8_t SharedKey[32])
+{
+	// xsalsa20 key construction
+	hsalsa20(Box->SubKey, Nonce, SharedKey);
+	memcpy(Box->Nonce, Nonce + 16, 8);
+
+	// first 32 bytes of keystream are poly1305 key, other 32 bytes are used for start of message
+	memset(Box->Block, 0, sizeof(Box->Block));
+	salsa20_xor(Box->Block, Box->Block, sizeof(Box->Block), Box->SubKey, Box->Nonce, 0);
+	poly1305_init(&Box->Mac, Box->Block);
+
+	Box->Counter = 1;
+	Box->BlockUsed = 32;
+}
+
+static void DerpNet__BoxXor(DerpNet__Box* Box, uint8_t* Output, const uint8_t* Input, size_t Size)
+{
+	// leftover keystream from previous call
+	while (Size != 0 && Box->BlockUsed < sizeof(Box->Block))
+	{
+		*Output++ = *Input++ ^ Box->Block[Box->BlockUsed++];
+		Size--;
+	}
+
+	size_t FullSize = Size & ~(size_t)63;
+	salsa20_xor(Output, Input, FullSize, Box->SubKey, Box->Nonce, Box->Counter);
+	Box->Counter += FullSize / 64;
+	Output += FullSize;
+	Input += FullSize;
+	Size -= FullSize;
+
+	if (Size != 0)
+	{
+		memset(Box->Block, 0, sizeof(Box->Block));
+		salsa20_xor(Box->Block, Box->Block, sizeof(Box->Block), Box->SubKey, Box->Nonce, Box->Counter);
+		Box->Counter += 1;
+
+		for (size_t i = 0; i < Size; i++)
+		{
+			Output[i] = Input[i] ^ Box->Block[i];
+		}
+		Box->BlockUsed = Size;
+	}
+}
+
+// how much to process next, chunks are kept aligned to keystream blocks
+static size_t DerpNet__BoxChunk(const DerpNet__Box* Box, size_t Size)
+{
+	size_t ChunkSize = DERPNET_BOX_CHUNK_SIZE - (sizeof(Box->Block) - Box->BlockUsed);
+	return Size < ChunkSize ? Size : ChunkSize;
+}
+
+static void DerpNet__BoxSealUpdate(DerpNet__Box* Box, uint8_t* Output, const uint8_t* Input, size_t Size)
+{
+	DerpNet__BoxXor(Box, Output, Input, Size);
+	poly1305_update(&Box->Mac, Output, Size);
+}
+
+static void DerpNet__BoxUnsealUpdate(DerpNet__Box* Box, uint8_t* Output, const uint8_t* Input, size_t Size)
+{
+	// authenticate ciphertext before in-place decryption overwrites it
+	poly1305_update(&Box->Mac, Input, Size);
+	DerpNet__BoxXor(Box, Output, Input, Size);
+}
+
+static void DerpNet__BoxSealEx(const uint8_t Nonce[24], uint8_t Auth[16], uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t SharedKey[32])
+{
+	DerpNet__Box Box;
+	DerpNet__BoxInit(&Box, Nonce, SharedKey);
+
+	while (InputSize != 0)
+	{
+		size_t ChunkSize = DerpNet__BoxChunk(&Box, InputSize);
+		DerpNet__BoxSealUpdate(&Box, Output, Input, ChunkSize);
+
+		Output += ChunkSize;
+		Input += ChunkSize;
+		InputSize -= ChunkSize;
+	}
+
+	poly1305_finish(&Box.Mac, Auth);
+}
+
+static void DerpNet__BoxSeal(const uint8_t Nonce[24], uint8_t Auth[16], uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t PrivateKey[32], const uint8_t PublicKey[32])
+{
+	uint8_t SharedKey[32];
+	DerpNet__GetSharedKey(SharedKey, PrivateKey, PublicKey);
+
+	DerpNet__BoxSealEx(Nonce, Auth, Output, Input, InputSize, SharedKey);
+}
+
+static bool DerpNet__BoxUnsealEx(uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t Auth[16], const uint8_t Nonce[24], const uint8_t SharedKey[32])
+{
+	DerpNet__Box Box;
+	DerpNet__BoxInit(&Box, Nonce, SharedKey);
+
+	uint8_t* OutputStart = Output;
+	size_t OutputSize = InputSize;
+
+	while (InputSize != 0)
+	{
+		size_t ChunkSize = DerpNet__BoxChunk(&Box, InputSize);
+		DerpNet__BoxUnsealUpdate(&Box, Output, Input, ChunkSize);
+
+		Output += ChunkSize;
+		Input += ChunkSize;
+		InputSize -= ChunkSize;
+	}
+
+	uint8_t ExpectedAuth[16];
+	poly1305_finish(&Box.Mac, ExpectedAuth);
+
+	if (poly1305_verify(Auth, ExpectedAuth) == 0)
+	{
+		// never release unauthenticated plaintext
+		memset(OutputStart, 0, OutputSize);
+		return false;
+	}
+
+	return true;
+}
+
+static bool DerpNet__BoxUnseal(uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t Auth[16], const uint8_t Nonce[24], const uint8_t PrivateKey[32], const uint8_t PublicKey[32])
+{
+	uint8_t SharedKey[32];
+	DerpNet__GetSharedKey(SharedKey, PrivateKey, PublicKey);
+
+	return DerpNet__BoxUnsealEx(Output, Input, InputSize, Auth, Nonce, SharedKey);
+}
+
+//
+// per-connection (and per-thread for DerpNet_ThreadSend) random generator for nonces, salsa20 keystream with fast key erasure:
+// first 32 bytes of every refill become next key, and bytes are wiped once handed out,
+// so state never allows recovering earlier output
+//
+
+// changes in child process after fork(), so it never repeats parent's output
+#if defined(_WIN32)
+
+// Windows has no fork()
+static uint32_t DerpNet__ForkGeneration(void)
+{
+	return 0;
+}
+
+#else
+
+static volatile uint32_t DerpNet__ForkCounter;
+
+static void DerpNet__ForkChild(void)
+{
+	DerpNet__ForkCounter++;
+}
+
+static void DerpNet__ForkRegister(void)
+{
+	pthread_atfork(NULL, NULL, &DerpNet__ForkChild);
+}
+
+static uint32_t DerpNet__ForkGeneration(void)
+{
+	static pthread_once_t ForkOnce = PTHREAD_ONCE_INIT;
+	pthread_once(&ForkOnce, &DerpNet__ForkRegister);
+	return DerpNet__ForkCounter;
+}
+
+#endif
+
+static void DerpNet__RandomReset(DerpNetRandom* Random)
+{
+	DerpNet__GetRandom(Random->Key, sizeof(Random->Key));
+	Random->Used = sizeof(Random->Buffer);
+	Random->Generation = DerpNet__ForkGeneration();
+}
+
+static void DerpNet__RandomRefill(DerpNetRandom* Random)
+{
+	static const uint8_t Nonce[8] = { 0 };
+
+	memset(Random->Buffer, 0, sizeof(Random->Buffer));
+	salsa20_xor(Random->Buffer, Random->Buffer, sizeof(Random->Buffer), Random->Key, Nonce, 0);
+
+	memcpy(Random->Key, Random->Buffer, sizeof(Random->Key));
+	memset(Random->Buffer, 0, sizeof(Random->Key));
+	Random->Used = sizeof(Random->Key);
+}
+
+// zeroed state is seeded on first use
+static void DerpNet__Random(DerpNetRandom* Random, uint8_t* Buffer, size_t BufferSize)
+{
+	if (Random->Used == 0 || Random->Generation != DerpNet__ForkGeneration())
+	{
+		DerpNet__RandomReset(Random);
+	}
+
+	while (BufferSize != 0)
+	{
+		if (Random->Used == sizeof(Random->Buffer))
+		{
+			DerpNet__RandomRefill(Random);
+		}
+
+		size_t Available = sizeof(Random->Buffer) - Random->Used;
+		size_t Size = BufferSize < Available ? BufferSize : Available;
+
+		memcpy(Buffer, Random->Buffer + Random->Used, Size);
+		memset(Random->Buffer + Random->Used, 0, Size);
+		Random->Used += Size;
+
+		Buffer += Size;
+		BufferSize -= Size;
+	}
+}
+
+//
+// shared key cache
+//
+
+#if (DERPNET_KEY_CACHE_SIZE & (DERPNET_KEY_CACHE_SIZE - 1)) != 0
+#	error DERPNET_KEY_CACHE_SIZE must be power of 2
+#endif
+
+// open addressing where each key can live only in small window of slots after its hash
+// when window is full, one of its entries is replaced with CLOCK algorithm - entries
+// used since last replacement get second chance
+#define DERPNET_KEY_CACHE_WINDOW (DERPNET_KEY_CACHE_SIZE < 8 ? DERPNET_KEY_CACHE_SIZE : 8)
+
+static void DerpNet__KeyCacheReset(DerpNet* Net)
+{
+	memset(Net->KeyCache, 0, sizeof(Net->KeyCache));
+	DerpNet__GetRandom(Net->KeyCacheSeed, sizeof(Net->KeyCacheSeed));
+	Net->KeyCacheHits = 0;
+	Net->KeyCacheMisses = 0;
+}
+
+#define DERPNET_SIPROUND(v0, v1, v2, v3) do { \
+	v0 += v1; v1 = rol64(v1, 13); v1 ^= v0; v0 = rol64(v0, 32); \
+	v2 += v3; v3 = rol64(v3, 16); v3 ^= v2;                     \
+	v0 += v3; v3 = rol64(v3, 21); v3 ^= v0;                     \
+	v2 += v1; v1 = rol64(v1, 17); v1 ^= v2; v2 = rol64(v2, 32); \
+} while (0)
+
+// SipHash-2-4 over whole 32 byte key with random per-connection 128-bit seed,
+// so remote peers cannot choose keys that collide on purpose
+static size_t DerpNet__KeyCacheIndex(DerpNet* Net, const uint8_t PublicKey[32])
+{
+	uint64_t v0 = Net->KeyCacheSeed[0] ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = Net->KeyCacheSeed[1] ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = Net->KeyCacheSeed[0] ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = Net->KeyCacheSeed[1] ^ 0x7465646279746573ULL;
+
+	for (size_t i = 0; i < 32; i += 8)
+	{
+		uint64_t m = Get64LE(PublicKey + i);
+		v3 ^= m;
+		DERPNET_SIPROUND(v0, v1, v2, v3);
+		DERPNET_SIPROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+
+	// final block has only length byte
+	uint64_t m = (uint64_t)32 << 56;
+	v3 ^= m;
+	DERPNET_SIPROUND(v0, v1, v2, v3);
+	DERPNET_SIPROUND(v0, v1, v2, v3);
+	v0 ^= m;
+
+	v2 ^= 0xff;
+	DERPNET_SIPROUND(v0, v1, v2, v3);
+	DERPNET_SIPROUND(v0, v1, v2, v3);
+	DERPNET_SIPROUND(v0, v1, v2, v3);
+	DERPNET_SIPROUND(v0, v1, v2, v3);
+
+	uint64_t Hash = v0 ^ v1 ^ v2 ^ v3;
+	return (size_t)Hash & (DERPNET_KEY_CACHE_SIZE - 1);
+}
+
+#undef DERPNET_SIPROUND
+
+static DerpNetPeer* DerpNet__KeyCacheLookup(DerpNet* Net, const uint8_t PublicKey[32])
+{
+	size_t Index = DerpNet__KeyCacheIndex(Net, PublicKey);
+
+	// slots are never emptied, so first empty slot ends the search
+	for (size_t i = 0; i < DERPNET_KEY_CACHE_WINDOW; i++)
+	{
+		DerpNetPeer* Peer = &Net->KeyCache[(Index + i) & (DERPNET_KEY_CACHE_SIZE - 1)];
+		if (!Peer->Used)
+		{
+			break;
+		}
+		if (memcmp(Peer->PublicKey.Bytes, PublicKey, sizeof(Peer->PublicKey.Bytes)) == 0)
+		{
+			return Peer;
+		}
+	}
+	return NULL;
+}
+
+// returns slot for key that is not in cache, caller must fill SharedKey
+static DerpNetPeer* DerpNet__KeyCacheInsert(DerpNet* Net, const uint8_t PublicKey[32])
+{
+	size_t Index = DerpNet__KeyCacheIndex(Net, PublicKey);
+	DerpNetPeer* Result = NULL;
+
+	for (size_t i = 0; i < DERPNET_KEY_CACHE_WINDOW; i++)
+	{
+		DerpNetPeer* Peer = &Net->KeyCache[(Index + i) & (DERPNET_KEY_CACHE_SIZE - 1)];
+		if (!Peer->Used)
+		{
+			Result = Peer;
+			break;
+		}
+	}
+
+	while (!Result)
+	{
+		for (size_t i = 0; i < DERPNET_KEY_CACHE_WINDOW; i++)
+		{
+			DerpNetPeer* Peer = &Net->KeyCache[(Index + i) & (DERPNET_KEY_CACHE_SIZE - 1)];
+			if (!Peer->Referenced)
+			{
+				Result = Peer;
+				break;
+			}
+			Peer->Referenced = 0;
+		}
+	}
+
+	memcpy(Result->PublicKey.Bytes, PublicKey, sizeof(Result->PublicKey.Bytes));
+	Result->Used = 1;
+	Result->Referenced = 1;
+	return Result;
+}
+
+static const uint8_t* DerpNet__GetPeerSharedKey(DerpNet* Net, const uint8_t PublicKey[32])
+{
+	DerpNetPeer* Peer = DerpNet__KeyCacheLookup(Net, PublicKey);
+	if (Peer)
+	{
+		Net->KeyCacheHits++;
+		Peer->Referenced = 1;
+	}
+	else
+	{
+		Net->KeyCacheMisses++;
+
+		Peer = DerpNet__KeyCacheInsert(Net, PublicKey);
+		DerpNet__GetSharedKey(Peer->SharedKey, Net->UserPrivateKey, PublicKey);
+	}
+	return Peer->SharedKey;
+}
+
+void DerpNet_GetSharedKeys(const DerpKey* UserSecret, const DerpKey* PublicKeys, size_t Count, DerpKey* SharedKeys)
+{
+	while (Count != 0)
+	{
+		size_t BatchCount = Count < curve25519_max_batch ? Count : curve25519_max_batch;
+		DerpNet__GetSharedKeyBatch((uint8_t(*)[32])SharedKeys, UserSecret->Bytes, (const uint8_t(*)[32])PublicKeys, BatchCount);
+
+		PublicKeys += BatchCount;
+		SharedKeys += BatchCount;
+		Count -= BatchCount;
+	}
+}
+
+void DerpNet_AddPeers(DerpNet* Net, const DerpKey* PublicKeys, size_t Count)
+{
+	while (Count != 0)
+	{
+		uint8_t Missing[curve25519_max_batch][32];
+		uint8_t SharedKeys[curve25519_max_batch][32];
+		size_t MissingCount = 0;
+
+		while (Count != 0 && MissingCount < curve25519_max_batch)
+		{
+			if (!DerpNet__KeyCacheLookup(Net, PublicKeys->Bytes))
+			{
+				memcpy(Missing[MissingCount++], PublicKeys->Bytes, 32);
+			}
+			PublicKeys++;
+			Count--;
+		}
+
+		if (MissingCount != 0)
+		{
+			DerpNet__GetSharedKeyBatch(SharedKeys, Net->UserPrivateKey, (const uint8_t(*)[32])Missing, MissingCount);
+
+			for (size_t i = 0; i < MissingCount; i++)
+			{
+				// same key can be in input more than once
+				if (!DerpNet__KeyCacheLookup(Net, Missing[i]))
+				{
+					DerpNetPeer* Peer = DerpNet__KeyCacheInsert(Net, Missing[i]);
+					memcpy(Peer->SharedKey, SharedKeys[i], sizeof(Peer->SharedKey));
+				}
+			}
+		}
+	}
+}
+
+DerpNetCpuLevel DerpNet_SetCpuLevel(DerpNetCpuLevel Level)
+{
+	// self-test runs before level is published, other threads keep using previous one meanwhile
+	Level = DerpNet__KernelsSelect(Level);
+	DerpNet__KernelLevelStore(Level);
+	return Level;
+}
+
+DerpNetCpuLevel DerpNet_GetCpuLevel(void)
+{
+	return DerpNet__KernelsLevel();
+}
+
+void DerpNet_CreateNewKey(DerpKey* UserSecret)
+{
+	DerpNet__GetRandom(UserSecret->Bytes, sizeof(UserSecret->Bytes));
+
+	UserSecret->Bytes[ 0] &= 0xf8;
+	UserSecret->Bytes[31] &= 0x7f;
+	UserSecret->Bytes[31] |= 0x40;
+}
+
+void DerpNet_GetPublicKey(const DerpKey* UserSecret, DerpKey* UserPublic)
+{
+	curve25519_scalarmult_base(UserPublic->Bytes, UserSecret->Bytes);
+}
+
+//
+// sockets - blocking during TLS handshake, non-blocking after that
+//
+
+#define DERPNET_INVALID_SOCKET ((uintptr_t)~(uintptr_t)0)
+
+// most TLS records one frame can be split into
+#define DERPNET_MAX_RECORDS 16
+
+// monotonic time, for timeouts & measurements
+static uint64_t DerpNet__Microseconds(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER Counter, Frequency;
+	QueryPerformanceCounter(&Counter);
+	QueryPerformanceFrequency(&Frequency);
+	return (uint64_t)(Counter.QuadPart / Frequency.QuadPart * 1000000 + Counter.QuadPart % Frequency.QuadPart * 1000000 / Frequency.QuadPart);
+#else
+	struct timespec Time;
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+	return (uint64_t)Time.tv_sec * 1000000 + Time.tv_nsec / 1000;
+#endif
+}
+
+#if defined(_WIN32)
+
+typedef SOCKET DerpNet__Socket;
+
+#define DERPNET_SEND_FLAGS 0
+#define DERPNET_SEND_FLAGS_NOWAIT 0 // socket is always non-blocking
+
+static bool DerpNet__SocketStartup(void)
+{
+	WSADATA SocketData;
+	return WSAStartup(MAKEWORD(2, 2), &SocketData) == 0;
+}
+
+static void DerpNet__SocketCleanup(void)
+{
+	WSACleanup();
+}
+
+static bool DerpNet__SocketWouldBlock(void)
+{
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+
+static bool DerpNet__SocketNonBlocking(DerpNet* Net)
+{
+	Net->SocketEvent = WSACreateEvent();
+	DERPNET_ASSERT(Net->SocketEvent);
+
+	// also switches socket to non-blocking mode
+	return WSAEventSelect((DerpNet__Socket)Net->Socket, Net->SocketEvent, FD_READ) == 0;
+}
+
+static bool DerpNet__SocketWait(DerpNet* Net, bool Write)
+{
+	fd_set Set;
+	FD_ZERO(&Set);
+	FD_SET((DerpNet__Socket)Net->Socket, &Set);
+
+	int Select = select(0, Write ? NULL : &Set, Write ? &Set : NULL, NULL, NULL);
+	Net->TotalSyscalls++;
+	if (Select < 0)
+	{
+		DERPNET_LOG("select failed");
+		return false;
+	}
+	return true;
+}
+
+static void DerpNet__SocketClose(DerpNet* Net)
+{
+	if (Net->SocketEvent)
+	{
+		WSACloseEvent(Net->SocketEvent);
+	}
+	if (Net->Socket != DERPNET_INVALID_SOCKET)
+	{
+		closesocket((DerpNet__Socket)Net->Socket);
+	}
+}
+
+#else
+
+typedef int DerpNet__Socket;
+
+#if defined(MSG_NOSIGNAL)
+#	define DERPNET_SEND_FLAGS MSG_NOSIGNAL
+#else
+#	define DERPNET_SEND_FLAGS 0
+#endif
+
+// socket stays blocking when io_uring is used
+#define DERPNET_SEND_FLAGS_NOWAIT (DERPNET_SEND_FLAGS | MSG_DONTWAIT)
+
+static bool DerpNet__SocketStartup(void)
+{
+	return true;
+}
+
+static void DerpNet__SocketCleanup(void)
+{
+}
+
+// interrupted calls are simply retried after waiting
+static bool DerpNet__SocketWouldBlock(void)
+{
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+static bool DerpNet__SocketNonBlocking(DerpNet* Net)
+{
+	DerpNet__Socket Socket = (DerpNet__Socket)Net->Socket;
+
+#if defined(SO_NOSIGPIPE)
+	int NoSigPipe = 1;
+	setsockopt(Socket, SOL_SOCKET, SO_NOSIGPIPE, &NoSigPipe, sizeof(NoSigPipe));
+#endif
+
+	int Flags = fcntl(Socket, F_GETFL);
+	if (Flags < 0 || fcntl(Socket, F_SETFL, Flags | O_NONBLOCK) < 0)
+	{
+		DERPNET_LOG("cannot switch socket to non-blocking mode");
+		return false;
+	}
+
+#if defined(__linux__)
+	if (Net->Hub)
+	{
+		// hub waits for all its sockets with one epoll, rare waits inside calls use poll
+		return true;
+	}
+
+	Net->SocketPoll = epoll_create1(EPOLL_CLOEXEC);
+	if (Net->SocketPoll < 0)
+	{
+		DERPNET_LOG("epoll_create1 failed");
+		return false;
+	}
+
+	struct epoll_event Event = { .events = EPOLLIN };
+	if (epoll_ctl(Net->SocketPoll, EPOLL_CTL_ADD, Socket, &Event) < 0)
+	{
+		DERPNET_LOG("epoll_ctl failed");
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+static bool DerpNet__SocketWait(DerpNet* Net, bool Write)
+{
+#if defined(__linux__)
+	DerpNet__Socket Socket = (DerpNet__Socket)Net->Socket;
+
+	if (Net->SocketPoll < 0)
+	{
+		// still in blocking mode and call was interrupted, or connection in hub without own epoll
+		struct pollfd Poll = { .fd = Socket, .events = Write ? POLLOUT : POLLIN };
+		Net->TotalSyscalls++;
+		if (poll(&Poll, 1, -1) < 0 && errno != EINTR)
+		{
+			DERPNET_LOG("poll failed");
+			return false;
+		}
+		return true;
+	}
+
+	// socket is registered only for reading, writes block rarely - only when kernel send buffer is full
+	struct epoll_event Event = { .events = EPOLLOUT };
+	if (Write && epoll_ctl(Net->SocketPoll, EPOLL_CTL_MOD, Socket, &Event) < 0)
+	{
+		DERPNET_LOG("epoll_ctl failed");
+		return false;
+	}
+
+	int Count = epoll_wait(Net->SocketPoll, &Event, 1, -1);
+	if (Count < 0 && errno != EINTR)
+	{
+		DERPNET_LOG("epoll_wait failed");
+		return false;
+	}
+
+	Event.events = EPOLLIN;
+	if (Write && epoll_ctl(Net->SocketPoll, EPOLL_CTL_MOD, Socket, &Event) < 0)
+	{
+		DERPNET_LOG("epoll_ctl failed");
+		return false;
+	}
+	Net->TotalSyscalls += Write ? 3 : 1;
+#else
+	struct pollfd Poll = { .fd = (DerpNet__Socket)Net->Socket, .events = Write ? POLLOUT : POLLIN };
+	Net->TotalSyscalls++;
+	if (poll(&Poll, 1, -1) < 0 && errno != EINTR)
+	{
+		DERPNET_LOG("poll failed");
+		return false;
+	}
+#endif
+	return true;
+}
+
+#if DERPNET_USE_KERNEL_TLS
+
+//
+// kernel TLS - after handshake record encryption & decryption is done by kernel, so library
+// sends & receives plaintext on socket, same as with plain HTTP
+//
+// receive offload is enabled only after all ciphertext already read into Buffer is decrypted
+// by TLS provider, because kernel must start from the first record it has not seen yet
+//
+
+static bool DerpNet__KernelTlsEnable(DerpNet* Net, bool Send)
+{
+	DerpNetTlsKeys Keys;
+	if (!Net->Tls->ExportKeys(Net, Send, &Keys))
+	{
+		DERPNET_LOG("TLS provider cannot export %s keys", Send ? "send" : "receive");
+		return false;
+	}
+
+	union
+	{
+		struct tls12_crypto_info_aes_gcm_128 Aes128;
+		struct tls12_crypto_info_aes_gcm_256 Aes256;
+#if defined(TLS_CIPHER_CHACHA20_POLY1305)
+		struct tls12_crypto_info_chacha20_poly1305 Chacha;
+#endif
+	} Info;
+	memset(&Info, 0, sizeof(Info));
+
+	uint16_t Version = Keys.Version == 0x0304 ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+	socklen_t InfoSize;
+
+	// for AES-GCM kernel wants first 4 bytes of IV as salt, and for TLS 1.3 remaining 8 bytes as iv
+	switch (Keys.Cipher)
+	{
+	case DERPNET_TLS_AES_128_GCM:
+		Info.Aes128.info.version = Version;
+		Info.Aes128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		memcpy(Info.Aes128.key, Keys.Key, sizeof(Info.Aes128.key));
+		memcpy(Info.Aes128.salt, Keys.Iv, sizeof(Info.Aes128.salt));
+		memcpy(Info.Aes128.iv, Keys.Iv + 4, sizeof(Info.Aes128.iv));
+		Set64BE(Info.Aes128.rec_seq, Keys.Sequence);
+		InfoSize = sizeof(Info.Aes128);
+		break;
+
+	case DERPNET_TLS_AES_256_GCM:
+		Info.Aes256.info.version = Version;
+		Info.Aes256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		memcpy(Info.Aes256.key, Keys.Key, sizeof(Info.Aes256.key));
+		memcpy(Info.Aes256.salt, Keys.Iv, sizeof(Info.Aes256.salt));
+		memcpy(Info.Aes256.iv, Keys.Iv + 4, sizeof(Info.Aes256.iv));
+		Set64BE(Info.Aes256.rec_seq, Keys.Sequence);
+		InfoSize = sizeof(Info.Aes256);
+		break;
+
+#if defined(TLS_CIPHER_CHACHA20_POLY1305)
+	case DERPNET_TLS_CHACHA20_POLY1305:
+		Info.Chacha.info.version = Version;
+		Info.Chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+		memcpy(Info.Chacha.key, Keys.Key, sizeof(Info.Chacha.key));
+		memcpy(Info.Chacha.iv, Keys.Iv, sizeof(Info.Chacha.iv));
+		Set64BE(Info.Chacha.rec_seq, Keys.Sequence);
+		InfoSize = sizeof(Info.Chacha);
+		break;
+#endif
+
+	default:
+		DERPNET_LOG("kernel headers do not support this TLS cipher");
+		memset(&Keys, 0, sizeof(Keys));
+		return false;
+	}
+
+	int Result = setsockopt((DerpNet__Socket)Net->Socket, SOL_TLS, Send ? TLS_TX : TLS_RX, &Info, InfoSize);
+
+	memset(&Keys, 0, sizeof(Keys));
+	memset(&Info, 0, sizeof(Info));
+
+	if (Result < 0)
+	{
+		DERPNET_LOG("kernel does not support TLS %s offload for this cipher", Send ? "send" : "receive");
+		return false;
+	}
+
+	DERPNET_LOG("TLS %s offloaded to kernel", Send ? "send" : "receive");
+	return true;
+}
+
+// called after handshake, connection keeps using TLS provider for anything kernel cannot do
+static void DerpNet__KernelTlsInit(DerpNet* Net)
+{
+	if (setsockopt((DerpNet__Socket)Net->Socket, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) < 0)
+	{
+		DERPNET_LOG("kernel TLS is not available, TLS stays in user space");
+		return;
+	}
+
+	Net->KernelTlsSend = DerpNet__KernelTlsEnable(Net, true);
+	Net->KernelTlsRecvLater = true;
+}
+
+static bool DerpNet__SendQueuePump(DerpNet* Net, bool Wait);
+
+// sends handshake message in its own record, kernel encrypts it with current send key
+static bool DerpNet__KernelTlsSendHandshake(DerpNet* Net, const uint8_t* Message, size_t Size)
+{
+	// plaintext queued earlier goes out as application data before it
+	if (Net->SendQueued != 0 && !DerpNet__SendQueuePump(Net, true))
+	{
+		return false;
+	}
+
+	union
+	{
+		struct cmsghdr Header;
+		uint8_t Data[CMSG_SPACE(sizeof(uint8_t))];
+	} Control;
+	memset(&Control, 0, sizeof(Control));
+
+	struct iovec Vec = { (void*)Message, Size };
+	struct msghdr Msg =
+	{
+		.msg_iov = &Vec,
+		.msg_iovlen = 1,
+		.msg_control = &Control,
+		.msg_controllen = sizeof(Control),
+	};
+
+	struct cmsghdr* Cmsg = CMSG_FIRSTHDR(&Msg);
+	Cmsg->cmsg_level = SOL_TLS;
+	Cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+	Cmsg->cmsg_len = CMSG_LEN(sizeof(uint8_t));
+	*CMSG_DATA(Cmsg) = 22; // handshake
+
+	for (;;)
+	{
+		int WriteSize = (int)sendmsg((DerpNet__Socket)Net->Socket, &Msg, DERPNET_SEND_FLAGS);
+		Net->TotalSyscalls++;
+		if (WriteSize < 0 && DerpNet__SocketWouldBlock())
+		{
+			if (!DerpNet__SocketWait(Net, true))
+			{
+				return false;
+			}
+			continue;
+		}
+		if (WriteSize != (int)Size)
+		{
+			DERPNET_LOG("failed to send TLS handshake record with kernel TLS");
+			return false;
+		}
+		Net->TotalRecords++;
+		Net->TotalSent += WriteSize;
+		return true;
+	}
+}
+
+// with kernel TLS, records other than application data (handshake messages like session tickets,
+// or alerts) are returned only when there is space for control message with record type
+static int DerpNet__KernelTlsRecv(DerpNet* Net, uint8_t* Data, size_t DataSize)
+{
+	for (;;)
+	{
+		union
+		{
+			struct cmsghdr Header;
+			uint8_t Data[CMSG_SPACE(sizeof(uint8_t))];
+		} Control;
+
+		struct iovec Vec = { Data, DataSize };
+		struct msghdr Msg =
+		{
+			.msg_iov = &Vec,
+			.msg_iovlen = 1,
+			.msg_control = &Control,
+			.msg_controllen = sizeof(Control),
+		};
+
+		int ReadSize = (int)recvmsg((DerpNet__Socket)Net->Socket, &Msg, MSG_DONTWAIT);
+		Net->TotalSyscalls++;
+		if (ReadSize <= 0)
+		{
+			return ReadSize;
+		}
+
+		struct cmsghdr* Cmsg = CMSG_FIRSTHDR(&Msg);
+		if (Cmsg && Cmsg->cmsg_level == SOL_TLS && Cmsg->cmsg_type == TLS_GET_RECORD_TYPE)
+		{
+			uint8_t RecordType = *CMSG_DATA(Cmsg);
+			if (RecordType == 21) // alert
+			{
+				DERPNET_LOG("received TLS alert from server");
+				return 0;
+			}
+			if (RecordType != 23) // not application data
+			{
+				DERPNET_LOG("ignoring TLS record of type %u", RecordType);
+				continue;
+			}
+		}
+
+		return ReadSize;
+	}
+}
+
+#endif // DERPNET_USE_KERNEL_TLS
+
+#if DERPNET_USE_IO_URING
+
+//
+// io_uring - receives read straight into Net->Buffer registered as fixed buffer, and all TLS
+// records of outgoing data are sent with one sendmsg, so one io_uring_enter call both submits
+// work & waits for it, instead of separate wait and send/recv calls
+//
+// socket stays in blocking mode, io_uring waits for it to be ready internally
+//
+
+enum
+{
+	DERPNET_RING_RECV = 1,
+	DERPNET_RING_SEND = 2,
+	DERPNET_RING_CANCEL = 3,
+};
+
+static void DerpNet__RingReap(DerpNet* Net)
+{
+	DerpNetRing* Ring = &Net->Ring;
+
+	uint32_t Head = *Ring->CqHead;
+	uint32_t Tail = __atomic_load_n(Ring->CqTail, __ATOMIC_ACQUIRE);
+
+	while (Head != Tail)
+	{
+		struct io_uring_cqe* Cqe = (struct io_uring_cqe*)Ring->Cqes + (Head & *Ring->CqMask);
+		if (Cqe->user_data == DERPNET_RING_RECV)
+		{
+			Ring->RecvResult = Cqe->res;
+			Ring->RecvPending = false;
+			Ring->RecvDone = true;
+		}
+		else if (Cqe->user_data == DERPNET_RING_SEND)
+		{
+			Ring->SendResult = Cqe->res;
+			Ring->SendPending = false;
+		}
+		Head++;
+	}
+
+	__atomic_store_n(Ring->CqHead, Head, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe* DerpNet__RingSqe(DerpNet* Net, uint8_t Opcode, uint64_t UserData)
+{
+	DerpNetRing* Ring = &Net->Ring;
+	DERPNET_ASSERT(Ring->SubmitCount <= *Ring->SqMask);
+
+	uint32_t Tail = *Ring->SqTail;
+	uint32_t Index = Tail & *Ring->SqMask;
+
+	struct io_uring_sqe* Sqe = (struct io_uring_sqe*)Ring->Sqes + Index;
+	memset(Sqe, 0, sizeof(*Sqe));
+	Sqe->opcode = Opcode;
+	Sqe->fd = (int)Net->Socket;
+	Sqe->user_data = UserData;
+
+	Ring->SqArray[Index] = Index;
+	__atomic_store_n(Ring->SqTail, Tail + 1, __ATOMIC_RELEASE);
+	Ring->SubmitCount++;
+
+	return Sqe;
+}
+
+// submits prepared entries, and if Wait is set, waits for at least one completion
+static bool DerpNet__RingEnter(DerpNet* Net, bool Wait)
+{
+	DerpNetRing* Ring = &Net->Ring;
+
+	int Submitted = (int)syscall(__NR_io_uring_enter, Ring->Fd, Ring->SubmitCount, Wait ? 1 : 0, Wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	Net->TotalSyscalls++;
+
+	if (Submitted < 0)
+	{
+		if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+		{
+			return true;
+		}
+		DERPNET_LOG("io_uring_enter failed");
+		return false;
+	}
+	Ring->SubmitCount -= Submitted;
+	return true;
+}
+
+// submits prepared entries, and waits until *Pending is cleared by completion
+static bool DerpNet__RingWait(DerpNet* Net, const bool* Pending)
+{
+	for (;;)
+	{
+		DerpNet__RingReap(Net);
+		if (!*Pending && Net->Ring.SubmitCount == 0)
+		{
+			return true;
+		}
+		if (!DerpNet__RingEnter(Net, *Pending))
+		{
+			return false;
+		}
+	}
+}
+
+static void DerpNet__RingClose(DerpNet* Net)
+{
+	DerpNetRing* Ring = &Net->Ring;
+
+	// kernel must not write into Buffer after connection is closed
+	if (Ring->RecvPending)
+	{
+		struct io_uring_sqe* Sqe = DerpNet__RingSqe(Net, IORING_OP_ASYNC_CANCEL, DERPNET_RING_CANCEL);
+		Sqe->fd = -1;
+		Sqe->addr = DERPNET_RING_RECV;
+		DerpNet__RingWait(Net, &Ring->RecvPending);
+	}
+
+	if (Ring->Sqes)
+	{
+		munmap(Ring->Sqes, Ring->SqesSize);
+	}
+	if (Ring->CqRing)
+	{
+		munmap(Ring->CqRing, Ring->CqRingSize);
+	}
+	if (Ring->SqRing)
+	{
+		munmap(Ring->SqRing, Ring->SqRingSize);
+	}
+	if (Ring->Fd >= 0)
+	{
+		close(Ring->Fd);
+	}
+
+	memset(Ring, 0, sizeof(*Ring));
+	Ring->Fd = -1;
+}
+
+static bool DerpNet__RingInit(DerpNet* Net)
+{
+	DerpNetRing* Ring = &Net->Ring;
+
+	struct io_uring_params Params = { 0 };
+	Ring->Fd = (int)syscall(__NR_io_uring_setup, 4, &Params);
+	if (Ring->Fd < 0)
+	{
+		DERPNET_LOG("io_uring is not available, using epoll");
+		return false;
+	}
+
+	Ring->SqRingSize = Params.sq_off.array + Params.sq_entries * sizeof(uint32_t);
+	Ring->CqRingSize = Params.cq_off.cqes + Params.cq_entries * sizeof(struct io_uring_cqe);
+	Ring->SqesSize = Params.sq_entries * sizeof(struct io_uring_sqe);
+
+	void* SqRing = mmap(NULL, Ring->SqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Ring->Fd, IORING_OFF_SQ_RING);
+	void* CqRing = mmap(NULL, Ring->CqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Ring->Fd, IORING_OFF_CQ_RING);
+	void* Sqes = mmap(NULL, Ring->SqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Ring->Fd, IORING_OFF_SQES);
+
+	Ring->SqRing = SqRing == MAP_FAILED ? NULL : SqRing;
+	Ring->CqRing = CqRing == MAP_FAILED ? NULL : CqRing;
+	Ring->Sqes = Sqes == MAP_FAILED ? NULL : Sqes;
+
+	if (!Ring->SqRing || !Ring->CqRing || !Ring->Sqes)
+	{
+		DERPNET_LOG("cannot map io_uring memory, using epoll");
+		DerpNet__RingClose(Net);
+		return false;
+	}
+
+	Ring->SqHead = (uint32_t*)((uint8_t*)SqRing + Params.sq_off.head);
+	Ring->SqTail = (uint32_t*)((uint8_t*)SqRing + Params.sq_off.tail);
+	Ring->SqMask = (uint32_t*)((uint8_t*)SqRing + Params.sq_off.ring_mask);
+	Ring->SqArray = (uint32_t*)((uint8_t*)SqRing + Params.sq_off.array);
+	Ring->CqHead = (uint32_t*)((uint8_t*)CqRing + Params.cq_off.head);
+	Ring->CqTail = (uint32_t*)((uint8_t*)CqRing + Params.cq_off.tail);
+	Ring->CqMask = (uint32_t*)((uint8_t*)CqRing + Params.cq_off.ring_mask);
+	Ring->Cqes = (uint8_t*)CqRing + Params.cq_off.cqes;
+
+	// buffer is registered once, so it gets its limit size now
+	size_t Size = DerpNet__Max(Net->BufferLimit, Net->BufferReceived);
+	if (Net->BufferSize != Size && !DerpNet__BufferResize(Net, &Net->Buffer, &Net->BufferSize, Size, Net->BufferReceived))
+	{
+		DerpNet__RingClose(Net);
+		return false;
+	}
+
+	struct iovec Registered = { Net->Buffer, Net->BufferSize };
+	if (syscall(__NR_io_uring_register, Ring->Fd, IORING_REGISTER_BUFFERS, &Registered, 1) < 0)
+	{
+		DERPNET_LOG("cannot register receive buffer for io_uring, using epoll");
+		DerpNet__RingClose(Net);
+		return false;
+	}
+
+	return true;
+}
+
+// same as DerpNet__BufferRecv, for io_uring
+static int DerpNet__RingRecv(DerpNet* Net, bool Wait)
+{
+	DerpNetRing* Ring = &Net->Ring;
+
+	for (;;)
+	{
+		if (!Ring->RecvPending && !Ring->RecvDone)
+		{
+			struct io_uring_sqe* Sqe = DerpNet__RingSqe(Net, IORING_OP_READ_FIXED, DERPNET_RING_RECV);
+			Sqe->addr = (uintptr_t)(Net->Buffer + Net->BufferReceived);
+			Sqe->len = (uint32_t)(Net->BufferSize - Net->BufferReceived);
+			Sqe->buf_index = 0;
+			Ring->RecvPending = true;
+		}
+
+		if (Wait)
+		{
+			if (!DerpNet__RingWait(Net, &Ring->RecvPending))
+			{
+				return -1;
+			}
+		}
+		else
+		{
+			// while receive is pending, checking for its completion needs no syscall
+			if (Ring->SubmitCount != 0 && !DerpNet__RingEnter(Net, false))
+			{
+				return -1;
+			}
+			DerpNet__RingReap(Net);
+
+			if (!Ring->RecvDone)
+			{
+				return 0;
+			}
+		}
+
+		Ring->RecvDone = false;
+
+#if DERPNET_USE_KERNEL_TLS
+		// plain read fails when next record is not application data, it needs to be received with its type
+		if (Ring->RecvResult == -EIO && Net->KernelTlsRecv)
+		{
+			Ring->RecvResult = DerpNet__KernelTlsRecv(Net, Net->Buffer + Net->BufferReceived, Net->BufferSize - Net->BufferReceived);
+			if (Ring->RecvResult < 0 && DerpNet__SocketWouldBlock())
+			{
+				continue;
+			}
+		}
+#endif
+		break;
+	}
+
+	if (Ring->RecvResult <= 0)
+	{
+		DERPNET_LOG("failed to read data from server, remote server disconnected?");
+		return -1;
+	}
+	Net->TotalReceived += Ring->RecvResult;
+	Net->BufferReceived += Ring->RecvResult;
+
+	DERPNET_LOG("read %d bytes from io_uring, BufferReceived=%zu", Ring->RecvResult, Net->BufferReceived);
+
+	return 1;
+}
+
+static bool DerpNet__RingSend(DerpNet* Net, const DerpNetIoVec* Records, size_t RecordCount)
+{
+	DerpNetRing* Ring = &Net->Ring;
+
+	struct iovec Vec[DERPNET_MAX_RECORDS];
+	size_t SizeToSend = 0;
+	for (size_t i = 0; i < RecordCount; i++)
+	{
+		Vec[i].iov_base = (void*)Records[i].Data;
+		Vec[i].iov_len = Records[i].Size;
+		SizeToSend += Records[i].Size;
+	}
+
+	struct msghdr Msg = { .msg_iov = Vec, .msg_iovlen = RecordCount };
+
+	while (SizeToSend != 0)
+	{
+		struct io_uring_sqe* Sqe = DerpNet__RingSqe(Net, IORING_OP_SENDMSG, DERPNET_RING_SEND);
+		Sqe->addr = (uintptr_t)&Msg;
+		Sqe->len = 1;
+		Sqe->msg_flags = MSG_NOSIGNAL;
+		Ring->SendPending = true;
+
+		if (!DerpNet__RingWait(Net, &Ring->SendPending))
+		{
+			return false;
+		}
+
+		if (Ring->SendResult <= 0)
+		{
+			DERPNET_LOG("failed to send data to server, remote server disconnected?");
+			return false;
+		}
+
+		size_t WriteSize = Ring->SendResult;
+		Net->TotalSent += WriteSize;
+		SizeToSend -= WriteSize;
+
+		// after short send, continue from first unsent byte
+		while (WriteSize != 0)
+		{
+			size_t Size = DerpNet__Min(WriteSize, Msg.msg_iov->iov_len);
+			Msg.msg_iov->iov_base = (uint8_t*)Msg.msg_iov->iov_base + Size;
+			Msg.msg_iov->iov_len -= Size;
+			WriteSize -= Size;
+
+			if (Msg.msg_iov->iov_len == 0)
+			{
+				Msg.msg_iov++;
+				Msg.msg_iovlen--;
+			}
+		}
+	}
+
+	return true;
+}
+
+#endif // DERPNET_USE_IO_URING
+
+static void DerpNet__SocketClose(DerpNet* Net)
+{
+#if DERPNET_USE_IO_URING
+	DerpNet__RingClose(Net);
+#endif
+	if (Net->SocketPoll >= 0)
+	{
+		close(Net->SocketPoll);
+	}
+	if (Net->Socket != DERPNET_INVALID_SOCKET)
+	{
+		close((DerpNet__Socket)Net->Socket);
+	}
+}
+
+#endif
+
+static bool DerpNet__SocketSend(DerpNet* Net, const uint8_t* Data, size_t DataSize)
+{
+	while (DataSize != 0)
+	{
+		int WriteSize = (int)send((DerpNet__Socket)Net->Socket, (const char*)Data, (int)DataSize, DERPNET_SEND_FLAGS);
+		Net->TotalSyscalls++;
+		if (WriteSize < 0 && DerpNet__SocketWouldBlock())
+		{
+			if (!DerpNet__SocketWait(Net, true))
+			{
+				return false;
+			}
+			continue;
+		}
+		if (WriteSize <= 0)
+		{
+			DERPNET_LOG("failed to send data to server, remote server disconnected?");
+			return false;
+		}
+		Net->TotalSent += WriteSize;
+
+		Data += WriteSize;
+		DataSize -= WriteSize;
+	}
+	return true;
+}
+
+// returns amount of bytes received, 0 if nothing is available and Wait=false, -1 on error
+static int DerpNet__SocketRecv(DerpNet* Net, uint8_t* Data, size_t DataSize, bool Wait)
+{
+	for (;;)
+	{
+#if defined(_WIN32)
+		// reset before reading, so data arriving after recv signals event again
+		if (Net->SocketEvent)
+		{
+			WSAResetEvent(Net->SocketEvent);
+		}
+#endif
+
+		int ReadSize;
+#if DERPNET_USE_KERNEL_TLS
+		if (Net->KernelTlsRecv)
+		{
+			ReadSize = DerpNet__KernelTlsRecv(Net, Data, DataSize);
+		}
+		else
+#endif
+		{
+			ReadSize = (int)recv((DerpNet__Socket)Net->Socket, (char*)Data, (int)DataSize, 0);
+			Net->TotalSyscalls++;
+		}
+		if (ReadSize < 0 && DerpNet__SocketWouldBlock())
+		{
+			if (!Wait)
+			{
+				return 0;
+			}
+			if (!DerpNet__SocketWait(Net, false))
+			{
+				return -1;
+			}
+			continue;
+		}
+		if (ReadSize <= 0)
+		{
+			DERPNET_LOG("failed to read data from server, remote server disconnected?");
+			return -1;
+		}
+		Net->TotalReceived += ReadSize;
+
+		return ReadSize;
+	}
+}
+
+#if defined(_WIN32)
+
+//
+// SChannel TLS, CredHandle is stored in TlsState[0..1] and CtxtHandle in TlsState[2..3]
+//
+
+static bool DerpNet__SchannelHandshake(DerpNet* Net, const char* Hostname)
+{
+	CredHandle CredentialHandle;
+	CtxtHandle ContextHandle;
+
+	SecInvalidateHandle(&CredentialHandle);
+	SecInvalidateHandle(&ContextHandle);
+
+	DERPNET_ASSERT(sizeof(CredentialHandle) + sizeof(ContextHandle) == sizeof(Net->TlsState));
+	memcpy(&Net->TlsState[0], &CredentialHandle, sizeof(CredentialHandle));
+	memcpy(&Net->TlsState[2], &ContextHandle, sizeof(ContextHandle));
+
+	SCHANNEL_CRED Cred = { 0 };
+	Cred.dwVersion = SCHANNEL_CRED_VERSION;
+	Cred.dwFlags = SCH_USE_STRONG_CRYPTO | SCH_CRED_AUTO_CRED_VALIDATION | SCH_CRED_NO_DEFAULT_CREDS;
+	Cred.grbitEnabledProtocols = SP_PROT_TLS1_2;
+
+	SECURITY_STATUS SecStatus = AcquireCredentialsHandleA(NULL, UNISP_NAME_A, SECPKG_CRED_OUTBOUND, NULL, &Cred, NULL, NULL, &CredentialHandle, NULL);
+	DERPNET_ASSERT(SecStatus == SEC_E_OK);
+	memcpy(&Net->TlsState[0], &CredentialHandle, sizeof(CredentialHandle));
+
+	CtxtHandle* Context = NULL;
+
+	for (;;)
+	{
+		SecBuffer InBuffers[2] = { 0 };
+		InBuffers[0].BufferType = SECBUFFER_TOKEN;
+		InBuffers[0].pvBuffer = Net->Buffer;
+		InBuffers[0].cbBuffer = (unsigned)Net->BufferReceived;
+		InBuffers[1].BufferType = SECBUFFER_EMPTY;
+
+		SecBuffer OutBuffers[1] = { 0 };
+		OutBuffers[0].BufferType = SECBUFFER_TOKEN;
+
+		SecBufferDesc InDesc = { SECBUFFER_VERSION, ARRAYSIZE(InBuffers), InBuffers };
+		SecBufferDesc OutDesc = { SECBUFFER_VERSION, ARRAYSIZE(OutBuffers), OutBuffers };
+
+		DWORD Flags = ISC_REQ_USE_SUPPLIED_CREDS | ISC_REQ_ALLOCATE_MEMORY | ISC_REQ_CONFIDENTIALITY | ISC_REQ_REPLAY_DETECT | ISC_REQ_SEQUENCE_DETECT | ISC_REQ_STREAM;
+		SecStatus = InitializeSecurityContextA(
+			&CredentialHandle,
+			Context,
+			Context ? NULL : (SEC_CHAR*)Hostname,
+			Flags,
+			0,
+			0,
+			Context ? &InDesc : NULL,
+			0,
+			Context ? NULL : &ContextHandle,
+			&OutDesc,
+			&Flags,
+			NULL);
+		Context = &ContextHandle;
+		memcpy(&Net->TlsState[2], &ContextHandle, sizeof(ContextHandle));
+
+		if (InBuffers[1].BufferType == SECBUFFER_EXTRA)
+		{
+			memmove(Net->Buffer, Net->Buffer + (Net->BufferReceived - InBuffers[1].cbBuffer), InBuffers[1].cbBuffer);
+			Net->BufferReceived = InBuffers[1].cbBuffer;
+		}
+		else
+		{
+			Net->BufferReceived = 0;
+		}
+
+		if (SecStatus == SEC_E_OK)
+		{
+			return true;
+		}
+		else if (SecStatus == SEC_I_INCOMPLETE_CREDENTIALS)
+		{
+			DERPNET_LOG("server asks for client certificate, not expected here");
+			return false;
+		}
+		else if (SecStatus == SEC_I_CONTINUE_NEEDED)
+		{
+			bool SendOk = DerpNet__SocketSend(Net, OutBuffers[0].pvBuffer, OutBuffers[0].cbBuffer);
+			FreeContextBuffer(OutBuffers[0].pvBuffer);
+
+			if (!SendOk)
+			{
+				return false;
+			}
+		}
+		else if (SecStatus != SEC_E_INCOMPLETE_MESSAGE)
+		{
+			DERPNET_LOG("cannot verify server certificate, bad hostname, expired cert, or bad crypto handshake");
+			return false;
+		}
+
+		if (Net->BufferReceived == Net->BufferSize)
+		{
+			DERPNET_LOG("server is sending too much data instead of proper handshake?");
+			return false;
+		}
+
+		int ReadSize = DerpNet__SocketRecv(Net, Net->Buffer + Net->BufferReceived, Net->BufferSize - Net->BufferReceived, true);
+		if (ReadSize < 0)
+		{
+			return false;
+		}
+		Net->BufferReceived += ReadSize;
+	}
+}
+
+static void DerpNet__SchannelGetSizes(DerpNet* Net, size_t* HeaderSize, size_t* MessageSize, size_t* TrailerSize)
+{
+	CtxtHandle ContextHandle;
+	memcpy(&ContextHandle, &Net->TlsState[2], sizeof(ContextHandle));
+
+	SecPkgContext_StreamSizes StreamSizes;
+	SECURITY_STATUS SecStatus = QueryContextAttributes(&ContextHandle, SECPKG_ATTR_STREAM_SIZES, &StreamSizes);
+	DERPNET_ASSERT(SecStatus == SEC_E_OK);
+
+	*HeaderSize = StreamSizes.cbHeader;
+	*MessageSize = StreamSizes.cbMaximumMessage;
+	*TrailerSize = StreamSizes.cbTrailer;
+}
+
+static size_t DerpNet__SchannelEncrypt(DerpNet* Net, uint8_t* Record, size_t HeaderSize, size_t DataSize, size_t TrailerSize)
+{
+	CtxtHandle ContextHandle;
+	memcpy(&ContextHandle, &Net->TlsState[2], sizeof(ContextHandle));
+
+	SecBuffer OutBuffers[3] = { 0 };
+	OutBuffers[0].BufferType = SECBUFFER_STREAM_HEADER;
+	OutBuffers[0].pvBuffer = Record;
+	OutBuffers[0].cbBuffer = (unsigned)HeaderSize;
+	OutBuffers[1].BufferType = SECBUFFER_DATA;
+	OutBuffers[1].pvBuffer = Record + HeaderSize;
+	OutBuffers[1].cbBuffer = (unsigned)DataSize;
+	OutBuffers[2].BufferType = SECBUFFER_STREAM_TRAILER;
+	OutBuffers[2].pvBuffer = Record + HeaderSize + DataSize;
+	OutBuffers[2].cbBuffer = (unsigned)TrailerSize;
+
+	SecBufferDesc OutDesc = { SECBUFFER_VERSION, ARRAYSIZE(OutBuffers), OutBuffers };
+	SECURITY_STATUS SecStatus = EncryptMessage(&ContextHandle, 0, &OutDesc, 0);
+	if (SecStatus != SEC_E_OK)
+	{
+		return 0;
+	}
+
+	// actual trailer can be shorter than maximum
+	return OutBuffers[0].cbBuffer + OutBuffers[1].cbBuffer + OutBuffers[2].cbBuffer;
+}
+
+static int DerpNet__SchannelDecrypt(DerpNet* Net, uint8_t* Data, size_t Size, size_t* DataOffset, size_t* DataSize, size_t* RecordSize)
+{
+	CtxtHandle ContextHandle;
+	memcpy(&ContextHandle, &Net->TlsState[2], sizeof(ContextHandle));
+
+	SecBuffer InBuffers[4] = { 0 };
+	InBuffers[0].BufferType = SECBUFFER_DATA;
+	InBuffers[0].pvBuffer = Data;
+	InBuffers[0].cbBuffer = (unsigned)Size;
+	InBuffers[1].BufferType = SECBUFFER_EMPTY;
+	InBuffers[2].BufferType = SECBUFFER_EMPTY;
+	InBuffers[3].BufferType = SECBUFFER_EMPTY;
+
+	SecBufferDesc InDesc = { SECBUFFER_VERSION, ARRAYSIZE(InBuffers), InBuffers };
+
+	SECURITY_STATUS SecStatus = DecryptMessage(&ContextHandle, &InDesc, 0, NULL);
+	if (SecStatus == SEC_E_INCOMPLETE_MESSAGE)
+	{
+		return 0;
+	}
+	else if (SecStatus != SEC_E_OK)
+	{
+		return -1;
+	}
+
+	//
+	// After decryption, Data = [hhhhhhhdddddddddtttttttteeeeeeeeeeee.......]
+	//                           ^      ^        ^       ^
+	//                           |      |        |       |
+	// Header from TLS packet ---+      |        |       |
+	// Decrypted data from TLS packet --+        |       |
+	// Trailer from TLS packet ------------------+       |
+	// Any extra remaining ciphertext for next packets --+
+	//
+
+	DERPNET_ASSERT(InBuffers[0].BufferType == SECBUFFER_STREAM_HEADER);
+	DERPNET_ASSERT(InBuffers[1].BufferType == SECBUFFER_DATA);
+	DERPNET_ASSERT(InBuffers[2].BufferType == SECBUFFER_STREAM_TRAILER);
+	DERPNET_ASSERT(InBuffers[3].BufferType == SECBUFFER_EXTRA || InBuffers[3].BufferType == SECBUFFER_EMPTY);
+
+	DERPNET_ASSERT(InBuffers[0].pvBuffer == Data);
+	DERPNET_ASSERT(InBuffers[1].pvBuffer == Data + InBuffers[0].cbBuffer);
+	DERPNET_ASSERT(InBuffers[2].pvBuffer == Data + InBuffers[0].cbBuffer + InBuffers[1].cbBuffer);
+
+	*DataOffset = (uint8_t*)InBuffers[1].pvBuffer - Data;
+	*DataSize = InBuffers[1].cbBuffer;
+	*RecordSize = InBuffers[3].BufferType == SECBUFFER_EXTRA ? Size - InBuffers[3].cbBuffer : Size;
+
+	return 1;
+}
+
+static void DerpNet__SchannelClose(DerpNet* Net)
+{
+	CredHandle CredentialHandle;
+	CtxtHandle ContextHandle;
+	memcpy(&CredentialHandle, &Net->TlsState[0], sizeof(CredentialHandle));
+	memcpy(&ContextHandle, &Net->TlsState[2], sizeof(ContextHandle));
+
+	if (SecIsValidHandle(&ContextHandle))
+	{
+		DeleteSecurityContext(&ContextHandle);
+	}
+	if (SecIsValidHandle(&CredentialHandle))
+	{
+		FreeCredentialsHandle(&CredentialHandle);
+	}
+}
+
+static const DerpNetTls DerpNet__SchannelTls =
+{
+	.Handshake = &DerpNet__SchannelHandshake,
+	.GetSizes = &DerpNet__SchannelGetSizes,
+	.Encrypt = &DerpNet__SchannelEncrypt,
+	.Decrypt = &DerpNet__SchannelDecrypt,
+	.Close = &DerpNet__SchannelClose,
+};
+
+#define DERPNET_DEFAULT_TLS (&DerpNet__SchannelTls)
+
+#else
+
+#define DERPNET_DEFAULT_TLS NULL
+
+#endif // defined(_WIN32)
+
+//
+// built-in TLS 1.3 client, see RFC 8446 - only X25519 key exchange and TLS_CHACHA20_POLY1305_SHA256
+// cipher suite, so there is always exactly one round trip, and no HelloRetryRequest
+//
+// server certificate is not parsed here - chain & CertificateVerify signature are given to
+// DerpNetConfig.Verify callback, and handshake fails when it is not set
+//
+
+#define DERPNET_TLS13_MAX_RECORD (5 + 16384 + 256)
+#define DERPNET_TLS13_MAX_CERTIFICATES 8
+
+static inline uint16_t DerpNet__Get16BE(const uint8_t* Buffer)
+{
+	return (uint16_t)((Buffer[0] << 8) + Buffer[1]);
+}
+
+static inline uint32_t DerpNet__Get24BE(const uint8_t* Buffer)
+{
+	return (Buffer[0] << 16) + (Buffer[1] << 8) + Buffer[2];
+}
+
+static inline uint8_t* DerpNet__Put16BE(uint8_t* Buffer, size_t Value)
+{
+	Buffer[0] = (uint8_t)(Value >> 8);
+	Buffer[1] = (uint8_t)(Value);
+	return Buffer + 2;
+}
+
+static inline uint8_t* DerpNet__Put24BE(uint8_t* Buffer, size_t Value)
+{
+	Buffer[0] = (uint8_t)(Value >> 16);
+	Buffer[1] = (uint8_t)(Value >> 8);
+	Buffer[2] = (uint8_t)(Value);
+	return Buffer + 3;
+}
+
+static void DerpNet__Tls13SetKeys(DerpNetTls13Keys* Keys, const uint8_t Secret[32])
+{
+	memcpy(Keys->Secret, Secret, sizeof(Keys->Secret));
+	hkdf_sha256_expand_label(Keys->Key, sizeof(Keys->Key), Secret, "key", NULL, 0);
+	hkdf_sha256_expand_label(Keys->Iv, sizeof(Keys->Iv), Secret, "iv", NULL, 0);
+	Keys->Sequence = 0;
+}
+
+static void DerpNet__Tls13Nonce(uint8_t Nonce[12], DerpNetTls13Keys* Keys)
+{
+	memcpy(Nonce, Keys->Iv, 12);
+	for (int i = 0; i < 8; i++)
+	{
+		Nonce[4 + i] ^= (uint8_t)(Keys->Sequence >> (56 - 8 * i));
+	}
+	Keys->Sequence++;
+}
+
+// encrypts DataSize bytes placed after 5 byte header of Record, needs 17 bytes of space after data
+static size_t DerpNet__Tls13SealRecord(DerpNetTls13Keys* Keys, uint8_t* Record, size_t DataSize, uint8_t ContentType)
+{
+	uint8_t* Data = Record + 5;
+	Data[DataSize++] = ContentType;
+
+	Record[0] = 23; // application_data
+	Record[1] = 0x03;
+	Record[2] = 0x03;
+	DerpNet__Put16BE(Record + 3, DataSize + 16);
+
+	uint8_t Nonce[12];
+	DerpNet__Tls13Nonce(Nonce, Keys);
+	chacha20poly1305_seal(Data + DataSize, Data, DataSize, Record, 5, Keys->Key, Nonce);
+
+	return 5 + DataSize + 16;
+}
+
+// decrypts full record in place, returns its content type and size of data after 5 byte header
+// returns -1 if record is not authentic
+static int DerpNet__Tls13OpenRecord(DerpNetTls13Keys* Keys, uint8_t* Record, size_t RecordSize, size_t* DataSize)
+{
+	if (Record[0] != 23 || RecordSize < 5 + 1 + 16)
+	{
+		return -1;
+	}
+
+	uint8_t* Data = Record + 5;
+	size_t Size = RecordSize - 5 - 16;
+
+	uint8_t Nonce[12];
+	DerpNet__Tls13Nonce(Nonce, Keys);
+	if (!chacha20poly1305_open(Data, Size, Data + Size, Record, 5, Keys->Key, Nonce))
+	{
+		return -1;
+	}
+
+	// real content type is last non-zero byte, zeros after it are padding
+	while (Size != 0 && Data[Size - 1] == 0)
+	{
+		Size--;
+	}
+	if (Size == 0)
+	{
+		return -1;
+	}
+
+	*DataSize = Size - 1;
+	return Data[Size - 1];
+}
+
+typedef struct {
+	DerpNet* Net;
+	size_t RecordOffset;   // where next record starts in Net->Buffer
+	uint8_t* Messages;     // handshake messages from server are collected in Net->SendBuffer
+	size_t MessagesSize;
+	size_t MessagesUsed;
+	sha256_state Transcript;
+} DerpNet__Tls13Context;
+
+// finds next full record from server, in place in Net->Buffer
+// returns 1 when there is one, 0 if Wait=false and more data is needed, or -1 on error
+static int DerpNet__Tls13ReadRecord(DerpNet__Tls13Context* Ctx, uint8_t** Record, size_t* RecordSize, bool Wait)
+{
+	DerpNet* Net = Ctx->Net;
+
+	for (;;)
+	{
+		size_t Available = Net->BufferReceived - Ctx->RecordOffset;
+		if (Available >= 5)
+		{
+			uint8_t* Next = Net->Buffer + Ctx->RecordOffset;
+			size_t Size = 5 + DerpNet__Get16BE(Next + 3);
+			if (Size > DERPNET_TLS13_MAX_RECORD)
+			{
+				DERPNET_LOG("TLS record from server is too large");
+				return -1;
+			}
+			if (Available >= Size)
+			{
+				Ctx->RecordOffset += Size;
+				*Record = Next;
+				*RecordSize = Size;
+				return 1;
+			}
+		}
+
+		if (Net->BufferReceived == Net->BufferSize)
+		{
+			memmove(Net->Buffer, Net->Buffer + Ctx->RecordOffset, Available);
+			Net->BufferReceived = Available;
+			Ctx->RecordOffset = 0;
+		}
+
+		int ReadSize = DerpNet__SocketRecv(Net, Net->Buffer + Net->BufferReceived, Net->BufferSize - Net->BufferReceived, Wait);
+		if (ReadSize <= 0)
+		{
+			return ReadSize;
+		}
+		Net->BufferReceived += ReadSize;
+	}
+}
+
+// appends decrypted handshake data, messages can be split across records
+static bool DerpNet__Tls13AddMessages(DerpNet__Tls13Context* Ctx, const uint8_t* Data, size_t Size)
+{
+	if (Size > Ctx->Net->SendBufferSize - Ctx->MessagesSize)
+	{
+		DERPNET_LOG("TLS handshake from server is too large");
+		return false;
+	}
+	memcpy(Ctx->Messages + Ctx->MessagesSize, Data, Size);
+	Ctx->MessagesSize += Size;
+	return true;
+}
+
+// returns next complete handshake message, or NULL if more records are needed
+static const uint8_t* DerpNet__Tls13NextMessage(DerpNet__Tls13Context* Ctx, uint8_t* Type, size_t* Size)
+{
+	size_t Available = Ctx->MessagesSize - Ctx->MessagesUsed;
+	if (Available < 4)
+	{
+		return NULL;
+	}
+
+	const uint8_t* Message = Ctx->Messages + Ctx->MessagesUsed;
+	size_t MessageSize = 4 + DerpNet__Get24BE(Message + 1);
+	if (Available < MessageSize)
+	{
+		return NULL;
+	}
+	Ctx->MessagesUsed += MessageSize;
+
+	*Type = Message[0];
+	*Size = MessageSize - 4;
+	return Message + 4;
+}
+
+static void DerpNet__Tls13TranscriptHash(const DerpNet__Tls13Context* Ctx, uint8_t Hash[32])
+{
+	sha256_state Transcript = Ctx->Transcript;
+	sha256_finish(&Transcript, Hash);
+}
+
+// SNI must not be used for IP addresses
+static bool DerpNet__Tls13IsAddress(const char* Hostname)
+{
+	for (const char* Ptr = Hostname; *Ptr; Ptr++)
+	{
+		if (*Ptr == ':' || ((*Ptr < '0' || *Ptr > '9') && *Ptr != '.'))
+		{
+			return *Ptr == ':';
+		}
+	}
+	return true;
+}
+
+// with Ticket, last 32 bytes are left for PSK binder
+static size_t DerpNet__Tls13ClientHello(uint8_t* Output, const char* Hostname, const uint8_t SessionId[32], const uint8_t PublicKey[32], const DerpNetSession* Ticket, uint32_t TicketAge)
+{
+	uint8_t* Ptr = Output;
+
+	*Ptr++ = 1; // ClientHello
+	Ptr += 3;   // size is set at the end
+
+	Ptr = DerpNet__Put16BE(Ptr, 0x0303); // legacy_version
+	DerpNet__GetRandom(Ptr, 32);
+	Ptr += 32;
+
+	// non-empty session id & ChangeCipherSpec make handshake look like TLS 1.2 to middleboxes
+	*Ptr++ = 32;
+	memcpy(Ptr, SessionId, 32);
+	Ptr += 32;
+
+	Ptr = DerpNet__Put16BE(Ptr, 2);
+	Ptr = DerpNet__Put16BE(Ptr, 0x1303); // TLS_CHACHA20_POLY1305_SHA256
+
+	*Ptr++ = 1;
+	*Ptr++ = 0; // null compression
+
+	uint8_t* Extensions = Ptr;
+	Ptr += 2;
+
+	size_t HostnameSize = strlen(Hostname);
+	if (!DerpNet__Tls13IsAddress(Hostname) && HostnameSize <= 255)
+	{
+		Ptr = DerpNet__Put16BE(Ptr, 0); // server_name
+		Ptr = DerpNet__Put16BE(Ptr, 2 + 1 + 2 + HostnameSize);
+		Ptr = DerpNet__Put16BE(Ptr, 1 + 2 + HostnameSize);
+		*Ptr++ = 0; // host_name
+		Ptr = DerpNet__Put16BE(Ptr, HostnameSize);
+		memcpy(Ptr, Hostname, HostnameSize);
+		Ptr += HostnameSize;
+	}
+
+	Ptr = DerpNet__Put16BE(Ptr, 10); // supported_groups
+	Ptr = DerpNet__Put16BE(Ptr, 2 + 2);
+	Ptr = DerpNet__Put16BE(Ptr, 2);
+	Ptr = DerpNet__Put16BE(Ptr, 0x001d); // x25519
+
+	static const uint16_t SignatureSchemes[] =
+	{
+		0x0403, // ecdsa_secp256r1_sha256
+		0x0503, // ecdsa_secp384r1_sha384
+		0x0807, // ed25519
+		0x0804, // rsa_pss_rsae_sha256
+		0x0805, // rsa_pss_rsae_sha384
+		0x0806, // rsa_pss_rsae_sha512
+		0x0401, // rsa_pkcs1_sha256, for certificates only
+		0x0501, // rsa_pkcs1_sha384, for certificates only
+		0x0601, // rsa_pkcs1_sha512, for certificates only
+	};
+	size_t SignatureSchemeCount = sizeof(SignatureSchemes) / sizeof(*SignatureSchemes);
+
+	Ptr = DerpNet__Put16BE(Ptr, 13); // signature_algorithms
+	Ptr = DerpNet__Put16BE(Ptr, 2 + 2 * SignatureSchemeCount);
+	Ptr = DerpNet__Put16BE(Ptr, 2 * SignatureSchemeCount);
+	for (size_t i = 0; i < SignatureSchemeCount; i++)
+	{
+		Ptr = DerpNet__Put16BE(Ptr, SignatureSchemes[i]);
+	}
+
+	Ptr = DerpNet__Put16BE(Ptr, 43); // supported_versions
+	Ptr = DerpNet__Put16BE(Ptr, 1 + 2);
+	*Ptr++ = 2;
+	Ptr = DerpNet__Put16BE(Ptr, 0x0304);
+
+	Ptr = DerpNet__Put16BE(Ptr, 51); // key_share
+	Ptr = DerpNet__Put16BE(Ptr, 2 + 2 + 2 + 32);
+	Ptr = DerpNet__Put16BE(Ptr, 2 + 2 + 32);
+	Ptr = DerpNet__Put16BE(Ptr, 0x001d);
+	Ptr = DerpNet__Put16BE(Ptr, 32);
+	memcpy(Ptr, PublicKey, 32);
+	Ptr += 32;
+
+	if (Ticket)
+	{
+		Ptr = DerpNet__Put16BE(Ptr, 45); // psk_key_exchange_modes
+		Ptr = DerpNet__Put16BE(Ptr, 1 + 1);
+		*Ptr++ = 1;
+		*Ptr++ = 1; // psk_dhe_ke, resumed session still gets new X25519 secret
+
+		// pre_shared_key must be last extension
+		Ptr = DerpNet__Put16BE(Ptr, 41);
+		Ptr = DerpNet__Put16BE(Ptr, 2 + 2 + Ticket->TicketSize + 4 + 2 + 1 + 32);
+		Ptr = DerpNet__Put16BE(Ptr, 2 + Ticket->TicketSize + 4);
+		Ptr = DerpNet__Put16BE(Ptr, Ticket->TicketSize);
+		memcpy(Ptr, Ticket->Ticket, Ticket->TicketSize);
+		Ptr += Ticket->TicketSize;
+		Set32BE(Ptr, TicketAge + Ticket->TicketAgeAdd);
+		Ptr += 4;
+		Ptr = DerpNet__Put16BE(Ptr, 1 + 32);
+		*Ptr++ = 32;
+		Ptr += 32; // binder is calculated by caller
+	}
+
+	DerpNet__Put16BE(Extensions, Ptr - Extensions - 2);
+	DerpNet__Put24BE(Output + 1, Ptr - Output - 4);
+
+	return Ptr - Output;
+}
+
+// returns server key share from ServerHello, and whether server accepted offered ticket
+static const uint8_t* DerpNet__Tls13ServerHello(const uint8_t* Message, size_t Size, const uint8_t SessionId[32], bool* Resumed)
+{
+	static const uint8_t HelloRetryRequest[32] =
+	{
+		0xcf, 0x21, 0xad, 0x74, 0xe5, 0x9a, 0x61, 0x11, 0xbe, 0x1d, 0x8c, 0x02, 0x1e, 0x65, 0xb8, 0x91,
+		0xc2, 0xa2, 0x11, 0x16, 0x7a, 0xbb, 0x8c, 0x5e, 0x07, 0x9e, 0x09, 0xe2, 0xc8, 0xa8, 0x33, 0x9c,
+	};
+
+	if (Size < 2 + 32 + 1 + 32 + 2 + 1 + 2)
+	{
+		return NULL;
+	}
+	if (memcmp(Message + 2, HelloRetryRequest, 32) == 0)
+	{
+		DERPNET_LOG("server does not support x25519 key exchange");
+		return NULL;
+	}
+	if (Message[34] != 32 || memcmp(Message + 35, SessionId, 32) != 0)
+	{
+		return NULL;
+	}
+	if (DerpNet__Get16BE(Message + 67) != 0x1303 || Message[69] != 0)
+	{
+		DERPNET_LOG("server does not support ChaCha20-Poly1305 cipher suite");
+		return NULL;
+	}
+
+	const uint8_t* Ptr = Message + 70;
+	const uint8_t* End = Ptr + 2 + DerpNet__Get16BE(Ptr);
+	if (End > Message + Size)
+	{
+		return NULL;
+	}
+	Ptr += 2;
+
+	bool Tls13 = false;
+	const uint8_t* KeyShare = NULL;
+	*Resumed = false;
+
+	while (End - Ptr >= 4)
+	{
+		uint16_t Type = DerpNet__Get16BE(Ptr);
+		size_t ExtensionSize = DerpNet__Get16BE(Ptr + 2);
+		Ptr += 4;
+		if ((size_t)(End - Ptr) < ExtensionSize)
+		{
+			return NULL;
+		}
+
+		if (Type == 43 && ExtensionSize == 2) // supported_versions
+		{
+			Tls13 = DerpNet__Get16BE(Ptr) == 0x0304;
+		}
+		else if (Type == 51 && ExtensionSize == 2 + 2 + 32) // key_share
+		{
+			if (DerpNet__Get16BE(Ptr) == 0x001d && DerpNet__Get16BE(Ptr + 2) == 32)
+			{
+				KeyShare = Ptr + 4;
+			}
+		}
+		else if (Type == 41 && ExtensionSize == 2) // pre_shared_key
+		{
+			// only one ticket is offered
+			if (DerpNet__Get16BE(Ptr) != 0)
+			{
+				return NULL;
+			}
+			*Resumed = true;
+		}
+		Ptr += ExtensionSize;
+	}
+
+	if (!Tls13)
+	{
+		DERPNET_LOG("server does not support TLS 1.3");
+		return NULL;
+	}
+	return KeyShare;
+}
+
+static bool DerpNet__Tls13Certificate(const uint8_t* Message, size_t Size, DerpNetIoVec* Certificates, size_t* CertificateCount)
+{
+	if (Size < 1 + 3 || Message[0] != 0)
+	{
+		return false;
+	}
+
+	const uint8_t* Ptr = Message + 1 + 3;
+	const uint8_t* End = Ptr + DerpNet__Get24BE(Message + 1);
+	if (End != Message + Size)
+	{
+		return false;
+	}
+
+	*CertificateCount = 0;
+	while (Ptr != End)
+	{
+		if (End - Ptr < 3)
+		{
+			return false;
+		}
+		size_t CertificateSize = DerpNet__Get24BE(Ptr);
+		Ptr += 3;
+		if ((size_t)(End - Ptr) < CertificateSize + 2)
+		{
+			return false;
+		}
+
+		if (*CertificateCount < DERPNET_TLS13_MAX_CERTIFICATES)
+		{
+			Certificates[*CertificateCount].Data = Ptr;
+			Certificates[*CertificateCount].Size = CertificateSize;
+			*CertificateCount += 1;
+		}
+		Ptr += CertificateSize;
+
+		size_t ExtensionsSize = DerpNet__Get16BE(Ptr);
+		Ptr += 2;
+		if ((size_t)(End - Ptr) < ExtensionsSize)
+		{
+			return false;
+		}
+		Ptr += ExtensionsSize;
+	}
+
+	return *CertificateCount != 0;
+}
+
+// handshake state that is kept between steps, when handshake runs with non-blocking socket
+typedef struct {
+	int Stage;
+	bool Allocated;
+	DerpNet__Tls13Context Ctx;
+	DerpKey PrivateKey;
+	uint8_t SessionId[32];
+	uint8_t EarlySecret[32];
+	uint8_t HandshakeSecret[32];
+	uint8_t ClientSecret[32];
+	DerpNetTls13Keys ClientKeys;
+	DerpNetTls13Keys ServerKeys;
+	DerpNetSession* Ticket;
+	bool Resumed;
+	DerpNetIoVec Certificates[DERPNET_TLS13_MAX_CERTIFICATES];
+	size_t CertificateCount;
+	size_t Expected; // how many encrypted handshake messages are processed
+} DerpNet__Tls13State;
+
+#define DERPNET_TLS13_CLIENT_HELLO 0
+#define DERPNET_TLS13_SERVER_HELLO 1
+#define DERPNET_TLS13_ENCRYPTED    2
+
+static void DerpNet__Tls13HandshakeEnd(DerpNet* Net)
+{
+	DerpNet__Tls13State* Handshake = (DerpNet__Tls13State*)Net->Tls13.Handshake;
+	if (Handshake)
+	{
+		bool Allocated = Handshake->Allocated;
+		memset(Handshake, 0, sizeof(*Handshake));
+		if (Allocated)
+		{
+			DerpNet__Free(&Net->Allocator, Handshake, sizeof(*Handshake));
+		}
+		Net->Tls13.Handshake = NULL;
+	}
+}
+
+// runs handshake as far as data from server allows, returns 1 when it is done, -1 on failure
+// or 0 when Wait=false and more data from server is needed - then call it again later
+static int DerpNet__Tls13HandshakeStep(DerpNet* Net, const char* Hostname, bool Wait)
+{
+	DerpNetTls13* State = &Net->Tls13;
+
+	DerpNet__Tls13State* Handshake = (DerpNet__Tls13State*)State->Handshake;
+	if (!Handshake)
+	{
+		Handshake = (DerpNet__Tls13State*)DerpNet__Alloc(&Net->Allocator, sizeof(*Handshake));
+		if (!Handshake)
+		{
+			DERPNET_LOG("not enough memory for TLS handshake");
+			return -1;
+		}
+		Handshake->Stage = DERPNET_TLS13_CLIENT_HELLO;
+		Handshake->Allocated = true;
+		State->Handshake = Handshake;
+	}
+
+	DerpNet__Tls13Context* Ctx = &Handshake->Ctx;
+
+	uint8_t Secret[32];
+	uint8_t Hash[32];
+	int Result = -1;
+
+	uint8_t Zero[32] = { 0 };
+	uint8_t EmptyHash[32];
+	sha256(EmptyHash, NULL, 0);
+
+	//
+	// ClientHello
+	//
+
+	if (Handshake->Stage == DERPNET_TLS13_CLIENT_HELLO)
+	{
+		bool Allocated = Handshake->Allocated;
+		memset(State, 0, sizeof(*State));
+		memset(Handshake, 0, sizeof(*Handshake));
+		State->Handshake = Handshake;
+		Handshake->Allocated = Allocated;
+
+		if (!Net->Verify)
+		{
+			DERPNET_LOG("built-in TLS needs DerpNetConfig.Verify callback to check server certificate");
+			goto done;
+		}
+
+		Ctx->Net = Net;
+		Ctx->Messages = Net->SendBuffer;
+		sha256_init(&Ctx->Transcript);
+
+		DerpKey PublicKey;
+		DerpNet_CreateNewKey(&Handshake->PrivateKey);
+		DerpNet_GetPublicKey(&Handshake->PrivateKey, &PublicKey);
+
+		DerpNet__GetRandom(Handshake->SessionId, sizeof(Handshake->SessionId));
+
+		// ticket is used only once, new ones come after handshake
+		DerpNetSession* Ticket = Net->Session;
+		uint32_t TicketAge = 0;
+		if (Ticket && Ticket->TicketSize != 0)
+		{
+			int64_t Now = (int64_t)time(NULL);
+			TicketAge = (uint32_t)((Now - Ticket->TicketTime) * 1000);
+			if (Now < Ticket->TicketTime || Now - Ticket->TicketTime >= Ticket->TicketLifetime)
+			{
+				Ticket->TicketSize = 0;
+			}
+		}
+		if (Ticket && Ticket->TicketSize == 0)
+		{
+			Ticket = NULL;
+		}
+		Handshake->Ticket = Ticket;
+
+		hkdf_sha256_extract(Handshake->EarlySecret, Zero, Ticket ? Ticket->TicketSecret : Zero, 32);
+
+		uint8_t* Record = Net->SendBuffer;
+		size_t HelloSize = DerpNet__Tls13ClientHello(Record + 5, Hostname, Handshake->SessionId, PublicKey.Bytes, Ticket, TicketAge);
+
+		if (Ticket)
+		{
+			// binder proves knowledge of ticket secret, it is calculated over ClientHello up to binders
+			uint8_t BinderKey[32];
+			hkdf_sha256_expand_label(BinderKey, sizeof(BinderKey), Handshake->EarlySecret, "res binder", EmptyHash, sizeof(EmptyHash));
+			hkdf_sha256_expand_label(BinderKey, sizeof(BinderKey), BinderKey, "finished", NULL, 0);
+
+			size_t BindersSize = 2 + 1 + 32;
+			sha256(Hash, Record + 5, HelloSize - BindersSize);
+			hmac_sha256(Record + 5 + HelloSize - 32, BinderKey, sizeof(BinderKey), Hash, sizeof(Hash));
+			memset(BinderKey, 0, sizeof(BinderKey));
+
+			Ticket->TicketSize = 0;
+		}
+
+		Record[0] = 22; // handshake
+		Record[1] = 0x03;
+		Record[2] = 0x01;
+		DerpNet__Put16BE(Record + 3, HelloSize);
+
+		sha256_update(&Ctx->Transcript, Record + 5, HelloSize);
+
+		if (!DerpNet__SocketSend(Net, Record, 5 + HelloSize))
+		{
+			goto done;
+		}
+
+		Handshake->Stage = DERPNET_TLS13_SERVER_HELLO;
+	}
+
+	//
+	// ServerHello
+	//
+
+	if (Handshake->Stage == DERPNET_TLS13_SERVER_HELLO)
+	{
+		const uint8_t* Message;
+		uint8_t MessageType;
+		size_t MessageSize;
+
+		while (!(Message = DerpNet__Tls13NextMessage(Ctx, &MessageType, &MessageSize)))
+		{
+			uint8_t* Record;
+			size_t RecordSize;
+			int GotRecord = DerpNet__Tls13ReadRecord(Ctx, &Record, &RecordSize, Wait);
+			if (GotRecord <= 0)
+			{
+				Result = GotRecord;
+				goto done;
+			}
+			if (Record[0] == 21) // alert
+			{
+				DERPNET_LOG("server rejected TLS handshake, alert %u", RecordSize >= 7 ? Record[6] : 0);
+				goto done;
+			}
+			if (Record[0] != 22 || !DerpNet__Tls13AddMessages(Ctx, Record + 5, RecordSize - 5))
+			{
+				DERPNET_LOG("unexpected TLS record from server");
+				goto done;
+			}
+		}
+
+		bool Resumed;
+		DerpNetSession* Ticket = Handshake->Ticket;
+		const uint8_t* ServerKey = MessageType == 2 ? DerpNet__Tls13ServerHello(Message, MessageSize, Handshake->SessionId, &Resumed) : NULL;
+		if (!ServerKey || Ctx->MessagesUsed != Ctx->MessagesSize || (Resumed && !Ticket))
+		{
+			DERPNET_LOG("bad ServerHello from server");
+			goto done;
+		}
+		if (Ticket && !Resumed)
+		{
+			// server did not accept ticket, so full handshake follows without it
+			hkdf_sha256_extract(Handshake->EarlySecret, Zero, Zero, sizeof(Zero));
+		}
+		DERPNET_LOG("TLS session %s", Resumed ? "resumed" : "not resumed");
+		Handshake->Resumed = Resumed;
+
+		sha256_update(&Ctx->Transcript, Message - 4, 4 + MessageSize);
+
+		uint8_t SharedSecret[32];
+		curve25519_scalarmult(SharedSecret, Handshake->PrivateKey.Bytes, ServerKey);
+
+		bool SharedOk = memcmp(SharedSecret, Zero, sizeof(Zero)) != 0;
+
+		hkdf_sha256_expand_label(Secret, sizeof(Secret), Handshake->EarlySecret, "derived", EmptyHash, sizeof(EmptyHash));
+		hkdf_sha256_extract(Handshake->HandshakeSecret, Secret, SharedSecret, sizeof(SharedSecret));
+		memset(SharedSecret, 0, sizeof(SharedSecret));
+
+		if (!SharedOk)
+		{
+			DERPNET_LOG("bad key share from server");
+			goto done;
+		}
+
+		DerpNet__Tls13TranscriptHash(Ctx, Hash);
+		hkdf_sha256_expand_label(Handshake->ClientSecret, sizeof(Handshake->ClientSecret), Handshake->HandshakeSecret, "c hs traffic", Hash, sizeof(Hash));
+		DerpNet__Tls13SetKeys(&Handshake->ClientKeys, Handshake->ClientSecret);
+		hkdf_sha256_expand_label(Secret, sizeof(Secret), Handshake->HandshakeSecret, "s hs traffic", Hash, sizeof(Hash));
+		DerpNet__Tls13SetKeys(&Handshake->ServerKeys, Secret);
+
+		Ctx->MessagesSize = Ctx->MessagesUsed = 0;
+		Handshake->Stage = DERPNET_TLS13_ENCRYPTED;
+	}
+
+	//
+	// EncryptedExtensions, Certificate, CertificateVerify & Finished
+	//
+
+	{
+		// resumed session is already authenticated, so there is no Certificate & CertificateVerify
+		static const uint8_t FullTypes[] = { 8, 11, 15, 20 };
+		static const uint8_t ResumedTypes[] = { 8, 20 };
+		const uint8_t* ExpectedTypes = Handshake->Resumed ? ResumedTypes : FullTypes;
+		size_t ExpectedCount = Handshake->Resumed ? sizeof(ResumedTypes) : sizeof(FullTypes);
+
+		while (Handshake->Expected != ExpectedCount)
+		{
+			const uint8_t* Message;
+			uint8_t MessageType;
+			size_t MessageSize;
+
+			if (!(Message = DerpNet__Tls13NextMessage(Ctx, &MessageType, &MessageSize)))
+			{
+				uint8_t* Record;
+				size_t RecordSize;
+				int GotRecord = DerpNet__Tls13ReadRecord(Ctx, &Record, &RecordSize, Wait);
+				if (GotRecord <= 0)
+				{
+					Result = GotRecord;
+					goto done;
+				}
+				if (Record[0] == 20) // ChangeCipherSpec for middleboxes
+				{
+					continue;
+				}
+
+				size_t DataSize;
+				int ContentType = DerpNet__Tls13OpenRecord(&Handshake->ServerKeys, Record, RecordSize, &DataSize);
+				if (ContentType == 21 && DataSize >= 2)
+				{
+					DERPNET_LOG("server rejected TLS handshake, alert %u", Record[5 + 1]);
+					goto done;
+				}
+				if (ContentType != 22 || !DerpNet__Tls13AddMessages(Ctx, Record + 5, DataSize))
+				{
+					DERPNET_LOG("cannot decrypt TLS handshake from server");
+					goto done;
+				}
+				continue;
+			}
+
+			if (MessageType != ExpectedTypes[Handshake->Expected++])
+			{
+				DERPNET_LOG("unexpected TLS handshake message %u from server", MessageType);
+				goto done;
+			}
+
+			if (MessageType == 11) // Certificate
+			{
+				if (!DerpNet__Tls13Certificate(Message, MessageSize, Handshake->Certificates, &Handshake->CertificateCount))
+				{
+					DERPNET_LOG("bad Certificate message from server");
+					goto done;
+				}
+			}
+			else if (MessageType == 15) // CertificateVerify
+			{
+				if (MessageSize < 4 || MessageSize != 4 + (size_t)DerpNet__Get16BE(Message + 2))
+				{
+					DERPNET_LOG("bad CertificateVerify message from server");
+					goto done;
+				}
+
+				static const char Context[] = "TLS 1.3, server CertificateVerify";
+
+				uint8_t Signed[64 + sizeof(Context) + 32];
+				memset(Signed, ' ', 64);
+				memcpy(Signed + 64, Context, sizeof(Context));
+				DerpNet__Tls13TranscriptHash(Ctx, Signed + 64 + sizeof(Context));
+
+				DerpNetIoVec Signature = { Message + 4, MessageSize - 4 };
+				DerpNetIoVec SignedData = { Signed, sizeof(Signed) };
+
+				if (!Net->Verify(Net->VerifyUser, Hostname, Handshake->Certificates, Handshake->CertificateCount, DerpNet__Get16BE(Message), &Signature, &SignedData))
+				{
+					DERPNET_LOG("server certificate is not trusted");
+					goto done;
+				}
+			}
+			else if (MessageType == 20) // Finished
+			{
+				uint8_t FinishedKey[32];
+				hkdf_sha256_expand_label(FinishedKey, sizeof(FinishedKey), Handshake->ServerKeys.Secret, "finished", NULL, 0);
+
+				uint8_t VerifyData[32];
+				DerpNet__Tls13TranscriptHash(Ctx, Hash);
+				hmac_sha256(VerifyData, FinishedKey, sizeof(FinishedKey), Hash, sizeof(Hash));
+
+				uint8_t Diff = MessageSize != sizeof(VerifyData);
+				for (size_t i = 0; i < sizeof(VerifyData) && MessageSize == sizeof(VerifyData); i++)
+				{
+					Diff |= VerifyData[i] ^ Message[i];
+				}
+				if (Diff || Ctx->MessagesUsed != Ctx->MessagesSize)
+				{
+					DERPNET_LOG("bad Finished message from server");
+					goto done;
+				}
+			}
+
+			sha256_update(&Ctx->Transcript, Message - 4, 4 + MessageSize);
+		}
+	}
+
+	//
+	// client Finished, and switch to application traffic keys
+	//
+
+	{
+		DerpNet__Tls13TranscriptHash(Ctx, Hash);
+
+		hkdf_sha256_expand_label(Secret, sizeof(Secret), Handshake->HandshakeSecret, "derived", EmptyHash, sizeof(EmptyHash));
+		hkdf_sha256_extract(Secret, Secret, Zero, sizeof(Zero));
+
+		uint8_t TrafficSecret[32];
+		hkdf_sha256_expand_label(TrafficSecret, sizeof(TrafficSecret), Secret, "c ap traffic", Hash, sizeof(Hash));
+		DerpNet__Tls13SetKeys(&State->Send, TrafficSecret);
+		hkdf_sha256_expand_label(TrafficSecret, sizeof(TrafficSecret), Secret, "s ap traffic", Hash, sizeof(Hash));
+		DerpNet__Tls13SetKeys(&State->Recv, TrafficSecret);
+		memset(TrafficSecret, 0, sizeof(TrafficSecret));
+
+		uint8_t FinishedKey[32];
+		hkdf_sha256_expand_label(FinishedKey, sizeof(FinishedKey), Handshake->ClientSecret, "finished", NULL, 0);
+
+		// ChangeCipherSpec and Finished records are sent together
+		uint8_t* Output = Net->SendBuffer;
+		static const uint8_t ChangeCipherSpec[] = { 20, 0x03, 0x03, 0x00, 0x01, 0x01 };
+		memcpy(Output, ChangeCipherSpec, sizeof(ChangeCipherSpec));
+
+		uint8_t* Record = Output + sizeof(ChangeCipherSpec);
+		uint8_t* Finished = Record + 5;
+		Finished[0] = 20; // Finished
+		DerpNet__Put24BE(Finished + 1, 32);
+		hmac_sha256(Finished + 4, FinishedKey, sizeof(FinishedKey), Hash, sizeof(Hash));
+
+		// tickets sent by server later are for session up to client Finished
+		sha256_update(&Ctx->Transcript, Finished, 4 + 32);
+		DerpNet__Tls13TranscriptHash(Ctx, Hash);
+		hkdf_sha256_expand_label(State->ResumptionSecret, sizeof(State->ResumptionSecret), Secret, "res master", Hash, sizeof(Hash));
+
+		size_t RecordSize = DerpNet__Tls13SealRecord(&Handshake->ClientKeys, Record, 4 + 32, 22);
+		if (!DerpNet__SocketSend(Net, Output, sizeof(ChangeCipherSpec) + RecordSize))
+		{
+			goto done;
+		}
+	}
+
+	// leftover data from server is already encrypted with application keys
+	memmove(Net->Buffer, Net->Buffer + Ctx->RecordOffset, Net->BufferReceived - Ctx->RecordOffset);
+	Net->BufferReceived -= Ctx->RecordOffset;
+
+	DERPNET_LOG("TLS 1.3 handshake done");
+	Result = 1;
+
+done:
+	memset(Secret, 0, sizeof(Secret));
+	if (Result != 0)
+	{
+		DerpNet__Tls13HandshakeEnd(Net);
+	}
+	return Result;
+}
+
+static bool DerpNet__Tls13Handshake(DerpNet* Net, const char* Hostname)
+{
+	// with blocking socket whole handshake runs in one step, so its state can be on stack
+	DerpNet__Tls13State Handshake;
+	Handshake.Stage = DERPNET_TLS13_CLIENT_HELLO;
+	Handshake.Allocated = false;
+	Net->Tls13.Handshake = &Handshake;
+
+	return DerpNet__Tls13HandshakeStep(Net, Hostname, true) > 0;
+}
+
+static int DerpNet__Tls13HandshakeAsync(DerpNet* Net, const char* Hostname)
+{
+	return DerpNet__Tls13HandshakeStep(Net, Hostname, false);
+}
+
+static void DerpNet__Tls13GetSizes(DerpNet* Net, size_t* HeaderSize, size_t* MessageSize, size_t* TrailerSize)
+{
+	(void)Net;
+	*HeaderSize = 5;
+	*MessageSize = 16384;
+	*TrailerSize = 1 + 16; // content type & tag
+}
+
+static size_t DerpNet__Tls13Encrypt(DerpNet* Net, uint8_t* Record, size_t HeaderSize, size_t DataSize, size_t TrailerSize)
+{
+	DERPNET_ASSERT(HeaderSize == 5 && TrailerSize == 1 + 16);
+	return DerpNet__Tls13SealRecord(&Net->Tls13.Send, Record, DataSize, 23);
+}
+
+static void DerpNet__Tls13SaveTicket(DerpNet* Net, const uint8_t* Message, size_t Size)
+{
+	DerpNetSession* Session = Net->Session;
+
+	if (Size < 4 + 4 + 1)
+	{
+		return;
+	}
+	size_t NonceSize = Message[8];
+	if (Size < 4 + 4 + 1 + NonceSize + 2 || NonceSize > 32)
+	{
+		return;
+	}
+	size_t TicketSize = DerpNet__Get16BE(Message + 9 + NonceSize);
+	if (Size < 4 + 4 + 1 + NonceSize + 2 + TicketSize || TicketSize == 0 || TicketSize > sizeof(Session->Ticket))
+	{
+		DERPNET_LOG("TLS session ticket is too large, ignoring it");
+		return;
+	}
+
+	Session->TicketLifetime = Get32BE(Message);
+	Session->TicketAgeAdd = Get32BE(Message + 4);
+	Session->TicketTime = (int64_t)time(NULL);
+	Session->TicketSize = (uint32_t)TicketSize;
+	memcpy(Session->Ticket, Message + 9 + NonceSize + 2, TicketSize);
+	hkdf_sha256_expand_label(Session->TicketSecret, sizeof(Session->TicketSecret), Net->Tls13.ResumptionSecret, "resumption", Message + 9, NonceSize);
+
+	DERPNET_LOG("received TLS session ticket, lifetime=%u seconds", Session->TicketLifetime);
+}
+
+static bool DerpNet__SocketSendRecords(DerpNet* Net, const DerpNetIoVec* Records, size_t RecordCount, bool Wait);
+
+// answers KeyUpdate that requested update of our keys - KeyUpdate goes out with old key, and
+// all records after it are encrypted with new one
+static bool DerpNet__Tls13SendKeyUpdate(DerpNet* Net)
+{
+	DerpNetTls13* State = &Net->Tls13;
+
+	static const uint8_t Message[] = { 24, 0, 0, 1, 0 }; // KeyUpdate, update_not_requested
+
+	bool Sent;
+#if DERPNET_USE_KERNEL_TLS
+	if (Net->KernelTlsSend)
+	{
+		Sent = DerpNet__KernelTlsSendHandshake(Net, Message, sizeof(Message));
+	}
+	else
+#endif
+	{
+		// batch waiting in SendBuffer is not encrypted yet, it will use new key
+		uint8_t Record[5 + sizeof(Message) + 1 + 16];
+		memcpy(Record + 5, Message, sizeof(Message));
+
+		DerpNetIoVec Vec = { Record, DerpNet__Tls13SealRecord(&State->Send, Record, sizeof(Message), 22) };
+		Sent = DerpNet__SocketSendRecords(Net, &Vec, 1, false);
+	}
+	if (!Sent)
+	{
+		return false;
+	}
+
+	uint8_t Secret[32];
+	hkdf_sha256_expand_label(Secret, sizeof(Secret), State->Send.Secret, "traffic upd", NULL, 0);
+	DerpNet__Tls13SetKeys(&State->Send, Secret);
+	memset(Secret, 0, sizeof(Secret));
+
+#if DERPNET_USE_KERNEL_TLS
+	if (Net->KernelTlsSend && !DerpNet__KernelTlsEnable(Net, true))
+	{
+		DERPNET_LOG("kernel cannot update TLS send key");
+		return false;
+	}
+#endif
+	DERPNET_LOG("updated TLS send key as server requested");
+	return true;
+}
+
+static int DerpNet__Tls13Decrypt(DerpNet* Net, uint8_t* Data, size_t Size, size_t* DataOffset, size_t* DataSize, size_t* RecordSize)
+{
+	if (Size < 5)
+	{
+		return 0;
+	}
+
+	size_t FullSize = 5 + DerpNet__Get16BE(Data + 3);
+	if (FullSize > DERPNET_TLS13_MAX_RECORD)
+	{
+		return -1;
+	}
+	if (Size < FullSize)
+	{
+		return 0;
+	}
+
+	DerpNetTls13* State = &Net->Tls13;
+
+	size_t Decrypted;
+	int ContentType = DerpNet__Tls13OpenRecord(&State->Recv, Data, FullSize, &Decrypted);
+
+	*DataOffset = 5;
+	*DataSize = 0;
+	*RecordSize = FullSize;
+
+	if (ContentType == 23) // application_data
+	{
+		*DataSize = Decrypted;
+		return 1;
+	}
+	else if (ContentType == 22) // post-handshake messages, expected to be whole in one record
+	{
+		for (size_t Offset = 0; Offset + 4 <= Decrypted; )
+		{
+			const uint8_t* Message = Data + 5 + Offset;
+			size_t MessageSize = DerpNet__Get24BE(Message + 1);
+			if (Offset + 4 + MessageSize > Decrypted)
+			{
+				return -1;
+			}
+
+			if (Message[0] == 4 && Net->Session) // NewSessionTicket
+			{
+				DerpNet__Tls13SaveTicket(Net, Message + 4, MessageSize);
+			}
+			else if (Message[0] == 24 && MessageSize == 1) // KeyUpdate
+			{
+				uint8_t Request = Message[4];
+				if (Request > 1)
+				{
+					return -1;
+				}
+
+				uint8_t Secret[32];
+				hkdf_sha256_expand_label(Secret, sizeof(Secret), State->Recv.Secret, "traffic upd", NULL, 0);
+				DerpNet__Tls13SetKeys(&State->Recv, Secret);
+				memset(Secret, 0, sizeof(Secret));
+
+				if (Request == 1 && !DerpNet__Tls13SendKeyUpdate(Net)) // update_requested
+				{
+					return -1;
+				}
+			}
+
+			Offset += 4 + MessageSize;
+		}
+		return 1;
+	}
+	else if (ContentType == 21) // alert
+	{
+		DERPNET_LOG("server closed TLS connection, alert %u", Decrypted >= 2 ? Data[5 + 1] : 0);
+	}
+	return -1;
+}
+
+static void DerpNet__Tls13Close(DerpNet* Net)
+{
+	DerpNet__Tls13HandshakeEnd(Net);
+	memset(&Net->Tls13, 0, sizeof(Net->Tls13));
+}
+
+static bool DerpNet__Tls13ExportKeys(DerpNet* Net, bool Send, DerpNetTlsKeys* Keys)
+{
+	DerpNetTls13Keys* Source = Send ? &Net->Tls13.Send : &Net->Tls13.Recv;
+
+	Keys->Version = 0x0304;
+	Keys->Cipher = DERPNET_TLS_CHACHA20_POLY1305;
+	memcpy(Keys->Key, Source->Key, sizeof(Keys->Key));
+	memcpy(Keys->Iv, Source->Iv, sizeof(Keys->Iv));
+	Keys->Sequence = Source->Sequence;
+
+	return true;
+}
+
+static const DerpNetTls DerpNet__Tls13 =
+{
+	.Handshake = &DerpNet__Tls13Handshake,
+	.GetSizes = &DerpNet__Tls13GetSizes,
+	.Encrypt = &DerpNet__Tls13Encrypt,
+	.Decrypt = &DerpNet__Tls13Decrypt,
+	.Close = &DerpNet__Tls13Close,
+	.ExportKeys = &DerpNet__Tls13ExportKeys,
+	.HandshakeStep = &DerpNet__Tls13HandshakeAsync,
+};
+
+const DerpNetTls* DerpNet_GetBuiltinTls(void)
+{
+	return &DerpNet__Tls13;
+}
+
+// outgoing data is placed directly into payloads of TLS records in SendBuffer, with space left
+// for record header & trailer in between, so records can be encrypted in place without copies
+typedef struct {
+	size_t Header;
+	size_t Message;
+	size_t Trailer;
+} DerpNet__RecordLayout;
+
+// sizes do not change after handshake, so TLS is asked for them only once
+static void DerpNet__InitRecordLayout(DerpNet* Net)
+{
+	if (Net->Tls && !Net->KernelTlsSend)
+	{
+		Net->Tls->GetSizes(Net, &Net->RecordHeader, &Net->RecordMessage, &Net->RecordTrailer);
+	}
+	else
+	{
+		Net->RecordHeader = 0;
+		Net->RecordMessage = Net->SendBufferLimit;
+		Net->RecordTrailer = 0;
+	}
+}
+
+static void DerpNet__GetRecordLayout(DerpNet* Net, DerpNet__RecordLayout* Layout)
+{
+	Layout->Header = Net->RecordHeader;
+	Layout->Message = Net->RecordMessage;
+	Layout->Trailer = Net->RecordTrailer;
+}
+
+// space needed in SendBuffer for DataSize bytes of outgoing data
+static size_t DerpNet__RecordSpace(const DerpNet__RecordLayout* Layout, size_t DataSize)
+{
+	size_t Records = (DataSize + Layout->Message - 1) / Layout->Message;
+	return DataSize + Records * (Layout->Header + Layout->Trailer);
+}
+
+// returns location for Offset-th byte of outgoing data, and how many bytes after it fit in same record
+static uint8_t* DerpNet__RecordData(DerpNet* Net, const DerpNet__RecordLayout* Layout, size_t Offset, size_t* Available)
+{
+	size_t Record = Offset / Layout->Message;
+	size_t RecordOffset = Offset % Layout->Message;
+
+	*Available = Layout->Message - RecordOffset;
+	return Net->SendBuffer + Record * (Layout->Header + Layout->Message + Layout->Trailer) + Layout->Header + RecordOffset;
+}
+
+// keeps data socket did not take, DerpNet_TrySend makes sure it stays under limit of SendQueue
+// returns false only when there is no memory for it
+static bool DerpNet__SendQueueAppend(DerpNet* Net, const void* Data, size_t Size)
+{
+	if (Net->SendQueueStart + Net->SendQueued + Size > Net->SendQueueSize)
+	{
+		if (Net->SendQueued != 0)
+		{
+			memmove(Net->SendQueue, Net->SendQueue + Net->SendQueueStart, Net->SendQueued);
+			Net->TotalMoved += Net->SendQueued;
+		}
+		Net->SendQueueStart = 0;
+
+		if (Net->SendQueued + Size > Net->SendQueueSize)
+		{
+			// limit + batch & frame sent when queue is just under it
+			size_t NewSize = DerpNet__BufferGrowSize(Net->SendQueueSize, Net->SendQueued + Size, Net->SendQueueLimit + 2 * Net->SendBufferLimit);
+			DERPNET_ASSERT(NewSize != 0);
+			if (!DerpNet__BufferResize(Net, &Net->SendQueue, &Net->SendQueueSize, NewSize, Net->SendQueued))
+			{
+				return false;
+			}
+		}
+	}
+
+	memcpy(Net->SendQueue + Net->SendQueueStart + Net->SendQueued, Data, Size);
+	Net->SendQueued += Size;
+	if (Net->SendQueued > Net->SendQueuedPeak)
+	{
+		Net->SendQueuedPeak = Net->SendQueued;
+	}
+	return true;
+}
+
+// with Wait=false sends only as much of queued data as socket takes right now
+static bool DerpNet__SendQueuePump(DerpNet* Net, bool Wait)
+{
+	while (Net->SendQueued != 0)
+	{
+		int WriteSize = (int)send((DerpNet__Socket)Net->Socket, (const char*)Net->SendQueue + Net->SendQueueStart, (int)Net->SendQueued, Wait ? DERPNET_SEND_FLAGS : DERPNET_SEND_FLAGS_NOWAIT);
+		Net->TotalSyscalls++;
+		if (WriteSize < 0 && DerpNet__SocketWouldBlock())
+		{
+			if (!Wait)
+			{
+				return true;
+			}
+			if (!DerpNet__SocketWait(Net, true))
+			{
+				return false;
+			}
+			continue;
+		}
+		if (WriteSize <= 0)
+		{
+			DERPNET_LOG("failed to send data to server, remote server disconnected?");
+			return false;
+		}
+		Net->TotalSent += WriteSize;
+
+		Net->SendQueueStart += WriteSize;
+		Net->SendQueued -= WriteSize;
+	}
+	Net->SendQueueStart = 0;
+	return true;
+}
+
+// all records go out with one vectored write, unless socket buffer is full
+// then with Wait=false rest of them is queued, otherwise it waits for socket
+static bool DerpNet__SocketSendRecords(DerpNet* Net, const DerpNetIoVec* Records, size_t RecordCount, bool Wait)
+{
+	Net->TotalRecords += RecordCount;
+
+	// earlier queued data must go out first
+	if (Net->SendQueued != 0)
+	{
+		if (!DerpNet__SendQueuePump(Net, Wait))
+		{
+			return false;
+		}
+		if (Net->SendQueued != 0)
+		{
+			for (size_t i = 0; i < RecordCount; i++)
+			{
+				if (!DerpNet__SendQueueAppend(Net, Records[i].Data, Records[i].Size))
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+	}
+
+#if DERPNET_USE_IO_URING
+	if (Net->Ring.Fd >= 0 && Wait)
+	{
+		return DerpNet__RingSend(Net, Records, RecordCount);
+	}
+#endif
+
+#if defined(_WIN32)
+	WSABUF Vec[DERPNET_MAX_RECORDS];
+	for (size_t i = 0; i < RecordCount; i++)
+	{
+		Vec[i].buf = (char*)Records[i].Data;
+		Vec[i].len = (ULONG)Records[i].Size;
+	}
+	WSABUF* Next = Vec;
+#else
+	struct iovec Vec[DERPNET_MAX_RECORDS];
+	for (size_t i = 0; i < RecordCount; i++)
+	{
+		Vec[i].iov_base = (void*)Records[i].Data;
+		Vec[i].iov_len = Records[i].Size;
+	}
+	struct msghdr Msg = { .msg_iov = Vec, .msg_iovlen = RecordCount };
+	struct iovec* Next = Vec;
+#endif
+
+	while (RecordCount != 0)
+	{
+#if defined(_WIN32)
+		DWORD Sent;
+		int WriteSize = WSASend((DerpNet__Socket)Net->Socket, Next, (DWORD)RecordCount, &Sent, 0, NULL, NULL) == 0 ? (int)Sent : -1;
+#else
+		Msg.msg_iov = Next;
+		Msg.msg_iovlen = RecordCount;
+		int WriteSize = (int)sendmsg((DerpNet__Socket)Net->Socket, &Msg, Wait ? DERPNET_SEND_FLAGS : DERPNET_SEND_FLAGS_NOWAIT);
+#endif
+		Net->TotalSyscalls++;
+		if (WriteSize < 0 && DerpNet__SocketWouldBlock())
+		{
+			if (!Wait)
+			{
+				for (size_t i = 0; i < RecordCount; i++)
+				{
+#if defined(_WIN32)
+					bool Queued = DerpNet__SendQueueAppend(Net, Next[i].buf, Next[i].len);
+#else
+					bool Queued = DerpNet__SendQueueAppend(Net, Next[i].iov_base, Next[i].iov_len);
+#endif
+					if (!Queued)
+					{
+						return false;
+					}
+				}
+				return true;
+			}
+			if (!DerpNet__SocketWait(Net, true))
+			{
+				return false;
+			}
+			continue;
+		}
+		if (WriteSize <= 0)
+		{
+			DERPNET_LOG("failed to send data to server, remote server disconnected?");
+			return false;
+		}
+		Net->TotalSent += WriteSize;
+
+		// after short send, continue from first unsent byte
+		size_t Size = WriteSize;
+		while (Size != 0)
+		{
+#if defined(_WIN32)
+			size_t Used = DerpNet__Min(Size, Next->len);
+			Next->buf += Used;
+			Next->len -= (ULONG)Used;
+			bool Done = Next->len == 0;
+#else
+			size_t Used = DerpNet__Min(Size, Next->iov_len);
+			Next->iov_base = (uint8_t*)Next->iov_base + Used;
+			Next->iov_len -= Used;
+			bool Done = Next->iov_len == 0;
+#endif
+			Size -= Used;
+			if (Done)
+			{
+				Next++;
+				RecordCount--;
+			}
+		}
+	}
+	return true;
+}
+
+// encrypts & sends DataSize bytes placed in SendBuffer with DerpNet__RecordData
+static bool DerpNet__TlsWriteRecords(DerpNet* Net, const DerpNet__RecordLayout* Layout, size_t DataSize, bool Wait)
+{
+	DERPNET_ASSERT(DerpNet__RecordSpace(Layout, DataSize) <= Net->SendBufferSize);
+
+	DerpNetIoVec Records[DERPNET_MAX_RECORDS];
+	size_t RecordCount = 0;
+
+	if (!Net->Tls || Net->KernelTlsSend)
+	{
+		Records[RecordCount++] = (DerpNetIoVec){ Net->SendBuffer, DataSize };
+		return DerpNet__SocketSendRecords(Net, Records, RecordCount, Wait);
+	}
+
+	uint8_t* Record = Net->SendBuffer;
+	while (DataSize != 0)
+	{
+		size_t DataSizeToUse = DerpNet__Min(DataSize, Layout->Message);
+
+		// actual trailer can be shorter than maximum, so every record is sent on its own
+		size_t SizeToSend = Net->Tls->Encrypt(Net, Record, Layout->Header, DataSizeToUse, Layout->Trailer);
+		if (SizeToSend == 0)
+		{
+			DERPNET_LOG("TLS failed to encrypt outgoing data");
+			return false;
+		}
+
+		DERPNET_ASSERT(RecordCount < DERPNET_MAX_RECORDS);
+		Records[RecordCount++] = (DerpNetIoVec){ Record, SizeToSend };
+
+		Record += Layout->Header + Layout->Message + Layout->Trailer;
+		DataSize -= DataSizeToUse;
+	}
+
+	return DerpNet__SocketSendRecords(Net, Records, RecordCount, Wait);
+}
+
+// copies data to Offset of outgoing data, it can cross record boundaries
+static void DerpNet__RecordWrite(DerpNet* Net, const DerpNet__RecordLayout* Layout, size_t Offset, const void* Data, size_t DataSize)
+{
+	const uint8_t* Input = (const uint8_t*)Data;
+	while (DataSize != 0)
+	{
+		size_t Available;
+		uint8_t* Output = DerpNet__RecordData(Net, Layout, Offset, &Available);
+
+		size_t Size = DerpNet__Min(DataSize, Available);
+		memcpy(Output, Input, Size);
+		Offset += Size;
+		Input += Size;
+		DataSize -= Size;
+	}
+}
+
+// with Wait=true also everything queued by DerpNet_TrySend is sent
+static bool DerpNet__Flush(DerpNet* Net, bool Wait)
+{
+	if (Net->SendPending == 0)
+	{
+		return !Wait || DerpNet__SendQueuePump(Net, true);
+	}
+
+	DerpNet__RecordLayout Layout;
+	DerpNet__GetRecordLayout(Net, &Layout);
+
+	size_t DataSize = Net->SendPending;
+	Net->SendPending = 0;
+	return DerpNet__TlsWriteRecords(Net, &Layout, DataSize, Wait);
+}
+
+// returns offset in outgoing data where frame of FrameSize bytes can be placed, sending earlier frames if they are in the way
+static bool DerpNet__SendReserve(DerpNet* Net, const DerpNet__RecordLayout* Layout, size_t FrameSize, size_t* Offset, bool Wait)
+{
+	if (Net->SendPending != 0 && DerpNet__RecordSpace(Layout, Net->SendPending + FrameSize) > Net->SendBufferLimit)
+	{
+		if (!DerpNet__Flush(Net, Wait))
+		{
+			return false;
+		}
+	}
+
+	// records of frames already in batch keep their place when buffer grows
+	size_t Space = DerpNet__RecordSpace(Layout, Net->SendPending + FrameSize);
+	if (Space > Net->SendBufferSize)
+	{
+		size_t NewSize = DerpNet__BufferGrowSize(Net->SendBufferSize, Space, Net->SendBufferLimit);
+		if (NewSize == 0)
+		{
+			DERPNET_LOG("frame of %zu bytes does not fit in send buffer of %zu bytes", FrameSize, Net->SendBufferLimit);
+			return false;
+		}
+		size_t Keep = Net->SendPending ? DerpNet__RecordSpace(Layout, Net->SendPending) : 0;
+		if (!DerpNet__BufferResize(Net, &Net->SendBuffer, &Net->SendBufferSize, NewSize, Keep))
+		{
+			return false;
+		}
+	}
+
+	*Offset = Net->SendPending;
+	return true;
+}
+
+// false for frame that can never be sent - over DERP limit, or larger than send buffer can grow
+static bool DerpNet__FrameFits(DerpNet* Net, size_t FrameSize)
+{
+	DerpNet__RecordLayout Layout;
+	DerpNet__GetRecordLayout(Net, &Layout);
+	return FrameSize <= (1 << 16) && DerpNet__RecordSpace(&Layout, FrameSize) <= Net->SendBufferLimit;
+}
+
+// frame is placed in outgoing data, and sent if batch is full, or its time is up
+static bool DerpNet__SendCommit(DerpNet* Net, size_t FrameSize, bool Wait)
+{
+	if (Net->SendPending == 0)
+	{
+		Net->SendPendingTime = Net->SendBatchTime ? DerpNet__Microseconds() : 0;
+	}
+	Net->SendPending += FrameSize;
+
+	if (Net->SendPending >= Net->SendBatchSize)
+	{
+		return DerpNet__Flush(Net, Wait);
+	}
+	if (Net->SendBatchTime && DerpNet__Microseconds() - Net->SendPendingTime >= Net->SendBatchTime)
+	{
+		return DerpNet__Flush(Net, Wait);
+	}
+	return true;
+}
+
+static bool DerpNet__TlsWrite(DerpNet* Net, const void* Data, size_t DataSize)
+{
+	DerpNet__RecordLayout Layout;
+	DerpNet__GetRecordLayout(Net, &Layout);
+
+	size_t Offset;
+	if (!DerpNet__SendReserve(Net, &Layout, DataSize, &Offset, true))
+	{
+		return false;
+	}
+	DerpNet__RecordWrite(Net, &Layout, Offset, Data, DataSize);
+
+	Net->SendPending += DataSize;
+	return DerpNet__Flush(Net, true);
+}
+
+//
+// Buffer = [......ppppppppppp.....eeeeeeeeeeeeeeeeeeeee..........]
+//                 ^          ^    ^                    ^
+//                 |          |    |                    |
+// BufferStart ----+          |    |                    |
+// BufferPlain ---------------+    |                    |
+// BufferCipher -------------------+                    |
+// BufferReceived --------------------------------------+
+//
+// consumed data only advances BufferStart and ciphertext is decrypted where it is,
+// so data is moved only when decrypted plaintext needs to be appended to previous
+// plaintext, or when end of buffer is reached and everything is moved to its start
+//
+
+static size_t DerpNet__BufferPlainSize(DerpNet* Net)
+{
+	return Net->BufferPlain - Net->BufferStart;
+}
+
+static void DerpNet__BufferCompact(DerpNet* Net)
+{
+	size_t PlainSize = Net->BufferPlain - Net->BufferStart;
+	size_t CipherSize = Net->BufferReceived - Net->BufferCipher;
+
+	memmove(Net->Buffer, Net->Buffer + Net->BufferStart, PlainSize);
+	memmove(Net->Buffer + PlainSize, Net->Buffer + Net->BufferCipher, CipherSize);
+	Net->TotalMoved += PlainSize + CipherSize;
+
+	Net->BufferStart = 0;
+	Net->BufferPlain = PlainSize;
+	Net->BufferCipher = PlainSize;
+	Net->BufferReceived = PlainSize + CipherSize;
+
+	DERPNET_LOG("compacted input buffer, BufferPlain=%zu, BufferReceived=%zu", Net->BufferPlain, Net->BufferReceived);
+}
+
+// makes space after received data when buffer is full, by moving data to its start or growing it
+static bool DerpNet__BufferReserve(DerpNet* Net)
+{
+	if (Net->BufferReceived == Net->BufferSize)
+	{
+		if (Net->BufferSize != 0)
+		{
+			DerpNet__BufferCompact(Net);
+		}
+		if (Net->BufferReceived == Net->BufferSize)
+		{
+			size_t NewSize = DerpNet__BufferGrowSize(Net->BufferSize, Net->BufferSize + 1, Net->BufferLimit);
+			if (NewSize == 0)
+			{
+				DERPNET_LOG("server is sending too much data instead of proper frames, or frame is over buffer limit?");
+				return false;
+			}
+			return DerpNet__BufferResize(Net, &Net->Buffer, &Net->BufferSize, NewSize, Net->BufferReceived);
+		}
+	}
+	return true;
+}
+
+// full size buffers were needed only for TLS handshake, after it they keep only what data in them needs
+static bool DerpNet__BufferTrim(DerpNet* Net)
+{
+	// io_uring keeps receive buffer it has registered
+	bool KeepBuffer = false;
+#if DERPNET_USE_IO_URING
+	KeepBuffer = Net->Ring.Fd >= 0;
+#endif
+	if (KeepBuffer)
+	{
+		Net->BufferLimit = Net->BufferSize;
+	}
+	else if (Net->BufferReceived == 0)
+	{
+		DerpNet__BufferResize(Net, &Net->Buffer, &Net->BufferSize, 0, 0);
+	}
+	else if (Net->BufferReceived - Net->BufferStart <= Net->BufferLimit)
+	{
+		DerpNet__BufferCompact(Net);
+		size_t NewSize = DerpNet__BufferGrowSize(0, Net->BufferReceived, Net->BufferLimit);
+		if (!DerpNet__BufferResize(Net, &Net->Buffer, &Net->BufferSize, NewSize, Net->BufferReceived))
+		{
+			return false;
+		}
+	}
+
+	if (Net->SendPending == 0)
+	{
+		DerpNet__BufferResize(Net, &Net->SendBuffer, &Net->SendBufferSize, 0, 0);
+	}
+	return true;
+}
+
+static int DerpNet__BufferRecv(DerpNet* Net, bool Wait)
+{
+	// waiting for response to message that is not sent yet would wait forever
+	if (Wait && !DerpNet__Flush(Net, true))
+	{
+		return -1;
+	}
+
+	if (!DerpNet__BufferReserve(Net))
+	{
+		return -1;
+	}
+
+#if DERPNET_USE_IO_URING
+	if (Net->Ring.Fd >= 0)
+	{
+		return DerpNet__RingRecv(Net, Wait);
+	}
+#endif
+
+	int ReadSize = DerpNet__SocketRecv(Net, Net->Buffer + Net->BufferReceived, Net->BufferSize - Net->BufferReceived, Wait);
+	if (ReadSize <= 0)
+	{
+		return ReadSize;
+	}
+	Net->BufferReceived += ReadSize;
+
+	DERPNET_LOG("read %d bytes from socket, BufferReceived=%zu", ReadSize, Net->BufferReceived);
+
+	return 1;
+}
+
+static bool DerpNet__TlsRead(DerpNet* Net, bool Wait)
+{
+#if DERPNET_USE_KERNEL_TLS
+	if (Net->KernelTlsRecvLater && Net->BufferCipher == Net->BufferReceived)
+	{
+		Net->KernelTlsRecvLater = false;
+		Net->KernelTlsRecv = DerpNet__KernelTlsEnable(Net, false);
+	}
+#endif
+
+	if (!Net->Tls || Net->KernelTlsRecv)
+	{
+		int Recv = DerpNet__BufferRecv(Net, Wait);
+		Net->BufferPlain = Net->BufferCipher = Net->BufferReceived;
+		return Recv >= 0;
+	}
+
+	for (;;)
+	{
+		size_t EncryptedSize = Net->BufferReceived - Net->BufferCipher;
+
+		if (EncryptedSize != 0)
+		{
+			size_t DataOffset;
+			size_t DataSize;
+			size_t RecordSize;
+
+			int Decrypted = Net->Tls->Decrypt(Net, Net->Buffer + Net->BufferCipher, EncryptedSize, &DataOffset, &DataSize, &RecordSize);
+			if (Decrypted < 0)
+			{
+				DERPNET_LOG("TLS protocol error when decrypting incoming data");
+				return false;
+			}
+
+			if (Decrypted > 0)
+			{
+				// new data is appended to previous plaintext, or if there is none, it becomes plaintext where it is
+
+				DataOffset += Net->BufferCipher;
+				DERPNET_ASSERT(DataOffset + DataSize <= Net->BufferCipher + RecordSize);
+				DERPNET_ASSERT(Net->BufferCipher + RecordSize <= Net->BufferReceived);
+
+				if (Net->BufferStart == Net->BufferPlain)
+				{
+					Net->BufferStart = Net->BufferPlain = DataOffset;
+				}
+				else
+				{
+					memmove(Net->Buffer + Net->BufferPlain, Net->Buffer + DataOffset, DataSize);
+					Net->TotalMoved += DataSize;
+				}
+				Net->BufferPlain += DataSize;
+				Net->BufferCipher += RecordSize;
+
+				DERPNET_LOG("TLS packet decrypted - decrypted=%zu, BufferStart=%zu, BufferPlain=%zu, BufferCipher=%zu, BufferReceived=%zu", DataSize, Net->BufferStart, Net->BufferPlain, Net->BufferCipher, Net->BufferReceived);
+
+				return true;
+			}
+		}
+
+		DERPNET_LOG("reading more data from socket, BufferPlain=%zu, BufferReceived=%zu", Net->BufferPlain, Net->BufferReceived);
+
+		int Recv = DerpNet__BufferRecv(Net, Wait);
+		if (Recv <= 0)
+		{
+			return Recv == 0;
+		}
+	}
+}
+
+static void DerpNet__TlsConsume(DerpNet* Net, size_t PlaintextSize)
+{
+	if (PlaintextSize == 0)
+	{
+		return;
+	}
+
+	DERPNET_ASSERT(PlaintextSize <= DerpNet__BufferPlainSize(Net));
+	Net->BufferStart += PlaintextSize;
+
+	// when everything is consumed, start from beginning of buffer again for free
+	// except when pending io_uring receive is still going to write after BufferReceived
+	bool RecvPending = false;
+#if DERPNET_USE_IO_URING
+	RecvPending = Net->Ring.RecvPending;
+#endif
+	if (Net->BufferStart == Net->BufferPlain && Net->BufferCipher == Net->BufferReceived && !RecvPending)
+	{
+		Net->BufferStart = Net->BufferPlain = Net->BufferCipher = Net->BufferReceived = 0;
+	}
+
+	DERPNET_LOG("consumed %zu bytes from input buffer, BufferStart=%zu, BufferPlain=%zu", PlaintextSize, Net->BufferStart, Net->BufferPlain);
+}
+
+static int DerpNet__ReadFrame(DerpNet* Net, uint8_t* FrameType, uint32_t* FrameSize, bool Wait)
+{
+	const size_t FrameHeaderSize = 1 + 4;
+
+	if (Wait)
+	{
+		for (;;)
+		{
+			if (DerpNet__BufferPlainSize(Net) < FrameHeaderSize)
+			{
+				if (!DerpNet__TlsRead(Net, Wait))
+				{
+					return -1;
+				}
+				continue;
+			}
+
+			*FrameType = Net->Buffer[Net->BufferStart];
+			*FrameSize = Get32BE(Net->Buffer + Net->BufferStart + 1);
+
+			if (DerpNet__BufferPlainSize(Net) < FrameHeaderSize + *FrameSize)
+			{
+				if (!DerpNet__TlsRead(Net, Wait))
+				{
+					return -1;
+				}
+				continue;
+			}
+
+			DerpNet__TlsConsume(Net, FrameHeaderSize);
+
+			DERPNET_LOG("received frame type=%u, size=%u, BufferStart=%zu, BufferPlain=%zu", *FrameType, *FrameSize, Net->BufferStart, Net->BufferPlain);
+			return 1;
+		}
+	}
+
+	// frames already in buffer are returned first, socket is read only when there is no full frame
+	for (;;)
+	{
+		size_t LastBufferSize = DerpNet__BufferPlainSize(Net);
+		size_t LastCipher = Net->BufferCipher;
+		size_t LastReceived = Net->BufferReceived;
+
+		if (LastBufferSize >= FrameHeaderSize)
+		{
+			*FrameType = Net->Buffer[Net->BufferStart];
+			*FrameSize = Get32BE(Net->Buffer + Net->BufferStart + 1);
+
+			if (LastBufferSize >= FrameHeaderSize + *FrameSize)
+			{
+				DerpNet__TlsConsume(Net, FrameHeaderSize);
+
+				DERPNET_LOG("received frame type=%u, size=%u, BufferStart=%zu, BufferPlain=%zu", *FrameType, *FrameSize, Net->BufferStart, Net->BufferPlain);
+				return 1;
+			}
+		}
+
+		if (!DerpNet__TlsRead(Net, Wait))
+		{
+			return -1;
+		}
+
+		// record without application data (session ticket) changes only cipher position, more may follow in buffer
+		if (DerpNet__BufferPlainSize(Net) == LastBufferSize && Net->BufferCipher == LastCipher && Net->BufferReceived == LastReceived)
+		{
+			return 0;
+		}
+	}
+}
+
+//
+// connecting - name is resolved on separate thread while local key work runs, then attempts to
+// all resolved addresses are started one after another with small delay, alternating between
+// IPv6 and IPv4, and first one that connects is used (RFC 8305 happy eyeballs)
+//
+
+// delay before starting next connection attempt, in milliseconds
+#define DERPNET_CONNECT_DELAY 250
+
+// how long connection to cached address can take, before hostname is resolved again
+#define DERPNET_CONNECT_CACHED_TIMEOUT 1000
+
+// most addresses that are tried in parallel
+#define DERPNET_CONNECT_MAX 8
+
+// most sockets that can be waited on at once, while connecting or probing servers
+#define DERPNET_WAIT_MAX 32
+
+// resolver is shared with its thread, whoever releases it last frees it - so opening that
+// does not wait for result can be closed while getaddrinfo still runs
+typedef struct {
+	char Hostname[256];
+	char Port[8];
+	struct addrinfo* AddrInfo;
+	int Error;
+	bool Started;
+	volatile long Refs;
+#if defined(_WIN32)
+	HANDLE Thread;
+#else
+	pthread_t Thread;
+#endif
+} DerpNet__Resolver;
+
+static void DerpNet__Resolve(DerpNet__Resolver* Resolver)
+{
+	struct addrinfo AddrHints =
+	{
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	Resolver->Error = getaddrinfo(Resolver->Hostname, Resolver->Port, &AddrHints, &Resolver->AddrInfo);
+}
+
+static void DerpNet__ResolveRelease(DerpNet__Resolver* Resolver)
+{
+#if defined(_WIN32)
+	long Refs = InterlockedDecrement(&Resolver->Refs);
+#else
+	long Refs = __atomic_sub_fetch(&Resolver->Refs, 1, __ATOMIC_ACQ_REL);
+#endif
+	if (Refs == 0)
+	{
+		if (Resolver->AddrInfo)
+		{
+			freeaddrinfo(Resolver->AddrInfo);
+		}
+		free(Resolver);
+	}
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI DerpNet__ResolveThread(LPVOID Arg)
+#else
+static void* DerpNet__ResolveThread(void* Arg)
+#endif
+{
+	DerpNet__Resolver* Resolver = (DerpNet__Resolver*)Arg;
+	DerpNet__Resolve(Resolver);
+	DerpNet__ResolveRelease(Resolver);
+	return 0;
+}
+
+// returns NULL when there is not enough memory
+static DerpNet__Resolver* DerpNet__ResolveStart(const char* Hostname, uint16_t Port)
+{
+	DerpNet__Resolver* Resolver = (DerpNet__Resolver*)malloc(sizeof(*Resolver));
+	if (!Resolver)
+	{
+		DERPNET_LOG("not enough memory for resolving hostname");
+		return NULL;
+	}
+
+	DERPNET_ASSERT(strlen(Hostname) < sizeof(Resolver->Hostname));
+	strcpy(Resolver->Hostname, Hostname);
+	snprintf(Resolver->Port, sizeof(Resolver->Port), "%u", Port);
+	Resolver->AddrInfo = NULL;
+	Resolver->Error = 0;
+	Resolver->Refs = 2;
+
+#if defined(_WIN32)
+	Resolver->Thread = CreateThread(NULL, 0, &DerpNet__ResolveThread, Resolver, 0, NULL);
+	Resolver->Started = Resolver->Thread != NULL;
+#else
+	Resolver->Started = pthread_create(&Resolver->Thread, NULL, &DerpNet__ResolveThread, Resolver) == 0;
+#endif
+	if (!Resolver->Started)
+	{
+		DERPNET_LOG("cannot create thread for resolving hostname, will resolve it later");
+		Resolver->Refs = 1;
+	}
+	return Resolver;
+}
+
+// true when DerpNet__ResolveFinish will not block on thread
+static bool DerpNet__ResolveDone(DerpNet__Resolver* Resolver)
+{
+	if (!Resolver || !Resolver->Started)
+	{
+		return true;
+	}
+#if defined(_WIN32)
+	return WaitForSingleObject(Resolver->Thread, 0) == WAIT_OBJECT_0;
+#else
+	return __atomic_load_n(&Resolver->Refs, __ATOMIC_ACQUIRE) == 1;
+#endif
+}
+
+// returns resolved addresses, or NULL on failure - resolver is freed
+static struct addrinfo* DerpNet__ResolveFinish(DerpNet__Resolver* Resolver)
+{
+	if (!Resolver)
+	{
+		return NULL;
+	}
+
+	if (Resolver->Started)
+	{
+#if defined(_WIN32)
+		WaitForSingleObject(Resolver->Thread, INFINITE);
+		CloseHandle(Resolver->Thread);
+#else
+		pthread_join(Resolver->Thread, NULL);
+#endif
+	}
+	else
+	{
+		DerpNet__Resolve(Resolver);
+	}
+
+	struct addrinfo* AddrInfo = NULL;
+	if (Resolver->Error != 0)
+	{
+		DERPNET_LOG("cannot resolve '%s' hostname", Resolver->Hostname);
+	}
+	else
+	{
+		AddrInfo = Resolver->AddrInfo;
+		Resolver->AddrInfo = NULL;
+	}
+	DerpNet__ResolveRelease(Resolver);
+	return AddrInfo;
+}
+
+// thread is left running, it frees resolver when getaddrinfo returns
+static void DerpNet__ResolveCancel(DerpNet__Resolver* Resolver)
+{
+	if (Resolver->Started)
+	{
+#if defined(_WIN32)
+		CloseHandle(Resolver->Thread);
+#else
+		pthread_detach(Resolver->Thread);
+#endif
+	}
+	DerpNet__ResolveRelease(Resolver);
+}
+
+typedef struct {
+	const struct sockaddr* Address[DERPNET_CONNECT_MAX];
+	int AddressSize[DERPNET_CONNECT_MAX];
+	uintptr_t Socket[DERPNET_CONNECT_MAX];
+	size_t Count;
+	size_t Started;
+	uint64_t NextStart; // when to start next attempt, in microseconds
+	uint64_t Deadline;  // 0 means no limit, attempts fail only when OS gives up
+} DerpNet__Connector;
+
+static void DerpNet__SocketBlocking(uintptr_t Socket, bool Blocking)
+{
+#if defined(_WIN32)
+	u_long NonBlocking = Blocking ? 0 : 1;
+	ioctlsocket((DerpNet__Socket)Socket, FIONBIO, &NonBlocking);
+#else
+	int Flags = fcntl((DerpNet__Socket)Socket, F_GETFL);
+	fcntl((DerpNet__Socket)Socket, F_SETFL, Blocking ? (Flags & ~O_NONBLOCK) : (Flags | O_NONBLOCK));
+#endif
+}
+
+static void DerpNet__SocketDestroy(uintptr_t Socket)
+{
+#if defined(_WIN32)
+	closesocket((DerpNet__Socket)Socket);
+#else
+	close((DerpNet__Socket)Socket);
+#endif
+}
+
+// waits until any of sockets is ready for writing (Write[i] set) or reading, or has error
+// sets Ready[i] for each of them, returns false on failure - on timeout all Ready are false
+static bool DerpNet__SocketWaitMany(DerpNet* Net, const uintptr_t* Sockets, const bool* Write, bool* Ready, size_t Count, int Timeout)
+{
+#if defined(_WIN32)
+	fd_set ReadSet, WriteSet, ErrorSet;
+	FD_ZERO(&ReadSet);
+	FD_ZERO(&WriteSet);
+	FD_ZERO(&ErrorSet);
+	for (size_t i = 0; i < Count; i++)
+	{
+		// failed connection attempt is reported only in error set on Windows
+		FD_SET((DerpNet__Socket)Sockets[i], Write[i] ? &WriteSet : &ReadSet);
+		FD_SET((DerpNet__Socket)Sockets[i], &ErrorSet);
+	}
+	struct timeval Time = { Timeout / 1000, Timeout % 1000 * 1000 };
+	int Result = select(0, &ReadSet, &WriteSet, &ErrorSet, Timeout < 0 ? NULL : &Time);
+	if (Net)
+	{
+		Net->TotalSyscalls++;
+	}
+	if (Result < 0)
+	{
+		DERPNET_LOG("select failed");
+		return false;
+	}
+	for (size_t i = 0; i < Count; i++)
+	{
+		DerpNet__Socket Socket = (DerpNet__Socket)Sockets[i];
+		Ready[i] = FD_ISSET(Socket, &ReadSet) || FD_ISSET(Socket, &WriteSet) || FD_ISSET(Socket, &ErrorSet);
+	}
+#else
+	struct pollfd Poll[DERPNET_WAIT_MAX];
+	DERPNET_ASSERT(Count <= DERPNET_WAIT_MAX);
+	for (size_t i = 0; i < Count; i++)
+	{
+		Poll[i].fd = (DerpNet__Socket)Sockets[i];
+		Poll[i].events = Write[i] ? POLLOUT : POLLIN;
+		Poll[i].revents = 0;
+	}
+	int Result = poll(Poll, Count, Timeout);
+	if (Net)
+	{
+		Net->TotalSyscalls++;
+	}
+	if (Result < 0 && errno != EINTR)
+	{
+		DERPNET_LOG("poll failed");
+		return false;
+	}
+	for (size_t i = 0; i < Count; i++)
+	{
+		Ready[i] = Result > 0 && Poll[i].revents != 0;
+	}
+#endif
+	return true;
+}
+
+// starts next connection attempt, returns false if there are no more addresses to try
+static bool DerpNet__ConnectNext(DerpNet__Connector* Connector)
+{
+	while (Connector->Started != Connector->Count)
+	{
+		size_t Index = Connector->Started++;
+		const struct sockaddr* Address = Connector->Address[Index];
+
+		uintptr_t Socket = (uintptr_t)socket(Address->sa_family, SOCK_STREAM, IPPROTO_TCP);
+		if (Socket == DERPNET_INVALID_SOCKET)
+		{
+			continue;
+		}
+		DerpNet__SocketBlocking(Socket, false);
+
+		if (connect((DerpNet__Socket)Socket, Address, Connector->AddressSize[Index]) != 0)
+		{
+#if defined(_WIN32)
+			bool Pending = WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+			bool Pending = errno == EINPROGRESS || errno == EINTR;
+#endif
+			if (!Pending)
+			{
+				// for example, no IPv6 route - try next address immediately
+				DerpNet__SocketDestroy(Socket);
+				continue;
+			}
+		}
+
+		Connector->Socket[Index] = Socket;
+		Connector->NextStart = DerpNet__Microseconds() + DERPNET_CONNECT_DELAY * 1000;
+		return true;
+	}
+	return false;
+}
+
+// Addresses are in order they should be tried
+static void DerpNet__ConnectStart(DerpNet__Connector* Connector, const struct sockaddr** Addresses, const int* AddressSizes, size_t Count, uint32_t Timeout)
+{
+	Count = DerpNet__Min(Count, DERPNET_CONNECT_MAX);
+
+	for (size_t i = 0; i < Count; i++)
+	{
+		Connector->Address[i] = Addresses[i];
+		Connector->AddressSize[i] = AddressSizes[i];
+		Connector->Socket[i] = DERPNET_INVALID_SOCKET;
+	}
+	Connector->Count = Count;
+	Connector->Started = 0;
+	Connector->Deadline = Timeout ? DerpNet__Microseconds() + Timeout * 1000 : 0;
+
+	DerpNet__ConnectNext(Connector);
+}
+
+// first address family goes first, then families alternate
+static void DerpNet__ConnectStartAll(DerpNet__Connector* Connector, const struct addrinfo* AddrInfo)
+{
+	const struct sockaddr* Addresses[2][DERPNET_CONNECT_MAX];
+	int AddressSizes[2][DERPNET_CONNECT_MAX];
+	size_t Counts[2] = { 0, 0 };
+
+	int FirstFamily = AddrInfo ? AddrInfo->ai_family : AF_UNSPEC;
+	for (const struct addrinfo* Info = AddrInfo; Info; Info = Info->ai_next)
+	{
+		size_t Family = Info->ai_family == FirstFamily ? 0 : 1;
+		if (Counts[Family] < DERPNET_CONNECT_MAX)
+		{
+			Addresses[Family][Counts[Family]] = Info->ai_addr;
+			AddressSizes[Family][Counts[Family]] = (int)Info->ai_addrlen;
+			Counts[Family]++;
+		}
+	}
+
+	const struct sockaddr* Ordered[DERPNET_CONNECT_MAX];
+	int OrderedSizes[DERPNET_CONNECT_MAX];
+	size_t Count = 0;
+	for (size_t i = 0; Count < DERPNET_CONNECT_MAX && (i < Counts[0] || i < Counts[1]); i++)
+	{
+		for (size_t Family = 0; Family < 2 && Count < DERPNET_CONNECT_MAX; Family++)
+		{
+			if (i < Counts[Family])
+			{
+				Ordered[Count] = Addresses[Family][i];
+				OrderedSizes[Count] = AddressSizes[Family][i];
+				Count++;
+			}
+		}
+	}
+
+	DerpNet__ConnectStart(Connector, Ordered, OrderedSizes, Count, 0);
+}
+
+// returned when Wait=false and no attempt has finished yet, all of them are kept running
+#define DERPNET_CONNECT_PENDING (-2)
+
+// waits until one of attempts connects, returns its index or -1 if all of them failed
+// connected socket is put into Net->Socket in blocking mode, all other attempts are closed
+static int DerpNet__ConnectFinish(DerpNet* Net, DerpNet__Connector* Connector, bool Wait)
+{
+	int Winner = -1;
+
+	for (;;)
+	{
+		size_t Pending = 0;
+		for (size_t i = 0; i < Connector->Started; i++)
+		{
+			Pending += Connector->Socket[i] != DERPNET_INVALID_SOCKET;
+		}
+		if (Pending == 0 && !DerpNet__ConnectNext(Connector))
+		{
+			break;
+		}
+
+		uint64_t Now = DerpNet__Microseconds();
+		if (Connector->Deadline && Now >= Connector->Deadline)
+		{
+			DERPNET_LOG("connection attempt timed out");
+			break;
+		}
+
+		int Timeout = -1;
+		if (!Wait)
+		{
+			Timeout = 0;
+		}
+		else if (Connector->Started != Connector->Count)
+		{
+			Timeout = Connector->NextStart > Now ? (int)((Connector->NextStart - Now + 999) / 1000) : 0;
+		}
+		if (Wait && Connector->Deadline)
+		{
+			int Remaining = (int)((Connector->Deadline - Now + 999) / 1000);
+			Timeout = Timeout < 0 ? Remaining : Timeout < Remaining ? Timeout : Remaining;
+		}
+
+		// socket becomes writable when connection attempt finishes, successfully or not
+		uintptr_t Sockets[DERPNET_CONNECT_MAX];
+		size_t Index[DERPNET_CONNECT_MAX];
+		bool Write[DERPNET_CONNECT_MAX];
+		bool Ready[DERPNET_CONNECT_MAX];
+		size_t Count = 0;
+		for (size_t i = 0; i < Connector->Started; i++)
+		{
+			if (Connector->Socket[i] != DERPNET_INVALID_SOCKET)
+			{
+				Sockets[Count] = Connector->Socket[i];
+				Write[Count] = true;
+				Index[Count++] = i;
+			}
+		}
+
+		if (!DerpNet__SocketWaitMany(Net, Sockets, Write, Ready, Count, Timeout))
+		{
+			break;
+		}
+
+		bool Any = false;
+		for (size_t i = 0; i < Count && Winner < 0; i++)
+		{
+			if (!Ready[i])
+			{
+				continue;
+			}
+			Any = true;
+
+			int Error = 0;
+			socklen_t ErrorSize = sizeof(Error);
+			if (getsockopt((DerpNet__Socket)Sockets[i], SOL_SOCKET, SO_ERROR, (char*)&Error, &ErrorSize) == 0 && Error == 0)
+			{
+				Winner = (int)Index[i];
+			}
+			else
+			{
+				// failed attempt does not wait for delay, next address is tried immediately
+				DerpNet__SocketDestroy(Sockets[i]);
+				Connector->Socket[Index[i]] = DERPNET_INVALID_SOCKET;
+				Connector->NextStart = 0;
+			}
+		}
+
+		if (!Any && DerpNet__Microseconds() >= Connector->NextStart)
+		{
+			// slow attempt keeps running, next one starts in parallel
+			DerpNet__ConnectNext(Connector);
+		}
+
+		if (Winner >= 0)
+		{
+			break;
+		}
+
+		if (!Wait)
+		{
+			for (size_t i = 0; i < Connector->Started; i++)
+			{
+				if (Connector->Socket[i] != DERPNET_INVALID_SOCKET)
+				{
+					return DERPNET_CONNECT_PENDING;
+				}
+			}
+		}
+	}
+
+	for (size_t i = 0; i < Connector->Started; i++)
+	{
+		if (Connector->Socket[i] != DERPNET_INVALID_SOCKET && (int)i != Winner)
+		{
+			DerpNet__SocketDestroy(Connector->Socket[i]);
+		}
+	}
+
+	if (Winner >= 0)
+	{
+		Net->Socket = Connector->Socket[Winner];
+		DerpNet__SocketBlocking(Net->Socket, true);
+	}
+	return Winner;
+}
+
+static const char DerpNet__ClientInfo[] = "{\"version\": 2}";
+
+#define DERPNET_CLIENT_INFO_FRAME_SIZE (1 + 4 + 32 + 24 + 16 + sizeof(DerpNet__ClientInfo) - 1)
+
+static void DerpNet__ClientInfoFrame(DerpNet* Net, uint8_t* OutFrame, const DerpKey* UserSecret, const DerpKey* UserPublicKey, const uint8_t ServerPublicKey[32])
+{
+	OutFrame[0] = 2; // ClientInfo
+	Set32BE(OutFrame + 1, DERPNET_CLIENT_INFO_FRAME_SIZE - (1 + 4));
+	memcpy(OutFrame + 1 + 4, UserPublicKey->Bytes, sizeof(UserPublicKey->Bytes));
+	DerpNet__Random(&Net->Random, OutFrame + 1 + 4 + 32, 24);
+	DerpNet__BoxSeal(OutFrame + 1 + 4 + 32, OutFrame + 1 + 4 + 32 + 24, OutFrame + 1 + 4 + 32 + 24 + 16, (const uint8_t*)DerpNet__ClientInfo, sizeof(DerpNet__ClientInfo) - 1, UserSecret->Bytes, ServerPublicKey);
+}
+
+bool DerpNet_Open(DerpNet* Net, const char* DerpServer, const DerpKey* UserSecret)
+{
+	return DerpNet_OpenEx(Net, DerpServer, UserSecret, NULL);
+}
+
+//
+// opening connection - runs as sequence of stages, so same code can either wait in each of them
+// (DerpNet_OpenEx), or return when stage cannot continue without waiting (DerpNet_OpenAsync)
+//
+
+#define DERPNET_OPEN_RESOLVE    0
+#define DERPNET_OPEN_CONNECT    1
+#define DERPNET_OPEN_HANDSHAKE  2
+#define DERPNET_OPEN_SERVER_KEY 3
+#define DERPNET_OPEN_SERVER_INFO 4
+
+// resolver thread cannot be waited on together with sockets, so it is checked this often, in msec
+#define DERPNET_RESOLVE_POLL 5
+
+typedef struct {
+	int Stage;
+	bool Allocated;   // by DerpNet_OpenAsync, freed when connection is open or fails
+	bool Cached;      // connecting to address from session
+	bool NonBlocking; // socket is already switched to non-blocking mode
+	bool ClientInfoSent;
+	char Hostname[256];
+	uint16_t Port;
+	DerpNetConfig Config;
+	DerpKey UserSecret;
+	DerpKey UserPublicKey;
+	uint8_t ServerPublicKey[32];
+	uint8_t ClientInfoFrame[DERPNET_CLIENT_INFO_FRAME_SIZE];
+	uint64_t Start;
+	DerpNet__Resolver* Resolver;
+	struct addrinfo* AddrInfo;
+	DerpNet__Connector Connector;
+} DerpNet__Opening;
+
+static bool DerpNet__OpenStart(DerpNet* Net, DerpNet__Opening* Opening, const char* DerpServer, const DerpKey* UserSecret, const DerpNetConfig* Config)
+{
+	DerpNetConfig DefaultConfig = { .PlainHttp = DERPNET_USE_PLAIN_HTTP };
+	if (!Config)
+	{
+		Config = &DefaultConfig;
+	}
+
+	const DerpNetTls* Tls = NULL;
+	if (!Config->PlainHttp)
+	{
+		Tls = Config->Tls ? Config->Tls : DERPNET_DEFAULT_TLS;
+		if (!Tls)
+		{
+			DERPNET_LOG("no built-in TLS on this platform, set DerpNetConfig.Tls or use plain HTTP");
+			return false;
+		}
+	}
+
+	if (strlen(DerpServer) >= sizeof(Opening->Hostname))
+	{
+		DERPNET_LOG("DERP server hostname is too long");
+		return false;
+	}
+
+	if (!DerpNet__AllocatorValid(Config->Allocator))
+	{
+		return false;
+	}
+
+	uint16_t Port = Config->Port ? Config->Port : Tls ? 443 : 80;
+
+	// everything in session belongs to one server
+	DerpNetSession* Session = Config->Session;
+	if (Session && (Session->Port != Port || strcmp(Session->Server, DerpServer) != 0))
+	{
+		if (strlen(DerpServer) >= sizeof(Session->Server))
+		{
+			Session = NULL;
+		}
+		else
+		{
+			memset(Session, 0, sizeof(*Session));
+			strcpy(Session->Server, DerpServer);
+			Session->Port = Port;
+		}
+	}
+
+	Net->Allocator = Config->Allocator ? *Config->Allocator : (DerpNetAllocator){ 0 };
+	Net->MemoryUsed = Net->MemoryPeak = 0;
+	Net->Buffer = Net->SendBuffer = Net->SendQueue = NULL;
+	Net->BufferSize = Net->SendBufferSize = Net->SendQueueSize = 0;
+
+	// limits apply once connection is open, TLS needs space for full record
+	size_t RecvLimit = Config->RecvBufferSize ? DerpNet__Min(Config->RecvBufferSize, DERPNET_RECV_BUFFER_SIZE) : DERPNET_RECV_BUFFER_SIZE;
+	size_t SendLimit = Config->SendBufferSize ? DerpNet__Min(Config->SendBufferSize, DERPNET_SEND_BUFFER_SIZE) : DERPNET_SEND_BUFFER_SIZE;
+	Net->BufferLimit = DerpNet__Max(RecvLimit, Tls ? (1 << 15) : DERPNET_BUFFER_START_SIZE);
+	Net->SendBufferLimit = DerpNet__Max(SendLimit, DERPNET_BUFFER_START_SIZE);
+
+	// TLS handshakes expect full size buffers, without TLS they grow as needed from start
+	if (Tls && (!DerpNet__BufferResize(Net, &Net->Buffer, &Net->BufferSize, DERPNET_RECV_BUFFER_SIZE, 0)
+		|| !DerpNet__BufferResize(Net, &Net->SendBuffer, &Net->SendBufferSize, DERPNET_SEND_BUFFER_SIZE, 0)))
+	{
+		DerpNet__BufferFreeAll(Net);
+		return false;
+	}
+
+	Opening->Stage = DERPNET_OPEN_RESOLVE;
+	Opening->NonBlocking = false;
+	strcpy(Opening->Hostname, DerpServer);
+	Opening->Port = Port;
+	Opening->Config = *Config;
+	Opening->Config.Tls = Tls;
+	Opening->Config.Session = Session;
+	Opening->Config.Allocator = &Net->Allocator;
+	Opening->UserSecret = *UserSecret;
+	Opening->Resolver = NULL;
+	Opening->AddrInfo = NULL;
+
+	Net->Opening = Opening;
+	Net->Socket = DERPNET_INVALID_SOCKET;
+#if defined(_WIN32)
+	Net->SocketEvent = NULL;
+#else
+	Net->SocketPoll = -1;
+#endif
+#if defined(__linux__)
+	memset(&Net->Ring, 0, sizeof(Net->Ring));
+	Net->Ring.Fd = -1;
+#endif
+	Net->Tls = NULL;
+	memset(&Net->Tls13, 0, sizeof(Net->Tls13));
+	Net->Verify = Config->Verify;
+	Net->VerifyUser = Config->VerifyUser;
+	Net->Session = Session;
+	Net->KernelTlsSend = Net->KernelTlsRecv = Net->KernelTlsRecvLater = false;
+	Net->BufferStart = Net->BufferPlain = Net->BufferCipher = Net->BufferReceived = 0;
+	Net->TotalReceived = Net->TotalSent = Net->TotalMoved = Net->TotalSyscalls = Net->TotalRecords = 0;
+	Net->SendPending = 0;
+	Net->SendBatchSize = 0;
+	Net->SendBatchTime = 0;
+	Net->SendQueueStart = Net->SendQueued = Net->SendQueuedPeak = 0;
+	Net->SendQueueLimit = DERPNET_SEND_QUEUE_SIZE;
+
+	bool SocketStarted = DerpNet__SocketStartup();
+	DERPNET_ASSERT(SocketStarted);
+
+	//
+	// connect to DERP server
+	//
+
+	Opening->Start = DerpNet__Microseconds();
+	memset(&Net->OpenTimes, 0, sizeof(Net->OpenTimes));
+
+	Opening->Cached = Session && Session->AddressSize != 0;
+	if (Opening->Cached)
+	{
+		const struct sockaddr* Address = (const struct sockaddr*)Session->Address;
+		int AddressSize = (int)Session->AddressSize;
+		DerpNet__ConnectStart(&Opening->Connector, &Address, &AddressSize, 1, DERPNET_CONNECT_CACHED_TIMEOUT);
+		Opening->Stage = DERPNET_OPEN_CONNECT;
+	}
+	else
+	{
+		Opening->Resolver = DerpNet__ResolveStart(Opening->Hostname, Port);
+	}
+
+	//
+	// local key work runs while waiting for network
+	//
+
+	DerpNet__KeyCacheReset(Net);
+	DerpNet__RandomReset(&Net->Random);
+
+	DerpNet_GetPublicKey(UserSecret, &Opening->UserPublicKey);
+
+	// when server key is known from previous connection, ClientInfo frame goes together
+	// with GET request, so there is no need to wait for ServerKey frame before sending it
+	Opening->ClientInfoSent = Session && Session->HasServerKey;
+	if (Opening->ClientInfoSent)
+	{
+		memcpy(Opening->ServerPublicKey, Session->ServerKey, sizeof(Opening->ServerPublicKey));
+		DerpNet__ClientInfoFrame(Net, Opening->ClientInfoFrame, UserSecret, &Opening->UserPublicKey, Opening->ServerPublicKey);
+	}
+
+	return true;
+}
+
+// releases everything opening holds, except connected socket & TLS state
+static void DerpNet__OpenEnd(DerpNet* Net)
+{
+	DerpNet__Opening* Opening = (DerpNet__Opening*)Net->Opening;
+
+	if (Opening->Resolver)
+	{
+		DerpNet__ResolveCancel(Opening->Resolver);
+	}
+	if (Opening->AddrInfo)
+	{
+		freeaddrinfo(Opening->AddrInfo);
+	}
+	if (Opening->Stage == DERPNET_OPEN_CONNECT)
+	{
+		for (size_t i = 0; i < Opening->Connector.Started; i++)
+		{
+			if (Opening->Connector.Socket[i] != DERPNET_INVALID_SOCKET)
+			{
+				DerpNet__SocketDestroy(Opening->Connector.Socket[i]);
+			}
+		}
+	}
+
+	bool Allocated = Opening->Allocated;
+	memset(Opening, 0, sizeof(*Opening));
+	if (Allocated)
+	{
+		DerpNet__Free(&Net->Allocator, Opening, sizeof(*Opening));
+	}
+	Net->Opening = NULL;
+}
+
+static void DerpNet__OpenAbort(DerpNet* Net)
+{
+	if (Net->Tls)
+	{
+		Net->Tls->Close(Net);
+	}
+	DerpNet__SocketClose(Net);
+	DerpNet__OpenEnd(Net);
+	DerpNet__BufferFreeAll(Net);
+	DerpNet__SocketCleanup();
+}
+
+// does not touch hub fields, so retry keeps connection in its hub
+static bool DerpNet__OpenAsync(DerpNet* Net, const char* DerpServer, const DerpKey* UserSecret, const DerpNetConfig* Config)
+{
+	if (Config && !DerpNet__AllocatorValid(Config->Allocator))
+	{
+		return false;
+	}
+	DerpNetAllocator Allocator = Config && Config->Allocator ? *Config->Allocator : (DerpNetAllocator){ 0 };
+
+	DerpNet__Opening* Opening = (DerpNet__Opening*)DerpNet__Alloc(&Allocator, sizeof(*Opening));
+	if (!Opening)
+	{
+		DERPNET_LOG("not enough memory for opening connection");
+		return false;
+	}
+	Opening->Allocated = true;
+
+	if (!DerpNet__OpenStart(Net, Opening, DerpServer, UserSecret, Config))
+	{
+		DerpNet__Free(&Allocator, Opening, sizeof(*Opening));
+		return false;
+	}
+	return true;
+}
+
+// runs stages of opening connection, with Wait=true until connection is open or fails
+// returns 1 when connection is open, 0 when Wait=false and stage needs to wait, -1 on failure
+static int DerpNet__OpenStep(DerpNet* Net, bool Wait)
+{
+	DerpNet__Opening* Opening = (DerpNet__Opening*)Net->Opening;
+	const DerpNetConfig* Config = &Opening->Config;
+	DerpNetSession* Session = Config->Session;
+	const char* DerpServer = Opening->Hostname;
+	bool RetryOpen = false;
+
+	if (Opening->Stage == DERPNET_OPEN_RESOLVE)
+	{
+		if (!Wait && !DerpNet__ResolveDone(Opening->Resolver))
+		{
+			return 0;
+		}
+
+		Opening->AddrInfo = DerpNet__ResolveFinish(Opening->Resolver);
+		Opening->Resolver = NULL;
+		if (!Opening->AddrInfo)
+		{
+			goto error;
+		}
+		Net->OpenTimes.Resolve = (uint32_t)(DerpNet__Microseconds() - Opening->Start);
+
+		DerpNet__ConnectStartAll(&Opening->Connector, Opening->AddrInfo);
+		Opening->Stage = DERPNET_OPEN_CONNECT;
+	}
+
+	if (Opening->Stage == DERPNET_OPEN_CONNECT)
+	{
+		DerpNet__Connector* Connector = &Opening->Connector;
+
+		int Connected = DerpNet__ConnectFinish(Net, Connector, Wait);
+		if (Connected == DERPNET_CONNECT_PENDING)
+		{
+			return 0;
+		}
+		Net->OpenTimes.ConnectAttempts += (uint32_t)Connector->Started;
+
+		if (Connected < 0 && Opening->Cached)
+		{
+			DERPNET_LOG("cannot connect to cached server address, resolving hostname again");
+			Session->AddressSize = 0;
+			Opening->Cached = false;
+			Opening->Resolver = DerpNet__ResolveStart(DerpServer, Opening->Port);
+			Opening->Stage = DERPNET_OPEN_RESOLVE;
+			return Wait ? DerpNet__OpenStep(Net, Wait) : 0;
+		}
+		if (Connected < 0)
+		{
+			DERPNET_LOG("cannot connect to '%s' server", DerpServer);
+			Opening->Stage = DERPNET_OPEN_HANDSHAKE;
+			goto error;
+		}
+		Opening->Stage = DERPNET_OPEN_HANDSHAKE;
+
+		if (Opening->Cached)
+		{
+			DERPNET_LOG("connected to cached server address");
+		}
+		else
+		{
+			const struct sockaddr* Address = Connector->Address[Connected];
+			int AddressSize = Connector->AddressSize[Connected];
+
+#if !defined(NDEBUG)
+			char AddressText[128];
+			getnameinfo(Address, AddressSize, AddressText, sizeof(AddressText), NULL, 0, NI_NUMERICHOST);
+			DERPNET_LOG("connected to '%s' -> '%s' server after %u attempts", DerpServer, AddressText, Net->OpenTimes.ConnectAttempts);
+#endif
+
+			if (Session && (size_t)AddressSize <= sizeof(Session->Address))
+			{
+				memcpy(Session->Address, Address, AddressSize);
+				Session->AddressSize = (uint32_t)AddressSize;
+			}
+
+			freeaddrinfo(Opening->AddrInfo);
+			Opening->AddrInfo = NULL;
+		}
+		Net->OpenTimes.Connect = (uint32_t)(DerpNet__Microseconds() - Opening->Start);
+
+		// every send is complete frame or TLS record, no reason to wait for more data
+		int NoDelay = 1;
+		setsockopt((DerpNet__Socket)Net->Socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&NoDelay, sizeof(NoDelay));
+
+		Net->Tls = Config->Tls;
+
+		// handshake that can run in steps gets non-blocking socket right away
+		if (!Wait && (!Net->Tls || Net->Tls->HandshakeStep))
+		{
+			if (!DerpNet__SocketNonBlocking(Net))
+			{
+				goto error;
+			}
+			Opening->NonBlocking = true;
+		}
+	}
+
+	if (Opening->Stage == DERPNET_OPEN_HANDSHAKE)
+	{
+		const DerpNetTls* Tls = Net->Tls;
+		if (Tls)
+		{
+			if (Opening->NonBlocking)
+			{
+				int Done = Tls->HandshakeStep(Net, DerpServer);
+				if (Done == 0)
+				{
+					return 0;
+				}
+				if (Done < 0)
+				{
+					goto error;
+				}
+			}
+			else if (!Tls->Handshake(Net, DerpServer))
+			{
+				goto error;
+			}
+
+#if DERPNET_USE_KERNEL_TLS
+			if (Config->KernelTls && Tls->ExportKeys)
+			{
+				DerpNet__KernelTlsInit(Net);
+			}
+#endif
+		}
+		Net->OpenTimes.Handshake = (uint32_t)(DerpNet__Microseconds() - Opening->Start);
+
+		if (!Opening->NonBlocking)
+		{
+			// with own event loop io_uring would be hidden from it
+			bool RingOk = false;
+#if DERPNET_USE_IO_URING
+			RingOk = Wait && Config->IoUring && DerpNet__RingInit(Net);
+#endif
+			if (!RingOk && !DerpNet__SocketNonBlocking(Net))
+			{
+				goto error;
+			}
+			Opening->NonBlocking = true;
+		}
+
+		DerpNet__InitRecordLayout(Net);
+
+		//
+		// send inital HTTP GET request, ask to switch to DERP protocol immediately
+		//
+
+		char HttpInit[256 + DERPNET_CLIENT_INFO_FRAME_SIZE];
+		int HttpInitLen = snprintf(HttpInit, 256,
+			"GET /derp HTTP/1.1\r\n"
+			"Host: %s\r\n"
+			"Connection: Upgrade\r\n"
+			"Upgrade: DERP\r\n"
+			"Derp-Fast-Start: 1\r\n"
+			"\r\n",
+			DerpServer);
+
+		if (Opening->ClientInfoSent)
+		{
+			memcpy(HttpInit + HttpInitLen, Opening->ClientInfoFrame, sizeof(Opening->ClientInfoFrame));
+			HttpInitLen += sizeof(Opening->ClientInfoFrame);
+		}
+
+		if (!DerpNet__TlsWrite(Net, HttpInit, HttpInitLen))
+		{
+			goto error;
+		}
+
+		Opening->Stage = DERPNET_OPEN_SERVER_KEY;
+	}
+
+	//
+	// now DERP protocol follows
+	//
+
+	uint8_t FrameType;
+	uint32_t FrameSize;
+
+	//
+	// receive ServerKey frame
+	//
+
+	if (Opening->Stage == DERPNET_OPEN_SERVER_KEY)
+	{
+		int GotFrame = DerpNet__ReadFrame(Net, &FrameType, &FrameSize, Wait);
+		if (GotFrame == 0)
+		{
+			return 0;
+		}
+		if (GotFrame < 0)
+		{
+			goto error;
+		}
+
+		DERPNET_ASSERT(FrameType == 1); // ServerKey
+		DERPNET_ASSERT(FrameSize >= 8 + 32);
+
+		static const uint8_t DerpMagic[8] = { 0x44, 0x45, 0x52, 0x50, 0xf0, 0x9f, 0x94, 0x91 };
+
+		const uint8_t* Magic = Net->Buffer + Net->BufferStart;
+		DERPNET_ASSERT(memcmp(Magic, DerpMagic, sizeof(DerpMagic)) == 0);
+
+		if (Opening->ClientInfoSent && memcmp(Opening->ServerPublicKey, Magic + 8, sizeof(Opening->ServerPublicKey)) != 0)
+		{
+			// server has new key, ClientInfo sealed for old one is useless - connect again without it
+			DERPNET_LOG("server key has changed, reconnecting");
+			Session->HasServerKey = false;
+			RetryOpen = true;
+			goto error;
+		}
+
+		memcpy(Opening->ServerPublicKey, Magic + 8, sizeof(Opening->ServerPublicKey));
+		if (Session)
+		{
+			memcpy(Session->ServerKey, Opening->ServerPublicKey, sizeof(Session->ServerKey));
+			Session->HasServerKey = true;
+		}
+
+		DerpNet__TlsConsume(Net, FrameSize);
+
+		//
+		// send ClientInfo frame
+		//
+
+		if (!Opening->ClientInfoSent)
+		{
+			uint8_t OutFrame[DERPNET_CLIENT_INFO_FRAME_SIZE];
+			DerpNet__ClientInfoFrame(Net, OutFrame, &Opening->UserSecret, &Opening->UserPublicKey, Opening->ServerPublicKey);
+
+			if (!DerpNet__TlsWrite(Net, OutFrame, sizeof(OutFrame)))
+			{
+				goto error;
+			}
+		}
+
+		Opening->Stage = DERPNET_OPEN_SERVER_INFO;
+	}
+
+	//
+	// receive ServerInfo frame
+	//
+
+	{
+		int GotFrame = DerpNet__ReadFrame(Net, &FrameType, &FrameSize, Wait);
+		if (GotFrame == 0)
+		{
+			return 0;
+		}
+		if (GotFrame < 0)
+		{
+			goto error;
+		}
+
+		DERPNET_ASSERT(FrameType == 3); // ServerInfo
+		DERPNET_ASSERT(FrameSize >= 24 + 16);
+
+		uint8_t* Nonce = Net->Buffer + Net->BufferStart;
+		uint8_t* Auth = Nonce + 24;
+		uint8_t* Data = Auth + 16;
+
+		size_t DataSize = FrameSize - (24 + 16);
+		bool UnsealOk = DerpNet__BoxUnseal(Data, Data, DataSize, Auth, Nonce, Opening->UserSecret.Bytes, Opening->ServerPublicKey);
+		if (!UnsealOk)
+		{
+			DERPNET_LOG("nacl box unseal for ServerInfo frame failed");
+			goto error;
+		}
+
+		DerpNet__TlsConsume(Net, FrameSize);
+	}
+
+	//
+	// ready!
+	//
+
+	memcpy(Net->UserPrivateKey, Opening->UserSecret.Bytes, sizeof(Net->UserPrivateKey));
+	Net->SendBatchSize = Config->SendBatchSize;
+	Net->SendBatchTime = Config->SendBatchSize ? Config->SendBatchTime : 0;
+	Net->SendQueueLimit = Config->SendQueueLimit && Config->SendQueueLimit < DERPNET_SEND_QUEUE_SIZE ? Config->SendQueueLimit : DERPNET_SEND_QUEUE_SIZE;
+	Net->OpenTimes.Ready = (uint32_t)(DerpNet__Microseconds() - Opening->Start);
+
+	Net->LastFrameSize = 0;
+	DerpNet__OpenEnd(Net);
+
+	if (!DerpNet__BufferTrim(Net))
+	{
+		DerpNet_Close(Net);
+		return -1;
+	}
+	return 1;
+
+error:
+	if (RetryOpen)
+	{
+		char Hostname[sizeof(Opening->Hostname)];
+		DerpKey UserSecret = Opening->UserSecret;
+		DerpNetConfig RetryConfig = *Config;
+		bool Allocated = Opening->Allocated;
+		strcpy(Hostname, DerpServer);
+
+		DerpNet__OpenAbort(Net);
+
+		bool RetryOk = Allocated
+			? DerpNet__OpenAsync(Net, Hostname, &UserSecret, &RetryConfig)
+			: DerpNet_OpenEx(Net, Hostname, &UserSecret, &RetryConfig);
+		memset(&UserSecret, 0, sizeof(UserSecret));
+		return RetryOk ? !Allocated : -1;
+	}
+
+	DerpNet__OpenAbort(Net);
+	return -1;
+}
+
+bool DerpNet_OpenEx(DerpNet* Net, const char* DerpServer, const DerpKey* UserSecret, const DerpNetConfig* Config)
+{
+	Net->Hub = NULL;
+
+	DerpNet__Opening Opening;
+	Opening.Allocated = false;
+
+	if (!DerpNet__OpenStart(Net, &Opening, DerpServer, UserSecret, Config))
+	{
+		return false;
+	}
+	return DerpNet__OpenStep(Net, true) > 0;
+}
+
+bool DerpNet_OpenAsync(DerpNet* Net, const char* DerpServer, const DerpKey* UserSecret, const DerpNetConfig* Config)
+{
+	Net->Hub = NULL;
+	return DerpNet__OpenAsync(Net, DerpServer, UserSecret, Config);
+}
+
+int DerpNet_Step(DerpNet* Net)
+{
+	if (Net->Opening)
+	{
+		return DerpNet__OpenStep(Net, false);
+	}
+
+	if (Net->SendQueued && !DerpNet__SendQueuePump(Net, false))
+	{
+		return -1;
+	}
+
+	// batch is sent only if it fits in queue, otherwise it waits for next step
+	if (Net->SendPending && Net->SendBatchTime && Net->SendQueued < Net->SendQueueLimit && DerpNet__Microseconds() - Net->SendPendingTime >= Net->SendBatchTime)
+	{
+		if (!DerpNet__Flush(Net, false))
+		{
+			return -1;
+		}
+	}
+	return 1;
+}
+
+void DerpNet_GetPoll(DerpNet* Net, DerpNetPoll* Poll)
+{
+	Poll->Socket = Net->Socket;
+	Poll->WantRead = true;
+	Poll->WantWrite = false;
+	Poll->Timeout = UINT32_MAX;
+
+	DerpNet__Opening* Opening = (DerpNet__Opening*)Net->Opening;
+	uint64_t Now = DerpNet__Microseconds();
+
+	if (!Opening)
+	{
+		Poll->WantWrite = Net->SendQueued != 0;
+		if (Net->SendPending && Net->SendBatchTime)
+		{
+			uint64_t Time = Now - Net->SendPendingTime;
+			Poll->Timeout = Time >= Net->SendBatchTime ? 0 : (uint32_t)((Net->SendBatchTime - Time + 999) / 1000);
+		}
+	}
+	else if (Opening->Stage == DERPNET_OPEN_RESOLVE)
+	{
+		Poll->WantRead = false;
+		Poll->Timeout = DERPNET_RESOLVE_POLL;
+	}
+	else if (Opening->Stage == DERPNET_OPEN_CONNECT)
+	{
+		// only newest attempt is watched, older ones are checked on every step
+		DerpNet__Connector* Connector = &Opening->Connector;
+		size_t Pending = 0;
+		for (size_t i = Connector->Started; i-- != 0; )
+		{
+			if (Connector->Socket[i] != DERPNET_INVALID_SOCKET && Pending++ == 0)
+			{
+				Poll->Socket = Connector->Socket[i];
+			}
+		}
+		Poll->WantRead = false;
+		Poll->WantWrite = Poll->Socket != DERPNET_INVALID_SOCKET;
+
+		uint64_t Until = 0;
+		if (Connector->Started != Connector->Count)
+		{
+			Until = Connector->NextStart;
+		}
+		else if (Pending > 1)
+		{
+			Until = Now + DERPNET_CONNECT_DELAY * 1000;
+		}
+		if (Connector->Deadline && (Until == 0 || Connector->Deadline < Until))
+		{
+			Until = Connector->Deadline;
+		}
+		if (Until != 0 || Poll->Socket == DERPNET_INVALID_SOCKET)
+		{
+			Poll->Timeout = Until > Now ? (uint32_t)((Until - Now + 999) / 1000) : 0;
+		}
+#if defined(_WIN32)
+		// WSAPoll before Windows 10 2004 never reports failed connect, step checks it with select error set
+		if (Poll->Timeout > DERPNET_CONNECT_DELAY)
+		{
+			Poll->Timeout = DERPNET_CONNECT_DELAY;
+		}
+#endif
+	}
+}
+
+// with Wait=false sends only what socket takes right now, the rest is dropped
+static void DerpNet__CloseEx(DerpNet* Net, bool Wait)
+{
+	if (Net->Opening)
+	{
+		DerpNet__OpenAbort(Net);
+		return;
+	}
+
+	if (Wait)
+	{
+		DerpNet__Flush(Net, true);
+	}
+	else if (DerpNet__Flush(Net, false))
+	{
+		DerpNet__SendQueuePump(Net, false);
+	}
+
+	if (Net->Tls)
+	{
+		Net->Tls->Close(Net);
+	}
+	DerpNet__SocketClose(Net);
+	DerpNet__BufferFreeAll(Net);
+	DerpNet__SocketCleanup();
+}
+
+void DerpNet_Close(DerpNet* Net)
+{
+	DerpNet__CloseEx(Net, true);
+}
+
+void DerpNet_Shrink(DerpNet* Net)
+{
+	if (Net->Opening)
+	{
+		return;
+	}
+
+	// io_uring has receive buffer registered, and its receive can be in progress
+	bool KeepBuffer = false;
+#if DERPNET_USE_IO_URING
+	KeepBuffer = Net->Ring.Fd >= 0;
+#endif
+	if (Net->BufferReceived == 0 && !KeepBuffer)
+	{
+		DerpNet__BufferResize(Net, &Net->Buffer, &Net->BufferSize, 0, 0);
+	}
+	if (Net->SendPending == 0)
+	{
+		DerpNet__BufferResize(Net, &Net->SendBuffer, &Net->SendBufferSize, 0, 0);
+	}
+	if (Net->SendQueued == 0)
+	{
+		DerpNet__BufferResize(Net, &Net->SendQueue, &Net->SendQueueSize, 0, 0);
+	}
+}
+
+//
+// DERP map parsing - only few fields of map are needed, so this is minimal JSON reader that
+// skips everything else
+//
+
+typedef struct {
+	const char* Ptr;
+	const char* End;
+	int Depth;
+} DerpNet__Json;
+
+#define DERPNET_JSON_MAX_DEPTH 32
+
+static void DerpNet__JsonSpace(DerpNet__Json* Json)
+{
+	while (Json->Ptr != Json->End && (*Json->Ptr == ' ' || *Json->Ptr == '\t' || *Json->Ptr == '\r' || *Json->Ptr == '\n'))
+	{
+		Json->Ptr++;
+	}
+}
+
+static bool DerpNet__JsonExpect(DerpNet__Json* Json, char Char)
+{
+	DerpNet__JsonSpace(Json);
+	if (Json->Ptr == Json->End || *Json->Ptr != Char)
+	{
+		return false;
+	}
+	Json->Ptr++;
+	return true;
+}
+
+static bool DerpNet__JsonPeek(DerpNet__Json* Json, char Char)
+{
+	DerpNet__JsonSpace(Json);
+	return Json->Ptr != Json->End && *Json->Ptr == Char;
+}
+
+// Output can be NULL to skip string, too long strings are cut, escaped non-ASCII characters become '?'
+static bool DerpNet__JsonString(DerpNet__Json* Json, char* Output, size_t OutputSize)
+{
+	if (!DerpNet__JsonExpect(Json, '"'))
+	{
+		return false;
+	}
+
+	size_t Size = 0;
+	while (Json->Ptr != Json->End && *Json->Ptr != '"')
+	{
+		char Char = *Json->Ptr++;
+		if (Char == '\\')
+		{
+			if (Json->Ptr == Json->End)
+			{
+				return false;
+			}
+			Char = *Json->Ptr++;
+			switch (Char)
+			{
+			case 'b': Char = '\b'; break;
+			case 'f': Char = '\f'; break;
+			case 'n': Char = '\n'; break;
+			case 'r': Char = '\r'; break;
+			case 't': Char = '\t'; break;
+			case 'u':
+				if (Json->End - Json->Ptr < 4)
+				{
+					return false;
+				}
+				Json->Ptr += 4;
+				Char = '?';
+				break;
+			}
+		}
+		if (Output && Size + 1 < OutputSize)
+		{
+			Output[Size++] = Char;
+		}
+	}
+	if (Output && OutputSize)
+	{
+		Output[Size] = 0;
+	}
+	return DerpNet__JsonExpect(Json, '"');
+}
+
+static bool DerpNet__JsonNumber(DerpNet__Json* Json, int64_t* Number)
+{
+	DerpNet__JsonSpace(Json);
+
+	bool Negative = Json->Ptr != Json->End && *Json->Ptr == '-';
+	Json->Ptr += Negative;
+
+	const char* Start = Json->Ptr;
+	int64_t Value = 0;
+	while (Json->Ptr != Json->End && *Json->Ptr >= '0' && *Json->Ptr <= '9')
+	{
+		Value = Value * 10 + (*Json->Ptr++ - '0');
+	}
+	if (Json->Ptr == Start)
+	{
+		return false;
+	}
+
+	// fraction & exponent are not used by DERP map
+	while (Json->Ptr != Json->End && (*Json->Ptr == '.' || *Json->Ptr == 'e' || *Json->Ptr == 'E' || *Json->Ptr == '+' || *Json->Ptr == '-' || (*Json->Ptr >= '0' && *Json->Ptr <= '9')))
+	{
+		Json->Ptr++;
+	}
+
+	*Number = Negative ? -Value : Value;
+	return true;
+}
+
+static bool DerpNet__JsonLiteral(DerpNet__Json* Json, const char* Literal)
+{
+	DerpNet__JsonSpace(Json);
+
+	size_t Size = strlen(Literal);
+	if ((size_t)(Json->End - Json->Ptr) < Size || memcmp(Json->Ptr, Literal, Size) != 0)
+	{
+		return false;
+	}
+	Json->Ptr += Size;
+	return true;
+}
+
+static bool DerpNet__JsonBool(DerpNet__Json* Json, bool* Value)
+{
+	*Value = DerpNet__JsonPeek(Json, 't');
+	return DerpNet__JsonLiteral(Json, *Value ? "true" : "false");
+}
+
+// iterates object members, returns 1 with member name when its value follows, 0 at end of object, -1 on error
+// First must be true on first call for object, it is cleared by call
+static int DerpNet__JsonMember(DerpNet__Json* Json, bool* First, char* Name, size_t NameSize)
+{
+	if (*First)
+	{
+		*First = false;
+		if (!DerpNet__JsonExpect(Json, '{'))
+		{
+			return -1;
+		}
+		if (DerpNet__JsonExpect(Json, '}'))
+		{
+			return 0;
+		}
+	}
+	else
+	{
+		if (DerpNet__JsonExpect(Json, '}'))
+		{
+			return 0;
+		}
+		if (!DerpNet__JsonExpect(Json, ','))
+		{
+			return -1;
+		}
+	}
+
+	return DerpNet__JsonString(Json, Name, NameSize) && DerpNet__JsonExpect(Json, ':') ? 1 : -1;
+}
+
+// same as DerpNet__JsonMember, for array elements
+static int DerpNet__JsonElement(DerpNet__Json* Json, bool* First)
+{
+	if (*First)
+	{
+		*First = false;
+		if (!DerpNet__JsonExpect(Json, '['))
+		{
+			return -1;
+		}
+		return DerpNet__JsonExpect(Json, ']') ? 0 : 1;
+	}
+
+	if (DerpNet__JsonExpect(Json, ']'))
+	{
+		return 0;
+	}
+	return DerpNet__JsonExpect(Json, ',') ? 1 : -1;
+}
+
+static bool DerpNet__JsonSkip(DerpNet__Json* Json)
+{
+	if (Json->Depth == DERPNET_JSON_MAX_DEPTH)
+	{
+		return false;
+	}
+
+	bool Ok = true;
+	bool First = true;
+	int Result;
+
+	Json->Depth++;
+	if (DerpNet__JsonPeek(Json, '{'))
+	{
+		while ((Result = DerpNet__JsonMember(Json, &First, NULL, 0)) > 0 && (Ok = DerpNet__JsonSkip(Json)))
+		{
+		}
+		Ok = Ok && Result == 0;
+	}
+	else if (DerpNet__JsonPeek(Json, '['))
+	{
+		while ((Result = DerpNet__JsonElement(Json, &First)) > 0 && (Ok = DerpNet__JsonSkip(Json)))
+		{
+		}
+		Ok = Ok && Result == 0;
+	}
+	else if (DerpNet__JsonPeek(Json, '"'))
+	{
+		Ok = DerpNet__JsonString(Json, NULL, 0);
+	}
+	else if (DerpNet__JsonPeek(Json, 't') || DerpNet__JsonPeek(Json, 'f') || DerpNet__JsonPeek(Json, 'n'))
+	{
+		Ok = DerpNet__JsonLiteral(Json, "true") || DerpNet__JsonLiteral(Json, "false") || DerpNet__JsonLiteral(Json, "null");
+	}
+	else
+	{
+		int64_t Number;
+		Ok = DerpNet__JsonNumber(Json, &Number);
+	}
+	Json->Depth--;
+
+	return Ok;
+}
+
+// parses one node of region, returns false on error - Skip is set for nodes not usable for DERP
+static bool DerpNet__JsonNode(DerpNet__Json* Json, DerpNetServer* Server, bool* Skip)
+{
+	memset(Server, 0, sizeof(*Server));
+	*Skip = false;
+
+	char Name[32];
+	bool First = true;
+	int Result;
+	while ((Result = DerpNet__JsonMember(Json, &First, Name, sizeof(Name))) > 0)
+	{
+		int64_t Number;
+		bool Ok;
+		if (strcmp(Name, "HostName") == 0)
+		{
+			Ok = DerpNet__JsonString(Json, Server->HostName, sizeof(Server->HostName));
+		}
+		else if (strcmp(Name, "IPv4") == 0)
+		{
+			Ok = DerpNet__JsonString(Json, Server->IPv4, sizeof(Server->IPv4));
+		}
+		else if (strcmp(Name, "IPv6") == 0)
+		{
+			Ok = DerpNet__JsonString(Json, Server->IPv6, sizeof(Server->IPv6));
+		}
+		else if (strcmp(Name, "DERPPort") == 0)
+		{
+			Ok = DerpNet__JsonNumber(Json, &Number);
+			Server->Port = Number > 0 && Number <= 65535 ? (uint16_t)Number : 0;
+		}
+		else if (strcmp(Name, "STUNOnly") == 0)
+		{
+			bool StunOnly;
+			Ok = DerpNet__JsonBool(Json, &StunOnly);
+			*Skip |= StunOnly;
+		}
+		else
+		{
+			Ok = DerpNet__JsonSkip(Json);
+		}
+		if (!Ok)
+		{
+			return false;
+		}
+	}
+
+	// "none" means DERP map disables that address family for node
+	if (strcmp(Server->IPv4, "none") == 0)
+	{
+		Server->IPv4[0] = 0;
+	}
+	if (strcmp(Server->IPv6, "none") == 0)
+	{
+		Server->IPv6[0] = 0;
+	}
+	*Skip |= Server->HostName[0] == 0;
+
+	return Result == 0;
+}
+
+// parses one region, appends its nodes to Servers
+static bool DerpNet__JsonRegion(DerpNet__Json* Json, DerpNetServer* Servers, size_t MaxCount, size_t* Count)
+{
+	size_t RegionStart = *Count;
+	int64_t RegionId = 0;
+	char RegionCode[sizeof(Servers->RegionCode)] = { 0 };
+	bool Avoid = false;
+
+	char Name[32];
+	bool First = true;
+	int Result;
+	while ((Result = DerpNet__JsonMember(Json, &First, Name, sizeof(Name))) > 0)
+	{
+		bool Ok;
+		if (strcmp(Name, "RegionID") == 0)
+		{
+			Ok = DerpNet__JsonNumber(Json, &RegionId);
+		}
+		else if (strcmp(Name, "RegionCode") == 0)
+		{
+			Ok = DerpNet__JsonString(Json, RegionCode, sizeof(RegionCode));
+		}
+		else if (strcmp(Name, "Avoid") == 0)
+		{
+			Ok = DerpNet__JsonBool(Json, &Avoid);
+		}
+		else if (strcmp(Name, "Nodes") == 0 && DerpNet__JsonPeek(Json, '['))
+		{
+			bool FirstNode = true;
+			int NodeResult;
+			while ((NodeResult = DerpNet__JsonElement(Json, &FirstNode)) > 0)
+			{
+				DerpNetServer Server;
+				bool Skip;
+				if (!DerpNet__JsonNode(Json, &Server, &Skip))
+				{
+					return false;
+				}
+				if (!Skip && *Count < MaxCount)
+				{
+					Servers[(*Count)++] = Server;
+				}
+			}
+			Ok = NodeResult == 0;
+		}
+		else
+		{
+			Ok = DerpNet__JsonSkip(Json);
+		}
+		if (!Ok)
+		{
+			return false;
+		}
+	}
+
+	// region members can come in any order, so they are set for nodes only at end
+	if (Avoid)
+	{
+		*Count = RegionStart;
+	}
+	for (size_t i = RegionStart; i < *Count; i++)
+	{
+		Servers[i].RegionId = (uint32_t)RegionId;
+		memcpy(Servers[i].RegionCode, RegionCode, sizeof(RegionCode));
+	}
+
+	return Result == 0;
+}
+
+size_t DerpNet_ParseDerpMap(const char* Json, size_t JsonSize, DerpNetServer* Servers, size_t MaxCount)
+{
+	DerpNet__Json Reader = { Json, Json + JsonSize, 0 };
+	size_t Count = 0;
+
+	char Name[32];
+	bool First = true;
+	int Result;
+	while ((Result = DerpNet__JsonMember(&Reader, &First, Name, sizeof(Name))) > 0)
+	{
+		if (strcmp(Name, "Regions") == 0 && DerpNet__JsonPeek(&Reader, '{'))
+		{
+			// region objects are keyed by region ID
+			bool FirstRegion = true;
+			int RegionResult;
+			while ((RegionResult = DerpNet__JsonMember(&Reader, &FirstRegion, NULL, 0)) > 0)
+			{
+				if (!DerpNet__JsonRegion(&Reader, Servers, MaxCount, &Count))
+				{
+					Result = -1;
+					break;
+				}
+			}
+			if (RegionResult < 0)
+			{
+				Result = -1;
+			}
+		}
+		else if (!DerpNet__JsonSkip(&Reader))
+		{
+			Result = -1;
+		}
+		if (Result < 0)
+		{
+			break;
+		}
+	}
+
+	if (Result < 0)
+	{
+		DERPNET_LOG("cannot parse DERP map at offset %zu", (size_t)(Reader.Ptr - Json));
+		return 0;
+	}
+	return Count;
+}
+
+size_t DerpNet_LoadDerpMap(const char* FileName, DerpNetServer* Servers, size_t MaxCount)
+{
+	FILE* File = fopen(FileName, "rb");
+	if (!File)
+	{
+		DERPNET_LOG("cannot open '%s' DERP map", FileName);
+		return 0;
+	}
+
+	size_t Count = 0;
+	char* Json = NULL;
+	if (fseek(File, 0, SEEK_END) == 0)
+	{
+		long Size = ftell(File);
+		if (Size > 0 && fseek(File, 0, SEEK_SET) == 0 && (Json = (char*)malloc(Size)) != NULL)
+		{
+			if (fread(Json, 1, Size, File) == (size_t)Size)
+			{
+				Count = DerpNet_ParseDerpMap(Json, Size, Servers, MaxCount);
+			}
+			free(Json);
+		}
+	}
+	fclose(File);
+
+	return Count;
+}
+
+//
+// server selection - probe request is sent to every server, and time till first byte of response
+// is server latency: for TLS it is ClientHello, answered with ServerHello, for plain HTTP it is
+// probe request that DERP servers answer without upgrading connection
+//
+
+static bool DerpNet__ProbeAddress(const DerpNetServer* Server, uint16_t Port, struct sockaddr_storage* Address, int* AddressSize)
 {
-	uint8_t SharedKey[32];
-	DerpNet__GetSharedKey(SharedKey, PrivateKey, PublicKey);
+	memset(Address, 0, sizeof(*Address));
+
+	struct sockaddr_in* Address4 = (struct sockaddr_in*)Address;
+	if (Server->IPv4[0] && inet_pton(AF_INET, Server->IPv4, &Address4->sin_addr) == 1)
+	{
+		Address4->sin_family = AF_INET;
+		Address4->sin_port = htons(Port);
+		*AddressSize = sizeof(*Address4);
+		return true;
+	}
+
+	struct sockaddr_in6* Address6 = (struct sockaddr_in6*)Address;
+	if (Server->IPv6[0] && inet_pton(AF_INET6, Server->IPv6, &Address6->sin6_addr) == 1)
+	{
+		Address6->sin6_family = AF_INET6;
+		Address6->sin6_port = htons(Port);
+		*AddressSize = sizeof(*Address6);
+		return true;
+	}
+
+	// map without addresses, for example with local servers
+	char PortText[8];
+	snprintf(PortText, sizeof(PortText), "%u", Port);
+
+	struct addrinfo AddrHints =
+	{
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo* AddrInfo;
+	if (getaddrinfo(Server->HostName, PortText, &AddrHints, &AddrInfo) != 0)
+	{
+		DERPNET_LOG("cannot resolve '%s' hostname", Server->HostName);
+		return false;
+	}
+
+	bool Ok = AddrInfo->ai_addrlen <= sizeof(*Address);
+	if (Ok)
+	{
+		memcpy(Address, AddrInfo->ai_addr, AddrInfo->ai_addrlen);
+		*AddressSize = (int)AddrInfo->ai_addrlen;
+	}
+	freeaddrinfo(AddrInfo);
+
+	return Ok;
+}
+
+static size_t DerpNet__ProbeRequest(uint8_t* Request, const DerpNetServer* Server, bool PlainHttp)
+{
+	if (PlainHttp)
+	{
+		return snprintf((char*)Request, 512,
+			"GET /derp/probe HTTP/1.1\r\n"
+			"Host: %s\r\n"
+			"Connection: close\r\n"
+			"\r\n",
+			Server->HostName);
+	}
+
+	uint8_t Random[64];
+	DerpNet__GetRandom(Random, sizeof(Random));
+
+	// any 32 bytes are valid X25519 public key, handshake is never finished
+	size_t HelloSize = DerpNet__Tls13ClientHello(Request + 5, Server->HostName, Random, Random + 32, NULL, 0);
+	Request[0] = 22; // handshake
+	DerpNet__Put16BE(Request + 1, 0x0301);
+	DerpNet__Put16BE(Request + 3, HelloSize);
+
+	return 5 + HelloSize;
+}
+
+void DerpNet_ProbeServers(DerpNetServer* Servers, size_t Count, const DerpNetConfig* Config, uint32_t Timeout)
+{
+	DerpNetConfig DefaultConfig = { .PlainHttp = DERPNET_USE_PLAIN_HTTP };
+	if (!Config)
+	{
+		Config = &DefaultConfig;
+	}
+	uint16_t DefaultPort = Config->Port ? Config->Port : Config->PlainHttp ? 80 : 443;
+
+	bool SocketStarted = DerpNet__SocketStartup();
+	DERPNET_ASSERT(SocketStarted);
+
+	// every probe slot is either connecting, or waiting for response
+	uintptr_t Sockets[DERPNET_WAIT_MAX];
+	size_t Index[DERPNET_WAIT_MAX];
+	bool Connecting[DERPNET_WAIT_MAX];
+	uint64_t Started[DERPNET_WAIT_MAX]; // when connection or request started
+	uint64_t Deadline[DERPNET_WAIT_MAX];
+	size_t Active = 0;
+	size_t Next = 0;
+
+	for (size_t i = 0; i < Count; i++)
+	{
+		Servers[i].Rtt = UINT32_MAX;
+	}
+
+	while (Next != Count || Active != 0)
+	{
+		while (Next != Count && Active != DERPNET_WAIT_MAX)
+		{
+			DerpNetServer* Server = &Servers[Next];
+
+			struct sockaddr_storage Address;
+			int AddressSize;
+			if (!DerpNet__ProbeAddress(Server, Server->Port ? Server->Port : DefaultPort, &Address, &AddressSize))
+			{
+				Next++;
+				continue;
+			}
+
+			uintptr_t Socket = (uintptr_t)socket(Address.ss_family, SOCK_STREAM, IPPROTO_TCP);
+			if (Socket == DERPNET_INVALID_SOCKET)
+			{
+				Next++;
+				continue;
+			}
+			DerpNet__SocketBlocking(Socket, false);
+
+			if (connect((DerpNet__Socket)Socket, (struct sockaddr*)&Address, AddressSize) != 0)
+			{
+#if defined(_WIN32)
+				bool Pending = WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+				bool Pending = errno == EINPROGRESS || errno == EINTR;
+#endif
+				if (!Pending)
+				{
+					DerpNet__SocketDestroy(Socket);
+					Next++;
+					continue;
+				}
+			}
+
+			Sockets[Active] = Socket;
+			Index[Active] = Next++;
+			Connecting[Active] = true;
+			Started[Active] = DerpNet__Microseconds();
+			Deadline[Active] = Started[Active] + (uint64_t)Timeout * 1000;
+			Active++;
+		}
+
+		if (Active == 0)
+		{
+			break;
+		}
+
+		// wait until next probe can time out
+		uint64_t Now = DerpNet__Microseconds();
+		uint64_t First = Deadline[0];
+		for (size_t i = 1; i < Active; i++)
+		{
+			First = Deadline[i] < First ? Deadline[i] : First;
+		}
+		int Wait = First > Now ? (int)((First - Now + 999) / 1000) : 0;
+
+		bool Ready[DERPNET_WAIT_MAX];
+		if (!DerpNet__SocketWaitMany(NULL, Sockets, Connecting, Ready, Active, Wait))
+		{
+			break;
+		}
+		Now = DerpNet__Microseconds();
+
+		for (size_t i = 0; i < Active; )
+		{
+			bool Done = false;
+			if (Ready[i] && Connecting[i])
+			{
+				int Error = 0;
+				socklen_t ErrorSize = sizeof(Error);
+				if (getsockopt((DerpNet__Socket)Sockets[i], SOL_SOCKET, SO_ERROR, (char*)&Error, &ErrorSize) == 0 && Error == 0)
+				{
+					uint8_t Request[512 + 256];
+					size_t RequestSize = DerpNet__ProbeRequest(Request, &Servers[Index[i]], Config->PlainHttp);
+
+					// request is small, so it fits into empty socket buffer
+					Done = send((DerpNet__Socket)Sockets[i], (const char*)Request, (int)RequestSize, DERPNET_SEND_FLAGS) != (int)RequestSize;
+					Connecting[i] = false;
+					Started[i] = Now;
+				}
+				else
+				{
+					Done = true;
+				}
+			}
+			else if (Ready[i])
+			{
+				char Response[64];
+				if (recv((DerpNet__Socket)Sockets[i], Response, sizeof(Response), 0) > 0)
+				{
+					uint64_t Rtt = Now - Started[i];
+					Servers[Index[i]].Rtt = Rtt < UINT32_MAX ? (uint32_t)Rtt : UINT32_MAX - 1;
+				}
+				Done = true;
+			}
+			else if (Now >= Deadline[i])
+			{
+				DERPNET_LOG("probe of '%s' server timed out", Servers[Index[i]].HostName);
+				Done = true;
+			}
+
+			if (Done)
+			{
+				DerpNet__SocketDestroy(Sockets[i]);
+				Active--;
+				Sockets[i] = Sockets[Active];
+				Index[i] = Index[Active];
+				Connecting[i] = Connecting[Active];
+				Started[i] = Started[Active];
+				Deadline[i] = Deadline[Active];
+				Ready[i] = Ready[Active];
+			}
+			else
+			{
+				i++;
+			}
+		}
+	}
+
+	DerpNet__SocketCleanup();
+
+	// insertion sort is stable, so servers with same latency keep order of DERP map
+	for (size_t i = 1; i < Count; i++)
+	{
+		DerpNetServer Server = Servers[i];
+		size_t k = i;
+		while (k != 0 && Servers[k - 1].Rtt > Server.Rtt)
+		{
+			Servers[k] = Servers[k - 1];
+			k--;
+		}
+		Servers[k] = Server;
+	}
+}
+
+int DerpNet_OpenFastest(DerpNet* Net, DerpNetServer* Servers, size_t Count, const DerpKey* UserSecret, const DerpNetConfig* Config, uint32_t Timeout)
+{
+	DerpNetConfig ServerConfig = { .PlainHttp = DERPNET_USE_PLAIN_HTTP };
+	if (Config)
+	{
+		ServerConfig = *Config;
+	}
+
+	DerpNet_ProbeServers(Servers, Count, &ServerConfig, Timeout);
+
+	for (size_t i = 0; i < Count && Servers[i].Rtt != UINT32_MAX; i++)
+	{
+		DERPNET_LOG("trying '%s' server with %u usec latency", Servers[i].HostName, Servers[i].Rtt);
+
+		ServerConfig.Port = Servers[i].Port ? Servers[i].Port : Config ? Config->Port : 0;
+		if (DerpNet_OpenEx(Net, Servers[i].HostName, UserSecret, &ServerConfig))
+		{
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+// sends expired batch or more of queue before receiving, and releases previous messages
+static bool DerpNet__RecvStart(DerpNet* Net, bool Wait)
+{
+	if (Net->SendPending && Net->SendBatchTime && DerpNet__Microseconds() - Net->SendPendingTime >= Net->SendBatchTime)
+	{
+		if (!DerpNet__Flush(Net, true))
+		{
+			return false;
+		}
+	}
+	else if (Net->SendQueued && !Wait && !DerpNet__SendQueuePump(Net, false))
+	{
+		return false;
+	}
+
+	DerpNet__TlsConsume(Net, Net->LastFrameSize);
+	Net->LastFrameSize = 0;
+	return true;
+}
+
+int DerpNet_Recv(DerpNet* Net, DerpKey* ReceivedUserPublicKey, uint8_t** ReceivedData, uint32_t* ReceivedSize, bool Wait)
+{
+	if (!DerpNet__RecvStart(Net, Wait))
+	{
+		return -1;
+	}
+
+	for (;;)
+	{
+		uint8_t FrameType;
+		uint32_t FrameSize;
+
+		int GotFrame = DerpNet__ReadFrame(Net, &FrameType, &FrameSize, Wait);
+		if (GotFrame < 0)
+		{
+			DERPNET_LOG("disconnecting in Recv");
+			return -1;
+		}
+
+		if (GotFrame == 0)
+		{
+			return 0;
+		}
+
+		if (FrameType == 5) // RecvPacket
+		{
+			if (FrameSize >= 32 + 24 + 16)
+			{
+				uint8_t* PublicKey = Net->Buffer + Net->BufferStart;
+				uint8_t* Nonce = PublicKey + 32;
+				uint8_t* Auth = Nonce + 24;
+				uint8_t* Data = Auth + 16;
+				uint32_t DataSize = FrameSize - (32 + 24 + 16);
+
+				const uint8_t* SharedKey = DerpNet__GetPeerSharedKey(Net, PublicKey);
+
+				bool UnsealOk = DerpNet__BoxUnsealEx(Data, Data, DataSize, Auth, Nonce, SharedKey);
+				if (UnsealOk)
+				{
+					memcpy(ReceivedUserPublicKey->Bytes, PublicKey, sizeof(ReceivedUserPublicKey->Bytes));
+					*ReceivedData = Data;
+					*ReceivedSize = DataSize;
+
+					Net->LastFrameSize = FrameSize;
+
+					return 1;
+				}
+				else
+				{
+					DERPNET_LOG("failed to verify encrypted data");
+				}
+			}
+			else
+			{
+				DERPNET_LOG("RecvPacket frame too short, expected at least %u bytes, got %u", 32 + 24 + 16, FrameSize);
+			}
+		}
+		else
+		{
+			DERPNET_LOG("unknown frame, ignoring");
+		}
+
+		DerpNet__TlsConsume(Net, FrameSize);
+	}
+
+	return -1;
+}
+
+// returns size of complete frame at Offset of plaintext including its header, or 0 if it is not all here
+static size_t DerpNet__PeekFrame(DerpNet* Net, size_t Offset)
+{
+	const size_t FrameHeaderSize = 1 + 4;
+
+	size_t Available = DerpNet__BufferPlainSize(Net) - Offset;
+	if (Available < FrameHeaderSize)
+	{
+		return 0;
+	}
+
+	size_t FrameSize = FrameHeaderSize + Get32BE(Net->Buffer + Net->BufferStart + Offset + 1);
+	return Available >= FrameSize ? FrameSize : 0;
+}
+
+int DerpNet_RecvBatch(DerpNet* Net, DerpNetMessage* Messages, size_t MaxCount, bool Wait)
+{
+	DERPNET_ASSERT(MaxCount != 0);
+
+	if (!DerpNet__RecvStart(Net, Wait))
+	{
+		return -1;
+	}
+
+	for (;;)
+	{
+		// everything socket already has is read first, so one batch covers all of it - buffer is
+		// not read again until batch is released, because compacting or growing it would move messages
+		// TLS record that is read only partially must fit in buffer, reading it into full buffer at its limit fails
+		size_t Reserve = Net->Tls && !Net->KernelTlsRecv ? DerpNet__Min(1 << 15, Net->BufferLimit / 2) : 1;
+		for (;;)
+		{
+			if (Net->BufferSize - Net->BufferCipher < Reserve)
+			{
+				if (Net->BufferStart != 0)
+				{
+					DerpNet__BufferCompact(Net);
+				}
+				if (Net->BufferSize - Net->BufferCipher < Reserve)
+				{
+					size_t NewSize = DerpNet__BufferGrowSize(Net->BufferSize, Net->BufferCipher + Reserve, Net->BufferLimit);
+					if (NewSize == 0 || !DerpNet__BufferResize(Net, &Net->Buffer, &Net->BufferSize, NewSize, Net->BufferReceived))
+					{
+						break;
+					}
+				}
+			}
+
+			size_t LastPlain = Net->BufferPlain;
+			size_t LastCipher = Net->BufferCipher;
+			size_t LastReceived = Net->BufferReceived;
+
+			if (!DerpNet__TlsRead(Net, false))
+			{
+				DERPNET_LOG("disconnecting in RecvBatch");
+				return -1;
+			}
+			if (Net->BufferPlain == LastPlain && Net->BufferCipher == LastCipher && Net->BufferReceived == LastReceived)
+			{
+				break;
+			}
+		}
+
+		while (DerpNet__PeekFrame(Net, 0) == 0)
+		{
+			if (!Wait)
+			{
+				return 0;
+			}
+			if (!DerpNet__TlsRead(Net, true))
+			{
+				DERPNET_LOG("disconnecting in RecvBatch");
+				return -1;
+			}
+		}
+
+		size_t Count = 0;
+		size_t Offset = 0;
+		size_t FrameSize;
+		while (Count != MaxCount && (FrameSize = DerpNet__PeekFrame(Net, Offset)) != 0)
+		{
+			uint8_t* Frame = Net->Buffer + Net->BufferStart + Offset;
+			uint32_t PayloadSize = (uint32_t)(FrameSize - (1 + 4));
+			Offset += FrameSize;
+
+			if (Frame[0] != 5) // RecvPacket
+			{
+				DERPNET_LOG("unknown frame, ignoring");
+				continue;
+			}
+
+			if (PayloadSize < 32 + 24 + 16)
+			{
+				DERPNET_LOG("RecvPacket frame too short, expected at least %u bytes, got %u", 32 + 24 + 16, PayloadSize);
+				continue;
+			}
+
+			uint8_t* PublicKey = Frame + 1 + 4;
+			uint8_t* Nonce = PublicKey + 32;
+			uint8_t* Auth = Nonce + 24;
+			uint8_t* Data = Auth + 16;
+			uint32_t DataSize = PayloadSize - (32 + 24 + 16);
+
+			const uint8_t* SharedKey = DerpNet__GetPeerSharedKey(Net, PublicKey);
+			if (!DerpNet__BoxUnsealEx(Data, Data, DataSize, Auth, Nonce, SharedKey))
+			{
+				DERPNET_LOG("failed to verify encrypted data");
+				continue;
+			}
 
-	DerpNet__GetRandom(Nonce, 24);
-	DerpNet__BoxSealEx(Nonce, Auth, Output, Input, InputSize, SharedKey);
+			Messages[Count].PublicKey = (const DerpKey*)PublicKey;
+			Messages[Count].Data = Data;
+			Messages[Count].Size = DataSize;
+			Count++;
+		}
+
+		if (Count != 0)
+		{
+			Net->LastFrameSize = Offset;
+			return (int)Count;
+		}
+
+		// only frames that are not messages were there
+		DerpNet__TlsConsume(Net, Offset);
+		if (!Wait)
+		{
+			return 0;
+		}
+	}
 }
 
-static bool DerpNet__BoxUnsealEx(uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t Auth[16], const uint8_t Nonce[24], const uint8_t SharedKey[32])
+void DerpNet_RecvRelease(DerpNet* Net)
 {
-	// xsalsa20 key construction
-	uint8_t SubKey[32];
-	hsalsa20(SubKey, Nonce, SharedKey);
+	DerpNet__TlsConsume(Net, Net->LastFrameSize);
+	Net->LastFrameSize = 0;
+}
+
+// frame is sealed straight into TLS record payloads, so plaintext is read once and ciphertext written once
+static bool DerpNet__SendPacket(DerpNet* Net, const DerpKey* TargetUserPublicKey, const uint8_t SharedKey[32], const uint8_t Nonce[24], const DerpNetIoVec* Vec, size_t VecCount, bool Wait)
+{
+	size_t DataSize = 0;
+	for (size_t i = 0; i < VecCount; i++)
+	{
+		DataSize += Vec[i].Size;
+	}
 
-	uint8_t FirstBlock[64] = { 0 };
-	salsa20_xor(FirstBlock, FirstBlock, sizeof(FirstBlock), SubKey, Nonce + 16, 0);
+	const size_t HeaderSize = 1 + 4 + 32 + 24 + 16;
+	size_t FrameSize = HeaderSize + DataSize;
+	DERPNET_ASSERT(FrameSize <= (1 << 16));
 
-	uint8_t ExpectedAuth[16];
-	poly1305_auth(ExpectedAuth, Input, InputSize, FirstBlock);
+	DerpNet__RecordLayout Layout;
+	DerpNet__GetRecordLayout(Net, &Layout);
 
-	if (poly1305_verify(Auth, ExpectedAuth) == 0)
+	size_t FrameOffset;
+	if (!DerpNet__SendReserve(Net, &Layout, FrameSize, &FrameOffset, Wait))
 	{
 		return false;
 	}
 
-	size_t FirstSize = InputSize > 32 ? 32 : InputSize;
-	for (size_t i = 0; i < FirstSize; i++)
+	// in batch frame can start anywhere in record, so header is copied in only after tag is known
+	uint8_t OutFrame[1 + 4 + 32 + 24 + 16];
+	OutFrame[0] = 4; // SendPacket
+	Set32BE(OutFrame + 1, (uint32_t)(FrameSize - (1 + 4)));
+
+	uint8_t* PublicKey = OutFrame + 1 + 4;
+	uint8_t* OutNonce = PublicKey + 32;
+	uint8_t* Auth = OutNonce + 24;
+
+	memcpy(PublicKey, TargetUserPublicKey->Bytes, sizeof(TargetUserPublicKey->Bytes));
+	memcpy(OutNonce, Nonce, 24);
+
+	DerpNet__Box Box;
+	DerpNet__BoxInit(&Box, Nonce, SharedKey);
+
+	size_t Available;
+	size_t Offset = FrameOffset + HeaderSize;
+	for (size_t i = 0; i < VecCount; i++)
 	{
-		Output[i] = Input[i] ^ FirstBlock[32 + i];
+		const uint8_t* Input = (const uint8_t*)Vec[i].Data;
+		size_t InputSize = Vec[i].Size;
+
+		while (InputSize != 0)
+		{
+			uint8_t* Output = DerpNet__RecordData(Net, &Layout, Offset, &Available);
+			size_t ChunkSize = DerpNet__BoxChunk(&Box, DerpNet__Min(InputSize, Available));
+			DerpNet__BoxSealUpdate(&Box, Output, Input, ChunkSize);
+
+			Offset += ChunkSize;
+			Input += ChunkSize;
+			InputSize -= ChunkSize;
+		}
 	}
 
-	salsa20_xor(Output + FirstSize, Input + FirstSize, InputSize - FirstSize, SubKey, Nonce + 16, 1);
-	return true;
+	poly1305_finish(&Box.Mac, Auth);
+	DerpNet__RecordWrite(Net, &Layout, FrameOffset, OutFrame, HeaderSize);
+
+	return DerpNet__SendCommit(Net, FrameSize, Wait);
 }
 
-static bool DerpNet__BoxUnseal(uint8_t* Output, const uint8_t* Input, size_t InputSize, const uint8_t Auth[16], const uint8_t Nonce[24], const uint8_t PrivateKey[32], const uint8_t PublicKey[32])
+bool DerpNet_Send(DerpNet* Net, const DerpKey* TargetUserPublicKey, const void* Data, size_t DataSize)
 {
-	uint8_t SharedKey[32];
-	DerpNet__GetSharedKey(SharedKey, PrivateKey, PublicKey);
-
-	return DerpNet__BoxUnsealEx(Output, Input, InputSize, Auth, Nonce, SharedKey);
+	DerpNetIoVec Vec = { Data, DataSize };
+	return DerpNet_SendV(Net, TargetUserPublicKey, &Vec, 1);
 }
 
-void DerpNet_CreateNewKey(DerpKey* UserSecret)
+bool DerpNet_SendV(DerpNet* Net, const DerpKey* TargetUserPublicKey, const DerpNetIoVec* Vec, size_t VecCount)
 {
-	DerpNet__GetRandom(UserSecret->Bytes, sizeof(UserSecret->Bytes));
+	const uint8_t* SharedKey = DerpNet__GetPeerSharedKey(Net, TargetUserPublicKey->Bytes);
 
-	UserSecret->Bytes[ 0] &= 0xf8;
-	UserSecret->Bytes[31] &= 0x7f;
-	UserSecret->Bytes[31] |= 0x40;
+	uint8_t Nonce[24];
+	DerpNet__Random(&Net->Random, Nonce, sizeof(Nonce));
+
+	return DerpNet__SendPacket(Net, TargetUserPublicKey, SharedKey, Nonce, Vec, VecCount, true);
 }
 
-void DerpNet_GetPublicKey(const DerpKey* UserSecret, DerpKey* UserPublic)
+bool DerpNet_SendEx(DerpNet* Net, const DerpKey* TargetUserPublicKey, const uint8_t SharedKey[32], const uint8_t Nonce[24], const void* Data, size_t DataSize)
 {
-	static const uint8_t Base[32] = { 9 };
-	curve25519_scalarmult(UserPublic->Bytes, UserSecret->Bytes, Base);
+	DerpNetIoVec Vec = { Data, DataSize };
+	return DerpNet__SendPacket(Net, TargetUserPublicKey, SharedKey, Nonce, &Vec, 1, true);
 }
 
-static bool DerpNet__TlsHandshake(DerpNet* Net, const char* Hostname, CredHandle* CredentialHandle, CtxtHandle* ContextHandle)
+bool DerpNet_Flush(DerpNet* Net)
 {
-	SCHANNEL_CRED Cred = { 0 };
-	Cred.dwVersion = SCHANNEL_CRED_VERSION;
-	Cred.dwFlags = SCH_USE_STRONG_CRYPTO | SCH_CRED_AUTO_CRED_VALIDATION | SCH_CRED_NO_DEFAULT_CREDS;
-	Cred.grbitEnabledProtocols = SP_PROT_TLS1_2;
-
-	SECURITY_STATUS SecStatus = AcquireCredentialsHandleA(NULL, UNISP_NAME_A, SECPKG_CRED_OUTBOUND, NULL, &Cred, NULL, NULL, CredentialHandle, NULL);
-	DERPNET_ASSERT(SecStatus == SEC_E_OK);
+	return DerpNet__Flush(Net, true);
+}
 
-	CtxtHandle* Context = NULL;
+// connection in hub is flushed by it later
+static void DerpNet__HubSent(DerpNet* Net);
 
-	for (;;)
+int DerpNet_TrySend(DerpNet* Net, const DerpKey* TargetUserPublicKey, const void* Data, size_t DataSize)
+{
+	const size_t HeaderSize = 1 + 4 + 32 + 24 + 16;
+	if (!DerpNet__FrameFits(Net, HeaderSize + DataSize))
 	{
-		SecBuffer InBuffers[2] = { 0 };
-		InBuffers[0].BufferType = SECBUFFER_TOKEN;
-		InBuffers[0].pvBuffer = Net->Buffer;
-		InBuffers[0].cbBuffer = (unsigned)Net->BufferReceived;
-		InBuffers[1].BufferType = SECBUFFER_EMPTY;
-
-		SecBuffer OutBuffers[1] = { 0 };
-		OutBuffers[0].BufferType = SECBUFFER_TOKEN;
-
-		SecBufferDesc InDesc = { SECBUFFER_VERSION, ARRAYSIZE(InBuffers), InBuffers };
-		SecBufferDesc OutDesc = { SECBUFFER_VERSION, ARRAYSIZE(OutBuffers), OutBuffers };
+		DERPNET_LOG("message of %zu bytes is too large to send", DataSize);
+		return -2;
+	}
 
-		DWORD Flags = ISC_REQ_USE_SUPPLIED_CREDS | ISC_REQ_ALLOCATE_MEMORY | ISC_REQ_CONFIDENTIALITY | ISC_REQ_REPLAY_DETECT | ISC_REQ_SEQUENCE_DETECT | ISC_REQ_STREAM;
-		SecStatus = InitializeSecurityContextA(
-			CredentialHandle,
-			Context,
-			Context ? NULL : (SEC_CHAR*)Hostname,
-			Flags,
-			0,
-			0,
-			Context ? &InDesc : NULL,
-			0,
-			Context ? NULL : ContextHandle,
-			&OutDesc,
-			&Flags,
-			NULL);
-		Context = ContextHandle;
+	if (Net->Hub)
+	{
+		DerpNet__HubSent(Net);
+	}
 
-		if (InBuffers[1].BufferType == SECBUFFER_EXTRA)
+	if (Net->SendQueued != 0)
+	{
+		if (!DerpNet__SendQueuePump(Net, false))
 		{
-			memmove(Net->Buffer, Net->Buffer + (Net->BufferReceived - InBuffers[1].cbBuffer), InBuffers[1].cbBuffer);
-			Net->BufferReceived = InBuffers[1].cbBuffer;
+			return -1;
 		}
-		else
+		// under limit whatever one message & batch before it adds still fits in SendQueue
+		if (Net->SendQueued >= Net->SendQueueLimit)
 		{
-			Net->BufferReceived = 0;
+			return 0;
 		}
+	}
 
-		if (SecStatus == SEC_E_OK)
+	const uint8_t* SharedKey = DerpNet__GetPeerSharedKey(Net, TargetUserPublicKey->Bytes);
+
+	uint8_t Nonce[24];
+	DerpNet__Random(&Net->Random, Nonce, sizeof(Nonce));
+
+	DerpNetIoVec Vec = { Data, DataSize };
+	return DerpNet__SendPacket(Net, TargetUserPublicKey, SharedKey, Nonce, &Vec, 1, false) ? 1 : -1;
+}
+
+bool DerpNet_Pump(DerpNet* Net)
+{
+	return DerpNet__SendQueuePump(Net, false);
+}
+
+//
+// I/O thread - producers seal DERP frames on their own threads and push them into bounded
+// multi-producer queue (Vyukov), I/O thread moves them to TLS records & socket, and puts
+// received messages into single-producer single-consumer ring for one receiving thread
+//
+
+#if (DERPNET_THREAD_QUEUE_SIZE & (DERPNET_THREAD_QUEUE_SIZE - 1)) != 0
+#	error DERPNET_THREAD_QUEUE_SIZE must be power of 2
+#endif
+
+#if (DERPNET_THREAD_RECV_SIZE & (DERPNET_THREAD_RECV_SIZE - 1)) != 0 || DERPNET_THREAD_RECV_SIZE < (1 << 18)
+#	error DERPNET_THREAD_RECV_SIZE must be power of 2, at least 256KB
+#endif
+
+#if defined(_MSC_VER)
+#	define DERPNET_THREAD_LOCAL __declspec(thread)
+#else
+#	define DERPNET_THREAD_LOCAL __thread
+#endif
+
+// shared keys cached by each producer thread, direct mapped
+#define DERPNET_THREAD_KEY_CACHE_SIZE 64
+
+// received messages are moved from connection buffer to ring in groups of this many
+#define DERPNET_THREAD_RECV_BATCH 64
+
+// marks end of ring, next entry starts at its beginning
+#define DERPNET_THREAD_RECV_WRAP 0xffffffff
+
+#if defined(_WIN32)
+static int64_t DerpNet__AtomicLoad(volatile int64_t* Value)
+{
+	return InterlockedCompareExchange64((volatile LONG64*)Value, 0, 0);
+}
+
+static void DerpNet__AtomicStore(volatile int64_t* Value, int64_t NewValue)
+{
+	InterlockedExchange64((volatile LONG64*)Value, NewValue);
+}
+
+static int64_t DerpNet__AtomicExchange(volatile int64_t* Value, int64_t NewValue)
+{
+	return InterlockedExchange64((volatile LONG64*)Value, NewValue);
+}
+
+static bool DerpNet__AtomicCompareExchange(volatile int64_t* Value, int64_t Expected, int64_t NewValue)
+{
+	return InterlockedCompareExchange64((volatile LONG64*)Value, NewValue, Expected) == Expected;
+}
+
+static int64_t DerpNet__AtomicIncrement(volatile int64_t* Value)
+{
+	return InterlockedIncrement64((volatile LONG64*)Value);
+}
+#else
+static int64_t DerpNet__AtomicLoad(volatile int64_t* Value)
+{
+	return __atomic_load_n(Value, __ATOMIC_SEQ_CST);
+}
+
+static void DerpNet__AtomicStore(volatile int64_t* Value, int64_t NewValue)
+{
+	__atomic_store_n(Value, NewValue, __ATOMIC_SEQ_CST);
+}
+
+static int64_t DerpNet__AtomicExchange(volatile int64_t* Value, int64_t NewValue)
+{
+	return __atomic_exchange_n(Value, NewValue, __ATOMIC_SEQ_CST);
+}
+
+static bool DerpNet__AtomicCompareExchange(volatile int64_t* Value, int64_t Expected, int64_t NewValue)
+{
+	return __atomic_compare_exchange_n(Value, &Expected, NewValue, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static int64_t DerpNet__AtomicIncrement(volatile int64_t* Value)
+{
+	return __atomic_add_fetch(Value, 1, __ATOMIC_SEQ_CST);
+}
+#endif
+
+typedef struct {
+	volatile int64_t Sequence;
+	uint8_t* Frame;
+} DerpNet__ThreadSlot;
+
+typedef struct {
+	int64_t Owner; // Id of DerpNetThread
+	uint8_t PublicKey[32];
+	uint8_t SharedKey[32];
+} DerpNet__ThreadPeer;
+
+struct DerpNetThread {
+	DerpNet* Net;
+	int64_t Id;
+	uint32_t SendBatchSize; // of connection, restored when thread stops
+	uint32_t SendBatchTime;
+
+	volatile int64_t Stop;
+	volatile int64_t Failed;   // connection is disconnected
+	volatile int64_t Sleeping; // I/O thread is waiting, producers must wake it
+	volatile int64_t RecvBlocked; // ring is full, consumer must wake I/O thread when it takes something
+	volatile int64_t RecvWaiting; // consumer is waiting for I/O thread
+
+	// producers
+	uint8_t Padding0[64];
+	volatile int64_t SendTail;
+
+	// I/O thread
+	uint8_t Padding1[64];
+	int64_t SendHead;
+	volatile int64_t RecvWrite;
+
+	// consumer
+	uint8_t Padding2[64];
+	volatile int64_t RecvRead;
+	size_t RecvLast; // size of entry returned by last DerpNet_ThreadRecv
+
+	uint8_t Padding3[64];
+
+#if defined(_WIN32)
+	HANDLE Thread;
+	HANDLE WakeEvent;
+	HANDLE RecvEvent;
+	WSAEVENT SocketEvent;
+#else
+	pthread_t Thread;
+	int WakePipe[2];
+	pthread_mutex_t RecvMutex;
+	pthread_cond_t RecvCond;
+#endif
+
+	DerpNet__ThreadSlot SendSlots[DERPNET_THREAD_QUEUE_SIZE];
+	uint8_t RecvRing[DERPNET_THREAD_RECV_SIZE];
+};
+
+static volatile int64_t DerpNet__ThreadIds;
+
+static DERPNET_THREAD_LOCAL DerpNet__ThreadPeer DerpNet__ThreadPeers[DERPNET_THREAD_KEY_CACHE_SIZE];
+static DERPNET_THREAD_LOCAL DerpNetRandom DerpNet__ThreadRandom;
+
+static void DerpNet__ThreadWake(DerpNetThread* Thread)
+{
+#if defined(_WIN32)
+	SetEvent(Thread->WakeEvent);
+#else
+	char Byte = 0;
+	ssize_t Written = write(Thread->WakePipe[1], &Byte, 1);
+	(void)Written; // when pipe is full, I/O thread is already woken up
+#endif
+}
+
+static void DerpNet__ThreadWakeRecv(DerpNetThread* Thread)
+{
+#if defined(_WIN32)
+	SetEvent(Thread->RecvEvent);
+#else
+	pthread_mutex_lock(&Thread->RecvMutex);
+	pthread_cond_signal(&Thread->RecvCond);
+	pthread_mutex_unlock(&Thread->RecvMutex);
+#endif
+}
+
+static const uint8_t* DerpNet__ThreadSharedKey(DerpNetThread* Thread, const uint8_t PublicKey[32])
+{
+	uint64_t Hash = Get64LE(PublicKey) * 0x9e3779b97f4a7c15ULL;
+	DerpNet__ThreadPeer* Peer = &DerpNet__ThreadPeers[(Hash >> 32) & (DERPNET_THREAD_KEY_CACHE_SIZE - 1)];
+
+	if (Peer->Owner != Thread->Id || memcmp(Peer->PublicKey, PublicKey, sizeof(Peer->PublicKey)) != 0)
+	{
+		DerpNet__GetSharedKey(Peer->SharedKey, Thread->Net->UserPrivateKey, PublicKey);
+		memcpy(Peer->PublicKey, PublicKey, sizeof(Peer->PublicKey));
+		Peer->Owner = Thread->Id;
+	}
+	return Peer->SharedKey;
+}
+
+static bool DerpNet__ThreadPush(DerpNetThread* Thread, uint8_t* Frame)
+{
+	int64_t Position = DerpNet__AtomicLoad(&Thread->SendTail);
+	for (;;)
+	{
+		DerpNet__ThreadSlot* Slot = &Thread->SendSlots[Position & (DERPNET_THREAD_QUEUE_SIZE - 1)];
+		int64_t Difference = DerpNet__AtomicLoad(&Slot->Sequence) - Position;
+		if (Difference == 0)
 		{
-			return true;
+			if (DerpNet__AtomicCompareExchange(&Thread->SendTail, Position, Position + 1))
+			{
+				Slot->Frame = Frame;
+				DerpNet__AtomicStore(&Slot->Sequence, Position + 1);
+				return true;
+			}
 		}
-		else if (SecStatus == SEC_I_INCOMPLETE_CREDENTIALS)
+		else if (Difference < 0)
 		{
-			DERPNET_LOG("server asks for client certificate, not expected here");
+			// slot is not taken by I/O thread since last round
 			return false;
 		}
-		else if (SecStatus == SEC_I_CONTINUE_NEEDED)
+		Position = DerpNet__AtomicLoad(&Thread->SendTail);
+	}
+}
+
+static uint8_t* DerpNet__ThreadPop(DerpNetThread* Thread)
+{
+	DerpNet__ThreadSlot* Slot = &Thread->SendSlots[Thread->SendHead & (DERPNET_THREAD_QUEUE_SIZE - 1)];
+	if (DerpNet__AtomicLoad(&Slot->Sequence) != Thread->SendHead + 1)
+	{
+		return NULL;
+	}
+
+	uint8_t* Frame = Slot->Frame;
+	DerpNet__AtomicStore(&Slot->Sequence, Thread->SendHead + DERPNET_THREAD_QUEUE_SIZE);
+	Thread->SendHead++;
+	return Frame;
+}
+
+// ring entry is 4 byte size, sender key & data, aligned to 8 bytes
+static size_t DerpNet__ThreadRecvEntrySize(uint32_t DataSize)
+{
+	return (4 + 32 + (size_t)DataSize + 7) & ~(size_t)7;
+}
+
+static bool DerpNet__ThreadRecvPushOne(DerpNetThread* Thread, const DerpNetMessage* Message)
+{
+	int64_t Write = Thread->RecvWrite;
+	int64_t Read = DerpNet__AtomicLoad(&Thread->RecvRead);
+
+	size_t Offset = (size_t)Write & (DERPNET_THREAD_RECV_SIZE - 1);
+	size_t Tail = DERPNET_THREAD_RECV_SIZE - Offset;
+	size_t EntrySize = DerpNet__ThreadRecvEntrySize(Message->Size);
+	size_t Needed = Tail < EntrySize ? Tail + EntrySize : EntrySize;
+
+	if (DERPNET_THREAD_RECV_SIZE - (size_t)(Write - Read) < Needed)
+	{
+		return false;
+	}
+
+	if (Tail < EntrySize)
+	{
+		uint32_t Wrap = DERPNET_THREAD_RECV_WRAP;
+		memcpy(Thread->RecvRing + Offset, &Wrap, sizeof(Wrap));
+		Write += Tail;
+		Offset = 0;
+	}
+
+	uint8_t* Entry = Thread->RecvRing + Offset;
+	memcpy(Entry, &Message->Size, 4);
+	memcpy(Entry + 4, Message->PublicKey->Bytes, 32);
+	memcpy(Entry + 4 + 32, Message->Data, Message->Size);
+
+	DerpNet__AtomicStore(&Thread->RecvWrite, Write + EntrySize);
+	return true;
+}
+
+// moves as many held messages to ring as fit, returns false when none did
+static bool DerpNet__ThreadRecvPush(DerpNetThread* Thread, const DerpNetMessage* Messages, int* MessageIndex, int MessageCount)
+{
+	int Index = *MessageIndex;
+	while (Index < MessageCount && DerpNet__ThreadRecvPushOne(Thread, &Messages[Index]))
+	{
+		Index++;
+	}
+	if (Index == *MessageIndex)
+	{
+		return false;
+	}
+	*MessageIndex = Index;
+
+	if (DerpNet__AtomicExchange(&Thread->RecvWaiting, 0))
+	{
+		DerpNet__ThreadWakeRecv(Thread);
+	}
+	return true;
+}
+
+// frame is already sealed, it is only copied into TLS record payloads
+static bool DerpNet__SendFrame(DerpNet* Net, const uint8_t* Frame, size_t FrameSize, bool Wait)
+{
+	DerpNet__RecordLayout Layout;
+	DerpNet__GetRecordLayout(Net, &Layout);
+
+	size_t Offset;
+	if (!DerpNet__SendReserve(Net, &Layout, FrameSize, &Offset, Wait))
+	{
+		return false;
+	}
+	DerpNet__RecordWrite(Net, &Layout, Offset, Frame, FrameSize);
+
+	return DerpNet__SendCommit(Net, FrameSize, Wait);
+}
+
+// sends frames from producers and moves received messages to ring until there is nothing more to do
+// returns false when connection fails
+static bool DerpNet__ThreadWork(DerpNetThread* Thread, DerpNetMessage* Messages, int* MessageIndex, int* MessageCount)
+{
+	DerpNet* Net = Thread->Net;
+
+	for (;;)
+	{
+		bool Progress = false;
+
+		if (Net->SendQueued && !DerpNet__SendQueuePump(Net, false))
 		{
-			char* OutBuffer = OutBuffers[0].pvBuffer;
-			int OutSize = OutBuffers[0].cbBuffer;
+			return false;
+		}
 
-			while (OutSize != 0)
+		// frames from all producers are packed together into full TLS records
+		uint8_t* Frame;
+		while (Net->SendQueued < Net->SendQueueLimit && (Frame = DerpNet__ThreadPop(Thread)) != NULL)
+		{
+			bool SendOk = DerpNet__SendFrame(Net, Frame, 1 + 4 + Get32BE(Frame + 1), false);
+			free(Frame);
+			if (!SendOk)
 			{
-				int WriteSize = send(Net->Socket, OutBuffer, OutSize, 0);
-				if (WriteSize <= 0)
-				{
-					DERPNET_LOG("failed to send data to server, remote server disconnected?");
-					return false;
-				}
-				Net->TotalSent += WriteSize;
-
-				OutSize -= WriteSize;
-				OutBuffer += WriteSize;
+				return false;
 			}
-			FreeContextBuffer(OutBuffers[0].pvBuffer);
+			Progress = true;
 		}
-		else if (SecStatus != SEC_E_INCOMPLETE_MESSAGE)
+		if (Net->SendPending && Net->SendQueued < Net->SendQueueLimit && !DerpNet__Flush(Net, false))
 		{
-			DERPNET_LOG("cannot verify server certificate, bad hostname, expired cert, or bad crypto handshake");
 			return false;
 		}
 
-		if (Net->BufferReceived == sizeof(Net->BufferReceived))
+		if (*MessageIndex == *MessageCount)
 		{
-			DERPNET_LOG("server is sending too much data instead of proper handshake?");
-			return false;
+			int Received = DerpNet_RecvBatch(Net, Messages, DERPNET_THREAD_RECV_BATCH, false);
+			if (Received < 0)
+			{
+				return false;
+			}
+			*MessageIndex = 0;
+			*MessageCount = Received;
 		}
 
-		int ReadSize = recv(Net->Socket, (char*)Net->Buffer + Net->BufferReceived, (int)(sizeof(Net->Buffer) - Net->BufferReceived), 0);
-		if (ReadSize <= 0)
+		if (DerpNet__ThreadRecvPush(Thread, Messages, MessageIndex, *MessageCount))
+		{
+			Progress = true;
+		}
+
+		if (!Progress)
 		{
-			DERPNET_LOG("failed to read data from server, remote server disconnected?");
-			return false;
+			return true;
 		}
-		Net->TotalReceived += ReadSize;
-		Net->BufferReceived += ReadSize;
 	}
 }
 
-static bool DerpNet__TlsWrite(DerpNet* Net, const void* Data, size_t DataSize)
+#if defined(_WIN32)
+static DWORD WINAPI DerpNet__ThreadRun(LPVOID Arg)
+#else
+static void* DerpNet__ThreadRun(void* Arg)
+#endif
 {
-#if DERPNET_USE_PLAIN_HTTP
-	while (DataSize != 0)
+	DerpNetThread* Thread = (DerpNetThread*)Arg;
+	DerpNet* Net = Thread->Net;
+
+	// messages stay in connection buffer while ring has no space for them
+	DerpNetMessage Messages[DERPNET_THREAD_RECV_BATCH];
+	int MessageIndex = 0;
+	int MessageCount = 0;
+
+	while (!DerpNet__AtomicLoad(&Thread->Stop))
 	{
-		fd_set WriteSet;
-		FD_ZERO(&WriteSet);
-		FD_SET(Net->Socket, &WriteSet);
+		if (!DerpNet__ThreadWork(Thread, Messages, &MessageIndex, &MessageCount))
+		{
+			DERPNET_LOG("connection failed in I/O thread");
+			break;
+		}
 
-		int Select = select((int)(Net->Socket + 1), NULL, &WriteSet, NULL, NULL);
-		if (Select < 0)
+		// consumer wakes thread only when flag is set, so ring is checked again after setting it
+		bool CanRead = MessageIndex == MessageCount;
+		if (!CanRead)
 		{
-			DERPNET_LOG("select failed");
-			return false;
+			DerpNet__AtomicStore(&Thread->RecvBlocked, 1);
+			if (DerpNet__ThreadRecvPush(Thread, Messages, &MessageIndex, MessageCount))
+			{
+				continue;
+			}
 		}
 
-		int WriteSize = send(Net->Socket, Data, (int)DataSize, 0);
-		if (WriteSize <= 0)
+		// same for producers and send queue
+		DerpNet__AtomicStore(&Thread->Sleeping, 1);
+		DerpNet__ThreadSlot* Next = &Thread->SendSlots[Thread->SendHead & (DERPNET_THREAD_QUEUE_SIZE - 1)];
+		bool CanSend = Net->SendQueued < Net->SendQueueLimit && DerpNet__AtomicLoad(&Next->Sequence) == Thread->SendHead + 1;
+		if (CanSend || DerpNet__AtomicLoad(&Thread->Stop))
 		{
-			DERPNET_LOG("failed to send data to server, remote server disconnected?");
-			return false;
+			DerpNet__AtomicStore(&Thread->Sleeping, 0);
+			continue;
 		}
-		Net->TotalSent += WriteSize;
 
-		Data = (char*)Data + WriteSize;
-		DataSize -= WriteSize;
-	}
-	return true; 
+#if defined(_WIN32)
+		// socket event is signaled by FD_READ, and by FD_WRITE once send that would block can continue
+		HANDLE Handles[2] = { Thread->WakeEvent, Thread->SocketEvent };
+		DWORD Wait = WaitForMultipleObjects(CanRead || Net->SendQueued ? 2 : 1, Handles, FALSE, INFINITE);
+		Net->TotalSyscalls++;
+		if (Wait == WAIT_FAILED)
+		{
+			DERPNET_LOG("WaitForMultipleObjects failed in I/O thread");
+			break;
+		}
+		if (Wait == WAIT_OBJECT_0 + 1)
+		{
+			WSANETWORKEVENTS Events;
+			WSAEnumNetworkEvents((DerpNet__Socket)Net->Socket, Thread->SocketEvent, &Events);
+		}
 #else
-	CtxtHandle ContextHandle;
-	memcpy(&ContextHandle, Net->CtxHandle, sizeof(ContextHandle));
+		struct pollfd Poll[2] =
+		{
+			{ .fd = Thread->WakePipe[0], .events = POLLIN },
+			{ .fd = (DerpNet__Socket)Net->Socket, .events = (short)((CanRead ? POLLIN : 0) | (Net->SendQueued ? POLLOUT : 0)) },
+		};
+		int PollCount = poll(Poll, Poll[1].events ? 2 : 1, -1);
+		Net->TotalSyscalls++;
+		if (PollCount < 0 && errno != EINTR)
+		{
+			DERPNET_LOG("poll failed in I/O thread");
+			break;
+		}
+		if (PollCount > 0 && Poll[0].revents)
+		{
+			char Drain[64];
+			while (read(Thread->WakePipe[0], Drain, sizeof(Drain)) == sizeof(Drain))
+			{
+			}
+		}
+#endif
+		DerpNet__AtomicStore(&Thread->Sleeping, 0);
+	}
 
-	SecPkgContext_StreamSizes StreamSizes;
-	SECURITY_STATUS SecStatus = QueryContextAttributes(&ContextHandle, SECPKG_ATTR_STREAM_SIZES, &StreamSizes);
-	DERPNET_ASSERT(SecStatus == SEC_E_OK);
+	// messages that did not fit in ring are dropped
+	DerpNet_RecvRelease(Net);
 
-	while (DataSize != 0)
+	if (!DerpNet__AtomicLoad(&Thread->Stop))
 	{
-		size_t DataSizeToUse = min(DataSize, StreamSizes.cbMaximumMessage);
-
-		char WriteBuffer[16384 + 512];
-		DERPNET_ASSERT(StreamSizes.cbHeader + StreamSizes.cbMaximumMessage + StreamSizes.cbTrailer <= sizeof(WriteBuffer));
+		DerpNet__AtomicStore(&Thread->Failed, 1);
+		DerpNet__ThreadWakeRecv(Thread);
+	}
+	return 0;
+}
 
-		SecBuffer OutBuffers[3] = { 0 };
-		OutBuffers[0].BufferType = SECBUFFER_STREAM_HEADER;
-		OutBuffers[0].pvBuffer = WriteBuffer;
-		OutBuffers[0].cbBuffer = StreamSizes.cbHeader;
-		OutBuffers[1].BufferType = SECBUFFER_DATA;
-		OutBuffers[1].pvBuffer = WriteBuffer + StreamSizes.cbHeader;
-		OutBuffers[1].cbBuffer = (unsigned)DataSizeToUse;
-		OutBuffers[2].BufferType = SECBUFFER_STREAM_TRAILER;
-		OutBuffers[2].pvBuffer = WriteBuffer + StreamSizes.cbHeader + DataSizeToUse;
-		OutBuffers[2].cbBuffer = StreamSizes.cbTrailer;
+DerpNetThread* DerpNet_ThreadStart(DerpNet* Net)
+{
+#if defined(__linux__)
+	if (Net->Ring.Fd >= 0)
+	{
+		DERPNET_LOG("I/O thread cannot be used with io_uring");
+		return NULL;
+	}
+#endif
+	if (Net->Opening)
+	{
+		return NULL;
+	}
 
-		memcpy(OutBuffers[1].pvBuffer, Data, DataSizeToUse);
+	DerpNetThread* Thread = (DerpNetThread*)DerpNet__AllocZero(&Net->Allocator, sizeof(*Thread));
+	if (!Thread)
+	{
+		return NULL;
+	}
 
-		SecBufferDesc OutDesc = { SECBUFFER_VERSION, ARRAYSIZE(OutBuffers), OutBuffers };
-		SecStatus = EncryptMessage(&ContextHandle, 0, &OutDesc, 0);
-		DERPNET_ASSERT(SecStatus == SEC_E_OK);
+	Thread->Net = Net;
+	Thread->Id = DerpNet__AtomicIncrement(&DerpNet__ThreadIds);
+	for (int64_t i = 0; i < DERPNET_THREAD_QUEUE_SIZE; i++)
+	{
+		Thread->SendSlots[i].Sequence = i;
+	}
 
-		int SizeToSend = OutBuffers[0].cbBuffer + OutBuffers[1].cbBuffer + OutBuffers[2].cbBuffer;
-		int BytesSent = 0;
-		while (BytesSent != SizeToSend)
+	// I/O thread decides itself when to flush, and Recv calls must never wait for batch timer
+	Thread->SendBatchSize = Net->SendBatchSize;
+	Thread->SendBatchTime = Net->SendBatchTime;
+	Net->SendBatchSize = (uint32_t)Net->SendBufferLimit;
+	Net->SendBatchTime = 0;
+
+#if defined(_WIN32)
+	Thread->WakeEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+	Thread->RecvEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+	Thread->SocketEvent = WSACreateEvent();
+	if (Thread->WakeEvent && Thread->RecvEvent && Thread->SocketEvent != WSA_INVALID_EVENT
+		&& WSAEventSelect((DerpNet__Socket)Net->Socket, Thread->SocketEvent, FD_READ | FD_WRITE | FD_CLOSE) == 0)
+	{
+		Thread->Thread = CreateThread(NULL, 0, &DerpNet__ThreadRun, Thread, 0, NULL);
+		if (Thread->Thread)
 		{
-			fd_set WriteSet;
-			FD_ZERO(&WriteSet);
-			FD_SET(Net->Socket, &WriteSet);
-
-			int Select = select((int)(Net->Socket + 1), NULL, &WriteSet, NULL, NULL);
-			if (Select < 0)
-			{
-				DERPNET_LOG("select failed");
-				return false;
-			}
+			return Thread;
+		}
+		WSAEventSelect((DerpNet__Socket)Net->Socket, Net->SocketEvent, FD_READ);
+	}
+	if (Thread->WakeEvent)
+	{
+		CloseHandle(Thread->WakeEvent);
+	}
+	if (Thread->RecvEvent)
+	{
+		CloseHandle(Thread->RecvEvent);
+	}
+	if (Thread->SocketEvent != WSA_INVALID_EVENT)
+	{
+		WSACloseEvent(Thread->SocketEvent);
+	}
+#else
+	if (pipe(Thread->WakePipe) == 0)
+	{
+		fcntl(Thread->WakePipe[0], F_SETFL, fcntl(Thread->WakePipe[0], F_GETFL) | O_NONBLOCK);
+		fcntl(Thread->WakePipe[1], F_SETFL, fcntl(Thread->WakePipe[1], F_GETFL) | O_NONBLOCK);
+		pthread_mutex_init(&Thread->RecvMutex, NULL);
+		pthread_cond_init(&Thread->RecvCond, NULL);
 
-			int WriteSize = send(Net->Socket, WriteBuffer + BytesSent, SizeToSend - BytesSent, 0);
-			if (WriteSize <= 0)
-			{
-				DERPNET_LOG("failed to send data to server, remote server disconnected?");
-				return false;
-			}
-			Net->TotalSent += WriteSize;
-			BytesSent += WriteSize;
+		if (pthread_create(&Thread->Thread, NULL, &DerpNet__ThreadRun, Thread) == 0)
+		{
+			return Thread;
 		}
 
-		Data = (char*)Data + DataSizeToUse;
-		DataSize -= DataSizeToUse;
+		pthread_cond_destroy(&Thread->RecvCond);
+		pthread_mutex_destroy(&Thread->RecvMutex);
+		close(Thread->WakePipe[0]);
+		close(Thread->WakePipe[1]);
 	}
-
-	return true;
 #endif
+
+	DERPNET_LOG("cannot start I/O thread");
+	Net->SendBatchSize = Thread->SendBatchSize;
+	Net->SendBatchTime = Thread->SendBatchTime;
+	DerpNet__Free(&Net->Allocator, Thread, sizeof(*Thread));
+	return NULL;
 }
 
-static bool DerpNet__TlsRead(DerpNet* Net, bool Wait)
+int DerpNet_ThreadSend(DerpNetThread* Thread, const DerpKey* TargetUserPublicKey, const void* Data, size_t DataSize)
 {
-#if DERPNET_USE_PLAIN_HTTP
-	fd_set ReadSet;
-	FD_ZERO(&ReadSet);
-	FD_SET(Net->Socket, &ReadSet);
-
-	struct timeval TimeVal = { 0, 0 };
-	int Select = select((int)(Net->Socket + 1), &ReadSet, NULL, NULL, Wait ? NULL : &TimeVal);
-	if (Select < 0)
+	if (DerpNet__AtomicLoad(&Thread->Failed))
 	{
-		return false;
+		return -1;
 	}
-	if (Select == 0)
+
+	const size_t HeaderSize = 1 + 4 + 32 + 24 + 16;
+	size_t FrameSize = HeaderSize + DataSize;
+
+	// I/O thread would fail on such frame, and disconnect it for all producers
+	// record layout & send buffer limit do not change while thread runs, so reading them here is safe
+	if (!DerpNet__FrameFits(Thread->Net, FrameSize))
 	{
-		return true;
+		DERPNET_LOG("message of %zu bytes is too large to send", DataSize);
+		return -2;
 	}
 
-	int ReadSize = recv(Net->Socket, (char*)Net->Buffer + Net->BufferReceived, (int)(sizeof(Net->Buffer) - Net->BufferReceived), 0);
-	if (ReadSize <= 0)
+	// not from connection allocator, producers & I/O thread allocate and free frames at same time
+	uint8_t* Frame = (uint8_t*)malloc(FrameSize);
+	if (!Frame)
 	{
-		DERPNET_LOG("failed to read data from server, remote server disconnected?");
-		return false;
+		return 0;
 	}
-	Net->TotalReceived += ReadSize;
-	Net->BufferReceived += ReadSize;
-	Net->BufferSize += ReadSize;
 
-	DERPNET_LOG("read %d bytes from socket", ReadSize);
-	WSAResetEvent(Net->SocketEvent);
+	uint8_t* PublicKey = Frame + 1 + 4;
+	uint8_t* Nonce = PublicKey + 32;
+	uint8_t* Auth = Nonce + 24;
 
-	return true;
+	Frame[0] = 4; // SendPacket
+	Set32BE(Frame + 1, (uint32_t)(FrameSize - (1 + 4)));
+	memcpy(PublicKey, TargetUserPublicKey->Bytes, sizeof(TargetUserPublicKey->Bytes));
+	DerpNet__Random(&DerpNet__ThreadRandom, Nonce, 24);
 
-#else
-	CtxtHandle ContextHandle;
-	memcpy(&ContextHandle, Net->CtxHandle, sizeof(ContextHandle));
+	const uint8_t* SharedKey = DerpNet__ThreadSharedKey(Thread, TargetUserPublicKey->Bytes);
+	DerpNet__BoxSealEx(Nonce, Auth, Frame + HeaderSize, (const uint8_t*)Data, DataSize, SharedKey);
 
-	SecPkgContext_StreamSizes StreamSizes;
-	SECURITY_STATUS SecStatus = QueryContextAttributes(&ContextHandle, SECPKG_ATTR_STREAM_SIZES, &StreamSizes);
-	DERPNET_ASSERT(SecStatus == SEC_E_OK);
+	if (!DerpNet__ThreadPush(Thread, Frame))
+	{
+		free(Frame);
+		return 0;
+	}
 
-	for (;;)
+	if (DerpNet__AtomicExchange(&Thread->Sleeping, 0))
 	{
-		size_t EncryptedSize = Net->BufferReceived - Net->BufferSize;
+		DerpNet__ThreadWake(Thread);
+	}
+	return 1;
+}
 
-		if (EncryptedSize != 0)
-		{
-			SecBuffer InBuffers[4] = { 0 };
-			DERPNET_ASSERT(StreamSizes.cBuffers == ARRAYSIZE(InBuffers));
-
-			InBuffers[0].BufferType = SECBUFFER_DATA;
-			InBuffers[0].pvBuffer = Net->Buffer + Net->BufferSize;
-			InBuffers[0].cbBuffer = (unsigned)EncryptedSize;
-			InBuffers[1].BufferType = SECBUFFER_EMPTY;
-			InBuffers[2].BufferType = SECBUFFER_EMPTY;
-			InBuffers[3].BufferType = SECBUFFER_EMPTY;
-
-			SecBufferDesc InDesc = { SECBUFFER_VERSION, ARRAYSIZE(InBuffers), InBuffers };
-
-			SecStatus = DecryptMessage(&ContextHandle, &InDesc, 0, NULL);
-			if (SecStatus == SEC_E_OK)
-			{
-				//
-				// Before decryption, Buffer = [ppppppppppeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeee.......]
-				//                                        ^                                   ^
-				//                                        |                                   |
-				// Buffer + BufferSize -------------------+                                   |
-				// Buffer + BufferReceived ---------------------------------------------------+
-				// 
-				// After decryption,  Buffer = [pppppppppphhhhhhhdddddddddtttttttteeeeeeeeeeee.......]
-				//                              ^         ^      ^        ^       ^
-				//                              |         |      |        |       |
-				// Plaintext data in buffer ----+         |      |        |       |
-				// Header from current TLS packet --------+      |        |       |
-				// Newly decrypted data from current TLS packet -+        |       |
-				// Trailer from current TLS packet -----------------------+       |
-				// Any extra remaining ciphertext in buffer for next TLS packets -+
-				//
-				// After memmoves,    Buffer = [ppppppppppdddddddddeeeeeeeeeeee......................]
-				//                                                 ^           ^
-				//                                                 |           |
-				// Buffer + BufferSize ----------------------------+           |
-				// Buffer + BufferReceived ------------------------------------+
-				//
-
-				DERPNET_ASSERT(InBuffers[0].BufferType == SECBUFFER_STREAM_HEADER);
-				DERPNET_ASSERT(InBuffers[1].BufferType == SECBUFFER_DATA);
-				DERPNET_ASSERT(InBuffers[2].BufferType == SECBUFFER_STREAM_TRAILER);
-				DERPNET_ASSERT(InBuffers[3].BufferType == SECBUFFER_EXTRA || InBuffers[3].BufferType == SECBUFFER_EMPTY);
-
-				DERPNET_ASSERT(InBuffers[0].cbBuffer == StreamSizes.cbHeader);
-
-				DERPNET_ASSERT(InBuffers[0].pvBuffer == Net->Buffer + Net->BufferSize);
-				DERPNET_ASSERT(InBuffers[1].pvBuffer == Net->Buffer + Net->BufferSize + InBuffers[0].cbBuffer);
-				DERPNET_ASSERT(InBuffers[2].pvBuffer == Net->Buffer + Net->BufferSize + InBuffers[0].cbBuffer + InBuffers[1].cbBuffer);
-
-				if (InBuffers[3].BufferType == SECBUFFER_EXTRA)
-				{
-					DERPNET_ASSERT(InBuffers[3].pvBuffer == Net->Buffer + Net->BufferSize + InBuffers[0].cbBuffer + InBuffers[1].cbBuffer + StreamSizes.cbTrailer);
-				}
-				else if (InBuffers[3].BufferType == SECBUFFER_EMPTY)
-				{
-					DERPNET_ASSERT(Net->BufferSize + InBuffers[0].cbBuffer + InBuffers[1].cbBuffer + StreamSizes.cbTrailer == Net->BufferReceived);
-				}
+int DerpNet_ThreadRecv(DerpNetThread* Thread, DerpKey* OtherUserPublicKey, uint8_t** Data, uint32_t* DataSize, bool Wait)
+{
+	int64_t Read = Thread->RecvRead;
+	if (Thread->RecvLast)
+	{
+		Read += Thread->RecvLast;
+		Thread->RecvLast = 0;
+		DerpNet__AtomicStore(&Thread->RecvRead, Read);
 
-				memmove(Net->Buffer + Net->BufferSize, InBuffers[1].pvBuffer, InBuffers[1].cbBuffer);
-				Net->BufferSize += InBuffers[1].cbBuffer;
+		if (DerpNet__AtomicExchange(&Thread->RecvBlocked, 0))
+		{
+			DerpNet__ThreadWake(Thread);
+		}
+	}
 
-				if (InBuffers[3].BufferType == SECBUFFER_EXTRA)
-				{
-					size_t ExtraSize = (Net->Buffer + Net->BufferReceived) - (uint8_t*)InBuffers[3].pvBuffer;
-					memmove(Net->Buffer + Net->BufferSize, InBuffers[3].pvBuffer, ExtraSize);
-				}
-				Net->BufferReceived -= InBuffers[0].cbBuffer + StreamSizes.cbTrailer;
-				
-				DERPNET_LOG("TLS packet decrypted - encrypted=%lu, decrypted=%lu, BufferSize=%zu, BufferReceived=%zu", InBuffers[0].cbBuffer + InBuffers[1].cbBuffer + StreamSizes.cbTrailer, InBuffers[1].cbBuffer, Net->BufferSize, Net->BufferReceived);
+	for (;;)
+	{
+		if (Read != DerpNet__AtomicLoad(&Thread->RecvWrite))
+		{
+			size_t Offset = (size_t)Read & (DERPNET_THREAD_RECV_SIZE - 1);
+			uint8_t* Entry = Thread->RecvRing + Offset;
 
-				return true;
-			}
-			else if (SecStatus != SEC_E_INCOMPLETE_MESSAGE)
+			uint32_t Size;
+			memcpy(&Size, Entry, sizeof(Size));
+			if (Size == DERPNET_THREAD_RECV_WRAP)
 			{
-				DERPNET_LOG("TLS protocol error when decrypting incoming data");
-				return false;
+				Read += DERPNET_THREAD_RECV_SIZE - Offset;
+				DerpNet__AtomicStore(&Thread->RecvRead, Read);
+				continue;
 			}
-		}
 
-		if (Net->BufferReceived == sizeof(Net->Buffer))
-		{
-			DERPNET_LOG("server is sending too much data instead of proper handshake?");
-			return false;
+			memcpy(OtherUserPublicKey->Bytes, Entry + 4, sizeof(OtherUserPublicKey->Bytes));
+			*Data = Entry + 4 + 32;
+			*DataSize = Size;
+			Thread->RecvLast = DerpNet__ThreadRecvEntrySize(Size);
+			return 1;
 		}
 
-		DERPNET_LOG("reading more data from socket, BufferSize=%zu, BufferReceived=%zu", Net->BufferSize, Net->BufferReceived);
-
-		fd_set ReadSet;
-		FD_ZERO(&ReadSet);
-		FD_SET(Net->Socket, &ReadSet);
-
-		struct timeval TimeVal = { 0, 0 };
-		int Select = select((int)(Net->Socket + 1), &ReadSet, NULL, NULL, Wait ? NULL : &TimeVal);
-		if (Select < 0)
+		if (DerpNet__AtomicLoad(&Thread->Failed))
 		{
-			return false;
+			return -1;
 		}
-		if (Select == 0)
+		if (!Wait)
 		{
-			return true;
+			return 0;
 		}
 
-		int ReadSize = recv(Net->Socket, (char*)Net->Buffer + Net->BufferReceived, (int)(sizeof(Net->Buffer) - Net->BufferReceived), 0);
-		if (ReadSize <= 0)
+		// I/O thread signals only after seeing flag, so ring is checked again after setting it
+#if defined(_WIN32)
+		DerpNet__AtomicStore(&Thread->RecvWaiting, 1);
+		if (Read == DerpNet__AtomicLoad(&Thread->RecvWrite) && !DerpNet__AtomicLoad(&Thread->Failed))
 		{
-			DERPNET_LOG("failed to read data from server, remote server disconnected?");
-			return false;
+			WaitForSingleObject(Thread->RecvEvent, INFINITE);
 		}
-		Net->TotalReceived += ReadSize;
-		Net->BufferReceived += ReadSize;
-
-		DERPNET_LOG("read %d bytes from socket, BufferReceived=%zu", ReadSize, Net->BufferReceived);
-		WSAResetEvent(Net->SocketEvent);
-	}
+#else
+		pthread_mutex_lock(&Thread->RecvMutex);
+		DerpNet__AtomicStore(&Thread->RecvWaiting, 1);
+		if (Read == DerpNet__AtomicLoad(&Thread->RecvWrite) && !DerpNet__AtomicLoad(&Thread->Failed))
+		{
+			pthread_cond_wait(&Thread->RecvCond, &Thread->RecvMutex);
+		}
+		pthread_mutex_unlock(&Thread->RecvMutex);
 #endif
+	}
 }
 
-static void DerpNet__TlsConsume(DerpNet* Net, size_t PlaintextSize)
+void DerpNet_ThreadStop(DerpNetThread* Thread)
 {
-	if (PlaintextSize == 0)
+	DerpNet* Net = Thread->Net;
+
+	DerpNet__AtomicStore(&Thread->Stop, 1);
+	DerpNet__ThreadWake(Thread);
+
+#if defined(_WIN32)
+	WaitForSingleObject(Thread->Thread, INFINITE);
+	CloseHandle(Thread->Thread);
+	CloseHandle(Thread->WakeEvent);
+	CloseHandle(Thread->RecvEvent);
+	WSAEventSelect((DerpNet__Socket)Net->Socket, Net->SocketEvent, FD_READ);
+	WSACloseEvent(Thread->SocketEvent);
+#else
+	pthread_join(Thread->Thread, NULL);
+	pthread_cond_destroy(&Thread->RecvCond);
+	pthread_mutex_destroy(&Thread->RecvMutex);
+	close(Thread->WakePipe[0]);
+	close(Thread->WakePipe[1]);
+#endif
+
+	// frames still in queue are sent now, waiting for socket if needed
+	bool SendOk = !Thread->Failed;
+	uint8_t* Frame;
+	while ((Frame = DerpNet__ThreadPop(Thread)) != NULL)
 	{
-		return;
+		SendOk = SendOk && DerpNet__SendFrame(Net, Frame, 1 + 4 + Get32BE(Frame + 1), true);
+		free(Frame);
+	}
+	if (SendOk)
+	{
+		DerpNet__Flush(Net, true);
 	}
 
-	DERPNET_ASSERT(Net->BufferSize <= Net->BufferReceived);
-	DERPNET_ASSERT(PlaintextSize <= Net->BufferSize);
+	Net->SendBatchSize = Thread->SendBatchSize;
+	Net->SendBatchTime = Thread->SendBatchTime;
+	DerpNet__Free(&Net->Allocator, Thread, sizeof(*Thread));
+}
 
-	memmove(Net->Buffer, Net->Buffer + PlaintextSize, Net->BufferReceived - PlaintextSize);
-	Net->BufferSize -= PlaintextSize;
-	Net->BufferReceived -= PlaintextSize;
+//
+// hub - many connections on one event loop, level-triggered epoll on Linux, poll() elsewhere
+// connections with data to send are kept in dirty list, and flushed once per DerpNet_HubRun
+// connections with frames left in Buffer after their receive rounds are kept in pending list, read again next run
+//
 
-	DERPNET_LOG("consumed %zu bytes from input buffer, BufferSize=%zu, BufferReceived=%zu", PlaintextSize, Net->BufferSize, Net->BufferReceived);
-}
+// events taken from one wait
+#define DERPNET_HUB_EVENTS 256
 
-static int DerpNet__ReadFrame(DerpNet* Net, uint8_t* FrameType, uint32_t* FrameSize, bool Wait)
-{
-	const size_t FrameHeaderSize = 1 + 4;
+// messages decrypted per Recv callback, and batches taken from one connection per event
+#define DERPNET_HUB_RECV_BATCH 64
+#define DERPNET_HUB_RECV_ROUNDS 4
 
-	if (Wait)
-	{
-		for (;;)
-		{
-			if (Net->BufferSize < FrameHeaderSize)
-			{
-				if (!DerpNet__TlsRead(Net, Wait))
-				{
-					return -1;
-				}
-				continue;
-			}
+typedef struct {
+	DerpNet* Net;
+	DerpNetHubRecv* Recv;
+	DerpNetHubNotify* Notify;
+	void* User;
+	uintptr_t Socket; // registered in hub poll, invalid socket when none
+	bool WantRead;
+	bool WantWrite;
+	bool Opening;     // DERPNET_HUB_OPEN is not reported yet
+	bool Dirty;       // in dirty list
+	bool Pending;     // in pending list
+	bool Full;        // send queue was over limit, WRITABLE is reported when it drains
+	bool Active;      // had traffic since last check for idle connections
+	uint64_t Time;    // usec, opening connection is stepped then even if its socket is not ready
+} DerpNet__HubEntry;
 
-			*FrameType = Net->Buffer[0];
-			*FrameSize = Get32BE(Net->Buffer + 1);
+typedef struct {
+	DerpNet* Net; // NULL when connection was removed after event was taken
+	bool Read;
+	bool Write;
+} DerpNet__HubReady;
 
-			if (Net->BufferSize < FrameHeaderSize + *FrameSize)
-			{
-				if (!DerpNet__TlsRead(Net, Wait))
-				{
-					return -1;
-				}
-				continue;
-			}
+struct DerpNetHub {
+	DerpNet__HubEntry* Entries;
+	size_t Count;
+	size_t Capacity;
+	size_t Opening;  // connections still opening
 
-			DerpNet__TlsConsume(Net, FrameHeaderSize);
+	DerpNet** Dirty;
+	size_t DirtyCount;
 
-			DERPNET_LOG("received frame type=%u, size=%u, BufferSize=%zu, BufferReceived=%zu", *FrameType, *FrameSize, Net->BufferSize, Net->BufferReceived);
-			return 1;
-		}
-	}
+	DerpNet** Pending; // socket may not be ready again for them, so they are not waited on
+	size_t PendingCount;
+	DerpNet** PendingRun; // pending list taken by current run, NULL for connection removed meanwhile
+	size_t PendingRunCount;
 
-	size_t LastBufferSize = Net->BufferSize;
+	DerpNet__HubReady Events[DERPNET_HUB_EVENTS];
+	size_t EventCount;
 
-	for (;;)
+	DerpNet* Current; // connection which callback is running
+	bool CurrentRemoved;
+
+	uint64_t ShrinkTime; // usec, when idle connections are checked next
+
+#if defined(__linux__)
+	int Poll; // epoll instance
+#else
+	void* Polls; // pollfd array, rebuilt for every wait
+#endif
+};
+
+#if defined(_WIN32)
+typedef WSAPOLLFD DerpNet__PollFd;
+#	define DerpNet__PollCall WSAPoll
+#elif !defined(__linux__)
+typedef struct pollfd DerpNet__PollFd;
+#	define DerpNet__PollCall poll
+#endif
+
+static DerpNet__HubEntry* DerpNet__HubGet(DerpNetHub* Hub, DerpNet* Net)
+{
+	return &Hub->Entries[Net->HubIndex];
+}
+
+// registers socket that connection waits on, socket can change while connection is opening
+static bool DerpNet__HubWatch(DerpNetHub* Hub, DerpNet__HubEntry* Entry, uintptr_t Socket, bool WantRead, bool WantWrite)
+{
+#if defined(__linux__)
+	if (Entry->Socket != Socket && Entry->Socket != DERPNET_INVALID_SOCKET)
 	{
-		if (!DerpNet__TlsRead(Net, Wait))
-		{
-			return -1;
-		}
+		// older connect attempt may be still open, it is closed otherwise and this fails
+		epoll_ctl(Hub->Poll, EPOLL_CTL_DEL, (int)Entry->Socket, NULL);
+	}
+	if (Socket != DERPNET_INVALID_SOCKET && (Entry->Socket != Socket || Entry->WantRead != WantRead || Entry->WantWrite != WantWrite))
+	{
+		struct epoll_event Event = { .events = (WantRead ? EPOLLIN : 0) | (WantWrite ? EPOLLOUT : 0), .data.ptr = Entry->Net };
 
-		if (Net->BufferSize < FrameHeaderSize)
+		// socket with same number could have been closed & created again in meantime
+		int Op = Entry->Socket == Socket ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+		if (epoll_ctl(Hub->Poll, Op, (int)Socket, &Event) < 0)
 		{
-			if (Net->BufferSize != LastBufferSize)
+			Op = errno == ENOENT ? EPOLL_CTL_ADD : errno == EEXIST ? EPOLL_CTL_MOD : -1;
+			if (Op < 0 || epoll_ctl(Hub->Poll, Op, (int)Socket, &Event) < 0)
 			{
-				LastBufferSize = Net->BufferSize;
-				continue;
+				DERPNET_LOG("epoll_ctl failed for hub");
+				Entry->Socket = DERPNET_INVALID_SOCKET;
+				return false;
 			}
-			return 0;
 		}
+	}
+#else
+	(void)Hub;
+#endif
+	Entry->Socket = Socket;
+	Entry->WantRead = WantRead;
+	Entry->WantWrite = WantWrite;
+	return true;
+}
 
-		*FrameType = Net->Buffer[0];
-		*FrameSize = Get32BE(Net->Buffer + 1);
+static void DerpNet__HubUnlink(DerpNetHub* Hub, DerpNet* Net)
+{
+	DerpNet__HubEntry* Entry = DerpNet__HubGet(Hub, Net);
+	DerpNet__HubWatch(Hub, Entry, DERPNET_INVALID_SOCKET, false, false);
 
-		if (Net->BufferSize < FrameHeaderSize + *FrameSize)
+	if (Entry->Opening)
+	{
+		Hub->Opening--;
+	}
+	if (Entry->Dirty)
+	{
+		for (size_t i = 0; i < Hub->DirtyCount; i++)
 		{
-			if (Net->BufferSize != LastBufferSize)
+			if (Hub->Dirty[i] == Net)
 			{
-				LastBufferSize = Net->BufferSize;
-				continue;
+				Hub->Dirty[i] = Hub->Dirty[--Hub->DirtyCount];
+				break;
 			}
-			return 0;
 		}
-
-		DerpNet__TlsConsume(Net, FrameHeaderSize);
-
-		DERPNET_LOG("received frame type=%u, size=%u, BufferSize=%zu, BufferReceived=%zu", *FrameType, *FrameSize, Net->BufferSize, Net->BufferReceived);
-		return 1;
 	}
+	if (Entry->Pending)
+	{
+		for (size_t i = 0; i < Hub->PendingCount; i++)
+		{
+			if (Hub->Pending[i] == Net)
+			{
+				Hub->Pending[i] = Hub->Pending[--Hub->PendingCount];
+				break;
+			}
+		}
+	}
+	for (size_t i = 0; i < Hub->EventCount; i++)
+	{
+		if (Hub->Events[i].Net == Net)
+		{
+			Hub->Events[i].Net = NULL;
+		}
+	}
+	for (size_t i = 0; i < Hub->PendingRunCount; i++)
+	{
+		if (Hub->PendingRun[i] == Net)
+		{
+			Hub->PendingRun[i] = NULL;
+		}
+	}
+	if (Hub->Current == Net)
+	{
+		Hub->CurrentRemoved = true;
+	}
+
+	// last entry takes place of removed one
+	*Entry = Hub->Entries[--Hub->Count];
+	Entry->Net->HubIndex = Net->HubIndex;
+	Net->Hub = NULL;
 }
 
-bool DerpNet_Open(DerpNet* Net, const char* DerpServer, const DerpKey* UserSecret)
+// removes failed connection from hub - when DerpNet_Step fails while opening, there is nothing to close
+static void DerpNet__HubFail(DerpNetHub* Hub, DerpNet* Net)
 {
-	CredHandle CredHandle;
-	CtxtHandle CtxHandle;
-
-	SecInvalidateHandle(&CredHandle);
-	SecInvalidateHandle(&CtxHandle);
-
-	struct addrinfo* AddrInfo = NULL;
-	Net->Socket = INVALID_SOCKET;
-	Net->SocketEvent = NULL;
-	Net->BufferSize = Net->BufferReceived = 0;
-	Net->TotalReceived = Net->TotalSent = 0;
-
-	WSADATA SocketData;
-	int SocketOk = WSAStartup(MAKEWORD(2, 2), &SocketData);
-	DERPNET_ASSERT(SocketOk == 0);
-
-	//
-	// connect to DERP server
-	//
-
-	struct addrinfo AddrHints =
+	DerpNet__HubEntry Entry = *DerpNet__HubGet(Hub, Net);
+	DerpNet__HubUnlink(Hub, Net);
+	if (!Entry.Opening || Net->Opening)
 	{
-		.ai_family = AF_UNSPEC,
-		.ai_socktype = SOCK_STREAM,
-	};
-
-#if DERPNET_USE_PLAIN_HTTP
-	const char* DerpServerPort = "80";
-#else
-	const char* DerpServerPort = "443";
-#endif
-	SocketOk = getaddrinfo(DerpServer, DerpServerPort, &AddrHints, &AddrInfo);
-	if (SocketOk != 0)
+		DerpNet__CloseEx(Net, false);
+	}
+	if (Entry.Notify)
 	{
-		DERPNET_LOG("cannot resolve '%s' hostname", DerpServer);
-		goto error;
+		Entry.Notify(Entry.User, Net, DERPNET_HUB_CLOSED);
 	}
+}
 
-	Net->Socket = socket(AddrInfo->ai_family, AddrInfo->ai_socktype, AddrInfo->ai_protocol);
-	DERPNET_ASSERT(Net->Socket != INVALID_SOCKET);
+static void DerpNet__HubDirty(DerpNetHub* Hub, DerpNet* Net)
+{
+	DerpNet__HubEntry* Entry = DerpNet__HubGet(Hub, Net);
+	Entry->Active = true;
+	if (!Entry->Dirty)
+	{
+		Entry->Dirty = true;
+		Hub->Dirty[Hub->DirtyCount++] = Net;
+	}
+}
 
-	SocketOk = connect(Net->Socket, AddrInfo->ai_addr, (int)AddrInfo->ai_addrlen);
-	if (SocketOk != 0)
+// connections without traffic since last check give back their empty buffers
+static void DerpNet__HubShrink(DerpNetHub* Hub)
+{
+	uint64_t Now = DerpNet__Microseconds();
+	if (Now < Hub->ShrinkTime)
 	{
-		DERPNET_LOG("cannot connect to '%s' server", DerpServer);
-		goto error;
+		return;
 	}
+	Hub->ShrinkTime = Now + DERPNET_HUB_IDLE_TIME;
 
-#if !defined(NDEBUG)
-	char Address[128];
-	DWORD AddressLength = ARRAYSIZE(Address);
-	WSAAddressToStringA(AddrInfo->ai_addr, (DWORD)AddrInfo->ai_addrlen, NULL, Address, &AddressLength);
-	DERPNET_LOG("connected to '%s' -> '%s' server", DerpServer, Address);
-#endif
+	for (size_t i = 0; i < Hub->Count; i++)
+	{
+		DerpNet__HubEntry* Entry = &Hub->Entries[i];
+		if (!Entry->Active && Entry->Net->MemoryUsed != 0)
+		{
+			DerpNet_Shrink(Entry->Net);
+		}
+		Entry->Active = false;
+	}
+}
 
-	freeaddrinfo(AddrInfo);
-	AddrInfo = NULL;
+static void DerpNet__HubSent(DerpNet* Net)
+{
+	DerpNet__HubDirty(Net->Hub, Net);
+}
 
-#if !DERPNET_USE_PLAIN_HTTP
-	if (!DerpNet__TlsHandshake(Net, DerpServer, &CredHandle, &CtxHandle))
+// notifies about connection, returns false if callback removed it from hub
+static bool DerpNet__HubNotify(DerpNetHub* Hub, DerpNet* Net, DerpNetHubEvent Event)
+{
+	DerpNet__HubEntry* Entry = DerpNet__HubGet(Hub, Net);
+	if (!Entry->Notify)
 	{
-		goto error;
+		return true;
 	}
 
-	DERPNET_ASSERT(sizeof(CredHandle) == sizeof(Net->CredHandle));
-	DERPNET_ASSERT(sizeof(CtxHandle) == sizeof(Net->CtxHandle));
-	memcpy(&Net->CredHandle, &CredHandle, sizeof(CredHandle));
-	memcpy(&Net->CtxHandle, &CtxHandle, sizeof(CtxHandle));
-#endif
-
-	Net->SocketEvent = WSACreateEvent();
-	DERPNET_ASSERT(Net->SocketEvent);
+	Hub->Current = Net;
+	Hub->CurrentRemoved = false;
+	Entry->Notify(Entry->User, Net, Event);
+	Hub->Current = NULL;
+	return !Hub->CurrentRemoved;
+}
 
-	WSAEventSelect(Net->Socket, Net->SocketEvent, FD_READ);
+// steps opening connection, and watches whatever it waits for next
+static void DerpNet__HubStep(DerpNetHub* Hub, DerpNet* Net)
+{
+	int Step = DerpNet_Step(Net);
+	if (Step < 0)
+	{
+		DerpNet__HubFail(Hub, Net);
+		return;
+	}
 
-	//
-	// send inital HTTP GET request, ask to switch to DERP protocol immediately
-	//
+	DerpNet__HubEntry* Entry = DerpNet__HubGet(Hub, Net);
+	if (Step > 0)
+	{
+		Entry->Opening = false;
+		Hub->Opening--;
+		if (!DerpNet__HubWatch(Hub, Entry, Net->Socket, true, false))
+		{
+			DerpNet__HubFail(Hub, Net);
+			return;
+		}
+		// hub flushes batches itself, so it never needs timer for them
+		Net->SendBatchTime = 0;
+		DerpNet__HubNotify(Hub, Net, DERPNET_HUB_OPEN);
+		return;
+	}
 
-	char HttpInit[256];
-	int HttpInitLen = snprintf(HttpInit, sizeof(HttpInit),
-		"GET /derp HTTP/1.1\r\n"
-		"Host: %s\r\n"
-		"Connection: Upgrade\r\n"
-		"Upgrade: DERP\r\n"
-		"Derp-Fast-Start: 1\r\n"
-		"\r\n",
-		DerpServer);
+	DerpNetPoll Poll;
+	DerpNet_GetPoll(Net, &Poll);
 
-	if (!DerpNet__TlsWrite(Net, HttpInit, HttpInitLen))
+	Entry->Time = Poll.Timeout == UINT32_MAX ? UINT64_MAX : DerpNet__Microseconds() + (uint64_t)Poll.Timeout * 1000;
+	if (!DerpNet__HubWatch(Hub, Entry, Poll.Socket, Poll.WantRead, Poll.WantWrite))
 	{
-		goto error;
+		DerpNet__HubFail(Hub, Net);
 	}
+}
 
-	//
-	// now DERP protocol follows
-	//
+// sends batches & queued data of connections in dirty list, without waiting
+static void DerpNet__HubFlush(DerpNetHub* Hub)
+{
+	while (Hub->DirtyCount != 0)
+	{
+		DerpNet* Net = Hub->Dirty[--Hub->DirtyCount];
+		DerpNet__HubEntry* Entry = DerpNet__HubGet(Hub, Net);
+		Entry->Dirty = false;
 
-	uint8_t FrameType;
-	uint32_t FrameSize;
-	memset(Net->LastPublicKey, 0, sizeof(Net->LastPublicKey));
+		if (Entry->Opening)
+		{
+			continue;
+		}
 
-	//
-	// receive ServerKey frame
-	//
+		if (Net->SendQueued && !DerpNet__SendQueuePump(Net, false))
+		{
+			DerpNet__HubFail(Hub, Net);
+			continue;
+		}
+		if (Net->SendPending && Net->SendQueued < Net->SendQueueLimit && !DerpNet__Flush(Net, false))
+		{
+			DerpNet__HubFail(Hub, Net);
+			continue;
+		}
 
-	uint8_t ServerPublicKey[32];
+		if (Net->SendQueued >= Net->SendQueueLimit)
+		{
+			Entry->Full = true;
+		}
+		if (!DerpNet__HubWatch(Hub, Entry, Net->Socket, true, Net->SendQueued != 0))
+		{
+			DerpNet__HubFail(Hub, Net);
+		}
+	}
+}
 
+static int DerpNet__HubRecv(DerpNetHub* Hub, DerpNet* Net)
+{
+	int Total = 0;
+	int Round;
+	for (Round = 0; Round < DERPNET_HUB_RECV_ROUNDS; Round++)
 	{
-		if (DerpNet__ReadFrame(Net, &FrameType, &FrameSize, true) < 0)
+		DerpNetMessage Messages[DERPNET_HUB_RECV_BATCH];
+		int Count = DerpNet_RecvBatch(Net, Messages, DERPNET_HUB_RECV_BATCH, false);
+		if (Count < 0)
 		{
-			goto error;
+			DerpNet__HubFail(Hub, Net);
+			return Total;
+		}
+		if (Count == 0)
+		{
+			break;
 		}
 
-		DERPNET_ASSERT(FrameType == 1); // ServerKey
-		DERPNET_ASSERT(FrameSize >= 8 + 32);
-
-		static const uint8_t DerpMagic[8] = { 0x44, 0x45, 0x52, 0x50, 0xf0, 0x9f, 0x94, 0x91 };
-
-		const uint8_t* Magic = Net->Buffer;
-		DERPNET_ASSERT(memcmp(Magic, DerpMagic, sizeof(DerpMagic)) == 0);
+		DerpNet__HubEntry* Entry = DerpNet__HubGet(Hub, Net);
+		Hub->Current = Net;
+		Hub->CurrentRemoved = false;
+		Entry->Recv(Entry->User, Net, Messages, (size_t)Count);
+		Hub->Current = NULL;
 
-		memcpy(ServerPublicKey, Net->Buffer + 8, sizeof(ServerPublicKey));
+		Total += Count;
+		if (Hub->CurrentRemoved)
+		{
+			return Total;
+		}
+	}
 
-		DerpNet__TlsConsume(Net, FrameSize);
+	// level-triggered wait comes back to connection if socket has more, but not for what is already in Buffer
+	DerpNet_RecvRelease(Net);
+	DerpNet__HubEntry* Entry = DerpNet__HubGet(Hub, Net);
+	if (Round == DERPNET_HUB_RECV_ROUNDS && Net->BufferStart != Net->BufferReceived && !Entry->Pending)
+	{
+		Entry->Pending = true;
+		Hub->Pending[Hub->PendingCount++] = Net;
 	}
+	return Total;
+}
 
-	// calculate user public key to send to server
+DerpNetHub* DerpNet_HubCreate(void)
+{
+	DerpNetHub* Hub = (DerpNetHub*)calloc(1, sizeof(*Hub));
+	if (!Hub)
+	{
+		return NULL;
+	}
 
-	DerpKey UserPublicKey;
-	DerpNet_GetPublicKey(UserSecret, &UserPublicKey);
+#if defined(__linux__)
+	Hub->Poll = epoll_create1(EPOLL_CLOEXEC);
+	if (Hub->Poll < 0)
+	{
+		DERPNET_LOG("epoll_create1 failed for hub");
+		free(Hub);
+		return NULL;
+	}
+#endif
 
-	//
-	// send ClientInfo frame
-	//
+	return Hub;
+}
 
+void DerpNet_HubDestroy(DerpNetHub* Hub)
+{
+	while (Hub->Count != 0)
 	{
-		static const char ClientInfo[] = "{\"version\": 2}";
+		DerpNet_HubRemove(Hub, Hub->Entries[Hub->Count - 1].Net);
+	}
 
-		uint8_t OutFrame[1 + 4 + 32 + 24 + 16 + sizeof(ClientInfo) - 1];
+#if defined(__linux__)
+	if (Hub->Poll >= 0)
+	{
+		close(Hub->Poll);
+	}
+#else
+	free(Hub->Polls);
+#endif
+	free(Hub->Entries);
+	free(Hub->Dirty);
+	free(Hub->Pending);
+	free(Hub->PendingRun);
+	free(Hub);
+}
 
-		OutFrame[0] = 2; // ClientInfo
-		Set32BE(OutFrame + 1, sizeof(OutFrame) - (1 + 4));
-		memcpy(OutFrame + 1 + 4, UserPublicKey.Bytes, sizeof(UserPublicKey.Bytes));
-		DerpNet__BoxSeal(OutFrame + 1 + 4 + 32, OutFrame + 1 + 4 + 32 + 24, OutFrame + 1 + 4 + 32 + 24 + 16, (uint8_t*)ClientInfo, sizeof(ClientInfo) - 1, UserSecret->Bytes, ServerPublicKey);
+bool DerpNet_HubAdd(DerpNetHub* Hub, DerpNet* Net, const char* DerpServer, const DerpKey* UserSecret, const DerpNetConfig* Config, DerpNetHubRecv* Recv, DerpNetHubNotify* Notify, void* User)
+{
+	if (Hub->Count == Hub->Capacity)
+	{
+		size_t Capacity = Hub->Capacity ? 2 * Hub->Capacity : 64;
 
-		if (!DerpNet__TlsWrite(Net, OutFrame, sizeof(OutFrame)))
+		// arrays that did grow are kept when later one fails, they are just bigger than needed
+		DerpNet__HubEntry* Entries = (DerpNet__HubEntry*)realloc(Hub->Entries, Capacity * sizeof(*Entries));
+		if (!Entries)
 		{
-			goto error;
+			DERPNET_LOG("not enough memory for hub");
+			return false;
 		}
-	}
-
-	//
-	// receive ServerInfo frame
-	//
+		Hub->Entries = Entries;
 
-	{
-		if (DerpNet__ReadFrame(Net, &FrameType, &FrameSize, true) < 0)
+		DerpNet** Dirty = (DerpNet**)realloc(Hub->Dirty, Capacity * sizeof(*Dirty));
+		if (!Dirty)
 		{
-			goto error;
+			DERPNET_LOG("not enough memory for hub");
+			return false;
 		}
+		Hub->Dirty = Dirty;
 
-		DERPNET_ASSERT(FrameType == 3); // ServerInfo
-		DERPNET_ASSERT(FrameSize >= 24 + 16);
+		DerpNet** Pending = (DerpNet**)realloc(Hub->Pending, Capacity * sizeof(*Pending));
+		if (!Pending)
+		{
+			DERPNET_LOG("not enough memory for hub");
+			return false;
+		}
+		Hub->Pending = Pending;
 
-		uint8_t* Nonce = Net->Buffer;
-		uint8_t* Auth = Nonce + 24;
-		uint8_t* Data = Auth + 16;
+		DerpNet** PendingRun = (DerpNet**)realloc(Hub->PendingRun, Capacity * sizeof(*PendingRun));
+		if (!PendingRun)
+		{
+			DERPNET_LOG("not enough memory for hub");
+			return false;
+		}
+		Hub->PendingRun = PendingRun;
 
-		size_t DataSize = FrameSize - (24 + 16);
-		bool UnsealOk = DerpNet__BoxUnseal(Data, Data, DataSize, Auth, Nonce, UserSecret->Bytes, ServerPublicKey);
-		if (!UnsealOk)
+#if !defined(__linux__)
+		void* Polls = realloc(Hub->Polls, Capacity * sizeof(DerpNet__PollFd));
+		if (!Polls)
 		{
-			DERPNET_LOG("nacl box unseal for ServerInfo frame failed");
-			goto error;
+			DERPNET_LOG("not enough memory for hub");
+			return false;
 		}
+		Hub->Polls = Polls;
+#endif
+		Hub->Capacity = Capacity;
+	}
 
-		DerpNet__TlsConsume(Net, FrameSize);
+	// connection is in hub already while it starts opening, so retries stay in it
+	Net->Hub = Hub;
+	Net->HubIndex = Hub->Count;
+	if (!DerpNet__OpenAsync(Net, DerpServer, UserSecret, Config))
+	{
+		Net->Hub = NULL;
+		return false;
 	}
 
-	//
-	// ready!
-	//
+	DerpNet__HubEntry* Entry = &Hub->Entries[Hub->Count++];
+	Entry->Net = Net;
+	Entry->Recv = Recv;
+	Entry->Notify = Notify;
+	Entry->User = User;
+	Entry->Socket = DERPNET_INVALID_SOCKET;
+	Entry->WantRead = Entry->WantWrite = false;
+	Entry->Opening = true;
+	Entry->Dirty = false;
+	Entry->Pending = false;
+	Entry->Full = false;
+	Entry->Active = false;
+	Entry->Time = 0; // first step right away
+	Hub->Opening++;
+	return true;
+}
 
-	memcpy(Net->UserPrivateKey, UserSecret->Bytes, sizeof(Net->UserPrivateKey));
+void DerpNet_HubRemove(DerpNetHub* Hub, DerpNet* Net)
+{
+	DerpNet__HubUnlink(Hub, Net);
+	DerpNet__CloseEx(Net, false);
+}
 
-	Net->LastFrameSize = 0;
-	return true;
+int DerpNet_HubRun(DerpNetHub* Hub, uint32_t Timeout)
+{
+	// whatever was sent since last run goes out before waiting
+	DerpNet__HubFlush(Hub);
 
-error:
-#if !DERPNET_USE_PLAIN_HTTP
-	if (SecIsValidHandle(&CtxHandle))
+	uint64_t Now = DerpNet__Microseconds();
+	uint64_t Until = Timeout == UINT32_MAX ? UINT64_MAX : Now + (uint64_t)Timeout * 1000;
+	if (Hub->Opening)
 	{
-		DeleteSecurityContext(&CtxHandle);
+		for (size_t i = 0; i < Hub->Count; i++)
+		{
+			if (Hub->Entries[i].Opening && Hub->Entries[i].Time < Until)
+			{
+				Until = Hub->Entries[i].Time;
+			}
+		}
 	}
-	if (SecIsValidHandle(&CredHandle))
+	if (Hub->Count != Hub->Opening && Hub->ShrinkTime < Until)
 	{
-		FreeCredentialsHandle(&CredHandle);
+		Until = Hub->ShrinkTime;
 	}
-#endif
-	if (Net->SocketEvent)
+	int Wait = Until == UINT64_MAX ? -1 : Until <= Now ? 0 : (int)DerpNet__Min((Until - Now + 999) / 1000, INT32_MAX);
+	if (Hub->PendingCount)
 	{
-		WSACloseEvent(Net->SocketEvent);
+		Wait = 0;
 	}
-	if (Net->Socket != INVALID_SOCKET)
+
+	Hub->EventCount = 0;
+
+#if defined(__linux__)
+	struct epoll_event Events[DERPNET_HUB_EVENTS];
+	int EventCount = epoll_wait(Hub->Poll, Events, DERPNET_HUB_EVENTS, Wait);
+	if (EventCount < 0 && errno != EINTR)
 	{
-		closesocket(Net->Socket);
+		DERPNET_LOG("epoll_wait failed for hub");
+		return -1;
 	}
-	if (AddrInfo)
+	for (int i = 0; i < EventCount; i++)
 	{
-		freeaddrinfo(AddrInfo);
+		DerpNet__HubReady* Event = &Hub->Events[Hub->EventCount++];
+		Event->Net = (DerpNet*)Events[i].data.ptr;
+		Event->Read = (Events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0;
+		Event->Write = (Events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0;
+	}
+#else
+	DerpNet__PollFd* Polls = (DerpNet__PollFd*)Hub->Polls;
+	size_t PollCount = 0;
+	for (size_t i = 0; i < Hub->Count; i++)
+	{
+		DerpNet__HubEntry* Entry = &Hub->Entries[i];
+		if (Entry->Socket != DERPNET_INVALID_SOCKET)
+		{
+			Polls[PollCount].fd = (DerpNet__Socket)Entry->Socket;
+			Polls[PollCount].events = (short)((Entry->WantRead ? POLLIN : 0) | (Entry->WantWrite ? POLLOUT : 0));
+			Polls[PollCount].revents = 0;
+			PollCount++;
+		}
+	}
+	if (PollCount == 0)
+	{
+		// nothing to wait on, sleep for timeout of opening connections
+		if (Wait != 0)
+		{
+#	if defined(_WIN32)
+			Sleep(Wait < 0 ? INFINITE : (DWORD)Wait);
+#	else
+			poll(NULL, 0, Wait);
+#	endif
+		}
+	}
+	else if (DerpNet__PollCall(Polls, (unsigned long)PollCount, Wait) < 0)
+	{
+		DERPNET_LOG("poll failed for hub");
+		return -1;
 	}
-	WSACleanup();
-
-	return false;
-}
 
-void DerpNet_Close(DerpNet* Net)
-{
-#if !DERPNET_USE_PLAIN_HTTP
-	DeleteSecurityContext((CtxtHandle*)Net->CtxHandle);
-	FreeCredentialsHandle((CredHandle*)Net->CredHandle);
+	// sockets are matched to connections by position, same order as above
+	size_t Index = 0;
+	for (size_t i = 0; i < Hub->Count && Hub->EventCount < DERPNET_HUB_EVENTS; i++)
+	{
+		DerpNet__HubEntry* Entry = &Hub->Entries[i];
+		if (Entry->Socket == DERPNET_INVALID_SOCKET)
+		{
+			continue;
+		}
+		short Ready = Polls[Index++].revents;
+		if (Ready)
+		{
+			DerpNet__HubReady* Event = &Hub->Events[Hub->EventCount++];
+			Event->Net = Entry->Net;
+			Event->Read = (Ready & (POLLIN | POLLERR | POLLHUP)) != 0;
+			Event->Write = (Ready & (POLLOUT | POLLERR | POLLHUP)) != 0;
+		}
+	}
 #endif
-	WSACloseEvent(Net->SocketEvent);
-	closesocket(Net->Socket);
-	WSACleanup();
-}
-
-int DerpNet_Recv(DerpNet* Net, DerpKey* ReceivedUserPublicKey, uint8_t** ReceivedData, uint32_t* ReceivedSize, bool Wait)
-{
-	DerpNet__TlsConsume(Net, Net->LastFrameSize);
-	Net->LastFrameSize = 0;
 
-	for (;;)
+	int Received = 0;
+	for (size_t i = 0; i < Hub->EventCount; i++)
 	{
-		uint8_t FrameType;
-		uint32_t FrameSize;
-
-		int GotFrame = DerpNet__ReadFrame(Net, &FrameType, &FrameSize, Wait);
-		if (GotFrame < 0)
+		DerpNet__HubReady* Event = &Hub->Events[i];
+		DerpNet* Net = Event->Net;
+		if (!Net)
 		{
-			DERPNET_LOG("disconnecting in Recv");
-			return -1;
+			continue;
 		}
 
-		if (GotFrame == 0)
+		DerpNet__HubEntry* Entry = DerpNet__HubGet(Hub, Net);
+		if (Entry->Opening)
 		{
-			return 0;
+			DerpNet__HubStep(Hub, Net);
+			continue;
 		}
+		Entry->Active = true;
 
-		if (FrameType == 5) // RecvPacket
+		if (Event->Write)
 		{
-			if (FrameSize >= 32 + 24 + 16)
+			if (!DerpNet__SendQueuePump(Net, false))
 			{
-				uint8_t* PublicKey = Net->Buffer;
-				uint8_t* Nonce = PublicKey + 32;
-				uint8_t* Auth = Nonce + 24;
-				uint8_t* Data = Auth + 16;
-				uint32_t DataSize = FrameSize - (32 + 24 + 16);
-
-				if (memcmp(PublicKey, Net->LastPublicKey, sizeof(Net->LastPublicKey)) != 0)
-				{
-					DerpNet__GetSharedKey(Net->LastSharedKey, Net->UserPrivateKey, PublicKey);
-					memcpy(Net->LastPublicKey, PublicKey, sizeof(Net->LastPublicKey));
-				}
-
-				bool UnsealOk = DerpNet__BoxUnsealEx(Data, Data, DataSize, Auth, Nonce, Net->LastSharedKey);
-				if (UnsealOk)
-				{
-					memcpy(ReceivedUserPublicKey->Bytes, PublicKey, sizeof(ReceivedUserPublicKey->Bytes));
-					*ReceivedData = Data;
-					*ReceivedSize = DataSize;
-
-					Net->LastFrameSize = FrameSize;
+				DerpNet__HubFail(Hub, Net);
+				continue;
+			}
 
-					return 1;
-				}
-				else
+			if (Entry->Full && Net->SendQueued < Net->SendQueueLimit)
+			{
+				Entry->Full = false;
+				if (!DerpNet__HubNotify(Hub, Net, DERPNET_HUB_WRITABLE))
 				{
-					DERPNET_LOG("failed to verify encrypted data");
+					continue;
 				}
 			}
-			else
-			{
-				DERPNET_LOG("RecvPacket frame too short, expected at least %u bytes, got %u", 32 + 24 + 16, FrameSize);
-			}
+			DerpNet__HubDirty(Hub, Net);
 		}
-		else
+
+		if (Event->Read)
 		{
-			DERPNET_LOG("unknown frame, ignoring");
+			Received += DerpNet__HubRecv(Hub, Net);
 		}
-
-		DerpNet__TlsConsume(Net, FrameSize);
 	}
-
-	return -1;
-}
-
-bool DerpNet_Send(DerpNet* Net, const DerpKey* TargetUserPublicKey, const void* Data, size_t DataSize)
-{
-	if (memcmp(TargetUserPublicKey->Bytes, Net->LastPublicKey, sizeof(Net->LastPublicKey)) != 0)
+	Hub->EventCount = 0;
+
+	// connections that still had frames in Buffer, ones added to list again while reading wait for next run
+	DerpNet** PendingRun = Hub->Pending;
+	Hub->Pending = Hub->PendingRun;
+	Hub->PendingRun = PendingRun;
+	Hub->PendingRunCount = Hub->PendingCount;
+	Hub->PendingCount = 0;
+	for (size_t i = 0; i < Hub->PendingRunCount; i++)
 	{
-		DerpNet__GetSharedKey(Net->LastSharedKey, Net->UserPrivateKey, TargetUserPublicKey->Bytes);
-		memcpy(Net->LastPublicKey, TargetUserPublicKey->Bytes, sizeof(Net->LastPublicKey));
+		if (PendingRun[i])
+		{
+			DerpNet__HubGet(Hub, PendingRun[i])->Pending = false;
+		}
 	}
+	for (size_t i = 0; i < Hub->PendingRunCount; i++)
+	{
+		DerpNet* Net = PendingRun[i];
+		if (Net)
+		{
+			Received += DerpNet__HubRecv(Hub, Net);
+		}
+	}
+	Hub->PendingRunCount = 0;
 
-	uint8_t Nonce[24];
-	DerpNet__GetRandom(Nonce, sizeof(Nonce));
-
-	return DerpNet_SendEx(Net, TargetUserPublicKey, Net->LastSharedKey, Nonce, Data, DataSize);
-}
-
-bool DerpNet_SendEx(DerpNet* Net, const DerpKey* TargetUserPublicKey, const uint8_t SharedKey[32], const uint8_t InNonce[24], const void* Data, size_t DataSize)
-{
-	uint8_t OutFrame[1 << 16];
-
-	size_t OutFrameSize = 1 + 4 + 32 + 24 + 16 + DataSize;
-	DERPNET_ASSERT(OutFrameSize <= sizeof(OutFrame));
-
-	OutFrame[0] = 4; // SendPacket
-	Set32BE(OutFrame + 1, (uint32_t)(OutFrameSize - (1 + 4)));
-
-	uint8_t* PublicKey = OutFrame + 1 + 4;
-	uint8_t* Nonce = PublicKey + 32;
-	uint8_t* Auth = Nonce + 24;
-	uint8_t* Output = Auth + 16;
-
-	memcpy(PublicKey, TargetUserPublicKey->Bytes, sizeof(TargetUserPublicKey->Bytes));
-	memcpy(Nonce, InNonce, 24);
-
-	DerpNet__BoxSealEx(Nonce, Auth, Output, (uint8_t*)Data, DataSize, SharedKey);
+	// opening connections which timeout has passed, when one fails last entry moves to its place
+	if (Hub->Opening)
+	{
+		Now = DerpNet__Microseconds();
+		for (size_t i = 0; i < Hub->Count; )
+		{
+			DerpNet* Net = Hub->Entries[i].Net;
+			if (Hub->Entries[i].Opening && Hub->Entries[i].Time <= Now)
+			{
+				DerpNet__HubStep(Hub, Net);
+				if (i < Hub->Count && Hub->Entries[i].Net != Net)
+				{
+					continue;
+				}
+			}
+			i++;
+		}
+	}
 
-	return DerpNet__TlsWrite(Net, OutFrame, OutFrameSize);
+	DerpNet__HubFlush(Hub);
+	DerpNet__HubShrink(Hub);
+	return Received;
 }
 
 #endif // defined(DERP_STATIC) || defined(DERP_IMPLEMENTATION)
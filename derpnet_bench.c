@@ -0,0 +1,860 @@
+#define _CRT_SECURE_NO_DEPRECATE
+
+#define DERPNET_STATIC
+#include "derpnet.h"
+
+#include <stdio.h>
+#include <string.h>
+#if defined(_MSC_VER)
+#	include <intrin.h>
+#else
+#	include <time.h>
+#	include <x86intrin.h>
+#endif
+
+static void PrintHelpAndExit(char* argv0)
+{
+	printf(
+		"USAGE: %s [csv|json]\n"
+		"Measures crypto performance for every CPU level supported by this machine\n"
+		" - csv  = prints results as CSV (default)\n"
+		" - json = prints results as JSON array\n"
+		"\n"
+		"USAGE: %s [csv|json] net PORT\n"
+		"Measures message rate & syscalls per message for every socket backend,\n"
+		"sending & receiving every message on its own, and in batches\n"
+		" - PORT = port of derpnet_relay running on this machine\n"
+		"\n"
+		"USAGE: %s [csv|json] conns PORT [COUNT]\n"
+		"Measures memory per connection, message rate & CPU time per message with many\n"
+		"connections, all in one DerpNetHub, and with one thread per connection\n"
+		" - COUNT = number of connections (default 10000), they talk in pairs\n"
+		"\n"
+		, argv0, argv0, argv0);
+	exit(0);
+}
+
+static const char* LevelNames[] = { "scalar", "sse2", "avx2" };
+
+static bool OutputJson;
+static bool FirstResult = true;
+
+// Size is 0 for operations that do not process variable amount of bytes
+static void PrintResult(DerpNetCpuLevel Level, const char* Function, size_t Size, double Cycles, double Seconds, size_t Count)
+{
+	double CyclesPerByte = Size ? Cycles / ((double)Size * Count) : 0;
+	double GBytesPerSec = Size ? (double)Size * Count / Seconds / 1e9 : 0;
+	double OpsPerSec = Count / Seconds;
+
+	if (OutputJson)
+	{
+		printf("%s\n  {\"level\":\"%s\",\"function\":\"%s\",\"size\":%zu,\"cycles_per_byte\":%.3f,\"gb_per_sec\":%.3f,\"ops_per_sec\":%.1f}",
+			FirstResult ? "[" : ",", LevelNames[Level], Function, Size, CyclesPerByte, GBytesPerSec, OpsPerSec);
+	}
+	else
+	{
+		if (FirstResult)
+		{
+			printf("level,function,size,cycles_per_byte,gb_per_sec,ops_per_sec\n");
+		}
+		printf("%s,%s,%zu,%.3f,%.3f,%.1f\n", LevelNames[Level], Function, Size, CyclesPerByte, GBytesPerSec, OpsPerSec);
+	}
+	fflush(stdout);
+	FirstResult = false;
+}
+
+static double GetSeconds(void)
+{
+#if defined(_WIN32)
+	static LARGE_INTEGER Frequency;
+	if (Frequency.QuadPart == 0)
+	{
+		QueryPerformanceFrequency(&Frequency);
+	}
+
+	LARGE_INTEGER Counter;
+	QueryPerformanceCounter(&Counter);
+	return (double)Counter.QuadPart / Frequency.QuadPart;
+#else
+	struct timespec Time;
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+	return Time.tv_sec + Time.tv_nsec * 1e-9;
+#endif
+}
+
+enum
+{
+	BENCH_SALSA20_XOR,
+	BENCH_POLY1305_AUTH,
+	BENCH_BOX_SEAL,
+	BENCH_BOX_UNSEAL,
+	BENCH_SCALARMULT,
+	BENCH_GET_PUBLIC_KEY,
+	BENCH_GET_SHARED_KEY,
+	BENCH_COUNT,
+};
+
+static const char* BenchNames[] =
+{
+	"salsa20_xor",
+	"poly1305_auth",
+	"box_seal",
+	"box_unseal",
+	"curve25519_scalarmult",
+	"get_public_key",
+	"get_shared_key",
+};
+
+#define MAX_SIZE (64 * 1024)
+
+static uint8_t Input[MAX_SIZE];
+static uint8_t Output[MAX_SIZE];
+static uint8_t Sealed[MAX_SIZE];
+
+static void RunBench(int Bench, size_t Size, size_t Count)
+{
+	static uint8_t Key[32];
+	static uint8_t Nonce[24];
+	static uint8_t Auth[16];
+	static uint8_t Point[32] = { 9 };
+
+	switch (Bench)
+	{
+	case BENCH_SALSA20_XOR:
+		for (size_t i = 0; i < Count; i++)
+		{
+			salsa20_xor(Output, Input, Size, Key, Nonce, i);
+		}
+		break;
+
+	case BENCH_POLY1305_AUTH:
+		for (size_t i = 0; i < Count; i++)
+		{
+			poly1305_auth(Auth, Input, Size, Key, DerpNet_GetCpuLevel());
+		}
+		break;
+
+	case BENCH_BOX_SEAL:
+		for (size_t i = 0; i < Count; i++)
+		{
+			DerpNet__BoxSealEx(Nonce, Auth, Output, Input, Size, Key);
+		}
+		break;
+
+	case BENCH_BOX_UNSEAL:
+		for (size_t i = 0; i < Count; i++)
+		{
+			bool Ok = DerpNet__BoxUnsealEx(Output, Sealed, Size, Auth, Nonce, Key);
+			DERPNET_ASSERT(Ok);
+		}
+		break;
+
+	case BENCH_SCALARMULT:
+		for (size_t i = 0; i < Count; i++)
+		{
+			// feed result back, so calls cannot be overlapped or skipped
+			curve25519_scalarmult(Point, Key, Point);
+		}
+		break;
+
+	case BENCH_GET_PUBLIC_KEY:
+		for (size_t i = 0; i < Count; i++)
+		{
+			DerpKey Secret, Public;
+			memcpy(Secret.Bytes, Key, sizeof(Key));
+			DerpNet_GetPublicKey(&Secret, &Public);
+			Key[0] ^= Public.Bytes[0];
+		}
+		break;
+
+	case BENCH_GET_SHARED_KEY:
+		for (size_t i = 0; i < Count; i++)
+		{
+			DerpNet__GetSharedKey(Point, Key, Point);
+		}
+		break;
+	}
+
+	if (Bench == BENCH_BOX_SEAL)
+	{
+		// keep sealed message for unseal benchmark of same size
+		memcpy(Sealed, Output, Size);
+	}
+}
+
+static void Measure(DerpNetCpuLevel Level, int Bench, size_t Size)
+{
+	// about 64MB of data per measurement, or fixed count of key operations
+	size_t Count = Size ? (64 << 20) / Size : 2000;
+	if (Count > 1000000)
+	{
+		Count = 1000000;
+	}
+
+	// warm up caches & CPU clock, and prepare sealed data for unseal
+	RunBench(Bench == BENCH_BOX_UNSEAL ? BENCH_BOX_SEAL : Bench, Size, Count / 16 + 1);
+
+	// best of 3 runs
+	double BestCycles = 0;
+	double BestSeconds = 0;
+	for (int Run = 0; Run < 3; Run++)
+	{
+		double StartSeconds = GetSeconds();
+		uint64_t StartCycles = __rdtsc();
+
+		RunBench(Bench, Size, Count);
+
+		uint64_t EndCycles = __rdtsc();
+		double EndSeconds = GetSeconds();
+
+		if (Run == 0 || EndSeconds - StartSeconds < BestSeconds)
+		{
+			BestCycles = (double)(EndCycles - StartCycles);
+			BestSeconds = EndSeconds - StartSeconds;
+		}
+	}
+
+	PrintResult(Level, BenchNames[Bench], Size, BestCycles, BestSeconds, Count);
+}
+
+static const char* BackendNames[] = { "select", "epoll", "io_uring" };
+
+static void PrintNetResult(int Backend, bool Batch, size_t Size, double Seconds, size_t Count, const DerpNet* Sender, const DerpNet* Receiver)
+{
+	double MessagesPerSec = Count / Seconds;
+	double MBytesPerSec = (double)Size * Count / Seconds / 1e6;
+	double SendSyscalls = (double)Sender->TotalSyscalls / Count;
+	double RecvSyscalls = (double)Receiver->TotalSyscalls / Count;
+
+	if (OutputJson)
+	{
+		printf("%s\n  {\"backend\":\"%s\",\"batch\":%s,\"size\":%zu,\"msgs_per_sec\":%.1f,\"mb_per_sec\":%.1f,\"send_syscalls_per_msg\":%.3f,\"recv_syscalls_per_msg\":%.3f}",
+			FirstResult ? "[" : ",", BackendNames[Backend], Batch ? "true" : "false", Size, MessagesPerSec, MBytesPerSec, SendSyscalls, RecvSyscalls);
+	}
+	else
+	{
+		if (FirstResult)
+		{
+			printf("backend,batch,size,msgs_per_sec,mb_per_sec,send_syscalls_per_msg,recv_syscalls_per_msg\n");
+		}
+		printf("%s,%d,%zu,%.1f,%.1f,%.3f,%.3f\n", BackendNames[Backend], Batch, Size, MessagesPerSec, MBytesPerSec, SendSyscalls, RecvSyscalls);
+	}
+	fflush(stdout);
+	FirstResult = false;
+}
+
+static DerpNet Sender;
+static DerpNet Receiver;
+
+// sends bursts of messages from one connection to other through relay, and receives them
+// with Batch, each burst is packed together and sent with DerpNet_Flush, and received with DerpNet_RecvBatch
+static void MeasureNet(int Backend, bool Batch, uint16_t Port, size_t Size)
+{
+	DerpNetConfig Config = { .PlainHttp = true, .Port = Port, .IoUring = Backend == 2, .SendBatchSize = Batch ? 16384 : 0 };
+
+	DerpKey SenderSecret, ReceiverSecret, ReceiverPublic;
+	DerpNet_CreateNewKey(&SenderSecret);
+	DerpNet_CreateNewKey(&ReceiverSecret);
+	DerpNet_GetPublicKey(&ReceiverSecret, &ReceiverPublic);
+
+	if (!DerpNet_OpenEx(&Sender, "localhost", &SenderSecret, &Config) || !DerpNet_OpenEx(&Receiver, "localhost", &ReceiverSecret, &Config))
+	{
+		printf("Cannot connect to derpnet_relay on port %u\n", Port);
+		exit(1);
+	}
+
+#if defined(__linux__)
+	if (Backend == 2 && (Sender.Ring.Fd < 0 || Receiver.Ring.Fd < 0))
+	{
+		// io_uring is not available, results would be same as for epoll
+		DerpNet_Close(&Sender);
+		DerpNet_Close(&Receiver);
+		return;
+	}
+#endif
+
+	// about 256MB of data, in bursts that fit in relay queue
+	size_t Count = (256 << 20) / Size;
+	if (Count > 500000)
+	{
+		Count = 500000;
+	}
+	size_t Burst = (512 << 10) / Size;
+	if (Burst > 64)
+	{
+		Burst = 64;
+	}
+
+	// counts only syscalls for messages, not for connecting
+	Sender.TotalSyscalls = 0;
+	Receiver.TotalSyscalls = 0;
+
+	double StartSeconds = GetSeconds();
+
+	for (size_t Sent = 0; Sent < Count; )
+	{
+		size_t BurstCount = Count - Sent < Burst ? Count - Sent : Burst;
+		for (size_t i = 0; i < BurstCount; i++)
+		{
+			if (!DerpNet_Send(&Sender, &ReceiverPublic, Input, Size))
+			{
+				printf("Send failed\n");
+				exit(1);
+			}
+		}
+		if (!DerpNet_Flush(&Sender))
+		{
+			printf("Send failed\n");
+			exit(1);
+		}
+
+		for (size_t i = 0; i < BurstCount; )
+		{
+			if (Batch)
+			{
+				DerpNetMessage Messages[64];
+				int Received = DerpNet_RecvBatch(&Receiver, Messages, sizeof(Messages) / sizeof(*Messages), true);
+				if (Received <= 0)
+				{
+					printf("Recv failed\n");
+					exit(1);
+				}
+				for (int k = 0; k < Received; k++)
+				{
+					if (Messages[k].Size != Size)
+					{
+						printf("Recv failed\n");
+						exit(1);
+					}
+				}
+				i += Received;
+				continue;
+			}
+
+			DerpKey ReceivedKey;
+			uint8_t* ReceivedData;
+			uint32_t ReceivedSize;
+			if (DerpNet_Recv(&Receiver, &ReceivedKey, &ReceivedData, &ReceivedSize, true) <= 0 || ReceivedSize != Size)
+			{
+				printf("Recv failed\n");
+				exit(1);
+			}
+			i++;
+		}
+
+		Sent += BurstCount;
+	}
+
+	double EndSeconds = GetSeconds();
+
+	PrintNetResult(Backend, Batch, Size, EndSeconds - StartSeconds, Count, &Sender, &Receiver);
+
+	DerpNet_Close(&Sender);
+	DerpNet_Close(&Receiver);
+}
+
+#if defined(_WIN32)
+#	include <psapi.h>
+#	pragma comment (lib, "psapi")
+#else
+#	include <sys/resource.h>
+#endif
+
+// resident memory of whole process, 0 where it is not known
+static size_t GetResidentBytes(void)
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS Counters;
+	return GetProcessMemoryInfo(GetCurrentProcess(), &Counters, sizeof(Counters)) ? Counters.WorkingSetSize : 0;
+#elif defined(__linux__)
+	size_t Size = 0;
+	size_t Resident = 0;
+	FILE* File = fopen("/proc/self/statm", "r");
+	if (File)
+	{
+		if (fscanf(File, "%zu %zu", &Size, &Resident) != 2)
+		{
+			Resident = 0;
+		}
+		fclose(File);
+	}
+	return Resident * (size_t)sysconf(_SC_PAGESIZE);
+#else
+	return 0;
+#endif
+}
+
+// user + kernel time of all threads in process
+static double GetCpuSeconds(void)
+{
+#if defined(_WIN32)
+	FILETIME Creation, Exit, Kernel, User;
+	GetProcessTimes(GetCurrentProcess(), &Creation, &Exit, &Kernel, &User);
+	ULARGE_INTEGER K, U;
+	K.LowPart = Kernel.dwLowDateTime;
+	K.HighPart = Kernel.dwHighDateTime;
+	U.LowPart = User.dwLowDateTime;
+	U.HighPart = User.dwHighDateTime;
+	return (double)(K.QuadPart + U.QuadPart) * 1e-7;
+#else
+	struct rusage Usage;
+	getrusage(RUSAGE_SELF, &Usage);
+	return Usage.ru_utime.tv_sec + Usage.ru_utime.tv_usec * 1e-6 + Usage.ru_stime.tv_sec + Usage.ru_stime.tv_usec * 1e-6;
+#endif
+}
+
+static void PrintConnsResult(const char* Mode, size_t Conns, double OpenSeconds, size_t Resident, size_t Buffers, double Seconds, double CpuSeconds, size_t Count)
+{
+	double KBytesPerConn = (double)Resident / Conns / 1024;
+	double BufferKBytesPerConn = (double)Buffers / Conns / 1024;
+	double MessagesPerSec = Count / Seconds;
+	double CpuUsecPerMsg = CpuSeconds * 1e6 / Count;
+
+	if (OutputJson)
+	{
+		printf("%s\n  {\"mode\":\"%s\",\"conns\":%zu,\"open_sec\":%.2f,\"rss_kb_per_conn\":%.1f,\"buf_kb_per_conn\":%.1f,\"msgs_per_sec\":%.1f,\"cpu_usec_per_msg\":%.3f}",
+			FirstResult ? "[" : ",", Mode, Conns, OpenSeconds, KBytesPerConn, BufferKBytesPerConn, MessagesPerSec, CpuUsecPerMsg);
+	}
+	else
+	{
+		if (FirstResult)
+		{
+			printf("mode,conns,open_sec,rss_kb_per_conn,buf_kb_per_conn,msgs_per_sec,cpu_usec_per_msg\n");
+		}
+		printf("%s,%zu,%.2f,%.1f,%.1f,%.1f,%.3f\n", Mode, Conns, OpenSeconds, KBytesPerConn, BufferKBytesPerConn, MessagesPerSec, CpuUsecPerMsg);
+	}
+	fflush(stdout);
+	FirstResult = false;
+}
+
+// every connection sends this many bursts of small messages to its pair, and receives as many
+#define CONNS_ROUNDS 20
+#define CONNS_BURST  8
+#define CONNS_SIZE   64
+
+typedef struct {
+	DerpNet* Net;
+	DerpKey Public;
+	size_t Received;
+	bool Open;
+	bool Failed;
+} Conn;
+
+static Conn* Conns;
+static size_t ConnsReceived;
+static size_t ConnsOpen;
+static size_t ConnsFailed;
+
+static void ConnsCreate(size_t Count)
+{
+	Conns = (Conn*)calloc(Count, sizeof(*Conns));
+	DERPNET_ASSERT(Conns);
+
+	ConnsReceived = ConnsOpen = ConnsFailed = 0;
+	for (size_t i = 0; i < Count; i++)
+	{
+		// DerpNet is small, its buffers are allocated as needed
+		Conns[i].Net = (DerpNet*)calloc(1, sizeof(DerpNet));
+		DERPNET_ASSERT(Conns[i].Net);
+	}
+}
+
+// buffer memory connections hold after traffic
+static size_t ConnsBufferBytes(size_t Count)
+{
+	size_t Bytes = 0;
+	for (size_t i = 0; i < Count; i++)
+	{
+		Bytes += Conns[i].Net->MemoryUsed;
+	}
+	return Bytes;
+}
+
+static void ConnsDestroy(size_t Count)
+{
+	for (size_t i = 0; i < Count; i++)
+	{
+		free(Conns[i].Net);
+	}
+	free(Conns);
+}
+
+static void HubRecv(void* User, DerpNet* Net, const DerpNetMessage* Messages, size_t Count)
+{
+	(void)Net;
+	(void)Messages;
+	Conn* C = (Conn*)User;
+	C->Received += Count;
+	ConnsReceived += Count;
+}
+
+static void HubNotify(void* User, DerpNet* Net, DerpNetHubEvent Event)
+{
+	(void)Net;
+	Conn* C = (Conn*)User;
+	if (Event == DERPNET_HUB_OPEN)
+	{
+		C->Open = true;
+		ConnsOpen++;
+	}
+	else if (Event == DERPNET_HUB_CLOSED)
+	{
+		C->Failed = true;
+		ConnsFailed++;
+	}
+}
+
+// all connections run on one thread in one hub, connection 2*i talks to 2*i+1
+static void MeasureHub(uint16_t Port, size_t Count)
+{
+	DerpNetConfig Config = { .PlainHttp = true, .Port = Port, .SendBatchSize = 16384 };
+
+	size_t ResidentStart = GetResidentBytes();
+	ConnsCreate(Count);
+
+	DerpNetHub* Hub = DerpNet_HubCreate();
+	DERPNET_ASSERT(Hub);
+
+	double OpenStart = GetSeconds();
+	for (size_t i = 0; i < Count; i++)
+	{
+		DerpKey Secret;
+		DerpNet_CreateNewKey(&Secret);
+		DerpNet_GetPublicKey(&Secret, &Conns[i].Public);
+		if (!DerpNet_HubAdd(Hub, Conns[i].Net, "localhost", &Secret, &Config, &HubRecv, &HubNotify, &Conns[i]))
+		{
+			printf("Cannot open connection %zu\n", i);
+			exit(1);
+		}
+	}
+	while (ConnsOpen + ConnsFailed != Count)
+	{
+		if (DerpNet_HubRun(Hub, UINT32_MAX) < 0)
+		{
+			printf("Hub failed\n");
+			exit(1);
+		}
+	}
+	double OpenSeconds = GetSeconds() - OpenStart;
+	if (ConnsFailed)
+	{
+		printf("Cannot connect %zu of %zu connections to derpnet_relay on port %u\n", ConnsFailed, Count, Port);
+		exit(1);
+	}
+	size_t Resident = GetResidentBytes() - ResidentStart;
+
+	double StartSeconds = GetSeconds();
+	double StartCpu = GetCpuSeconds();
+
+	for (int Round = 0; Round < CONNS_ROUNDS; Round++)
+	{
+		for (size_t i = 0; i < Count; i++)
+		{
+			for (int k = 0; k < CONNS_BURST; k++)
+			{
+				if (DerpNet_TrySend(Conns[i].Net, &Conns[i ^ 1].Public, Input, CONNS_SIZE) <= 0)
+				{
+					printf("Send failed\n");
+					exit(1);
+				}
+			}
+		}
+
+		size_t Expected = (size_t)(Round + 1) * CONNS_BURST * Count;
+		while (ConnsReceived < Expected)
+		{
+			if (DerpNet_HubRun(Hub, UINT32_MAX) < 0 || ConnsFailed)
+			{
+				printf("Recv failed\n");
+				exit(1);
+			}
+		}
+	}
+
+	double Seconds = GetSeconds() - StartSeconds;
+	double CpuSeconds = GetCpuSeconds() - StartCpu;
+
+	PrintConnsResult("hub", Count, OpenSeconds, Resident, ConnsBufferBytes(Count), Seconds, CpuSeconds, ConnsReceived);
+
+	DerpNet_HubDestroy(Hub);
+	ConnsDestroy(Count);
+}
+
+static uint16_t ThreadPort;
+static size_t ThreadsOpen;
+static bool ThreadsGo;
+
+// threads report when connection is open, and wait until all of them are
+#if defined(_WIN32)
+static CRITICAL_SECTION ThreadsLock;
+static CONDITION_VARIABLE ThreadsChanged;
+#	define ThreadsLockInit()  (InitializeCriticalSection(&ThreadsLock), InitializeConditionVariable(&ThreadsChanged))
+#	define ThreadsLockEnter() EnterCriticalSection(&ThreadsLock)
+#	define ThreadsLockLeave() LeaveCriticalSection(&ThreadsLock)
+#	define ThreadsWait()      SleepConditionVariableCS(&ThreadsChanged, &ThreadsLock, INFINITE)
+#	define ThreadsWakeAll()   WakeAllConditionVariable(&ThreadsChanged)
+#else
+static pthread_mutex_t ThreadsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ThreadsChanged = PTHREAD_COND_INITIALIZER;
+#	define ThreadsLockInit()
+#	define ThreadsLockEnter() pthread_mutex_lock(&ThreadsLock)
+#	define ThreadsLockLeave() pthread_mutex_unlock(&ThreadsLock)
+#	define ThreadsWait()      pthread_cond_wait(&ThreadsChanged, &ThreadsLock)
+#	define ThreadsWakeAll()   pthread_cond_broadcast(&ThreadsChanged)
+#endif
+
+// one blocking connection per thread, same traffic as with hub
+#if defined(_WIN32)
+static DWORD WINAPI ConnThread(LPVOID Arg)
+#else
+static void* ConnThread(void* Arg)
+#endif
+{
+	size_t Index = (size_t)(uintptr_t)Arg;
+	Conn* C = &Conns[Index];
+
+	DerpNetConfig Config = { .PlainHttp = true, .Port = ThreadPort, .SendBatchSize = 16384 };
+
+	DerpKey Secret;
+	DerpNet_CreateNewKey(&Secret);
+	DerpNet_GetPublicKey(&Secret, &C->Public);
+	C->Failed = !DerpNet_OpenEx(C->Net, "localhost", &Secret, &Config);
+
+	// relay drops messages to peers that are not connected yet
+	ThreadsLockEnter();
+	ThreadsOpen++;
+	ThreadsWakeAll();
+	while (!ThreadsGo)
+	{
+		ThreadsWait();
+	}
+	ThreadsLockLeave();
+
+	for (int Round = 0; Round < CONNS_ROUNDS && !C->Failed; Round++)
+	{
+		for (int k = 0; k < CONNS_BURST; k++)
+		{
+			C->Failed |= !DerpNet_Send(C->Net, &Conns[Index ^ 1].Public, Input, CONNS_SIZE);
+		}
+		C->Failed |= !DerpNet_Flush(C->Net);
+
+		for (int k = 0; k < CONNS_BURST && !C->Failed; k++)
+		{
+			DerpKey ReceivedKey;
+			uint8_t* ReceivedData;
+			uint32_t ReceivedSize;
+			C->Failed |= DerpNet_Recv(C->Net, &ReceivedKey, &ReceivedData, &ReceivedSize, true) <= 0;
+			C->Received += !C->Failed;
+		}
+	}
+	return 0;
+}
+
+static void MeasureThreads(uint16_t Port, size_t Count)
+{
+	ThreadPort = Port;
+	ThreadsOpen = 0;
+	ThreadsGo = false;
+	ThreadsLockInit();
+
+	size_t ResidentStart = GetResidentBytes();
+	ConnsCreate(Count);
+
+#if defined(_WIN32)
+	HANDLE* Threads = (HANDLE*)calloc(Count, sizeof(*Threads));
+#else
+	pthread_t* Threads = (pthread_t*)calloc(Count, sizeof(*Threads));
+#endif
+	DERPNET_ASSERT(Threads);
+
+	double OpenStart = GetSeconds();
+	for (size_t i = 0; i < Count; i++)
+	{
+#if defined(_WIN32)
+		Threads[i] = CreateThread(NULL, 0, &ConnThread, (void*)(uintptr_t)i, 0, NULL);
+		bool Started = Threads[i] != NULL;
+#else
+		bool Started = pthread_create(&Threads[i], NULL, &ConnThread, (void*)(uintptr_t)i) == 0;
+#endif
+		if (!Started)
+		{
+			printf("Cannot start thread %zu\n", i);
+			exit(1);
+		}
+	}
+	ThreadsLockEnter();
+	while (ThreadsOpen != Count)
+	{
+		ThreadsWait();
+	}
+	ThreadsLockLeave();
+	double OpenSeconds = GetSeconds() - OpenStart;
+
+	for (size_t i = 0; i < Count; i++)
+	{
+		if (Conns[i].Failed)
+		{
+			printf("Cannot connect connection %zu to derpnet_relay on port %u\n", i, Port);
+			exit(1);
+		}
+	}
+	size_t Resident = GetResidentBytes() - ResidentStart;
+
+	double StartSeconds = GetSeconds();
+	double StartCpu = GetCpuSeconds();
+
+	ThreadsLockEnter();
+	ThreadsGo = true;
+	ThreadsWakeAll();
+	ThreadsLockLeave();
+
+	size_t Received = 0;
+	bool Failed = false;
+	for (size_t i = 0; i < Count; i++)
+	{
+#if defined(_WIN32)
+		WaitForSingleObject(Threads[i], INFINITE);
+		CloseHandle(Threads[i]);
+#else
+		pthread_join(Threads[i], NULL);
+#endif
+		Received += Conns[i].Received;
+		Failed |= Conns[i].Failed;
+	}
+
+	double Seconds = GetSeconds() - StartSeconds;
+	double CpuSeconds = GetCpuSeconds() - StartCpu;
+	if (Failed)
+	{
+		printf("Recv failed\n");
+		exit(1);
+	}
+
+	PrintConnsResult("threads", Count, OpenSeconds, Resident, ConnsBufferBytes(Count), Seconds, CpuSeconds, Received);
+
+	for (size_t i = 0; i < Count; i++)
+	{
+		DerpNet_Close(Conns[i].Net);
+	}
+	free(Threads);
+	ConnsDestroy(Count);
+}
+
+int main(int argc, char* argv[])
+{
+	int NetPort = 0;
+	int ConnsPort = 0;
+	size_t ConnsCount = 10000;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "json") == 0)
+		{
+			OutputJson = true;
+		}
+		else if (strcmp(argv[i], "net") == 0 && i + 1 < argc)
+		{
+			NetPort = atoi(argv[++i]);
+			if (NetPort <= 0 || NetPort > 65535)
+			{
+				PrintHelpAndExit(argv[0]);
+			}
+		}
+		else if (strcmp(argv[i], "conns") == 0 && i + 1 < argc)
+		{
+			ConnsPort = atoi(argv[++i]);
+			if (ConnsPort <= 0 || ConnsPort > 65535)
+			{
+				PrintHelpAndExit(argv[0]);
+			}
+			if (i + 1 < argc && atoi(argv[i + 1]) > 0)
+			{
+				// connections talk in pairs
+				ConnsCount = ((size_t)atoi(argv[++i]) + 1) & ~(size_t)1;
+			}
+		}
+		else if (strcmp(argv[i], "csv") != 0)
+		{
+			PrintHelpAndExit(argv[0]);
+		}
+	}
+
+	for (size_t i = 0; i < sizeof(Input); i++)
+	{
+		Input[i] = (uint8_t)i;
+	}
+
+	if (ConnsPort)
+	{
+#if !defined(_WIN32)
+		// every connection takes one descriptor, and one more when it has its own thread
+		struct rlimit Limit;
+		if (getrlimit(RLIMIT_NOFILE, &Limit) == 0 && Limit.rlim_cur < Limit.rlim_max)
+		{
+			Limit.rlim_cur = Limit.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &Limit);
+		}
+#endif
+		MeasureHub((uint16_t)ConnsPort, ConnsCount);
+		MeasureThreads((uint16_t)ConnsPort, ConnsCount);
+
+		if (OutputJson && !FirstResult)
+		{
+			printf("\n]\n");
+		}
+		return 0;
+	}
+
+	if (NetPort)
+	{
+#if defined(_WIN32)
+		int Backends[] = { 0 };
+#else
+		int Backends[] = { 1, 2 };
+#endif
+		for (size_t i = 0; i < sizeof(Backends) / sizeof(*Backends); i++)
+		{
+			for (int Batch = 0; Batch < 2; Batch++)
+			{
+				for (size_t Size = 16; Size <= 16384; Size *= 4)
+				{
+					MeasureNet(Backends[i], Batch, (uint16_t)NetPort, Size);
+				}
+				MeasureNet(Backends[i], Batch, (uint16_t)NetPort, 65000);
+			}
+		}
+
+		if (OutputJson && !FirstResult)
+		{
+			printf("\n]\n");
+		}
+		return 0;
+	}
+
+	DerpNetCpuLevel MaxLevel = DerpNet_GetCpuLevel();
+	for (int Level = DERPNET_CPU_LEVEL_SCALAR; Level <= (int)MaxLevel; Level++)
+	{
+		if ((int)DerpNet_SetCpuLevel((DerpNetCpuLevel)Level) != Level)
+		{
+			continue;
+		}
+
+		for (int Bench = BENCH_SALSA20_XOR; Bench <= BENCH_BOX_UNSEAL; Bench++)
+		{
+			for (size_t Size = 16; Size <= MAX_SIZE; Size *= 4)
+			{
+				Measure((DerpNetCpuLevel)Level, Bench, Size);
+			}
+		}
+
+		for (int Bench = BENCH_SCALARMULT; Bench < BENCH_COUNT; Bench++)
+		{
+			Measure((DerpNetCpuLevel)Level, Bench, 0);
+		}
+	}
+
+	if (OutputJson && !FirstResult)
+	{
+		printf("\n]\n");
+	}
+}
@@ -249,6 +249,7 @@ int main(int argc, char* argv[])
 		double Time = (double)(clock() - ClockStart) / CLOCKS_PER_SEC;
 		double Speed = TotalSize / Time;
 		printf("\rReceived %zu KB in %.1f seconds = %.2f KB/s\n", TotalSize / 1024, Time, Speed / 1024);
+		printf("Input buffer moved %.4f bytes per received byte\n", (double)Net.TotalMoved / Net.TotalReceived);
 
 		fclose(File);
 		DerpNet_Close(&Net);
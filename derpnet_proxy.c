@@ -85,20 +85,50 @@ int main(int argc, char* argv[])
 		SOCKET LocalSocket = INVALID_SOCKET;
 		printf("Waiting for remote connection...\n");
 
+		// data read from local socket that DERP send queue did not take yet
+		char Pending[8192];
+		int PendingSize = 0;
+
 		for (;;)
 		{
 			fd_set ReadSet;
 			FD_ZERO(&ReadSet);
 			FD_SET(Net.Socket, &ReadSet);
 
-			if (LocalSocket != INVALID_SOCKET)
+			fd_set WriteSet;
+			FD_ZERO(&WriteSet);
+			if (Net.SendQueued != 0)
+			{
+				FD_SET(Net.Socket, &WriteSet);
+			}
+
+			// read local socket only while DERP connection takes more data
+			if (LocalSocket != INVALID_SOCKET && PendingSize == 0 && Net.SendQueued < Net.SendQueueLimit)
 			{
 				FD_SET(LocalSocket, &ReadSet);
 			}
 
-			int SelectOk = select(0, &ReadSet, NULL, NULL, NULL);
+			int SelectOk = select(0, &ReadSet, &WriteSet, NULL, NULL);
 			DERPNET_ASSERT(SelectOk != SOCKET_ERROR);
 
+			if (FD_ISSET(Net.Socket, &WriteSet) && !DerpNet_Pump(&Net))
+			{
+				printf("ERROR: DERP server disconnected!\n");
+				return 1;
+			}
+
+			// retry data that did not fit into send queue, once Pump made space for it
+			if (PendingSize != 0)
+			{
+				int TrySend = DerpNet_TrySend(&Net, &RemotePublicKey, Pending, PendingSize);
+				if (TrySend < 0)
+				{
+					printf(TrySend == -1 ? "ERROR: DERP server disconnected!\n" : "ERROR: data is too large for DERP message!\n");
+					return 1;
+				}
+				PendingSize = TrySend == 0 ? PendingSize : 0;
+			}
+
 			// forward all incoming traffic to local socket
 			if (FD_ISSET(Net.Socket, &ReadSet))
 			{
@@ -164,6 +194,7 @@ int main(int argc, char* argv[])
 							printf("Local socket disconnected!\n");
 							closesocket(LocalSocket);
 							LocalSocket = INVALID_SOCKET;
+							PendingSize = 0;
 
 							while (DerpNet_Recv(&Net, &OtherPublicKey, &OtherData, &OtherSize, false) > 0)
 							{
@@ -182,8 +213,7 @@ int main(int argc, char* argv[])
 			// forward all outgoing traffic from local socket
 			if (LocalSocket != INVALID_SOCKET && FD_ISSET(LocalSocket, &ReadSet))
 			{
-				char Buffer[8192];
-				int Size = recv(LocalSocket, Buffer, sizeof(Buffer), 0);
+				int Size = recv(LocalSocket, Pending, sizeof(Pending), 0);
 				if (Size <= 0)
 				{
 					printf("Local socket closed!\n");
@@ -194,11 +224,14 @@ int main(int argc, char* argv[])
 					continue;
 				}
 
-				if (!DerpNet_Send(&Net, &RemotePublicKey, Buffer, Size))
+				// 0 means queue is full, data is kept and local socket is not read until it is sent
+				int TrySend = DerpNet_TrySend(&Net, &RemotePublicKey, Pending, Size);
+				if (TrySend < 0)
 				{
-					printf("ERROR: DERP server disconnected!\n");
+					printf(TrySend == -1 ? "ERROR: DERP server disconnected!\n" : "ERROR: data is too large for DERP message!\n");
 					return 1;
 				}
+				PendingSize = TrySend == 0 ? Size : 0;
 			}
 		}
 	}
@@ -256,6 +289,10 @@ int main(int argc, char* argv[])
 		printf("Waiting for local connection... ");
 		SOCKET LocalSocket = INVALID_SOCKET;
 
+		// data read from local socket that DERP send queue did not take yet
+		char Pending[8192];
+		int PendingSize = 0;
+
 		for (;;)
 		{
 			fd_set ReadSet;
@@ -265,14 +302,40 @@ int main(int argc, char* argv[])
 			{
 				FD_SET(ListenSocket, &ReadSet);
 			}
-			else
+			else if (PendingSize == 0 && Net.SendQueued < Net.SendQueueLimit)
 			{
+				// read local socket only while DERP connection takes more data
 				FD_SET(LocalSocket, &ReadSet);
 			}
 
-			int SelectOk = select(0, &ReadSet, NULL, NULL, NULL);
+			fd_set WriteSet;
+			FD_ZERO(&WriteSet);
+			if (Net.SendQueued != 0)
+			{
+				FD_SET(Net.Socket, &WriteSet);
+			}
+
+			int SelectOk = select(0, &ReadSet, &WriteSet, NULL, NULL);
 			DERPNET_ASSERT(SelectOk != SOCKET_ERROR);
 
+			if (FD_ISSET(Net.Socket, &WriteSet) && !DerpNet_Pump(&Net))
+			{
+				printf("ERROR: DERP server disconnected!\n");
+				return 1;
+			}
+
+			// retry data that did not fit into send queue, once Pump made space for it
+			if (PendingSize != 0)
+			{
+				int TrySend = DerpNet_TrySend(&Net, &RemoteUserKey, Pending, PendingSize);
+				if (TrySend < 0)
+				{
+					printf(TrySend == -1 ? "ERROR: DERP server disconnected!\n" : "ERROR: data is too large for DERP message!\n");
+					return 1;
+				}
+				PendingSize = TrySend == 0 ? PendingSize : 0;
+			}
+
 			// forward all incoming traffic to local socket
 			if (FD_ISSET(Net.Socket, &ReadSet))
 			{
@@ -321,6 +384,7 @@ int main(int argc, char* argv[])
 				{
 					closesocket(LocalSocket);
 					LocalSocket = INVALID_SOCKET;
+					PendingSize = 0;
 
 					DerpKey OtherPublicKey;
 					uint8_t* OtherData;
@@ -337,8 +401,7 @@ int main(int argc, char* argv[])
 				// forward all outgoing traffic from local socket
 			if (LocalSocket != INVALID_SOCKET && FD_ISSET(LocalSocket, &ReadSet))
 			{
-				char Buffer[8192];
-				int Size = recv(LocalSocket, Buffer, sizeof(Buffer), 0);
+				int Size = recv(LocalSocket, Pending, sizeof(Pending), 0);
 				if (Size <= 0)
 				{
 					printf("Local socket closed!\n");
@@ -350,11 +413,14 @@ int main(int argc, char* argv[])
 					continue;
 				}
 
-				if (!DerpNet_Send(&Net, &RemoteUserKey, Buffer, Size))
+				// 0 means queue is full, data is kept and local socket is not read until it is sent
+				int TrySend = DerpNet_TrySend(&Net, &RemoteUserKey, Pending, Size);
+				if (TrySend < 0)
 				{
-					printf("ERROR: DERP server disconnected!\n");
+					printf(TrySend == -1 ? "ERROR: DERP server disconnected!\n" : "ERROR: data is too large for DERP message!\n");
 					return 1;
 				}
+				PendingSize = TrySend == 0 ? Size : 0;
 			}
 
 			// accept new connection for local socket
@@ -0,0 +1,454 @@
+#define _CRT_SECURE_NO_DEPRECATE
+
+#define DERPNET_STATIC
+#include "derpnet.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#	define CloseSocket closesocket
+#	define PollSockets WSAPoll
+typedef WSAPOLLFD PollSocket;
+#else
+#	include <sys/resource.h>
+#	define CloseSocket close
+#	define PollSockets poll
+typedef struct pollfd PollSocket;
+#endif
+
+static void PrintHelpAndExit(char* argv0)
+{
+	printf(
+		"USAGE: %s PORT [DELAY]\n"
+		"Runs minimal DERP relay on PORT with plain HTTP, for local testing\n"
+		"Clients connect with DerpNet_OpenEx, with PlainHttp and Port set in config\n"
+		"DELAY in msec holds back every response, to test server selection with far away servers\n"
+		"\n"
+		, argv0);
+	exit(0);
+}
+
+static void PrintKey(const DerpKey* Key)
+{
+	for (size_t i=0; i<32; i++)
+	{
+		printf("%02hhx", Key->Bytes[i]);
+	}
+}
+
+#define MAX_CLIENTS 16384
+
+#define INPUT_SIZE  (1 << 17)
+#define OUTPUT_SIZE (1 << 20)
+
+typedef struct Client {
+	DerpNet__Socket Socket;
+	bool Upgraded;  // HTTP request is received, only frames follow
+	bool Ready;     // ClientInfo is received
+	bool Blocked;   // next packet waits for space in output of its target
+	DerpKey PublicKey;
+	uint8_t* Input;
+	size_t InputSize;
+	uint8_t* Output;
+	size_t OutputSize;
+	uint64_t OutputTime; // when output can be sent, after delay
+	struct Client* LastTarget; // checked before searching all clients, peers usually talk to same target
+} Client;
+
+static Client Clients[MAX_CLIENTS];
+static size_t ClientsUsed; // slots after this one are all free
+
+static PollSocket Polls[1 + MAX_CLIENTS];
+static Client* PollClients[1 + MAX_CLIENTS];
+
+static DerpKey ServerSecret;
+static DerpKey ServerPublic;
+
+static uint64_t Delay; // usec
+
+static size_t PacketsForwarded;
+static size_t PacketsDropped;
+
+static bool SetNonBlocking(DerpNet__Socket Socket)
+{
+#if defined(_WIN32)
+	u_long NonBlocking = 1;
+	return ioctlsocket(Socket, FIONBIO, &NonBlocking) == 0;
+#else
+	int Flags = fcntl(Socket, F_GETFL);
+	return Flags >= 0 && fcntl(Socket, F_SETFL, Flags | O_NONBLOCK) == 0;
+#endif
+}
+
+// frame is built from header & two pieces, returns false if it does not fit in output
+static bool QueueFrame(Client* C, uint8_t FrameType, const void* Data1, size_t Size1, const void* Data2, size_t Size2)
+{
+	size_t FrameSize = 1 + 4 + Size1 + Size2;
+	if (C->OutputSize + FrameSize > OUTPUT_SIZE)
+	{
+		return false;
+	}
+
+	if (C->OutputSize == 0)
+	{
+		C->OutputTime = DerpNet__Microseconds() + Delay;
+	}
+
+	uint8_t* Output = C->Output + C->OutputSize;
+	Output[0] = FrameType;
+	Set32BE(Output + 1, (uint32_t)(Size1 + Size2));
+	memcpy(Output + 1 + 4, Data1, Size1);
+	memcpy(Output + 1 + 4 + Size1, Data2, Size2);
+
+	C->OutputSize += FrameSize;
+	return true;
+}
+
+static bool IsClient(const Client* C, const uint8_t* PublicKey)
+{
+	return C->Input && C->Ready && memcmp(C->PublicKey.Bytes, PublicKey, 32) == 0;
+}
+
+static Client* FindClient(Client* From, const uint8_t* PublicKey)
+{
+	if (From->LastTarget && IsClient(From->LastTarget, PublicKey))
+	{
+		return From->LastTarget;
+	}
+
+	for (size_t i=0; i<ClientsUsed; i++)
+	{
+		if (IsClient(&Clients[i], PublicKey))
+		{
+			From->LastTarget = &Clients[i];
+			return &Clients[i];
+		}
+	}
+	return NULL;
+}
+
+static void DropClient(Client* C)
+{
+	if (C->Ready)
+	{
+		printf("Disconnected: ");
+		PrintKey(&C->PublicKey);
+		printf(" - packets forwarded %zu, dropped %zu in total\n", PacketsForwarded, PacketsDropped);
+		fflush(stdout);
+	}
+
+	CloseSocket(C->Socket);
+	free(C->Input);
+	free(C->Output);
+	memset(C, 0, sizeof(*C));
+
+	while (ClientsUsed != 0 && !Clients[ClientsUsed - 1].Input)
+	{
+		ClientsUsed--;
+	}
+}
+
+// returns false when there is nothing more to accept
+static bool AcceptClient(DerpNet__Socket Listen)
+{
+	DerpNet__Socket Socket = accept(Listen, NULL, NULL);
+	if ((uintptr_t)Socket == DERPNET_INVALID_SOCKET)
+	{
+		return false;
+	}
+
+	Client* C = NULL;
+	for (size_t i=0; i<MAX_CLIENTS; i++)
+	{
+		if (!Clients[i].Input)
+		{
+			C = &Clients[i];
+			break;
+		}
+	}
+
+	if (!C || !SetNonBlocking(Socket))
+	{
+		CloseSocket(Socket);
+		return true;
+	}
+
+	int NoDelay = 1;
+	setsockopt(Socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&NoDelay, sizeof(NoDelay));
+
+	C->Socket = Socket;
+	C->Input = malloc(INPUT_SIZE);
+	C->Output = malloc(OUTPUT_SIZE);
+	if (C - Clients + 1 > (ptrdiff_t)ClientsUsed)
+	{
+		ClientsUsed = C - Clients + 1;
+	}
+
+	// client asks for fast start, so ServerKey frame can be sent without HTTP response
+	static const uint8_t DerpMagic[8] = { 0x44, 0x45, 0x52, 0x50, 0xf0, 0x9f, 0x94, 0x91 };
+	QueueFrame(C, 1, DerpMagic, sizeof(DerpMagic), ServerPublic.Bytes, sizeof(ServerPublic.Bytes)); // ServerKey
+	return true;
+}
+
+// returns false if client needs to be disconnected
+static bool ProcessFrame(Client* C, uint8_t FrameType, uint8_t* Frame, uint32_t FrameSize)
+{
+	if (FrameType == 2) // ClientInfo
+	{
+		if (FrameSize < 32 + 24 + 16)
+		{
+			return false;
+		}
+
+		uint8_t* PublicKey = Frame;
+		uint8_t* Nonce = PublicKey + 32;
+		uint8_t* Auth = Nonce + 24;
+		uint8_t* Data = Auth + 16;
+
+		if (!DerpNet__BoxUnseal(Data, Data, FrameSize - (32 + 24 + 16), Auth, Nonce, ServerSecret.Bytes, PublicKey))
+		{
+			printf("ClientInfo does not match client public key\n");
+			return false;
+		}
+		memcpy(C->PublicKey.Bytes, PublicKey, 32);
+		C->Ready = true;
+
+		static const char ServerInfo[] = "{}";
+
+		uint8_t Sealed[24 + 16 + sizeof(ServerInfo) - 1];
+		DerpNet__GetRandom(Sealed, 24);
+		DerpNet__BoxSeal(Sealed, Sealed + 24, Sealed + 24 + 16, (const uint8_t*)ServerInfo, sizeof(ServerInfo) - 1, ServerSecret.Bytes, PublicKey);
+		QueueFrame(C, 3, Sealed, sizeof(Sealed), NULL, 0); // ServerInfo
+
+		printf("Connected: ");
+		PrintKey(&C->PublicKey);
+		printf("\n");
+		fflush(stdout);
+	}
+	else if (FrameType == 4) // SendPacket
+	{
+		if (!C->Ready || FrameSize < 32)
+		{
+			return false;
+		}
+
+		Client* Target = FindClient(C, Frame);
+		if (!Target)
+		{
+			PacketsDropped++;
+			return true;
+		}
+
+		// RecvPacket has the same layout, only with key of sender instead of target
+		if (!QueueFrame(Target, 5, C->PublicKey.Bytes, 32, Frame + 32, FrameSize - 32))
+		{
+			C->Blocked = true;
+			return true;
+		}
+		PacketsForwarded++;
+	}
+
+	return true;
+}
+
+static bool ProcessInput(Client* C)
+{
+	size_t Offset = 0;
+	C->Blocked = false;
+
+	if (!C->Upgraded)
+	{
+		for (size_t i=3; i<C->InputSize; i++)
+		{
+			if (memcmp(C->Input + i - 3, "\r\n\r\n", 4) == 0)
+			{
+				C->Upgraded = true;
+				Offset = i + 1;
+				break;
+			}
+		}
+
+		if (!C->Upgraded)
+		{
+			return C->InputSize != INPUT_SIZE;
+		}
+	}
+
+	while (C->InputSize - Offset >= 1 + 4)
+	{
+		uint8_t FrameType = C->Input[Offset];
+		uint32_t FrameSize = Get32BE(C->Input + Offset + 1);
+
+		if (1 + 4 + (size_t)FrameSize > INPUT_SIZE)
+		{
+			return false;
+		}
+		if (C->InputSize - Offset < 1 + 4 + (size_t)FrameSize)
+		{
+			break;
+		}
+
+		if (!ProcessFrame(C, FrameType, C->Input + Offset + 1 + 4, FrameSize))
+		{
+			return false;
+		}
+		if (C->Blocked)
+		{
+			break;
+		}
+
+		Offset += 1 + 4 + FrameSize;
+	}
+
+	memmove(C->Input, C->Input + Offset, C->InputSize - Offset);
+	C->InputSize -= Offset;
+
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc != 2 && argc != 3)
+	{
+		PrintHelpAndExit(argv[0]);
+	}
+
+	int Port = atoi(argv[1]);
+	if (Port <= 0 || Port > 65535)
+	{
+		PrintHelpAndExit(argv[0]);
+	}
+	Delay = argc == 3 ? (uint64_t)atoi(argv[2]) * 1000 : 0;
+
+	DerpNet__SocketStartup();
+
+#if !defined(_WIN32)
+	// every client takes one descriptor
+	struct rlimit Limit;
+	if (getrlimit(RLIMIT_NOFILE, &Limit) == 0 && Limit.rlim_cur < Limit.rlim_max)
+	{
+		Limit.rlim_cur = Limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &Limit);
+	}
+#endif
+
+	DerpNet_CreateNewKey(&ServerSecret);
+	DerpNet_GetPublicKey(&ServerSecret, &ServerPublic);
+
+	// IPv6 socket also accepts IPv4 connections, so "localhost" works whatever it resolves to
+	DerpNet__Socket Listen = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+
+	int Off = 0;
+	int On = 1;
+	setsockopt(Listen, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&Off, sizeof(Off));
+	setsockopt(Listen, SOL_SOCKET, SO_REUSEADDR, (const char*)&On, sizeof(On));
+
+	struct sockaddr_in6 Address = { 0 };
+	Address.sin6_family = AF_INET6;
+	Address.sin6_port = htons((uint16_t)Port);
+
+	if (bind(Listen, (struct sockaddr*)&Address, sizeof(Address)) != 0 || listen(Listen, SOMAXCONN) != 0 || !SetNonBlocking(Listen))
+	{
+		printf("Cannot listen on port %d\n", Port);
+		exit(1);
+	}
+
+	printf("Listening on port %d, server PUBLIC key is: ", Port);
+	PrintKey(&ServerPublic);
+	printf("\n");
+	fflush(stdout);
+
+	for (;;)
+	{
+		Polls[0].fd = Listen;
+		Polls[0].events = POLLIN;
+		size_t PollCount = 1;
+
+		uint64_t Now = DerpNet__Microseconds();
+		uint64_t NextOutput = UINT64_MAX;
+
+		for (size_t i=0; i<ClientsUsed; i++)
+		{
+			Client* C = &Clients[i];
+			if (!C->Input)
+			{
+				continue;
+			}
+
+			short Events = 0;
+
+			// blocked client is not read from, so it cannot send faster than its targets receive
+			if (!C->Blocked && C->InputSize != INPUT_SIZE)
+			{
+				Events |= POLLIN;
+			}
+			if (C->OutputSize != 0 && C->OutputTime <= Now)
+			{
+				Events |= POLLOUT;
+			}
+			else if (C->OutputSize != 0 && C->OutputTime < NextOutput)
+			{
+				NextOutput = C->OutputTime;
+			}
+
+			if (Events)
+			{
+				Polls[PollCount].fd = C->Socket;
+				Polls[PollCount].events = Events;
+				PollClients[PollCount] = C;
+				PollCount++;
+			}
+		}
+
+		int Timeout = NextOutput == UINT64_MAX ? -1 : (int)((NextOutput - Now + 999) / 1000);
+		if (PollSockets(Polls, (unsigned long)PollCount, Timeout) < 0)
+		{
+			continue;
+		}
+
+		if (Polls[0].revents)
+		{
+			while (AcceptClient(Listen))
+			{
+			}
+		}
+
+		for (size_t i=1; i<PollCount; i++)
+		{
+			Client* C = PollClients[i];
+			short Ready = Polls[i].revents;
+
+			if (Ready & POLLOUT)
+			{
+				int WriteSize = (int)send(C->Socket, (const char*)C->Output, (int)C->OutputSize, DERPNET_SEND_FLAGS);
+				if (WriteSize > 0)
+				{
+					memmove(C->Output, C->Output + WriteSize, C->OutputSize - WriteSize);
+					C->OutputSize -= WriteSize;
+				}
+			}
+
+			if (Ready & (POLLIN | POLLERR | POLLHUP))
+			{
+				int ReadSize = (int)recv(C->Socket, (char*)C->Input + C->InputSize, (int)(INPUT_SIZE - C->InputSize), 0);
+				if (ReadSize <= 0)
+				{
+					DropClient(C);
+					continue;
+				}
+				C->InputSize += ReadSize;
+			}
+		}
+
+		// output space may have been freed for blocked clients, so everybody gets processed
+		for (size_t i=0; i<ClientsUsed; i++)
+		{
+			Client* C = &Clients[i];
+			if (C->Input && !ProcessInput(C))
+			{
+				DropClient(C);
+			}
+		}
+	}
+}